@@ -102,6 +102,7 @@ fun(void *             ,get_base,      arg(void *, obj))  /* base address? */ \
 fun(unsigned long      ,get_size,      arg(void *, obj))  /* size? */ \
 fun(const void *       ,get_site,      arg(void *, obj))  /* where allocated?   optional   */ \
 fun(liballocs_err_t    ,get_info,      arg(void *, obj), arg(struct big_allocation *, maybe_alloc), arg(struct uniqtype **,out_type), arg(void **,out_base), arg(unsigned long*,out_size), arg(const void**, out_site)) \
+fun(liballocs_err_t    ,get_info_signal_safe, arg(void *, obj), arg(struct big_allocation *, maybe_alloc), arg(struct uniqtype **,out_type), arg(void **,out_base), arg(unsigned long*,out_size), arg(const void**, out_site)) /* optional; see liballocs.h */ \
 fun(struct big_allocation *,ensure_big,arg(void *, obj)) \
 fun(Dl_info            ,dladdr,        arg(void *, obj))  /* dladdr-like -- only for static*/ \
 fun(lifetime_policy_t *,get_lifetime,  arg(void *, obj)) \
@@ -143,6 +144,8 @@ void __mmap_allocator_notify_mremap_before(void *old_addr, size_t old_size,
 void __mmap_allocator_notify_mremap_after(void *ret_addr, void *old_addr, size_t old_size, 
 	size_t new_size, int flags, void *new_address, void *caller);
 void __mmap_allocator_notify_munmap(void *addr, size_t length, void *caller);
+_Bool __mmap_allocator_notify_unindexed_address(const void *ptr);
+int __mmap_allocator_get_stack_mapping_bounds(const void *addr, void **out_begin, void **out_end);
 
 void __static_allocator_init(void);
 void __static_allocator_notify_load(void *handle);
@@ -150,11 +153,15 @@ void __static_allocator_notify_unload(const char *copied_filename);
 
 void __stack_allocator_init(void);
 _Bool __stack_allocator_notify_unindexed_address(const void *ptr);
+void __stack_allocator_notify_thread_start(void);
+void __stack_allocator_notify_thread_exit(void);
 extern void *__top_of_initial_stack __attribute__((visibility("protected")));
 rlim_t __stack_lim_cur __attribute__((visibility("protected")));
 
 void __auxv_allocator_init(void);
 void __alloca_allocator_init(void);
+struct insert *__alloca_allocator_lookup(const void *obj, void **out_base, unsigned long *out_size);
+void __alloca_allocator_notify_thread_exit(void);
 void __generic_malloc_allocator_init(void);
 void __generic_small_allocator_init(void);
 void __generic_uniform_allocator_init(void);
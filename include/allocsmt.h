@@ -28,6 +28,23 @@ struct static_allocsite_entry
 	(!(p_ent)->entry.allocsite && !(p_ent)->name && \
 	!(p_ent)->entry.next && !(p_ent)->entry.prev)
 
+/* Newer -allocsites.so objects define "allocsites_table" instead of the
+ * "allocsites" array. It is sorted and bucketed at build time, and its vaddrs
+ * are relative to the object's load address, so we never write to it (and its
+ * pages stay shared between processes). Sites in bucket b, i.e. those with
+ * (vaddr >> log_bucket_size) == b, are vaddrs[bucket_starts[b]] up to
+ * vaddrs[bucket_starts[b+1]]; the site's type is at the same index in
+ * uniqtypes. See __liballocs_prechained_allocsite_lookup in liballocs.c. */
+struct allocsites_table
+{
+	unsigned long nsites;
+	unsigned long nbuckets;
+	unsigned log_bucket_size;
+	const unsigned long *vaddrs;
+	const unsigned *bucket_starts; /* nbuckets + 1 entries */
+	struct uniqtype *const *uniqtypes;
+};
+
 /* allocsmt is a memtable lookup mainly because it's easy 
  * and reduces code dependencies. In particular, it's easy to 
  * initialize using a single linear scan, assuming that allocsites info
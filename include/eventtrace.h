@@ -0,0 +1,63 @@
+#ifndef LIBALLOCS_EVENTTRACE_H_
+#define LIBALLOCS_EVENTTRACE_H_
+
+#include <stdint.h>
+
+/* When LIBALLOCS_TRACE names a file, a process using liballocs traces its
+ * malloc index and bigalloc operations into it, for tools/allocstrace to
+ * decode. The file holds a header page, then space for a fixed number of
+ * fixed-size records (LIBALLOCS_TRACE_MB megabytes' worth, default 256).
+ *
+ * Each thread collects records in its own ring, and copies them out in
+ * batches to space it reserves by atomically adding to nreserved. So
+ * records are grouped by thread, not in time order; sort them by time_ns.
+ * Reservations beyond capacity are dropped and counted in ndropped, as
+ * are bigalloc events on a thread whose ring is already gone (because it
+ * is exiting). A record with kind zero was reserved but never written
+ * (e.g. the process died mid-copy); skip it.
+ *
+ * For the heap events, addr is the user chunk address, size its usable
+ * size including our insert, and site its allocation site. For bigalloc
+ * events, site is null. duration_ns is how long the operation took,
+ * including waiting for the index lock; time_ns is when it began. Times
+ * are CLOCK_MONOTONIC. */
+
+#define EVENTTRACE_MAGIC "LATRACE"
+#define EVENTTRACE_VERSION 1
+#define EVENTTRACE_HEADER_SIZE 4096
+
+enum eventtrace_kind
+{
+	EVENTTRACE_NONE,
+	EVENTTRACE_HEAP_INSERT,     /* index_insert: a chunk was allocated */
+	EVENTTRACE_HEAP_DELETE,     /* index_delete: a chunk is being freed */
+	EVENTTRACE_BIGALLOC_NEW,
+	EVENTTRACE_BIGALLOC_DELETE,
+	EVENTTRACE_NKINDS
+};
+
+struct eventtrace_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;       /* sizeof (struct eventtrace_record) */
+	int32_t pid;
+	uint32_t padding;
+	uint64_t capacity;          /* in records */
+	uint64_t nreserved;         /* may exceed capacity */
+	uint64_t ndropped;
+	uint64_t start_time_ns;
+};
+
+struct eventtrace_record
+{
+	uint64_t time_ns;
+	uint32_t kind;              /* enum eventtrace_kind */
+	uint32_t tid;
+	uint64_t addr;
+	uint64_t size;
+	uint64_t site;
+	uint64_t duration_ns;
+};
+
+#endif
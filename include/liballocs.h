@@ -43,14 +43,70 @@ extern void warnx(const char *fmt, ...); // avoid repeating proto
 
 #include "allocsmt.h"
 
-extern unsigned long __liballocs_aborted_stack;
-extern unsigned long __liballocs_aborted_static;
-extern unsigned long __liballocs_aborted_unknown_storage;
-extern unsigned long __liballocs_hit_heap_case;
-extern unsigned long __liballocs_hit_stack_case;
-extern unsigned long __liballocs_hit_static_case;
-extern unsigned long __liballocs_aborted_unindexed_heap;
-extern unsigned long __liballocs_aborted_unrecognised_allocsite;
+/* Query counters, including per allocator, and (if LIBALLOCS_QUERY_LATENCY
+ * is set in the environment) per-allocator histograms of query latency.
+ * Threads count separately, so as not to contend for cache lines; this
+ * adds up all threads' counts, including those of threads that have exited. */
+#define LIBALLOCS_STATS_MAX_ALLOCATORS 16
+#define LIBALLOCS_LATENCY_NBUCKETS 24
+struct liballocs_stats
+{
+	unsigned long aborted_stack;
+	unsigned long aborted_static;
+	unsigned long aborted_unknown_storage;
+	unsigned long hit_heap_case;
+	unsigned long hit_stack_case;
+	unsigned long hit_static_case;
+	unsigned long aborted_unindexed_heap;
+	unsigned long aborted_unrecognised_allocsite;
+	unsigned long lookup_cache_hits;   /* of the malloc index's lookup cache */
+	unsigned long lookup_cache_misses;
+	unsigned nallocators;
+	struct liballocs_allocator_latency
+	{
+		const char *allocator_name;
+		unsigned long nqueries;
+		/* ns_log2[i] counts queries taking [2^i, 2^(i+1)) ns; the last bucket
+		 * also has everything slower. */
+		unsigned long ns_log2[LIBALLOCS_LATENCY_NBUCKETS];
+	} by_allocator[LIBALLOCS_STATS_MAX_ALLOCATORS];
+};
+void __liballocs_get_stats(struct liballocs_stats *out) __attribute__((weak));
+extern _Bool __liballocs_query_latency_enabled;
+
+/* Deprecated: these used to be the counters themselves. Now they are
+ * refreshed from the per-thread counts whenever __liballocs_get_stats()
+ * runs, including at exit. Anything a client adds to them still shows up
+ * in the stats. */
+extern unsigned long __liballocs_aborted_stack __attribute__((deprecated("use __liballocs_get_stats")));
+extern unsigned long __liballocs_aborted_static __attribute__((deprecated("use __liballocs_get_stats")));
+extern unsigned long __liballocs_aborted_unknown_storage __attribute__((deprecated("use __liballocs_get_stats")));
+extern unsigned long __liballocs_hit_heap_case __attribute__((deprecated("use __liballocs_get_stats")));
+extern unsigned long __liballocs_hit_stack_case __attribute__((deprecated("use __liballocs_get_stats")));
+extern unsigned long __liballocs_hit_static_case __attribute__((deprecated("use __liballocs_get_stats")));
+extern unsigned long __liballocs_aborted_unindexed_heap __attribute__((deprecated("use __liballocs_get_stats")));
+extern unsigned long __liballocs_aborted_unrecognised_allocsite __attribute__((deprecated("use __liballocs_get_stats")));
+
+/* A census of live malloc chunks, by allocation site or (once a query has
+ * rewritten a chunk's insert, or if by_type is set) by uniqtype. It is kept
+ * up to date as chunks come and go, unless LIBALLOCS_HEAP_CENSUS=0 is set
+ * in the environment. This fills in up to max entries, biggest first, and
+ * returns how many entries there are in all. Chunks whose site we don't
+ * know, or that didn't fit in our table of sites, share an entry with a
+ * null site and type. Bytes are usable chunk sizes, including our insert. */
+struct liballocs_census_entry
+{
+	const void *alloc_site;   /* null when counting by type */
+	struct uniqtype *type;    /* null if not known */
+	unsigned long nobjects;
+	unsigned long nbytes;
+};
+size_t __liballocs_get_heap_census(struct liballocs_census_entry *out, size_t max,
+	_Bool by_type) __attribute__((weak));
+/* Write the census by site as CSV, returning 0 on success. The same
+ * happens on receipt of the signal named by LIBALLOCS_CENSUS_SIGNAL, to
+ * LIBALLOCS_CENSUS_FILE (default /tmp/liballocs-census.<pid>.<n>.csv). */
+int __liballocs_dump_heap_census(const char *path) __attribute__((weak));
 
 /* This API is a mess because there are three different classes of client. 
  * 
@@ -79,20 +135,40 @@ extern void *__liballocs_main_bp; // beginning of main's stack frame
 char *get_exe_fullname(void) __attribute__((visibility("hidden")));
 char *get_exe_basename(void) __attribute__((visibility("hidden")));
 
+/* Lookups that miss tell us. If addr lies in an object whose metadata was
+ * deferred, this loads it (if nobody has yet) and returns nonzero, and the
+ * lookup should look once more. A null addr means "somewhere". */
+int __liballocs_load_metadata_on_miss(const void *addr) __attribute__((weak));
+
+/* Returns nonzero if allocsite lies in an object whose allocsites came in a
+ * prebuilt struct allocsites_table, in which case *out is its type or NULL. */
+int __liballocs_prechained_allocsite_lookup(const void *allocsite, struct uniqtype **out) __attribute__((weak));
+
 extern inline struct uniqtype *allocsite_to_uniqtype(const void *allocsite) __attribute__((gnu_inline,always_inline));
 extern inline struct uniqtype * __attribute__((gnu_inline)) allocsite_to_uniqtype(const void *allocsite)
 {
 	if (!allocsite) return NULL;
 	assert(__liballocs_allocsmt != NULL);
 	struct allocsite_entry **bucketpos = ALLOCSMT_FUN(ADDR, allocsite);
-	struct allocsite_entry *bucket = *bucketpos;
-	for (struct allocsite_entry *p = bucket; p; p = (struct allocsite_entry *) p->next)
+	struct uniqtype *found;
+	_Bool looked_again = 0;
+look:
+	if (&__liballocs_prechained_allocsite_lookup
+			&& __liballocs_prechained_allocsite_lookup(allocsite, &found)) return found;
+	for (struct allocsite_entry *p = __atomic_load_n(bucketpos, __ATOMIC_ACQUIRE); p;
+			p = (struct allocsite_entry *) p->next)
 	{
 		if (p->allocsite == allocsite)
 		{
 			return p->uniqtype;
 		}
 	}
+	if (!looked_again && &__liballocs_load_metadata_on_miss
+			&& __liballocs_load_metadata_on_miss(allocsite))
+	{
+		looked_again = 1;
+		goto look;
+	}
 	return NULL;
 }
 
@@ -168,6 +244,8 @@ extern struct liballocs_err __liballocs_err_unindexed_heap_object;
 extern struct liballocs_err __liballocs_err_unrecognised_alloc_site;
 extern struct liballocs_err __liballocs_err_unrecognised_static_object;
 extern struct liballocs_err __liballocs_err_object_of_unknown_storage;
+extern struct liballocs_err __liballocs_err_retry;
+extern struct liballocs_err __liballocs_err_not_signal_safe;
 
 const char *__liballocs_errstring(struct liballocs_err *err);
 liballocs_err_t extract_and_output_alloc_site_and_type(
@@ -581,10 +659,18 @@ __liballocs_find_matching_subobject(signed target_offset_within_uniqtype,
  * sure that sensible things happen under the large code model -- more experimentation
  * required.
  */
+struct liballocs_err *
+__liballocs_get_alloc_info_timed
+	(const void *obj, 
+	struct allocator **out_allocator,
+	const void **out_alloc_start,
+	unsigned long *out_alloc_size_bytes, 
+	struct uniqtype **out_alloc_uniqtype, 
+	const void **out_alloc_site) __attribute__((visibility("protected")));
 #if defined(__PIC__) || defined(__code_model_large__)
 inline 
 struct liballocs_err *
-__liballocs_get_alloc_info
+__liballocs_get_alloc_info_untimed
 	(const void *obj, 
 	struct allocator **out_allocator,
 	const void **out_alloc_start,
@@ -607,8 +693,7 @@ __liballocs_get_alloc_info
 		}
 		else
 		{
-			__liballocs_report_wild_address(obj);
-			++__liballocs_aborted_unknown_storage;
+			__liballocs_report_wild_address(obj); /* also counts it */
 			return &__liballocs_err_object_of_unknown_storage;
 		}
 	}
@@ -616,6 +701,25 @@ __liballocs_get_alloc_info
 	return a->get_info((void*) obj, maybe_the_allocation, out_alloc_uniqtype, (void**) out_alloc_start,
 			out_alloc_size_bytes, out_alloc_site);
 }
+inline 
+struct liballocs_err *
+__liballocs_get_alloc_info
+	(const void *obj, 
+	struct allocator **out_allocator,
+	const void **out_alloc_start,
+	unsigned long *out_alloc_size_bytes, 
+	struct uniqtype **out_alloc_uniqtype, 
+	const void **out_alloc_site)
+{
+	/* Timing is out of line, to keep the usual case small. */
+	if (__builtin_expect(__liballocs_query_latency_enabled, 0))
+	{
+		return __liballocs_get_alloc_info_timed(obj, out_allocator, out_alloc_start,
+			out_alloc_size_bytes, out_alloc_uniqtype, out_alloc_site);
+	}
+	return __liballocs_get_alloc_info_untimed(obj, out_allocator, out_alloc_start,
+		out_alloc_size_bytes, out_alloc_uniqtype, out_alloc_site);
+}
 #else
 struct liballocs_err *
 __liballocs_get_alloc_info
@@ -627,6 +731,24 @@ __liballocs_get_alloc_info
 	const void **out_alloc_site);
 #endif
 
+/* An async-signal-safe variant of __liballocs_get_alloc_info, e.g. for
+ * profilers sampling from a SIGPROF handler. It never takes a lock,
+ * allocates, walks the stack or writes to a shared cache. Instead it reads
+ * the indexes optimistically, and if it overlaps with a change to them
+ * (even one on this thread, which the signal interrupted) it returns
+ * &__liballocs_err_retry, whereupon the outputs mean nothing. Don't retry
+ * in a loop from within the handler; just try again at the next sample.
+ *
+ * Only the mmap, malloc and alloca allocators answer these queries, and
+ * alloca only for chunks on the calling thread's stack; others give
+ * &__liballocs_err_not_signal_safe. Nor do we load metadata, so a type is
+ * reported only if the allocation site's is already known. Otherwise we
+ * output the site and return &__liballocs_err_unrecognised_alloc_site. */
+struct liballocs_err *__liballocs_get_alloc_info_signal_safe(const void *obj, 
+	struct allocator **out_allocator, const void **out_alloc_start,
+	unsigned long *out_alloc_size_bytes,
+	struct uniqtype **out_alloc_uniqtype, const void **out_alloc_site);
+
 /* We define a more friendly API for simple queries.
  * NOTE that we don't make these functions inline. They are still fast, internally,
  * because they make an inlined call to __liballocs_get_alloc_info.
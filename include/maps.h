@@ -8,11 +8,14 @@
 #include <sys/user.h>
 #else
 #include <asm-generic/fcntl.h>
+#include <asm/ioctl.h>
+#include <errno.h>
 #endif
 
 /* Don't include stdio -- trap-syscalls won't like it, for example. */
 int sscanf(const char *str, const char *format, ...);
 int open(const char *pathname, int flags, ...);
+int ioctl(int fd, unsigned long request, ...);
 
 /* Rethinking this "maps" concept in the name of portability (to FreeBSD), we have
  * 
@@ -23,6 +26,8 @@ int open(const char *pathname, int flags, ...);
  * get_a_line really reads a single raw entry into the user's buffer;
  * process_one_maps_entry decodes a raw entry and calls the cb on the decoded entry;
  * for_each_maps_entry is a loop that interleaves get_a_line with process_one;
+ * for_each_maps_entry_in_range does the same for only the mappings overlapping
+ * an address range, and on Linux uses the PROCMAP_QUERY ioctl if it can.
  *
  * In trap-syscalls we avoid race conditions by doing it differently: rather
  * than use for_each_maps_entry, we snapshot all the raw entries and then
@@ -189,6 +194,139 @@ struct proc_entry
 };
 typedef int maps_cb_t(struct proc_entry *ent, char *linebuf, void *arg);
 
+#ifndef __FreeBSD__
+/* We parse maps lines by hand. sscanf() was most of the cost of reading
+ * a large maps file, and this is also async-signal-safe. */
+static inline const char *maps_parse_number(const char *pos, unsigned base, unsigned long *out)
+{
+	unsigned long val = 0;
+	for (;; ++pos)
+	{
+		unsigned digit;
+		if (*pos >= '0' && *pos <= '9') digit = *pos - '0';
+		else if (base == 16 && *pos >= 'a' && *pos <= 'f') digit = *pos - 'a' + 10;
+		else if (base == 16 && *pos >= 'A' && *pos <= 'F') digit = *pos - 'A' + 10;
+		else break;
+		val = val * base + digit;
+	}
+	*out = val;
+	return pos;
+}
+
+/* Decode one line (ending in a newline or a null) of the form
+ * "begin-end rwxp offset maj:min inode   rest". Returns 0 if it's malformed. */
+static inline int parse_maps_line(const char *line, struct proc_entry *entry_buf)
+{
+	const char *pos = line;
+	unsigned long num;
+	pos = maps_parse_number(pos, 16, &entry_buf->first);
+	if (*pos++ != '-') return 0;
+	pos = maps_parse_number(pos, 16, &entry_buf->second);
+	if (*pos++ != ' ') return 0;
+	char *perms[] = { &entry_buf->r, &entry_buf->w, &entry_buf->x, &entry_buf->p };
+	for (unsigned i = 0; i < sizeof perms / sizeof perms[0]; ++i)
+	{
+		if (!*pos || *pos == ' ' || *pos == '\n') return 0;
+		*perms[i] = *pos++;
+	}
+	if (*pos++ != ' ') return 0;
+	pos = maps_parse_number(pos, 16, &num); entry_buf->offset = num;
+	if (*pos++ != ' ') return 0;
+	pos = maps_parse_number(pos, 16, &num); entry_buf->devmaj = num;
+	if (*pos++ != ':') return 0;
+	pos = maps_parse_number(pos, 16, &num); entry_buf->devmin = num;
+	if (*pos++ != ' ') return 0;
+	pos = maps_parse_number(pos, 10, &num); entry_buf->inode = num;
+	while (*pos == ' ') ++pos;
+	size_t len = 0;
+	while (pos[len] && pos[len] != '\n' && len < sizeof entry_buf->rest - 1) ++len;
+	memcpy(entry_buf->rest, pos, len);
+	entry_buf->rest[len] = '\0';
+	return 1;
+}
+
+/* PROCMAP_QUERY (Linux 6.11 onwards) is an ioctl on the maps fd that gives
+ * us one mapping at a time, in binary: the one covering an address, or the
+ * next one after it. We spell out its ABI because <linux/fs.h> doesn't mix
+ * with the libc headers. */
+struct maps_procmap_query
+{
+	unsigned long long size;
+	unsigned long long query_flags;
+	unsigned long long query_addr;
+	unsigned long long vma_start;
+	unsigned long long vma_end;
+	unsigned long long vma_flags;
+	unsigned long long vma_page_size;
+	unsigned long long vma_offset;
+	unsigned long long inode;
+	unsigned dev_major;
+	unsigned dev_minor;
+	unsigned vma_name_size;
+	unsigned build_id_size;
+	unsigned long long vma_name_addr;
+	unsigned long long build_id_addr;
+};
+#define MAPS_PROCMAP_QUERY _IOWR('f', 17, struct maps_procmap_query)
+#define MAPS_QUERY_VMA_READABLE             0x01
+#define MAPS_QUERY_VMA_WRITABLE             0x02
+#define MAPS_QUERY_VMA_EXECUTABLE           0x04
+#define MAPS_QUERY_VMA_SHARED               0x08
+#define MAPS_QUERY_COVERING_OR_NEXT_VMA     0x10
+#define MAPS_QUERY_UNSUPPORTED (-1)
+
+/* Call cb on each mapping overlapping [begin, end), or return
+ * MAPS_QUERY_UNSUPPORTED if the kernel can't do this before we've called it.
+ * Here linebuf isn't used, so callbacks see an empty string. */
+static inline int query_maps_entries_in_range(int fd, char *linebuf,
+		struct proc_entry *entry_buf, unsigned long begin, unsigned long end,
+		maps_cb_t *cb, void *arg)
+{
+	static int unsupported;
+	if (unsupported) return MAPS_QUERY_UNSUPPORTED;
+	unsigned long addr = begin;
+	_Bool first = 1;
+	while (addr < end)
+	{
+		struct maps_procmap_query q = {
+			.size = sizeof q,
+			.query_flags = MAPS_QUERY_COVERING_OR_NEXT_VMA,
+			.query_addr = addr,
+			.vma_name_size = sizeof entry_buf->rest,
+			.vma_name_addr = (unsigned long) &entry_buf->rest[0]
+		};
+		if (ioctl(fd, MAPS_PROCMAP_QUERY, &q) == -1)
+		{
+			if (errno == ENOENT) break; /* nothing at or after addr */
+			if (first && (errno == ENOTTY || errno == EINVAL || errno == EOPNOTSUPP))
+			{
+				unsupported = 1;
+				return MAPS_QUERY_UNSUPPORTED;
+			}
+			return -1;
+		}
+		first = 0;
+		if (q.vma_start >= end) break;
+		if (q.vma_name_size == 0) entry_buf->rest[0] = '\0';
+		entry_buf->first = q.vma_start;
+		entry_buf->second = q.vma_end;
+		entry_buf->r = (q.vma_flags & MAPS_QUERY_VMA_READABLE) ? 'r' : '-';
+		entry_buf->w = (q.vma_flags & MAPS_QUERY_VMA_WRITABLE) ? 'w' : '-';
+		entry_buf->x = (q.vma_flags & MAPS_QUERY_VMA_EXECUTABLE) ? 'x' : '-';
+		entry_buf->p = (q.vma_flags & MAPS_QUERY_VMA_SHARED) ? 's' : 'p';
+		entry_buf->offset = q.vma_offset;
+		entry_buf->devmaj = q.dev_major;
+		entry_buf->devmin = q.dev_minor;
+		entry_buf->inode = q.inode;
+		linebuf[0] = '\0';
+		int ret = cb(entry_buf, linebuf, arg);
+		if (ret) return ret;
+		addr = q.vma_end;
+	}
+	return 0;
+}
+#endif
+
 static inline int process_one_maps_entry(char *linebuf, struct proc_entry *entry_buf,
 		maps_cb_t *cb, void *arg)
 {
@@ -210,31 +348,79 @@ static inline int process_one_maps_entry(char *linebuf, struct proc_entry *entry
 	};
 	
 #else
-	#define NUM_FIELDS 11
-	entry_buf->rest[0] = '\0';
-	int fields_read = sscanf(linebuf, 
-		"%lx-%lx %c%c%c%c %8x %2x:%2x %d %4095[\x01-\x09\x0b-\xff]\n",
-		&entry_buf->first, &entry_buf->second, &entry_buf->r, &entry_buf->w, &entry_buf->x, 
-		&entry_buf->p, &entry_buf->offset, &entry_buf->devmaj, &entry_buf->devmin, 
-		&entry_buf->inode, entry_buf->rest);
-
-	assert(fields_read >= (NUM_FIELDS-1)); // we might not get a "rest"
-	#undef NUM_FIELDS
+	int parsed_ok = parse_maps_line(linebuf, entry_buf);
+	assert(parsed_ok);
 #endif
 	int ret = cb(entry_buf, linebuf, arg);
 	if (ret) return ret;
 	else return 0;
 }
 
-static inline int for_each_maps_entry(int fd, char *linebuf, size_t bufsz, struct proc_entry *entry_buf, 
+/* Call cb on each mapping overlapping [begin, end), in address order. */
+static inline int for_each_maps_entry_in_range(int fd, char *linebuf, size_t bufsz,
+		struct proc_entry *entry_buf, unsigned long begin, unsigned long end,
 		maps_cb_t *cb, void *arg)
 {
+#ifdef __FreeBSD__
 	while (get_a_line(linebuf, bufsz, fd) != -1)
 	{
 		int ret = process_one_maps_entry(linebuf, entry_buf, cb, arg);
 		if (ret) return ret;
 	}
 	return 0;
+#else
+	int ret = query_maps_entries_in_range(fd, linebuf, entry_buf, begin, end, cb, arg);
+	if (ret != MAPS_QUERY_UNSUPPORTED) return ret;
+	/* Fall back to the text. Rather than get_a_line(), which costs a read()
+	 * and an lseek() per line, we fill the whole buffer each time and walk
+	 * the complete lines in it. */
+	if (bufsz < 2) return -1;
+	size_t nbuffered = 0;
+	for (;;)
+	{
+		ssize_t nread = read(fd, linebuf + nbuffered, bufsz - 1 - nbuffered);
+		if (nread <= 0)
+		{
+			/* Process any unterminated last line. */
+			if (nbuffered == 0) break;
+			linebuf[nbuffered] = '\0';
+			nread = 0;
+		}
+		else linebuf[nbuffered + nread] = '\0';
+		char *line = linebuf;
+		char *buffered_end = linebuf + nbuffered + nread;
+		char *newline;
+		while (line < buffered_end
+				&& ((newline = memchr(line, '\n', buffered_end - line)) || nread == 0))
+		{
+			if (newline) *newline = '\0';
+			if (parse_maps_line(line, entry_buf))
+			{
+				if (entry_buf->first >= end) return 0; /* entries are sorted */
+				if (entry_buf->second > begin)
+				{
+					ret = cb(entry_buf, line, arg);
+					if (ret) return ret;
+				}
+			}
+			if (!newline) break;
+			line = newline + 1;
+		}
+		if (nread == 0) break;
+		nbuffered = buffered_end - line;
+		/* A line longer than the buffer can't be a sane mapping; drop it. */
+		if (nbuffered == bufsz - 1) nbuffered = 0;
+		memmove(linebuf, line, nbuffered);
+	}
+	return 0;
+#endif
+}
+
+static inline int for_each_maps_entry(int fd, char *linebuf, size_t bufsz, struct proc_entry *entry_buf, 
+		maps_cb_t *cb, void *arg)
+{
+	return for_each_maps_entry_in_range(fd, linebuf, bufsz, entry_buf,
+		0, (unsigned long) -1, cb, arg);
 	
 	/* Here's how we open-coded it in trap-syscalls's saw_mapping(), 
 	 * before we started using selected C library calls in there.
@@ -118,6 +118,27 @@ struct allocator *__liballocs_ool_get_allocator(const void *obj) __attribute__((
 _Bool __pages_unused(void *begin, void *end) __attribute__((visibility("hidden")));
 _Bool __liballocs_notify_unindexed_address(const void *);
 
+/* The mmap allocator defers munmap notifications, coalescing adjacent and
+ * overlapping ones into a single pending span (see allocators/mmap.c). Until
+ * that is flushed, the index still describes the unmapped pages, so anything
+ * that asks about an address in the pending span must flush it first. */
+struct pending_unmap
+{
+	void *begin;
+	void *end;
+};
+extern struct pending_unmap __mmap_allocator_pending_unmap __attribute__((weak,visibility("protected")));
+void __mmap_allocator_flush_pending_unmaps(void) __attribute__((visibility("protected")));
+#define FLUSH_PENDING_UNMAPS_COVERING(obj) \
+	do { \
+		if (__builtin_expect( \
+				(char*) (obj) >= (char*) __mmap_allocator_pending_unmap.begin \
+				&& (char*) (obj) < (char*) __mmap_allocator_pending_unmap.end, 0)) \
+		{ \
+			__mmap_allocator_flush_pending_unmaps(); \
+		} \
+	} while (0)
+
 /* mappings of 4GB or more in size are assumed to be memtables and are ignored */
 #define BIGGEST_BIGALLOC BIGGEST_SANE_USER_ALLOC
 
@@ -137,6 +158,7 @@ __liballocs_get_bigalloc_containing)
 	// if (__builtin_expect(obj == 0, 0)) return NULL;
 	// if (__builtin_expect(obj == (void*) -1, 0)) return NULL;
 	/* More heuristics go here. */
+	FLUSH_PENDING_UNMAPS_COVERING(obj);
 	bigalloc_num_t bigalloc_num = pageindex[PAGENUM(obj)];
 	if (bigalloc_num == 0) return NULL;
 	struct big_allocation *b = &big_allocations[bigalloc_num];
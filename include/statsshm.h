@@ -0,0 +1,67 @@
+#ifndef LIBALLOCS_STATSSHM_H_
+#define LIBALLOCS_STATSSHM_H_
+
+/* When LIBALLOCS_STATS_SHM is set in its environment, a process using
+ * liballocs publishes its counters in a file under /dev/shm, named by
+ * STATSSHM_PATH_FORMAT, which tools/allocsstat can map and read without
+ * disturbing the process. A background thread in the process refreshes
+ * the snapshot every LIBALLOCS_STATS_SHM_INTERVAL_MS milliseconds (default
+ * 1000); the file is removed when the process exits.
+ *
+ * The snapshot is guarded by a sequence count: the writer makes seq odd
+ * before it starts and even again when it is done, so a reader takes a
+ * copy, then retries if seq was odd or has changed meanwhile. All the
+ * counters are cumulative since the process started, except those
+ * describing current state (nindexed_chunks, nbigallocs and the RSS
+ * figures). */
+
+#define STATSSHM_MAGIC "LASTATS"
+#define STATSSHM_VERSION 1
+#define STATSSHM_PATH_FORMAT "/dev/shm/liballocs-stats.%d"
+#define STATSSHM_MAX_ALLOCATORS 16
+#define STATSSHM_LATENCY_NBUCKETS 24
+#define STATSSHM_ALLOCATOR_NAME_MAX 32
+
+struct statsshm_allocator
+{
+	char name[STATSSHM_ALLOCATOR_NAME_MAX];
+	unsigned long nqueries;
+	/* ns_log2[i] counts queries taking [2^i, 2^(i+1)) ns */
+	unsigned long ns_log2[STATSSHM_LATENCY_NBUCKETS];
+};
+
+struct statsshm
+{
+	char magic[8];
+	unsigned version;
+	unsigned size;             /* sizeof (struct statsshm) in the writer */
+	int pid;
+	unsigned interval_ms;
+	unsigned long seq;         /* odd while an update is in progress */
+	unsigned long nupdates;
+	unsigned long update_time_ns; /* CLOCK_REALTIME */
+
+	/* indexes */
+	unsigned long nindexed_chunks;  /* malloc chunks in the heap index */
+	unsigned long nbigallocs;       /* live bigallocs */
+	unsigned long pageindex_rss_bytes;
+	unsigned long index_region_rss_bytes;
+	unsigned long lookup_cache_hits;
+	unsigned long lookup_cache_misses;
+
+	/* queries, as in the exit summary */
+	unsigned long aborted_stack;
+	unsigned long aborted_static;
+	unsigned long aborted_unknown_storage;
+	unsigned long hit_heap_case;
+	unsigned long hit_stack_case;
+	unsigned long hit_static_case;
+	unsigned long aborted_unindexed_heap;
+	unsigned long aborted_unrecognised_allocsite;
+
+	/* per-allocator queries; ns_log2 is only filled in under LIBALLOCS_QUERY_LATENCY */
+	unsigned nallocators;
+	struct statsshm_allocator by_allocator[STATSSHM_MAX_ALLOCATORS];
+};
+
+#endif
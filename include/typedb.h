@@ -0,0 +1,95 @@
+#ifndef LIBALLOCS_TYPEDB_H_
+#define LIBALLOCS_TYPEDB_H_
+
+/* A type database ("-types.db") is a compact, read-only image of the
+ * uniqtypes in one -types.so, written by tools/typesdb from the built
+ * -types.so. It contains no pointers that need relocating by the dynamic
+ * linker, so a reader that wants the types without dlopen()ing anything
+ * can map its pages straight from the page cache.
+ *
+ * It does not replace the -types.so in a process running liballocs. We
+ * still dlopen() that, relocations and all, because allocsites and
+ * frame/static tables refer to its uniqtypes by symbol; in-process the
+ * database only serves as an index for naming those uniqtypes (typedb.c).
+ *
+ * The file holds
+ * - a header;
+ * - a record table, one entry per distinct uniqtype, sorted by image_off;
+ * - a name table, one entry per symbol name (so aliases share a record),
+ *   sorted by strcmp() order of the names;
+ * - a permutation of the record table sorted by so_offset, i.e. by address
+ *   within the -types.so the database was generated from;
+ * - a string table of symbol names;
+ * - the record images themselves, laid out like struct uniqtype.
+ *
+ * Pointer fields within the images (related[] type pointers) hold the address
+ * the target record would have if the file were mapped at preferred_base;
+ * a mapping anywhere else needs the words listed in the reloc table (as file
+ * offsets) adjusting. Fields that cannot be expressed this way are zero:
+ * cache_word, member-names vectors, and make_precise. Records whose
+ * make_precise was set in the -types.so have TYPEDB_RECORD_MAKE_PRECISE and
+ * live in a separate page-aligned patch area, so that filling it in at run
+ * time only unshares those pages. */
+
+#define TYPEDB_MAGIC "LATYPEDB"
+#define TYPEDB_VERSION 1
+
+struct typedb_header
+{
+	char magic[8];
+	unsigned version;
+	unsigned flags;
+	unsigned long preferred_base;
+	unsigned long file_size;
+	unsigned long nrecords;
+	unsigned long records_off;      /* struct typedb_record[nrecords] */
+	unsigned long nnames;
+	unsigned long names_off;        /* struct typedb_name[nnames] */
+	unsigned long by_so_offset_off; /* unsigned[nrecords] */
+	unsigned long nrelocs;
+	unsigned long relocs_off;       /* unsigned long[nrelocs] */
+	unsigned long strtab_off;
+	unsigned long strtab_size;
+	unsigned long images_off;       /* page-aligned */
+	unsigned long images_size;
+	unsigned long patch_off;        /* page-aligned; part of the images */
+	unsigned long patch_size;
+};
+
+#define TYPEDB_RECORD_MAKE_PRECISE 0x1
+
+struct typedb_record
+{
+	unsigned long image_off;
+	unsigned long so_offset;
+	unsigned long name_off;         /* the symbol name dladdr() would give */
+	unsigned size;
+	unsigned flags;
+};
+
+struct typedb_name
+{
+	unsigned long name_off;
+	unsigned long record;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct uniqtype;
+struct typedb;
+
+/* Open a type database for use without its -types.so. The returned records
+ * are read-only struct uniqtypes, but they are not the uniqtypes liballocs
+ * uses in this process: compare them only with each other. */
+struct typedb *__liballocs_typedb_open(const char *path) __attribute__((weak));
+void __liballocs_typedb_close(struct typedb *db) __attribute__((weak));
+struct uniqtype *__liballocs_typedb_lookup(struct typedb *db, const char *symname) __attribute__((weak));
+const char *__liballocs_typedb_symbol_name(struct typedb *db, const struct uniqtype *t) __attribute__((weak));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
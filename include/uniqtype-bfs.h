@@ -48,18 +48,91 @@ static inline _Bool __uniqtype_node_queue_empty(void *q_head)
 typedef void follow_ptr_fn(void**, struct uniqtype**, void *);
 typedef void on_blacken_fn(void *obj, struct uniqtype *t, void *);
 
+typedef void on_edge_fn(void *from_obj, struct uniqtype *from_t,
+	void *to_obj, struct uniqtype *to_t, void *);
+
 void __uniqtype_default_follow_ptr(void**, struct uniqtype**, void *);
 
+/* Call on_edge for every plausible, non-null pointer held anywhere in obj
+ * (after follow_ptr has had its say), in subobject order. */
+void __uniqtype_for_each_pointer_edge(void *obj, struct uniqtype *t,
+	follow_ptr_fn *follow_ptr, void *fp_arg,
+	on_edge_fn *on_edge, void *oe_arg);
+
 void __uniqtype_walk_bfs_from_object(
 	void *object, struct uniqtype *t,
 	follow_ptr_fn *follow_ptr, void *fp_arg,
 	on_blacken_fn *on_blacken, void *ob_arg);
 
+/* Throughput of the most recent walk on the calling thread. */
+struct uniqtype_bfs_stats
+{
+	unsigned long nblackened;
+	unsigned long nedges;
+	unsigned long elapsed_ns;
+	double objects_per_sec;
+};
+void __uniqtype_bfs_get_last_stats(struct uniqtype_bfs_stats *out);
+
 void __uniqtype_process_bfs_queue(
 	__uniqtype_node_rec **p_q_head,
 	__uniqtype_node_rec **p_q_tail,
 	follow_ptr_fn *follow_ptr, void *fp_arg,
 	on_blacken_fn *on_blacken, void *ob_arg);
 
+/* Incremental, budgeted traversal: the queue and visited set persist in a
+ * continuation between slices. __uniqtype_bfs_resume does at most max_objects
+ * objects or max_ns nanoseconds of work (0 means unlimited) and returns
+ * nonzero while work remains. See uniqtype-bfs.c for how frees and reallocs
+ * between slices are handled. __uniqtype_bfs_begin_incremental returns null
+ * if it can't get memory. */
+struct uniqtype_bfs_continuation;
+struct uniqtype_bfs_continuation *__uniqtype_bfs_begin_incremental(
+	void *object, struct uniqtype *t,
+	follow_ptr_fn *follow_ptr, void *fp_arg,
+	on_blacken_fn *on_blacken, void *ob_arg);
+int __uniqtype_bfs_resume(struct uniqtype_bfs_continuation *k,
+	unsigned long max_objects, unsigned long max_ns);
+void __uniqtype_bfs_get_incremental_stats(struct uniqtype_bfs_continuation *k,
+	struct uniqtype_bfs_stats *out);
+void __uniqtype_bfs_finish_incremental(struct uniqtype_bfs_continuation *k);
+void __uniqtype_bfs_notify_free(void *obj);
+void __uniqtype_bfs_notify_realloc(void *old_obj, void *new_obj);
+
+/* Parallel work-stealing traversal (uniqtype-bfs-parallel.c). Visits the same
+ * set of objects as the serial walk, but not in BFS order. The ordering option
+ * says how on_blacken gets called:
+ * UNORDERED      -- concurrently, from any worker; on_blacken must be thread-safe;
+ * SERIALISED     -- one at a time (under a lock), in no particular order;
+ * ADDRESS_ORDER  -- on the calling thread, after the traversal, sorted by object
+ *                   address, so output is independent of scheduling.
+ * Returns 0, or -1 with errno set if the walk stopped early: ENOSPC if more
+ * than max_objects objects were reachable, ENOMEM or EAGAIN if we ran out of
+ * memory or threads. */
+enum uniqtype_parallel_walk_ordering
+{
+	UNIQTYPE_PARALLEL_WALK_UNORDERED,
+	UNIQTYPE_PARALLEL_WALK_SERIALISED,
+	UNIQTYPE_PARALLEL_WALK_ADDRESS_ORDER
+};
+#define UNIQTYPE_PARALLEL_WALK_DEFAULT_MAX_OBJECTS (1ul<<24)
+#define UNIQTYPE_PARALLEL_WALK_MAX_THREADS 256
+struct uniqtype_parallel_walk_opts
+{
+	unsigned nthreads;            /* 0 means one per online CPU; at most the max */
+	unsigned long max_objects;    /* sizes the visited set; 0 means the default */
+	enum uniqtype_parallel_walk_ordering ordering;
+};
+struct uniqtype_parallel_walk_item
+{
+	void *obj;
+	struct uniqtype *t;
+};
+int __uniqtype_walk_parallel_from_objects(
+	void **objects, struct uniqtype **types, unsigned nobjects,
+	follow_ptr_fn *follow_ptr, void *fp_arg,
+	on_blacken_fn *on_blacken, void *ob_arg,
+	const struct uniqtype_parallel_walk_opts *opts,
+	struct uniqtype_bfs_stats *out_stats);
 
 #endif
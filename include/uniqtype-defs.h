@@ -305,6 +305,21 @@ UNIQTYPE_DECLS
 
 extern struct uniqtype __uniqtype__void __attribute__((weak));
 
+/* Pointer maps. Alongside each uniqtype, the tools emit a weak array
+ *     unsigned long <symname>_ptrmap[] = { nwords, word0, word1, ... };
+ * in the same section group. Bit j of word i is set iff the pointer-sized
+ * slot at byte offset (i * UNIQTYPE_PTRMAP_SLOTS_PER_WORD + j) * sizeof (void*)
+ * holds a pointer. nwords == 0 means the type holds no pointers at all;
+ * UNIQTYPE_PTRMAP_UNKNOWN means the type can't be described this way
+ * (unaligned or overlapping pointers, flexible or very large contents) and
+ * scanners must walk related[] instead. */
+#define UNIQTYPE_PTRMAP_UNKNOWN          (~0ul)
+#define UNIQTYPE_PTRMAP_SLOTS_PER_WORD   (8 * sizeof (unsigned long))
+#define UNIQTYPE_PTRMAP_MAX_WORDS        64
+#define UNIQTYPE_PTRMAP_NWORDS(m)        ((m)[0])
+#define UNIQTYPE_PTRMAP_HAS_NO_POINTERS(m) ((m)[0] == 0)
+#define UNIQTYPE_PTRMAP_IS_KNOWN(m)      ((m)[0] != UNIQTYPE_PTRMAP_UNKNOWN)
+
 #define UNIQTYPE_IS_SUBPROGRAM_TYPE(u)   ((u)->un.info.kind == SUBPROGRAM)
 #define UNIQTYPE_SUBPROGRAM_ARG_COUNT(u) ((u)->un.subprogram.narg)
 #define UNIQTYPE_IS_POINTER_TYPE(u)      ((u)->un.info.kind == ADDRESS)
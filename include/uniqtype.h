@@ -58,6 +58,29 @@ void *dlbind(void *lib, const char *symname, void *obj, size_t len, Elf64_Word t
 
 extern void *__liballocs_rt_uniqtypes_obj __attribute__((weak));
 
+/* liballocs hash-conses synthesised array types (see uniqtype-arrays.c).
+ * If it's not loaded, or can't get memory, we fall back to dlsym/dlbind. */
+struct uniqtype *__liballocs_intern_array_type(struct uniqtype *element_t, unsigned array_len) __attribute__((weak));
+
+struct liballocs_array_type_stats
+{
+	unsigned long nentries;         /* types in the hash-consing table */
+	unsigned long ncreated;         /* of all types, those we synthesised */
+	unsigned long noverflow;        /* requests made after the table filled */
+	unsigned long nhits;
+	unsigned long nmisses;
+	unsigned long nraces_lost;      /* concurrent creations of the same type */
+	unsigned long table_nslots;
+};
+void __liballocs_get_array_type_stats(struct liballocs_array_type_stats *out) __attribute__((weak));
+
+/* Pointer maps (format in uniqtype-defs.h; see uniqtype-ptrmaps.c). The map is
+ * never NULL, but may be UNIQTYPE_PTRMAP_UNKNOWN. The slot types, if any, give
+ * the pointer uniqtype for each set bit of the map, in bit order. */
+const unsigned long *__liballocs_uniqtype_ptrmap(struct uniqtype *t) __attribute__((weak));
+struct uniqtype *const *__liballocs_uniqtype_ptrmap_slot_types(struct uniqtype *t) __attribute__((weak));
+int __liballocs_uniqtype_has_no_pointers(struct uniqtype *t) __attribute__((weak));
+
 inline
 struct uniqtype *
 __liballocs_get_or_create_array_type(struct uniqtype *element_t, unsigned array_len)
@@ -66,11 +89,16 @@ __liballocs_get_or_create_array_type(struct uniqtype *element_t, unsigned array_
 	assert(element_t->pos_maxoff > 0);
 	assert(element_t->pos_maxoff != UNIQTYPE_POS_MAXOFF_UNBOUNDED);
 	
+	if (__liballocs_intern_array_type)
+	{
+		struct uniqtype *interned = __liballocs_intern_array_type(element_t, array_len);
+		if (interned) return interned;
+	}
+	
 	char precise_uniqtype_name[4096];
 	const char *element_name = UNIQTYPE_NAME(element_t); /* gets "simple", not symbol, name */
 	snprintf(precise_uniqtype_name, sizeof precise_uniqtype_name,
 			"__uniqtype____ARR%d_%s", array_len, element_name);
-	/* FIXME: compute hash code. Should be an easy case. */
 	
 	/* Does such a type exist? */
 	void *found = NULL;
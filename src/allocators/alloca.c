@@ -10,78 +10,242 @@
 #include <string.h>
 #include <dlfcn.h>
 #include <link.h>
+#include <pthread.h>
 #include "relf.h"
 #include "liballocs_private.h"
 #include "pageindex.h"
 #include "heap_index.h"
 
+/* Alloca chunks used to go into the heap index, alongside malloc chunks.
+ * Now each thread keeps its own index of them: an array of (addr, size)
+ * records in stack order, i.e. by descending address, since each alloca
+ * lands below the last and each frame below its caller's. A frame's
+ * records are a suffix of the array, so indexing a chunk is an append and
+ * cleaning up a frame is a truncation. The chunk's trailing insert still
+ * holds its allocation site (or type), as it did in the heap index.
+ *
+ * Each frame bigalloc's suballocator_meta points to the owning thread's
+ * index, so other threads can find it. Only the owner writes an index, and
+ * it reads its own without locking. Another thread reading it takes the
+ * index's mutex, which the owner also holds while it swaps or frees the
+ * array, so the array can't be freed under the reader. Indexes themselves
+ * are never freed: when a thread exits, its index is emptied and pooled
+ * for the next thread, so a stale suballocator_meta still points at an
+ * index, if not at the right thread's. Like any query on another thread's
+ * stack, the answer races with that thread. */
+struct alloca_record
+{
+	void *addr;
+	unsigned long size;
+};
+#define ALLOCA_INDEX_INLINE_LEN 32
+struct alloca_index
+{
+	unsigned n;
+	unsigned nallocated;
+	struct alloca_record *recs;
+	pthread_mutex_t mutex;
+	struct alloca_index *next_free;
+	struct alloca_record inline_recs[ALLOCA_INDEX_INLINE_LEN];
+};
+static __thread struct alloca_index *thread_alloca_index;
+static struct alloca_index *free_indexes;
+static pthread_mutex_t free_indexes_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static liballocs_err_t get_info(void *obj, struct big_allocation *maybe_bigalloc,
+	struct uniqtype **out_type, void **out_base, 
+	unsigned long *out_size, const void **out_site);
+static liballocs_err_t get_info_signal_safe(void *obj, struct big_allocation *maybe_bigalloc,
+	struct uniqtype **out_type, void **out_base, 
+	unsigned long *out_size, const void **out_site);
+
 struct allocator __alloca_allocator = {
 	.name = "alloca",
 	.is_cacheable = 1,   // HMM: am I sure that we're cacheable?
-	.get_info = __generic_heap_get_info
+	.get_info = get_info,
+	.get_info_signal_safe = get_info_signal_safe
 };
 
-void __liballocs_unindex_stack_objects_counted_by(unsigned long *bytes_counter, void *frame_addr)
+static struct alloca_index *this_thread_index(void)
 {
-	struct big_allocation *b = __lookup_bigalloc(bytes_counter, &__stackframe_allocator, NULL);
-	if (*bytes_counter == 0) goto out;
-	if (!b) abort();
-	
-	/* Starting at the stack pointer, we look for indexed chunks and 
-	 * keep unindexing until we have unindexed exactly *bytes_counter bytes. */
-	void *sp;
-	#ifdef UNW_TARGET_X86
-		__asm__ ("movl %%esp, %0\n" :"=r"(sp));
-	#else // assume X86_64 for now
-		__asm__("movq %%rsp, %0\n" : "=r"(sp));
-	#endif
+	struct alloca_index *idx = thread_alloca_index;
+	if (__builtin_expect(idx != NULL, 1)) return idx;
+	pthread_mutex_lock(&free_indexes_mutex);
+	idx = free_indexes;
+	if (idx) free_indexes = idx->next_free;
+	pthread_mutex_unlock(&free_indexes_mutex);
+	if (!idx)
+	{
+		idx = __wrap_dlmalloc(sizeof (struct alloca_index));
+		if (!idx) abort();
+		pthread_mutex_init(&idx->mutex, NULL);
+	}
+	idx->n = 0;
+	idx->nallocated = ALLOCA_INDEX_INLINE_LEN;
+	idx->recs = idx->inline_recs;
+	idx->next_free = NULL;
+	__atomic_store_n(&thread_alloca_index, idx, __ATOMIC_RELEASE);
+	return idx;
+}
 
-	struct entry *first_head = INDEX_LOC_FOR_ADDR(sp);
-	struct entry *cur_head = first_head;
-	unsigned long total_to_unindex = *bytes_counter;
-	unsigned long total_unindexed = 0;
-	unsigned chunks_unindexed = 0;
-	
-	/* Iterate forward over the buckets, but not beyond frame_addr's bucket. */
-	for (; cur_head != INDEX_LOC_FOR_ADDR(frame_addr) + 1; ++cur_head)
+/* Find the record whose chunk contains addr, by binary search. */
+static struct alloca_record *find_record(struct alloca_index *idx, const void *addr)
+{
+	unsigned n = __atomic_load_n(&idx->n, __ATOMIC_ACQUIRE);
+	struct alloca_record *recs = idx->recs;
+	/* Find the first record beginning at or below addr. */
+	unsigned lo = 0, hi = n;
+	while (lo < hi)
 	{
-		/* Repeatedly find the lowest-addressed chunk and unindex it. */
-		while (entry_ptr_to_addr(cur_head) != NULL)
-		{
-			void *cur_userchunk = entry_ptr_to_addr(cur_head);
-			struct insert *cur_insert = insert_for_chunk(cur_userchunk);
-			void *lowest_chunkaddr = cur_userchunk;
+		unsigned mid = lo + (hi - lo) / 2;
+		if ((char*) recs[mid].addr > (char*) addr) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo < n && (char*) addr < (char*) recs[lo].addr + recs[lo].size) return &recs[lo];
+	return NULL;
+}
+
+/* Forget every record for a chunk below addr. */
+static void truncate_below(struct alloca_index *idx, const void *addr)
+{
+	unsigned lo = 0, hi = idx->n;
+	while (lo < hi)
+	{
+		unsigned mid = lo + (hi - lo) / 2;
+		if ((char*) idx->recs[mid].addr >= (char*) addr) lo = mid + 1;
+		else hi = mid;
+	}
+	__atomic_store_n(&idx->n, lo, __ATOMIC_RELEASE);
+}
+
+static void append_record(struct alloca_index *idx, void *addr, unsigned long size)
+{
+	/* Anything at or below the new chunk belongs to a frame that's gone
+	 * without cleaning up, e.g. by longjmp(). */
+	truncate_below(idx, (char*) addr + 1);
+	if (idx->n == idx->nallocated)
+	{
+		struct alloca_record *new_recs = __wrap_dlmalloc(2 * idx->nallocated
+			* sizeof (struct alloca_record));
+		if (!new_recs) abort();
+		memcpy(new_recs, idx->recs, idx->n * sizeof (struct alloca_record));
+		struct alloca_record *old_recs = idx->recs;
+		/* A signal handler on this thread may read the index, so publish
+		 * the new array before freeing the old, and a record before
+		 * counting it. Other threads read it under the mutex. */
+		pthread_mutex_lock(&idx->mutex);
+		__atomic_store_n(&idx->recs, new_recs, __ATOMIC_RELEASE);
+		idx->nallocated *= 2;
+		pthread_mutex_unlock(&idx->mutex);
+		if (old_recs != idx->inline_recs) __wrap_dlfree(old_recs);
+	}
+	idx->recs[idx->n] = (struct alloca_record) { .addr = addr, .size = size };
+	__atomic_store_n(&idx->n, idx->n + 1, __ATOMIC_RELEASE);
+}
+
+void __alloca_allocator_notify_thread_exit(void)
+{
+	struct alloca_index *idx = thread_alloca_index;
+	if (!idx) return;
+	/* A signal handler won't find it from here on. */
+	__atomic_store_n(&thread_alloca_index, NULL, __ATOMIC_RELAXED);
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	/* Frames that didn't clean up, e.g. because the thread called
+	 * pthread_exit(), still have bigallocs covering their records. */
+	for (unsigned i = 0; i < idx->n; ++i)
+	{
+		struct big_allocation *frame = __lookup_bigalloc(idx->recs[i].addr,
+			&__stackframe_allocator, NULL);
+		if (frame) __liballocs_delete_bigalloc_at(frame->begin, &__stackframe_allocator);
+	}
+	pthread_mutex_lock(&idx->mutex);
+	struct alloca_record *old_recs = idx->recs;
+	__atomic_store_n(&idx->n, 0, __ATOMIC_RELEASE);
+	idx->recs = idx->inline_recs;
+	idx->nallocated = ALLOCA_INDEX_INLINE_LEN;
+	pthread_mutex_unlock(&idx->mutex);
+	if (old_recs != idx->inline_recs) __wrap_dlfree(old_recs);
+	pthread_mutex_lock(&free_indexes_mutex);
+	idx->next_free = free_indexes;
+	free_indexes = idx;
+	pthread_mutex_unlock(&free_indexes_mutex);
+}
+
+struct insert *__alloca_allocator_lookup(const void *obj, void **out_base, unsigned long *out_size)
+{
+	/* Usually it's our own stack, so try our index before any lookup. */
+	struct alloca_index *own = thread_alloca_index;
+	struct alloca_record *found = own ? find_record(own, obj) : NULL;
+	struct alloca_record copied;
+	if (!found)
+	{
+		struct big_allocation *frame = __lookup_bigalloc(obj, &__stackframe_allocator, NULL);
+		if (!frame || frame->suballocator != &__alloca_allocator) return NULL;
+		struct alloca_index *idx = frame->suballocator_meta;
+		if (!idx || idx == own) return NULL;
+		/* Another thread's: copy the record out before its array can go. */
+		pthread_mutex_lock(&idx->mutex);
+		found = find_record(idx, obj);
+		if (found) copied = *found;
+		pthread_mutex_unlock(&idx->mutex);
+		if (!found) return NULL;
+		found = &copied;
+	}
+	if (out_base) *out_base = found->addr;
+	if (out_size) *out_size = found->size - sizeof (struct insert);
+	return insert_for_chunk_and_usable_size(found->addr, found->size);
+}
+
+static liballocs_err_t get_info(void *obj, struct big_allocation *maybe_bigalloc,
+	struct uniqtype **out_type, void **out_base, 
+	unsigned long *out_size, const void **out_site)
+{
+	count_allocator_query(&__alloca_allocator);
+	count_query(QUERY_HIT_STACK_CASE);
+	struct insert *ins = __alloca_allocator_lookup(obj, out_base, out_size);
+	if (!ins)
+	{
+		count_query(QUERY_ABORTED_UNINDEXED_HEAP);
+		return &__liballocs_err_unindexed_heap_object;
+	}
+	return extract_and_output_alloc_site_and_type(ins, out_type, (void**) out_site);
+}
 
-			for (;
-				cur_userchunk; 
-				cur_userchunk = entry_to_same_range_addr(cur_insert->un.ptrs.next, cur_userchunk), 
-					cur_insert = cur_userchunk ? insert_for_chunk(cur_userchunk) : NULL)
-			{
-				if ((char*) cur_userchunk < (char*) lowest_chunkaddr)
-				{
-					lowest_chunkaddr = cur_userchunk;
-				}
-			}
-			
-			/* Now we definitely have a lowest chunk addr */
-			unsigned long bytes_to_unindex = malloc_usable_size(lowest_chunkaddr);
-			__liballocs_index_delete(lowest_chunkaddr);
-			total_unindexed += bytes_to_unindex;
-			++chunks_unindexed;
-			if (total_unindexed >= total_to_unindex)
-			{
-				if (total_unindexed > total_to_unindex)
-				{
-					fprintf(stderr, 
-						"Warning: unindexed too many bytes "
-						"(requested %lu from %p; got %lu in %u chunks)\n",
-						total_to_unindex, frame_addr, total_unindexed, chunks_unindexed);
-				}
-				goto out;
-			}
+/* A signal handler can only safely read its own thread's index, since it
+ * interrupted the only writer. We don't initialize it here: if it's not
+ * initialized, it's empty. */
+static liballocs_err_t get_info_signal_safe(void *obj, struct big_allocation *maybe_bigalloc,
+	struct uniqtype **out_type, void **out_base, 
+	unsigned long *out_size, const void **out_site)
+{
+	struct alloca_index *idx = thread_alloca_index;
+	__atomic_signal_fence(__ATOMIC_ACQUIRE);
+	struct alloca_record *found = idx ? find_record(idx, obj) : NULL;
+	if (!found)
+	{
+		struct thread_stack_bounds *bounds = &__stack_allocator_thread_stack;
+		if (bounds->looked_up && (char*) obj >= bounds->begin && (char*) obj < bounds->end)
+		{
+			return &__liballocs_err_unindexed_heap_object;
 		}
+		return &__liballocs_err_not_signal_safe; /* maybe another thread's */
 	}
-	assert(0);
+	if (out_base) *out_base = found->addr;
+	if (out_size) *out_size = found->size - sizeof (struct insert);
+	return extract_alloc_site_and_type_signal_safe(
+		insert_for_chunk_and_usable_size(found->addr, found->size),
+		out_type, (void**) out_site);
+}
+
+void __liballocs_unindex_stack_objects_counted_by(unsigned long *bytes_counter, void *frame_addr)
+{
+	struct big_allocation *b = __lookup_bigalloc(bytes_counter, &__stackframe_allocator, NULL);
+	if (*bytes_counter == 0) goto out;
+	if (!b) abort();
+	
+	/* This frame's allocas are the records below its frame address.
+	 * Outer frames' are all above it. */
+	truncate_below(this_thread_index(), frame_addr);
 	
 out:
 	if (b) __liballocs_delete_bigalloc_at(bytes_counter, &__stackframe_allocator);
@@ -110,12 +274,16 @@ void __alloca_allocator_notify(void *new_userchunkaddr, unsigned long modified_s
 	assert(b);
 	if (!b->suballocator) b->suballocator = &__alloca_allocator;
 	else if (b->suballocator != &__alloca_allocator) abort();
+	struct alloca_index *idx = this_thread_index();
+	b->suballocator_meta = idx;
 	
 	/* Extend the frame bigalloc to include this alloca. Note that we're *prepending*
 	 * to the allocation. */
 	__liballocs_pre_extend_bigalloc(b, sp_at_caller);
 	 
 	/* index it */
-	__liballocs_index_insert(new_userchunkaddr, modified_size, caller);
+	struct insert *p_insert = insert_for_chunk_and_usable_size(new_userchunkaddr, modified_size);
+	p_insert->alloc_site_flag = 0U;
+	p_insert->alloc_site = (uintptr_t) caller;
+	append_record(idx, new_userchunkaddr, modified_size);
 }
-
@@ -93,6 +93,7 @@ static liballocs_err_t get_info(void * obj, struct big_allocation *maybe_bigallo
 	struct uniqtype **out_type, void **out_base, 
 	unsigned long *out_size, const void **out_site)
 {
+	count_allocator_query(&__auxv_allocator);
 	if (!auxv_array_uniqtype) init_uniqtypes();
 	
 	/* Decide whether it falls into the asciiz, auxv_t or ptr vector parts. */
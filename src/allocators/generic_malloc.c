@@ -52,6 +52,8 @@ static void *userptr_to_allocptr(void *allocptr);
 #include "alloc_events.h"
 #include "heap_index.h"
 #include "pageindex.h"
+#include "uniqtype-bfs.h"
+#include "eventtrace.h"
 
 #ifndef NO_PTHREADS
 #define BIG_LOCK \
@@ -68,6 +70,15 @@ static pthread_mutex_t mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 #define BIG_LOCK
 #define BIG_UNLOCK
 #endif
+/* Inserting and deleting also bump the index's sequence count, for
+ * signal-safe lookups (see get_info_signal_safe). */
+#define BIG_LOCK_FOR_WRITE \
+	BIG_LOCK \
+	index_seq_begin_write(&heap_index_seq);
+#define BIG_UNLOCK_FOR_WRITE \
+	index_seq_end_write(&heap_index_seq); \
+	BIG_UNLOCK
+static struct index_seq heap_index_seq;
 
 #ifndef NO_TLS
 __thread void *__current_allocsite;
@@ -350,6 +361,13 @@ __liballocs_index_insert(void *new_userchunkaddr, size_t modified_size, const vo
 }
 
 static unsigned long index_insert_count;
+/* How many chunks are on the l1 index's lists right now. Only changed
+ * under the big lock, but read without it (see stats-shm.c). */
+static unsigned long nindexed_chunks;
+unsigned long __generic_malloc_allocator_nindexed_chunks(void)
+{
+	return __atomic_load_n(&nindexed_chunks, __ATOMIC_RELAXED);
+}
 
 #define PROMOTE_TO_BIGALLOC(userchunk) \
 	(malloc_usable_size(userptr_to_allocptr((userchunk))) \
@@ -366,6 +384,15 @@ static unsigned long index_insert_count;
 	 ? (void*)(ROUND_DOWN_PTR((allocptr), PAGE_SIZE)) : (allocptr) \
 	)*/
 	
+/* A promoted chunk isn't on any l1 list, so its in-chunk insert's link
+ * fields are free. We set them to the bigalloc entry value, which no list
+ * link ever takes, so that index_delete can tell a promoted chunk from its
+ * own insert and only then go to the pageindex. A chunk we never indexed
+ * might have garbage that happens to look the same; that just costs the
+ * lookup we would have done anyway. */
+#define BIGALLOC_LINK ((struct entry) { .present = 0, .removed = 1, .distance = 63 })
+#define INSERT_IS_PROMOTED(p_ins) IS_BIGALLOC_ENTRY(&(p_ins)->un.ptrs.next)
+
 static struct big_allocation *fresh_big(void *allocptr, size_t bigalloc_size, 
 	struct insert ins, struct big_allocation *containing_bigalloc)
 {
@@ -390,6 +417,9 @@ static struct big_allocation *fresh_big(void *allocptr, size_t bigalloc_size,
 	);
 		
 	if (!b) abort();
+	struct insert *p_ins = insert_for_chunk(allocptr_to_userptr(allocptr));
+	p_ins->un.ptrs.next = BIGALLOC_LINK;
+	p_ins->un.ptrs.prev = BIGALLOC_LINK;
 	return b;
 }
 
@@ -398,6 +428,12 @@ static struct big_allocation *become_big(void *allocptr, size_t bigalloc_size,
 {
 	/* It's only legal call this if allocptr is already an allocation. */
 	index_delete(allocptr_to_userptr(allocptr));
+	/* It's still live, so put back what index_delete took out of the census. */
+	if (__liballocs_heap_census_enabled)
+	{
+		void *userptr = allocptr_to_userptr(allocptr);
+		__liballocs_heap_census_add(census_key(insert_for_chunk(userptr)), 1, usersize(userptr));
+	}
 	return fresh_big(allocptr, bigalloc_size, ins, containing_bigalloc);
 }
 
@@ -422,16 +458,53 @@ static struct big_allocation *ensure_big(void *addr)
 						.alloc_site = (uintptr_t) site
 					}, __lookup_deepest_bigalloc(start));
 }
+static void do_index_insert(void *new_userchunkaddr, size_t modified_size, const void *caller);
+static void do_index_delete(void *userptr);
+/* When tracing (see event-trace.c), time each index operation as a whole,
+ * including the wait for the lock. */
 static void 
 index_insert(void *new_userchunkaddr, size_t modified_size, const void *caller)
+{
+	if (__builtin_expect(!__liballocs_trace_enabled, 1))
+	{
+		do_index_insert(new_userchunkaddr, modified_size, caller);
+		return;
+	}
+	unsigned long begin_ns = __liballocs_trace_now();
+	do_index_insert(new_userchunkaddr, modified_size, caller);
+	__liballocs_trace_event(EVENTTRACE_HEAP_INSERT, new_userchunkaddr,
+		usersize(new_userchunkaddr), caller, begin_ns);
+}
+static void index_delete(void *userptr)
+{
+	if (__builtin_expect(!__liballocs_trace_enabled, 1) || !userptr)
+	{
+		do_index_delete(userptr);
+		return;
+	}
+	unsigned long begin_ns = __liballocs_trace_now();
+	/* Get these while the chunk is still indexed. A query may have
+	 * replaced the site with a uniqtype, which is no use to us. */
+	size_t size = usersize(userptr);
+	struct insert *ins = insert_for_chunk(userptr);
+	const void *site = ins->alloc_site_flag ? NULL : (const void *)(uintptr_t) ins->alloc_site;
+	do_index_delete(userptr);
+	__liballocs_trace_event(EVENTTRACE_HEAP_DELETE, userptr, size, site, begin_ns);
+}
+static void 
+do_index_insert(void *new_userchunkaddr, size_t modified_size, const void *caller)
 {
 	int lock_ret;
-	BIG_LOCK
+	BIG_LOCK_FOR_WRITE
 	
 	/* We *must* have been initialized to continue. So initialize now.
 	 * (Sometimes the initialize hook doesn't get called til after we are called.) */
 	if (!index_region) do_init();
 	assert(index_region);
+	if (__liballocs_heap_census_enabled)
+	{
+		__liballocs_heap_census_add((uintptr_t) caller, 1, usersize(new_userchunkaddr));
+	}
 	
 	/* The address *must* be in our tracked range. Assert this. */
 	assert(new_userchunkaddr <= (index_end_addr ? index_end_addr : MAP_FAILED));
@@ -489,7 +562,7 @@ index_insert(void *new_userchunkaddr, size_t modified_size, const void *caller)
 						.alloc_site = (uintptr_t) caller
 					}, containing_bigalloc);
 		if (!this_chunk_bigalloc) abort();
-		BIG_UNLOCK
+		BIG_UNLOCK_FOR_WRITE
 		return;
 	}
 	
@@ -526,6 +599,7 @@ after_promotion: ;
 	}
 	/* 3. Fix up the index. */
 	*index_entry = addr_to_entry(new_userchunkaddr); // FIXME: thread-safety
+	__atomic_store_n(&nindexed_chunks, nindexed_chunks + 1, __ATOMIC_RELAXED);
 
 	/* sanity checks */
 	struct entry *e = index_entry;
@@ -539,7 +613,7 @@ after_promotion: ;
 		insert_for_chunk(entry_to_same_range_addr(p_insert->un.ptrs.prev, new_userchunkaddr)));
 	list_sanity_check(e, new_userchunkaddr);
 	
-	BIG_UNLOCK
+	BIG_UNLOCK_FOR_WRITE
 }
 
 void 
@@ -590,7 +664,7 @@ __liballocs_index_delete(void *userptr)
 	index_delete(userptr);
 }
 
-static void index_delete(void *userptr/*, size_t freed_usable_size*/)
+static void do_index_delete(void *userptr/*, size_t freed_usable_size*/)
 {
 	/* The freed_usable_size is not strictly necessary. It was added
 	 * for handling realloc after-the-fact. In this case, by the time we
@@ -611,7 +685,7 @@ static void index_delete(void *userptr/*, size_t freed_usable_size*/)
 	}
 	
 	int lock_ret;
-	BIG_LOCK
+	BIG_LOCK_FOR_WRITE
 	
 #ifdef TRACE_HEAP_INDEX
 	/* Check the recently-freed list for this pointer. We will warn about
@@ -622,6 +696,7 @@ static void index_delete(void *userptr/*, size_t freed_usable_size*/)
 		{
 			fprintf(stderr, "*** Double free detected for alloc chunk %p\n", 
 				userptr);
+			BIG_UNLOCK_FOR_WRITE
 			return;
 		}
 	}
@@ -630,9 +705,14 @@ static void index_delete(void *userptr/*, size_t freed_usable_size*/)
 	/* We promoted this entry into the bigalloc index. We still
 	 * kept its metadata locally, though. */
 	struct entry *index_entry = INDEX_LOC_FOR_ADDR(userptr);
-	/* Are we a bigalloc? */
-	struct big_allocation *b = __lookup_bigalloc(userptr, 
-			&__generic_malloc_allocator, NULL);
+	struct insert *ins = insert_for_chunk(userptr);
+	if (__liballocs_heap_census_enabled)
+	{
+		__liballocs_heap_census_add(census_key(ins), -1, -(long) usersize(userptr));
+	}
+	/* Are we a bigalloc? Only ask the pageindex if our insert says so. */
+	struct big_allocation *b = INSERT_IS_PROMOTED(ins) ? __lookup_bigalloc(userptr, 
+			&__generic_malloc_allocator, NULL) : NULL;
 	if (b)
 	{
 		void *allocptr = userptr_to_allocptr(userptr);
@@ -663,7 +743,7 @@ static void index_delete(void *userptr/*, size_t freed_usable_size*/)
 		}
 #endif
 		
-		BIG_UNLOCK
+		BIG_UNLOCK_FOR_WRITE
 		return;
 	}
 
@@ -673,7 +753,6 @@ static void index_delete(void *userptr/*, size_t freed_usable_size*/)
 #endif
 	
 	unsigned suballocated_region_number = 0;
-	struct insert *ins = insert_for_chunk(userptr);
 	//if (ALLOC_IS_SUBALLOCATED(userptr, ins)) 
 	//{
 	//	suballocated_region_number = (uintptr_t) ins->alloc_site;
@@ -686,6 +765,7 @@ static void index_delete(void *userptr/*, size_t freed_usable_size*/)
 	 * to avoid concurrent in-place realloc()s messing with the other inserts we access. */
 
 	/* remove it from the bins */
+	__atomic_store_n(&nindexed_chunks, nindexed_chunks - 1, __ATOMIC_RELAXED);
 	void *our_next_chunk = entry_to_same_range_addr(insert_for_chunk(userptr)->un.ptrs.next, userptr);
 	void *our_prev_chunk = entry_to_same_range_addr(insert_for_chunk(userptr)->un.ptrs.prev, userptr);
 	
@@ -742,7 +822,7 @@ out:
 	invalidate_cache_entries(userptr, (unsigned short) -1, NULL, -1);
 	list_sanity_check(index_entry, NULL);
 	
-	BIG_UNLOCK
+	BIG_UNLOCK_FOR_WRITE
 }
 
 void pre_nonnull_free(void *userptr, size_t freed_usable_size) __attribute__((visibility("hidden")));
@@ -750,6 +830,7 @@ void __liballocs_malloc_pre_nonnull_free(void *userptr, size_t freed_usable_size
 		__attribute__((alias("pre_nonnull_free")));
 void pre_nonnull_free(void *userptr, size_t freed_usable_size)
 {
+	__uniqtype_bfs_notify_free(userptr);
 	index_delete(userptr/*, freed_usable_size*/);
 }
 
@@ -823,6 +904,10 @@ void post_nonnull_nonzero_realloc(void *userptr,
 		index_insert(userptr, old_usable_size, __current_allocsite ? __current_allocsite : caller);
 	}
 	
+	/* Tell any incremental heap walk that this object moved or changed. */
+	__uniqtype_bfs_notify_realloc(userptr,
+		__new_allocptr ? allocptr_to_userptr(__new_allocptr) : userptr);
+	
 	if (__new_allocptr == userptr && modified_size < old_usable_size)
 	{
 		if (b)
@@ -1049,7 +1134,10 @@ struct insert *__liballocs_get_insert(const void *mem)
 		assert(b->meta.what == INS_AND_BITS);
 		return &b->meta.un.ins_and_bits.ins;
 	}
-	else return lookup_object_info(mem, NULL, NULL, NULL);
+	struct insert *ins = lookup_object_info(mem, NULL, NULL, NULL);
+	/* Alloca chunks have inserts too, but they're not in our index. */
+	if (!ins) ins = __alloca_allocator_lookup(mem, NULL, NULL);
+	return ins;
 }
 
 /* A client-friendly lookup function with cache. */
@@ -1103,12 +1191,14 @@ struct insert *lookup_object_info(const void *mem, void **out_object_start, size
 					assert(next_to_evict - &lookup_cache[0] < LOOKUP_CACHE_SIZE);
 				}
 				assert(INSERT_DESCRIBES_OBJECT(lookup_cache[i].insert));
+				count_query(QUERY_LOOKUP_CACHE_HIT);
 				return lookup_cache[i].insert;
 			}
 		}
 	}
 	
 	// didn't hit cache, but we may have seen the l01 entry
+	count_query(QUERY_LOOKUP_CACHE_MISS);
 	struct insert *found;
 	void *object_start;
 	unsigned short depth = 1;
@@ -1206,9 +1296,15 @@ struct insert *lookup_l01_object_info(const void *mem, void **out_object_start)
 	return lookup_l01_object_info_nocache(mem, out_object_start);
 }
 
-static
-struct insert *lookup_l01_object_info_nocache(const void *mem, void **out_object_start) 
+/* Signal-safe lookups can see the lists mid-update on another thread, so
+ * they give up after visiting max_chunks chunks rather than risk a cycle.
+ * They also can't use malloc_usable_size(), so the caller says how to get
+ * a chunk's usable size; it returns 0 if it can't tell. */
+static inline
+struct insert *lookup_l01_object_info_bounded(const void *mem, void **out_object_start,
+	unsigned long max_chunks, size_t (*usable_size)(void *allocptr))
 {
+	_Bool may_print = (max_chunks == (unsigned long) -1);
 	struct entry *first_head = INDEX_LOC_FOR_ADDR(mem);
 	struct entry *cur_head = first_head;
 	size_t object_minimum_size = 0;
@@ -1272,11 +1368,15 @@ struct insert *lookup_l01_object_info_nocache(const void *mem, void **out_object
 
 		while (cur_userchunk)
 		{
-			struct insert *cur_insert = insert_for_chunk(cur_userchunk);
+			if (max_chunks-- == 0) goto fail;
+			size_t cur_usable_size = usable_size(userptr_to_allocptr(cur_userchunk));
+			if (__builtin_expect(cur_usable_size == 0, 0)) goto fail;
+			struct insert *cur_insert = insert_for_chunk_and_usable_size(cur_userchunk,
+				cur_usable_size);
 #ifndef NDEBUG
 			/* Sanity check on the insert. */
-			if ((char*) cur_insert < (char*) cur_userchunk
-				|| (char*) cur_insert - (char*) cur_userchunk > biggest_unpromoted_object)
+			if (may_print && ((char*) cur_insert < (char*) cur_userchunk
+				|| (char*) cur_insert - (char*) cur_userchunk > biggest_unpromoted_object))
 			{
 				fprintf(stderr, "Saw insane insert address %p for chunk beginning %p "
 					"(usable size %zu, allocptr %p); memory corruption?\n", 
@@ -1286,7 +1386,7 @@ struct insert *lookup_l01_object_info_nocache(const void *mem, void **out_object
 			}	
 #endif
 			if (mem >= cur_userchunk
-				&& mem < cur_userchunk + malloc_usable_size(userptr_to_allocptr(cur_userchunk))) 
+				&& mem < cur_userchunk + cur_usable_size) 
 			{
 				// match!
 				if (out_object_start) *out_object_start = cur_userchunk;
@@ -1310,11 +1410,19 @@ fail:
 	/* FIXME: use the actual biggest allocated object, not a guess. */
 }
 
+static
+struct insert *lookup_l01_object_info_nocache(const void *mem, void **out_object_start) 
+{
+	return lookup_l01_object_info_bounded(mem, out_object_start, (unsigned long) -1,
+		malloc_usable_size);
+}
+
 liballocs_err_t __generic_heap_get_info(void * obj, struct big_allocation *maybe_bigalloc, 
 	struct uniqtype **out_type, void **out_base, 
 	unsigned long *out_size, const void **out_site)
 {
-	++__liballocs_hit_heap_case; // FIXME: needn't be heap -- could be alloca
+	count_allocator_query(&__generic_malloc_allocator);
+	count_query(QUERY_HIT_HEAP_CASE); // FIXME: needn't be heap -- could be alloca
 	/* For heap allocations, we look up the allocation site.
 	 * (This also yields an offset within a toplevel object.)
 	 * Then we translate the allocation site to a uniqtypes rec location.
@@ -1334,28 +1442,119 @@ liballocs_err_t __generic_heap_get_info(void * obj, struct big_allocation *maybe
 		if (out_base) *out_base = maybe_bigalloc->begin;
 		if (out_size) *out_size = (char*) maybe_bigalloc->end - (char*) maybe_bigalloc->begin;
 	} 
-	else
+	void *chunk_start = NULL;
+	if (!maybe_bigalloc)
 	{
 		size_t alloc_chunksize;
-		heap_info = lookup_object_info(obj, out_base, &alloc_chunksize, NULL);
+		heap_info = lookup_object_info(obj, &chunk_start, &alloc_chunksize, NULL);
 		if (heap_info)
 		{
+			if (out_base) *out_base = chunk_start;
 			if (out_size) *out_size = alloc_chunksize - sizeof (struct insert) - EXTRA_INSERT_SPACE;
 		}
 	}
 	
 	if (!heap_info)
 	{
-		++__liballocs_aborted_unindexed_heap;
+		count_query(QUERY_ABORTED_UNINDEXED_HEAP);
 		return &__liballocs_err_unindexed_heap_object;
 	}
 	
-	return extract_and_output_alloc_site_and_type(heap_info, out_type, (void**) out_site);
+	/* If the lookup rewrites the chunk's insert, we move the chunk to its
+	 * new census key, where index_delete will look for it. (A bigalloc's
+	 * insert is a copy, and index_delete looks at the chunk's own.) Only an
+	 * insert that still holds a site can be rewritten. We do the rewrite
+	 * and the move under the lock, so that of two queries racing to rewrite
+	 * the same insert, only the first sees the key change, and so that
+	 * index_delete sees either the old key with the old count or both new. */
+	if (!chunk_start || !__liballocs_heap_census_enabled
+			|| __builtin_expect(heap_info->alloc_site_flag, 1))
+	{
+		return extract_and_output_alloc_site_and_type(heap_info, out_type, (void**) out_site);
+	}
+	/* Looking up the site may load its object's metadata, which mallocs,
+	 * so do that before we take the lock. */
+	__liballocs_load_metadata_on_miss((void*) heap_info->alloc_site);
+	int lock_ret;
+	BIG_LOCK
+	uintptr_t key_before = census_key(heap_info);
+	liballocs_err_t err = extract_and_output_alloc_site_and_type(heap_info, out_type, (void**) out_site);
+	if (census_key(heap_info) != key_before)
+	{
+		long nbytes = usersize(chunk_start);
+		__liballocs_heap_census_add(key_before, -1, -nbytes);
+		__liballocs_heap_census_add(census_key(heap_info), 1, nbytes);
+	}
+	BIG_UNLOCK
+	return err;
+}
+
+/* malloc_usable_size() is our wrapper, which can look up the thread's
+ * stack, and the malloc beneath may take locks too. So in a signal handler
+ * we read glibc's chunk header ourselves: the size word just below the
+ * chunk, whose low three bits are flags. An mmapped chunk (bit 1) spends
+ * two words on overhead, others one. A size that can't belong to an
+ * indexed chunk, e.g. because the chunk is being freed, gives 0. */
+#if defined(__GLIBC__) && !defined(MALLOC_USABLE_SIZE_HACK)
+#define HAVE_SIGNAL_SAFE_USABLE_SIZE
+static size_t usable_size_signal_safe(void *allocptr)
+{
+	size_t size_word = ((size_t *) allocptr)[-1];
+	size_t chunk_size = size_word & ~(size_t) 7;
+	size_t overhead = ((size_word & 2) ? 2 : 1) * sizeof (size_t);
+	if (chunk_size < overhead + sizeof (struct insert)) return 0;
+	size_t usable = chunk_size - overhead;
+	if (usable > biggest_unpromoted_object + 2 * sizeof (size_t)) return 0;
+	return usable;
+}
+#endif
+
+/* Like __generic_heap_get_info, but without the lock, the lookup cache or
+ * any metadata loading. We read the index optimistically and report a
+ * retry if an insert or delete overlapped with us. */
+#define SIGNAL_SAFE_MAX_CHUNKS 65536
+static liballocs_err_t get_info_signal_safe(void *obj, struct big_allocation *maybe_bigalloc, 
+	struct uniqtype **out_type, void **out_base, 
+	unsigned long *out_size, const void **out_site)
+{
+	unsigned long seq = index_seq_read_begin(&heap_index_seq);
+	if (seq & 1) return &__liballocs_err_retry;
+	struct insert *heap_info = NULL;
+	if (maybe_bigalloc)
+	{
+		heap_info = &maybe_bigalloc->meta.un.ins_and_bits.ins;
+		if (out_base) *out_base = maybe_bigalloc->begin;
+		if (out_size) *out_size = (char*) maybe_bigalloc->end - (char*) maybe_bigalloc->begin;
+	}
+	else if (index_region)
+	{
+#ifdef HAVE_SIGNAL_SAFE_USABLE_SIZE
+		void *start;
+		heap_info = lookup_l01_object_info_bounded(obj, &start, SIGNAL_SAFE_MAX_CHUNKS,
+			usable_size_signal_safe);
+		if (heap_info)
+		{
+			if (out_base) *out_base = start;
+			if (out_size) *out_size = allocsize_to_usersize(
+					usable_size_signal_safe(userptr_to_allocptr(start)))
+				- sizeof (struct insert) - EXTRA_INSERT_SPACE;
+		}
+#else
+		/* We don't know how to size a chunk without calling into malloc. */
+		return &__liballocs_err_not_signal_safe;
+#endif
+	}
+	liballocs_err_t err = heap_info
+		? extract_alloc_site_and_type_signal_safe(heap_info, out_type, (void**) out_site)
+		: &__liballocs_err_unindexed_heap_object;
+	if (index_seq_read_changed(&heap_index_seq, seq)) return &__liballocs_err_retry;
+	return err;
 }
 
 struct allocator __generic_malloc_allocator = {
 	.name = "generic malloc",
 	.get_info = __generic_heap_get_info,
+	.get_info_signal_safe = get_info_signal_safe,
 	.is_cacheable = 1,
 	.ensure_big = ensure_big
 };
@@ -772,6 +772,7 @@ static liballocs_err_t get_info(void *obj, struct big_allocation *maybe_bigalloc
 	struct uniqtype **out_type, void **out_base, 
 	unsigned long *out_size, const void **out_site)
 {
+	count_allocator_query(&__generic_small_allocator);
 	struct big_allocation *parent = maybe_bigalloc ? maybe_bigalloc->parent
 		 : __lookup_deepest_bigalloc(obj);
 	
@@ -779,7 +780,7 @@ static liballocs_err_t get_info(void *obj, struct big_allocation *maybe_bigalloc
 		parent, out_base, out_size);
 	if (!heap_info)
 	{
-		++__liballocs_aborted_unindexed_heap;
+		count_query(QUERY_ABORTED_UNINDEXED_HEAP);
 		return &__liballocs_err_unindexed_heap_object;
 	}
 	
@@ -53,7 +53,11 @@ static const char *filename_for_fd(int fd)
 	return out_buf;
 }
 
-#define MAPPING_SEQUENCE_MAX_LEN 8
+/* A sequence's entries are kept in address order (we only ever append
+ * contiguous mappings at the end). Short sequences live in the inline
+ * array; longer ones spill into an array from our private malloc, which
+ * grows by doubling. So copying a sequence needs the helpers below. */
+#define MAPPING_SEQUENCE_INLINE_LEN 8
 struct mapping_entry
 {
 	void *begin;
@@ -70,9 +74,84 @@ struct mapping_sequence
 	void *end;
 	const char *filename;
 	unsigned nused;
-	struct mapping_entry mappings[MAPPING_SEQUENCE_MAX_LEN];
+	unsigned nallocated; /* 0 means we're using the inline array */
+	struct mapping_entry *mappings;
+	struct mapping_entry inline_mappings[MAPPING_SEQUENCE_INLINE_LEN];
 };
 
+static void init_sequence(struct mapping_sequence *seq)
+{
+	memset(seq, 0, sizeof (struct mapping_sequence));
+	seq->mappings = &seq->inline_mappings[0];
+}
+
+static unsigned sequence_capacity(struct mapping_sequence *seq)
+{
+	return seq->nallocated ? seq->nallocated : MAPPING_SEQUENCE_INLINE_LEN;
+}
+
+/* Move src's contents into dst, which takes over any out-of-line array. */
+static void move_sequence(struct mapping_sequence *dst, struct mapping_sequence *src)
+{
+	memcpy(dst, src, sizeof (struct mapping_sequence));
+	if (!src->nallocated) dst->mappings = &dst->inline_mappings[0];
+	init_sequence(src);
+}
+
+static _Bool private_malloc_is_active(void)
+{
+	return __private_realloc_active || __private_memalign_active || __private_posix_memalign_active
+			|| __private_calloc_active || __private_malloc_active;
+}
+
+/* Make room for one more entry. We can't do this if we're being called
+ * back from inside our own private malloc. */
+static _Bool grow_sequence(struct mapping_sequence *seq)
+{
+	unsigned capacity = sequence_capacity(seq);
+	if (seq->nused < capacity) return 1;
+	if (private_malloc_is_active()) return 0;
+	unsigned new_capacity = 2 * capacity;
+	struct mapping_entry *new_mappings;
+	if (seq->nallocated)
+	{
+		new_mappings = __wrap_dlrealloc(seq->mappings, new_capacity * sizeof (struct mapping_entry));
+		if (!new_mappings) return 0;
+	}
+	else
+	{
+		new_mappings = __wrap_dlmalloc(new_capacity * sizeof (struct mapping_entry));
+		if (!new_mappings) return 0;
+		memcpy(new_mappings, seq->inline_mappings, seq->nused * sizeof (struct mapping_entry));
+	}
+	seq->mappings = new_mappings;
+	seq->nallocated = new_capacity;
+	return 1;
+}
+
+static void free_sequence(void *seq_as_void)
+{
+	struct mapping_sequence *seq = seq_as_void;
+	if (seq->nallocated) __wrap_dlfree(seq->mappings);
+	__wrap_dlfree(seq);
+}
+
+/* Deep-copy src into a fresh heap sequence. */
+static struct mapping_sequence *copy_sequence(struct mapping_sequence *src)
+{
+	struct mapping_sequence *copy = __wrap_dlmalloc(sizeof (struct mapping_sequence));
+	if (!copy) return NULL;
+	memcpy(copy, src, sizeof (struct mapping_sequence));
+	if (src->nallocated)
+	{
+		copy->mappings = __wrap_dlmalloc(src->nallocated * sizeof (struct mapping_entry));
+		if (!copy->mappings) { __wrap_dlfree(copy); return NULL; }
+		memcpy(copy->mappings, src->mappings, src->nused * sizeof (struct mapping_entry));
+	}
+	else copy->mappings = &copy->inline_mappings[0];
+	return copy;
+}
+
 /* How are we supposed to allocate the mapping sequence metadata? */
 
 static struct big_allocation *add_bigalloc(void *begin, size_t size)
@@ -103,16 +182,16 @@ static void add_mapping_sequence_bigalloc(struct mapping_sequence *seq)
 	
 	/* Note that this will use early_malloc if we would otherwise be reentrant. */
 	struct mapping_sequence *copy = __wrap_dlmalloc(sizeof (struct mapping_sequence));
-	/* FIXME: free this somewhere? */
 	if (!copy) abort();
-	memcpy(copy, seq, sizeof (struct mapping_sequence));
+	/* The bigalloc takes over seq's entries; seq is left empty. */
+	move_sequence(copy, seq);
 	
 	b->meta = (struct meta_info) {
 		.what = DATA_PTR,
 		.un = {
 			opaque_data: {
 				.data_ptr = copy,
-				.free_func = __wrap_dlfree
+				.free_func = free_sequence
 			}
 		}
 	};
@@ -121,59 +200,64 @@ static void add_mapping_sequence_bigalloc(struct mapping_sequence *seq)
 /* HACK: we have a special link to the auxv allocator. */
 void __auxv_allocator_notify_init_stack_mapping(void *begin, void *end);
 
+/* Index of the first entry ending after addr, or nused if there is none. */
+static unsigned first_entry_ending_after(struct mapping_sequence *seq, void *addr)
+{
+	unsigned lo = 0, hi = seq->nused;
+	while (lo < hi)
+	{
+		unsigned mid = lo + (hi - lo) / 2;
+		if ((char*) seq->mappings[mid].end <= (char*) addr) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
 static void delete_mapping_sequence_span(struct mapping_sequence *seq,
 	void *addr, size_t length)
 {
-	int new_indices[MAPPING_SEQUENCE_MAX_LEN];
-	for (int i = 0; i < MAPPING_SEQUENCE_MAX_LEN; ++i)
+	unsigned first = first_entry_ending_after(seq, addr);
+	for (unsigned i = first; i < seq->nused
+			&& (char*) seq->mappings[i].begin < (char*) addr + length; ++i)
 	{
-		if ((char*) seq->mappings[i].begin <= (char*) addr 
-				&&  (char*) addr < (char*) seq->mappings[i].end)
+		/* We have some overlap. Is it partial or total? */
+		char *ent_begin = seq->mappings[i].begin;
+		char *ent_end = seq->mappings[i].end;
+		_Bool keeps_beginning = ent_begin < (char*) addr;
+		_Bool keeps_end = ent_end > (char*) addr + length;
+
+		// we can't punch holes, yet (FIXME)
+		if (keeps_beginning && keeps_end) abort();
+
+		if (!keeps_beginning && !keeps_end)
 		{
-			/* We have some overlap. Is it partial or total? */
-
-			// we can't punch holes, yet (FIXME)
-			_Bool splits_mapping = ((char*) addr > (char*) seq->mappings[i].begin
-					&& (char*) addr + length < (char*) seq->mappings[i].end);
-			if (splits_mapping) abort();
-			
-			size_t left_at_beginning = 
-				((char*) addr > (char*) seq->mappings[i].begin) 
-					? (char*) addr - (char*) seq->mappings[i].begin
-					: 0;
-			size_t left_at_end = ((char*) addr + length > (char*) seq->mappings[i].end)
-					? 0
-					: (char*) seq->mappings[i].end - ((char*) addr + length);
-			
-			_Bool total = (left_at_beginning == 0) && (left_at_end == 0);
-			
-			if (total)
-			{
-				/* clear it */
-				memset(&seq->mappings[i], 0, sizeof (struct mapping_entry));
-			}
-			else
+			/* clear it */
+			memset(&seq->mappings[i], 0, sizeof (struct mapping_entry));
+		}
+		else if (keeps_beginning) seq->mappings[i].end = addr;
+		else
+		{
+			seq->mappings[i].begin = (char*) addr + length;
+			if (!seq->mappings[i].is_anon)
 			{
-				seq->mappings[i].begin = (char*) seq->mappings[i].begin + left_at_beginning;
-				seq->mappings[i].end = (char*) seq->mappings[i].end - left_at_end;
+				seq->mappings[i].offset += ((char*) addr + length) - ent_begin;
 			}
 		}
 	}
 	
-	/* Now compact the sequence. */
-	int i = 0;
-	while (i < seq->nused)
+	/* Now compact the sequence, in one pass. */
+	unsigned out = 0;
+	for (unsigned i = 0; i < seq->nused; ++i)
 	{
-		if (!seq->mappings[i].begin)
-		{
-			// it's cleared; move all subsequent mappings down one
-			memmove(&seq->mappings[i], &seq->mappings[i + 1],
-					(seq->nused - (i + 1)) * sizeof (struct mapping_entry));
-			memset(&seq->mappings[seq->nused - 1], 0, sizeof (struct mapping_entry));
-			--(seq->nused);
-		}
-		else ++i;
+		if (!seq->mappings[i].begin) continue; // it's cleared
+		if (out != i) seq->mappings[out] = seq->mappings[i];
+		++out;
 	}
+	if (out < seq->nused)
+	{
+		memset(&seq->mappings[out], 0, (seq->nused - out) * sizeof (struct mapping_entry));
+	}
+	seq->nused = out;
 	
 	/* Update the overall metadata.
 	 * If the beginning is in the deleted span, push it to the end of the deleted span. 
@@ -183,8 +267,8 @@ static void delete_mapping_sequence_span(struct mapping_sequence *seq,
 	{
 		seq->begin = (char*) addr + length;
 	}
-	if ((char*) seq->end >= (char*) addr
-			&& (char*) seq->end < (char*) addr + length)
+	if ((char*) seq->end > (char*) addr
+			&& (char*) seq->end <= (char*) addr + length)
 	{
 		seq->end = addr;
 	}
@@ -197,6 +281,14 @@ static void do_munmap(void *addr, size_t length, void *caller)
 	while (cur < (char*) addr + length)
 	{
 		/* We're always working at level 0 */
+		/* Zoom past unindexed pages without taking the lock for each one;
+		 * coalesced unmaps often span many gaps. */
+		if (pageindex[PAGENUM(cur)] == 0)
+		{
+			cur += PAGE_SIZE;
+			remaining_length -= PAGE_SIZE;
+			continue;
+		}
 		struct big_allocation *b = __lookup_bigalloc(cur, &__mmap_allocator, NULL);
 		if (!b)
 		{
@@ -254,9 +346,9 @@ static void do_munmap(void *addr, size_t length, void *caller)
 				if (!second_half) abort();
 				__liballocs_truncate_bigalloc_at_end(b, addr);
 				/* Now the bigallocs are in the right place, but their metadata is wrong. */
-				struct mapping_sequence *new_seq = __wrap_dlmalloc(sizeof (struct mapping_sequence));
 				struct mapping_sequence *orig_seq = b->meta.un.opaque_data.data_ptr;
-				memcpy(new_seq, orig_seq, sizeof (struct mapping_sequence));
+				struct mapping_sequence *new_seq = copy_sequence(orig_seq);
+				if (!new_seq) abort();
 				/* From the first, delete from the hole all the way. */
 				delete_mapping_sequence_span(orig_seq, addr, (char*) old_end - (char*) addr);
 				/* From the second, delete from the old begin to the end of the hole. */
@@ -270,23 +362,97 @@ static void do_munmap(void *addr, size_t length, void *caller)
 	
 }
 
+/* Workloads like allocator trimming and GC page release unmap many small
+ * adjacent regions in a row, and doing each one's bigalloc and pageindex
+ * update separately means many small index writes and lock round-trips.
+ * So we don't process an munmap straight away. Instead we keep one pending
+ * span; an munmap that abuts or overlaps it just widens it. Anything else
+ * flushes it, i.e. does the update for the whole span at once:
+ *
+ * - an munmap that doesn't touch the pending span (which then becomes
+ *   the new pending span);
+ * - any other mapping notification, since it might reuse the addresses;
+ * - any query about an address in the pending span, via
+ *   FLUSH_PENDING_UNMAPS_COVERING in the pageindex lookups;
+ * - asking the mmap allocator for an allocation's extent, since the span
+ *   might be carved out of the one being asked about. */
+#ifndef NO_PTHREADS
+#include <pthread.h>
+static pthread_mutex_t pending_unmap_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+#define PENDING_UNMAP_LOCK pthread_mutex_lock(&pending_unmap_mutex);
+#define PENDING_UNMAP_UNLOCK pthread_mutex_unlock(&pending_unmap_mutex);
+#else
+#define PENDING_UNMAP_LOCK
+#define PENDING_UNMAP_UNLOCK
+#endif
+/* A mapping sequence changes (and its array may be reallocated) whenever
+ * its mappings do, so anyone changing one or reading it after their bigalloc
+ * lookup holds both our lock and the pageindex's, in that order. */
+#define SEQUENCE_LOCK PENDING_UNMAP_LOCK __liballocs_pageindex_lock();
+#define SEQUENCE_UNLOCK __liballocs_pageindex_unlock(); PENDING_UNMAP_UNLOCK
+struct pending_unmap __mmap_allocator_pending_unmap __attribute__((visibility("protected")));
+static void *pending_unmap_caller;
+static unsigned long munmaps_notified;
+static unsigned long munmap_spans_flushed;
+
+/* Call with the pending-unmap lock held. */
+static void flush_pending_unmap_locked(void)
+{
+	char *begin = __mmap_allocator_pending_unmap.begin;
+	char *end = __mmap_allocator_pending_unmap.end;
+	if (begin == end) return;
+	/* Clear it first, so that the lookups we do while flushing don't recurse. */
+	__mmap_allocator_pending_unmap = (struct pending_unmap) { NULL, NULL };
+	++munmap_spans_flushed;
+	__liballocs_pageindex_lock();
+	do_munmap(begin, end - begin, pending_unmap_caller);
+	__liballocs_pageindex_unlock();
+}
+
+void __mmap_allocator_flush_pending_unmaps(void)
+{
+	PENDING_UNMAP_LOCK
+	flush_pending_unmap_locked();
+	PENDING_UNMAP_UNLOCK
+}
+
 void __mmap_allocator_notify_munmap(void *addr, size_t length, void *caller)
 {
 	/* HACK: Is it actually a stack or sbrk area? Branch out if so. */
 	// FIXME
-	do_munmap(addr, length, caller);
+	char *begin = addr;
+	char *end = (char*) addr + ROUND_UP(length, PAGE_SIZE);
+	if (begin == end) return;
+	PENDING_UNMAP_LOCK
+	++munmaps_notified;
+	char *pending_begin = __mmap_allocator_pending_unmap.begin;
+	char *pending_end = __mmap_allocator_pending_unmap.end;
+	if (pending_begin != pending_end && begin <= pending_end && end >= pending_begin)
+	{
+		/* Widen the pending span. The caller is only a hint, so keep the first. */
+		if (begin < pending_begin) __mmap_allocator_pending_unmap.begin = begin;
+		if (end > pending_end) __mmap_allocator_pending_unmap.end = end;
+	}
+	else
+	{
+		flush_pending_unmap_locked();
+		__mmap_allocator_pending_unmap.begin = begin;
+		__mmap_allocator_pending_unmap.end = end;
+		pending_unmap_caller = caller;
+	}
+	PENDING_UNMAP_UNLOCK
+}
+
+void __mmap_allocator_get_munmap_stats(unsigned long *out_notified, unsigned long *out_flushed)
+{
+	if (out_notified) *out_notified = munmaps_notified;
+	if (out_flushed) *out_flushed = munmap_spans_flushed;
 }
 
 static struct mapping_entry *find_entry(void *addr, struct mapping_sequence *seq)
 {
-	for (unsigned i = 0; i < seq->nused; ++i)
-	{
-		if ((char*) addr >= (char*) seq->mappings[i].begin
-				&& (char*) addr < (char*) seq->mappings[i].end)
-		{
-			return &seq->mappings[i];
-		}
-	}
+	unsigned i = first_entry_ending_after(seq, addr);
+	if (i < seq->nused && (char*) addr >= (char*) seq->mappings[i].begin) return &seq->mappings[i];
 	return NULL;
 }
 
@@ -305,6 +471,8 @@ void __mmap_allocator_notify_mremap_before(void *old_addr, size_t old_size, size
 	/* HACK: Is it actually a stack or sbrk area? We can abort if so; remapping a
 	 * stack is a weird enough thing to do that it's not urgent to support it. */
 	// FIXME
+	SEQUENCE_LOCK
+	flush_pending_unmap_locked();
 	remembered_old_addr = old_addr;
 	struct big_allocation *bigalloc_before = __lookup_bigalloc(old_addr,
 		&__mmap_allocator, NULL);
@@ -315,9 +483,12 @@ void __mmap_allocator_notify_mremap_before(void *old_addr, size_t old_size, size
 	remembered_prot = maybe_ent->prot;
 	remembered_offset = maybe_ent->offset;
 	remembered_filename = seq->filename;
+	SEQUENCE_UNLOCK
 }
 void __mmap_allocator_notify_mremap_after(void *ret_addr, void *old_addr, size_t old_size, size_t new_size, int flags, void *new_address, void *caller)
 {
+	SEQUENCE_LOCK
+	flush_pending_unmap_locked();
 	if (ret_addr != MAP_FAILED)
 	{
 		/* Does the address match the remembered one? This is a HACK, i.e. 
@@ -335,14 +506,19 @@ void __mmap_allocator_notify_mremap_after(void *ret_addr, void *old_addr, size_t
 		}
 		else abort(); // FIXME: could do something best-effort
 	}
+	SEQUENCE_UNLOCK
 }
 
+/* Bumped (under our lock) by every mapping we're told about; see
+ * __mmap_allocator_notify_unindexed_address. */
+static unsigned long mappings_notified;
 static void do_mmap(void *mapped_addr, void *requested_addr, size_t requested_length, int prot, int flags,
                   const char *filename, off_t offset, void *caller)
 {
 	if (mapped_addr != MAP_FAILED)
 	{
 		if (mapped_addr == NULL) abort();
+		++mappings_notified;
 		
 		/* The actual length is rounded up to page size. */
 		size_t mapped_length = ROUND_UP(requested_length, PAGE_SIZE);
@@ -388,13 +564,12 @@ static void do_mmap(void *mapped_addr, void *requested_addr, size_t requested_le
 
 		/* If we got here, we have to create a new bigalloc. */
 		struct mapping_sequence new_seq;
-		memset(&new_seq, 0, sizeof new_seq);
+		init_sequence(&new_seq);
 		/* "Extend" the empty sequence. */
 		_Bool success = extend_sequence(&new_seq, mapped_addr, (char*) mapped_addr + mapped_length, 
 				prot, flags, offset, filename, caller);
 		if (!success) abort();
-		if (!__private_realloc_active && !__private_memalign_active && !__private_posix_memalign_active
-				&& !__private_calloc_active && !__private_malloc_active)
+		if (!private_malloc_is_active())
 		{
 			add_mapping_sequence_bigalloc(&new_seq);
 		}
@@ -409,7 +584,10 @@ void __mmap_allocator_notify_mmap(void *mapped_addr, void *requested_addr, size_
 {
 	/* HACK: Is it actually a stack or sbrk area? Branch out if so. */
 	// FIXME
+	SEQUENCE_LOCK
+	flush_pending_unmap_locked();
 	do_mmap(mapped_addr, requested_addr, length, prot, flags, filename_for_fd(fd), offset, caller);
+	SEQUENCE_UNLOCK
 }
 
 static int add_missing_cb(struct proc_entry *ent, char *linebuf, void *arg);
@@ -429,9 +607,8 @@ void add_missing_mappings_from_proc(void)
 	 * our own read loop. */
 	char linebuf[8192];
 	
-	struct mapping_sequence current = {
-		.begin = NULL
-	};
+	struct mapping_sequence current;
+	init_sequence(&current);
 	for_each_maps_entry(fd, linebuf, sizeof linebuf, &entry, add_missing_cb, &current);
 	/* Finish off the last mapping. */
 	if (current.nused > 0) add_mapping_sequence_bigalloc(&current);
@@ -589,8 +766,7 @@ static _Bool extend_sequence(struct mapping_sequence *cur,
 			      == get_highest_loaded_object_below(cur->mappings[cur->nused - 1].caller)))
 			// ... but if we're not beginning afresh, can't go from anonymous to with-name
 			|| (filename && cur->filename && 0 == strcmp(filename, cur->filename));
-	_Bool not_too_many = cur->nused != MAPPING_SEQUENCE_MAX_LEN;
-	if (is_contiguous && filename_is_consistent && not_too_many)
+	if (is_contiguous && filename_is_consistent && grow_sequence(cur))
 	{
 		if (!cur->begin) cur->begin = begin;
 		cur->end = end;
@@ -680,8 +856,7 @@ static int add_missing_cb(struct proc_entry *ent, char *linebuf, void *arg)
 		_Bool extended = extend_current(cur, ent);
 		if (!extended)
 		{
-			add_mapping_sequence_bigalloc(cur);
-			memset(cur, 0, sizeof (struct mapping_sequence));
+			add_mapping_sequence_bigalloc(cur); /* leaves cur empty */
 			_Bool began_new = extend_current(cur, ent);
 			if (!began_new) abort();
 		}
@@ -690,6 +865,96 @@ static int add_missing_cb(struct proc_entry *ent, char *linebuf, void *arg)
 	return 0; // keep going
 }
 
+static int resync_cb(struct proc_entry *ent, char *linebuf, void *arg)
+{
+	/* Stacks are the stack allocator's business, and anything already
+	 * indexed is either ours or someone else's; we only add what's missing. */
+	if (0 == strncmp(ent->rest, "[stack", 6)) return 0;
+	if (!__pages_unused((void*) ent->first, (void*) ent->second)) return 0;
+	return add_missing_cb(ent, linebuf, arg);
+}
+
+/* Pages we last re-read /proc for and found nothing new at, and how many
+ * mappings we'd been told about then. A mapping we didn't trap could still
+ * appear there later, but wild pointers tend to come back, and we'd rather
+ * not see it until the next mapping we do hear about than re-read /proc
+ * for each one. Under our lock. */
+#define UNINDEXED_CACHE_SIZE 64
+static struct
+{
+	uintptr_t page;
+	unsigned long mappings_notified;
+} unindexed_cache[UNINDEXED_CACHE_SIZE];
+
+/* Someone has found an address that nothing indexes. Maybe we missed the
+ * mapping it's in, e.g. because it was made by a raw syscall we didn't trap.
+ * Re-read just the mapping covering that page, and index it if it's new.
+ * Call without the pageindex lock, which comes after ours. In case somebody
+ * does hold it, we only try for ours, and give up if it's taken. */
+_Bool __mmap_allocator_notify_unindexed_address(const void *ptr)
+{
+	if (!initialized) return 0;
+	uintptr_t page = (uintptr_t) ptr & ~(PAGE_SIZE - 1);
+#ifndef NO_PTHREADS
+	if (0 != pthread_mutex_trylock(&pending_unmap_mutex)) return 0;
+#endif
+	unsigned cache_idx = (page >> LOG_PAGE_SIZE) % UNINDEXED_CACHE_SIZE;
+	if (unindexed_cache[cache_idx].page == page
+			&& unindexed_cache[cache_idx].mappings_notified == mappings_notified)
+	{
+		PENDING_UNMAP_UNLOCK
+		return 0;
+	}
+	int fd = open("/proc/self/maps", O_RDONLY);
+	if (fd == -1) { PENDING_UNMAP_UNLOCK return 0; }
+	struct proc_entry entry;
+	char linebuf[8192];
+	struct mapping_sequence current;
+	init_sequence(&current);
+	__liballocs_pageindex_lock();
+	for_each_maps_entry_in_range(fd, linebuf, sizeof linebuf, &entry,
+		page, page + PAGE_SIZE, resync_cb, &current);
+	if (current.nused > 0) add_mapping_sequence_bigalloc(&current);
+	_Bool found = pageindex[PAGENUM(ptr)] != 0;
+	__liballocs_pageindex_unlock();
+	close(fd);
+	if (!found)
+	{
+		unindexed_cache[cache_idx].page = page;
+		unindexed_cache[cache_idx].mappings_notified = mappings_notified;
+	}
+	PENDING_UNMAP_UNLOCK
+	return found;
+}
+
+/* If addr is in a mapping made as a stack, as pthreads makes thread stacks,
+ * get that mapping's bounds and return 1. Mappings we only learnt about from
+ * /proc have no flags, so they never count. Return 0 if addr's mapping is
+ * known not to be a stack, or -1 if we can't yet tell (we're not initialized,
+ * or addr is in no mapping we know about, or one we have no entries for). */
+int __mmap_allocator_get_stack_mapping_bounds(const void *addr, void **out_begin, void **out_end)
+{
+	if (!initialized) return -1;
+	int ret = -1;
+	SEQUENCE_LOCK
+	struct big_allocation *b = __lookup_bigalloc(addr, &__mmap_allocator, NULL);
+	struct mapping_sequence *seq = b ? b->meta.un.opaque_data.data_ptr : NULL;
+	if (seq)
+	{
+		struct mapping_entry *ent = find_entry((void*) addr, seq);
+		if (!ent) ret = -1;
+		else if (!(ent->flags & (MAP_STACK|MAP_GROWSDOWN))) ret = 0;
+		else
+		{
+			*out_begin = ent->begin;
+			*out_end = ent->end;
+			ret = 1;
+		}
+	}
+	SEQUENCE_UNLOCK
+	return ret;
+}
+
 static void update_data_segment_end(void *new_curbrk)
 {
 	struct mapping_sequence *seq
@@ -708,7 +973,7 @@ static void update_data_segment_end(void *new_curbrk)
 		/* We're expanding. */
 		__liballocs_extend_bigalloc(executable_data_segment_mapping_bigalloc, new_curbrk);
 		void *prev_mapping_end = seq->mappings[seq->nused - 1].end;
-		if (!seq->mappings[seq->nused - 1].is_anon)
+		if (!seq->mappings[seq->nused - 1].is_anon && grow_sequence(seq))
 		{
 			/* Most likely, the program has not yet called sbrk().
 			 * /proc/<pid>/maps does *not* necessarily list the break area.
@@ -736,24 +1001,52 @@ void __mmap_allocator_notify_brk(void *new_curbrk)
 		 * don't, so there's no need to do anything... */
 		return;
 	}
+	SEQUENCE_LOCK
+	flush_pending_unmap_locked();
 	update_data_segment_end(new_curbrk);
+	SEQUENCE_UNLOCK
 }
 
+static liballocs_err_t get_info_signal_safe(void *obj, struct big_allocation *maybe_bigalloc, 
+	struct uniqtype **out_type, void **out_base, 
+	unsigned long *out_size, const void **out_site);
 static liballocs_err_t get_info(void *obj, struct big_allocation *maybe_bigalloc, 
 	struct uniqtype **out_type, void **out_base, 
 	unsigned long *out_size, const void **out_site)
 {
-	/* The info is simply the top-level bigalloc for that address. */
+	count_allocator_query(&__mmap_allocator);
+	/* The info is simply the top-level bigalloc for that address. If we flush
+	 * pending unmaps, the bigalloc we were given may have moved or gone. */
+	if (__mmap_allocator_pending_unmap.begin != __mmap_allocator_pending_unmap.end)
+	{
+		__mmap_allocator_flush_pending_unmaps();
+		maybe_bigalloc = NULL;
+	}
+	return get_info_signal_safe(obj, maybe_bigalloc, out_type, out_base, out_size, out_site);
+}
+
+static liballocs_err_t get_info_signal_safe(void *obj, struct big_allocation *maybe_bigalloc, 
+	struct uniqtype **out_type, void **out_base, 
+	unsigned long *out_size, const void **out_site)
+{
+	/* Our signal-safe caller has already ruled out the pending unmap span,
+	 * and checks afterwards that the pageindex didn't change under us. */
 	struct big_allocation *b = maybe_bigalloc;
-	if (!b) b = &big_allocations[pageindex[PAGENUM(obj)]];
-	while (b && b->parent) b = b->parent;
-	if (!b) return &__liballocs_err_object_of_unknown_storage;
+	if (!b)
+	{
+		/* Nothing there any more, e.g. because obj was in the span we
+		 * just flushed. Slot 0 is not a bigalloc. */
+		bigalloc_num_t num = pageindex[PAGENUM(obj)];
+		if (num == 0) return &__liballocs_err_object_of_unknown_storage;
+		b = &big_allocations[num];
+	}
+	while (b->parent) b = b->parent;
 	
 	if (out_type) *out_type = NULL;
 	if (out_base) *out_base = b->begin;
 	if (out_size) *out_size = (char*) b->end - (char*) b->begin;
-	if (out_site) *out_site = ((struct mapping_sequence *) b->meta.un.opaque_data.data_ptr)->
-		mappings[0].caller; // bit of a HACK: just use the first one in the seq
+	struct mapping_sequence *seq = b->meta.un.opaque_data.data_ptr;
+	if (out_site) *out_site = seq ? seq->mappings[0].caller : NULL; // bit of a HACK: just use the first one in the seq
 	
 	// success
 	return NULL;
@@ -762,6 +1055,7 @@ static liballocs_err_t get_info(void *obj, struct big_allocation *maybe_bigalloc
 struct allocator __mmap_allocator = {
 	.name = "mmap",
 	.is_cacheable = 1,
-	.get_info = get_info
+	.get_info = get_info,
+	.get_info_signal_safe = get_info_signal_safe
 	/* FIXME: meta-protocol implementation */
 };
@@ -12,6 +12,8 @@
 #include <link.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include "relf.h"
 #include "vas.h"
 #include "liballocs_private.h"
@@ -92,6 +94,7 @@ static liballocs_err_t get_info(void *obj, struct big_allocation *maybe_bigalloc
 	struct uniqtype **out_type, void **out_base, 
 	unsigned long *out_size, const void** out_site)
 {
+	count_allocator_query(&__stack_allocator);
 	return &__liballocs_err_unrecognised_alloc_site;
 }
 
@@ -152,3 +155,72 @@ _Bool __stack_allocator_notify_unindexed_address(const void *ptr)
 	}
 	return 0;
 }
+
+__thread struct thread_stack_bounds __stack_allocator_thread_stack;
+
+/* Stack bigallocs are only a shortcut, so that queries on the stack go
+ * straight to the frame allocator. Every thread would need one, and the
+ * bigalloc table is small and fixed, so we leave this many slots free for
+ * the mappings and frames that the process can't do without. */
+#define STACK_BIGALLOC_RESERVE (NBIGALLOCS / 4)
+
+/* Called on each new thread that our pthread_create() wrapper starts.
+ * We remember its stack's bounds in TLS, which is all that telling its
+ * allocas from heap chunks needs. If the bigalloc table has room, we also
+ * register the stack as a bigalloc straight away, rather than waiting for
+ * a query to land there. We only do this for stacks that pthreads mapped
+ * for itself: a stack the program supplied is carved out of something
+ * else, most likely the heap. */
+void __stack_allocator_notify_thread_start(void)
+{
+	struct thread_stack_bounds *bounds = &__stack_allocator_thread_stack;
+	void *mapping_begin;
+	void *mapping_end;
+	int ret = __mmap_allocator_get_stack_mapping_bounds(__builtin_frame_address(0),
+			&mapping_begin, &mapping_end);
+	/* If the mmap allocator can't tell yet, malloc_usable_size() will ask later. */
+	if (ret != -1) bounds->looked_up = 1;
+	if (ret != 1) return;
+	pthread_attr_t attr;
+	if (0 != pthread_getattr_np(pthread_self(), &attr)) return;
+	void *stackaddr;
+	size_t stacksize;
+	ret = pthread_attr_getstack(&attr, &stackaddr, &stacksize);
+	pthread_attr_destroy(&attr);
+	if (ret != 0) return;
+	char *begin = ROUND_DOWN_PTR(stackaddr, PAGE_SIZE);
+	char *end = ROUND_UP_PTR((char*) stackaddr + stacksize, PAGE_SIZE);
+	if (begin < (char*) mapping_begin || end > (char*) mapping_end) return;
+	bounds->begin = begin;
+	bounds->end = end;
+	
+	if (__liballocs_nbigallocs_free() <= STACK_BIGALLOC_RESERVE) return;
+	struct big_allocation *b = __liballocs_new_bigalloc(
+		begin,
+		end - begin,
+		(struct meta_info) {
+			.what = DATA_PTR,
+			.un = {
+				opaque_data: {
+					.data_ptr = NULL,
+					.free_func = NULL
+				}
+			}
+		},
+		NULL, /* the stack's mapping */
+		&__stack_allocator
+	);
+	if (!b) return;
+	b->suballocator = &__stackframe_allocator;
+	bounds->has_bigalloc = 1;
+}
+
+void __stack_allocator_notify_thread_exit(void)
+{
+	struct thread_stack_bounds *bounds = &__stack_allocator_thread_stack;
+	/* This also takes away any frames that didn't clean up, e.g. because
+	 * the thread called pthread_exit(). */
+	__alloca_allocator_notify_thread_exit();
+	if (bounds->has_bigalloc) __liballocs_delete_bigalloc_at(bounds->begin, &__stack_allocator);
+	*bounds = (struct thread_stack_bounds) { .looked_up = 1 };
+}
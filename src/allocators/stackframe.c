@@ -170,7 +170,8 @@ static liballocs_err_t get_info(void *obj, struct big_allocation *maybe_bigalloc
 	struct uniqtype **out_type, void **out_base, 
 	unsigned long *out_size, const void** out_site)
 {		
-	++__liballocs_hit_stack_case;
+	count_allocator_query(&__stackframe_allocator);
+	count_query(QUERY_HIT_STACK_CASE);
 	liballocs_err_t err;
 #define BEGINNING_OF_STACK ((uintptr_t) MAXIMUM_USER_ADDRESS)
 	// we want to walk a sequence of vaddrs!
@@ -328,8 +329,8 @@ static liballocs_err_t get_info(void *obj, struct big_allocation *maybe_bigalloc
 		// is still higher than our object's addr, we must have gone past it
 		if (frame_allocation_base > (unsigned char *) obj)
 		{
-			struct insert *heap_info = lookup_object_info(obj, (void**) out_base, 
-				out_size, NULL);
+			struct insert *heap_info = __alloca_allocator_lookup(obj, (void**) out_base, 
+				out_size);
 			if (heap_info)
 			{
 				/* It looks like this is an alloca chunk, so proceed. */
@@ -352,13 +353,13 @@ out_success:
 	return NULL;
 abort_stack:
 	if (!err) err = &__liballocs_err_unknown_stack_walk_problem;
-	++__liballocs_aborted_stack;
+	count_query(QUERY_ABORTED_STACK);
 	return err;
 }
 #define maximum_vaddr_range_size (4*1024) // HACK
 
-struct frame_uniqtype_and_offset
-vaddr_to_stack_uniqtype(const void *vaddr)
+static struct frame_uniqtype_and_offset
+vaddr_to_stack_uniqtype_in_loaded(const void *vaddr)
 {
 	assert(__liballocs_allocsmt != NULL);
 	if (!vaddr) return (struct frame_uniqtype_and_offset) { NULL, 0 };
@@ -375,7 +376,7 @@ vaddr_to_stack_uniqtype(const void *vaddr)
 	_Bool might_start_in_lower_bucket = 1;
 	do 
 	{
-		struct allocsite_entry *bucket = *bucketpos;
+		struct allocsite_entry *bucket = __atomic_load_n(bucketpos, __ATOMIC_ACQUIRE);
 		for (struct allocsite_entry *p = bucket; p; p = (struct allocsite_entry *) p->next)
 		{
 			/* NOTE that in this memtable, buckets are sorted by address, so 
@@ -402,5 +403,18 @@ vaddr_to_stack_uniqtype(const void *vaddr)
 	  (initial_bucketpos - bucketpos) * allocsmt_entry_coverage < maximum_vaddr_range_size);
 	return (struct frame_uniqtype_and_offset) { NULL, 0 };
 }
+struct frame_uniqtype_and_offset
+vaddr_to_stack_uniqtype(const void *vaddr)
+{
+	struct frame_uniqtype_and_offset s;
+	if (vaddr && __liballocs_prechained_range_lookup(SHARED_FRAMES, vaddr,
+			maximum_vaddr_range_size, &s.u, NULL, &s.o)) return s;
+	s = vaddr_to_stack_uniqtype_in_loaded(vaddr);
+	if (!s.u && vaddr && __liballocs_load_metadata_on_miss(vaddr))
+	{
+		s = vaddr_to_stack_uniqtype_in_loaded(vaddr);
+	}
+	return s;
+}
 #undef maximum_vaddr_range_size
 #undef BEGINNING_OF_STACK
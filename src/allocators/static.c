@@ -149,8 +149,8 @@ int add_all_loaded_segments(struct dl_phdr_info *info, size_t size, void *data)
 	return 0;
 }
 #define maximum_static_obj_size (256*1024) // HACK
-struct uniqtype * 
-static_addr_to_uniqtype(const void *static_addr, void **out_object_start)
+static struct uniqtype * 
+static_addr_to_uniqtype_in_loaded(const void *static_addr, void **out_object_start)
 {
 	assert(__liballocs_allocsmt != NULL);
 	if (!static_addr) return NULL;
@@ -159,7 +159,7 @@ static_addr_to_uniqtype(const void *static_addr, void **out_object_start)
 	_Bool might_start_in_lower_bucket = 1;
 	do 
 	{
-		struct allocsite_entry *bucket = *bucketpos;
+		struct allocsite_entry *bucket = __atomic_load_n(bucketpos, __ATOMIC_ACQUIRE);
 		for (struct allocsite_entry *p = bucket; p; p = (struct allocsite_entry *) p->next)
 		{
 			/* NOTE that in this memtable, buckets are sorted by address, so 
@@ -182,6 +182,19 @@ static_addr_to_uniqtype(const void *static_addr, void **out_object_start)
 	  (initial_bucketpos - bucketpos) * allocsmt_entry_coverage < maximum_static_obj_size);
 	return NULL;
 }
+struct uniqtype * 
+static_addr_to_uniqtype(const void *static_addr, void **out_object_start)
+{
+	struct uniqtype *u;
+	if (static_addr && __liballocs_prechained_range_lookup(SHARED_STATICS, static_addr,
+			maximum_static_obj_size, &u, out_object_start, NULL)) return u;
+	u = static_addr_to_uniqtype_in_loaded(static_addr, out_object_start);
+	if (!u && static_addr && __liballocs_load_metadata_on_miss(static_addr))
+	{
+		u = static_addr_to_uniqtype_in_loaded(static_addr, out_object_start);
+	}
+	return u;
+}
 #undef maximum_vaddr_range_size
 
 
@@ -191,7 +204,8 @@ static liballocs_err_t get_info(void * obj, struct big_allocation *maybe_bigallo
 	struct uniqtype **out_type, void **out_base, 
 	unsigned long *out_size, const void **out_site)
 {
-	++__liballocs_hit_static_case;
+	count_allocator_query(&__static_allocator);
+	count_query(QUERY_HIT_STATIC_CASE);
 //			/* We use a blacklist to rule out static addrs that map to things like 
 //			 * mmap()'d regions (which we never have typeinfo for)
 //			 * or uninstrumented libraries (which we happen not to have typeinfo for). */
@@ -200,7 +214,7 @@ static liballocs_err_t get_info(void * obj, struct big_allocation *maybe_bigallo
 //			{
 //				// FIXME: record blacklist hits separately
 //				err = &__liballocs_err_unrecognised_static_object;
-//				++__liballocs_aborted_static;
+//				count_query(QUERY_ABORTED_STATIC);
 //				goto abort;
 //			}
 	void *object_start;
@@ -208,7 +222,7 @@ static liballocs_err_t get_info(void * obj, struct big_allocation *maybe_bigallo
 	if (out_type) *out_type = alloc_uniqtype;
 	if (!alloc_uniqtype)
 	{
-		++__liballocs_aborted_static;
+		count_query(QUERY_ABORTED_STATIC);
 //				consider_blacklisting(obj);
 		return &__liballocs_err_unrecognised_static_object;
 	}
@@ -224,6 +238,7 @@ static liballocs_err_t get_info(void * obj, struct big_allocation *maybe_bigallo
 _Bool __lookup_static_allocation_by_name(struct link_map *l, const char *name,
 	void **out_addr, size_t *out_len)
 {
+	__liballocs_ensure_metadata_for_load_addr(l->l_addr);
 	for (struct link_map *inner_l = _r_debug.r_map; inner_l; inner_l = inner_l->l_next)
 	{
 		if (is_meta_object_for_lib(inner_l, l, "-types.so" /* HACK */))
@@ -231,6 +246,9 @@ _Bool __lookup_static_allocation_by_name(struct link_map *l, const char *name,
 			ElfW(Sym) *statics_sym = symbol_lookup_in_object(inner_l, "statics");
 			if (!statics_sym) abort();
 			struct static_allocsite_entry *statics = sym_to_addr(statics_sym);
+			/* If the statics came from the shared cache, we didn't chain
+			 * them, so their addresses are still unrelocated. */
+			uintptr_t bias = __liballocs_statics_are_prechained(l->l_addr) ? l->l_addr : 0;
 			for (struct static_allocsite_entry *cur_ent = statics;
 					!STATIC_ALLOCSITE_IS_NULL(cur_ent);
 					cur_ent++)
@@ -239,8 +257,8 @@ _Bool __lookup_static_allocation_by_name(struct link_map *l, const char *name,
 				{
 					// found it! it'd better not be the last in the table...
 					if (!(cur_ent + 1)->entry.allocsite) abort();
-					void *this_static = cur_ent->entry.allocsite;
-					void *next_static = (char*) (cur_ent + 1)->entry.allocsite;
+					void *this_static = (char*) cur_ent->entry.allocsite + bias;
+					void *next_static = (char*) (cur_ent + 1)->entry.allocsite + bias;
 					*out_addr = this_static;
 					*out_len = (char*) next_static - (char*) this_static;
 					return 1;
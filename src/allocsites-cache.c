@@ -0,0 +1,459 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "liballocs_private.h"
+#include "uniqtype.h"
+
+/* Shared allocsite cache, for pools of processes running the same binary.
+ *
+ * Older -allocsites.so objects give us an unsorted-by-bucket "allocsites"
+ * array, and every -types.so gives us "frame_vaddrs" and "statics" arrays
+ * in the same style. Every process chains these into its own allocsmt,
+ * dirtying both the memtable and the objects' data pages. If
+ * LIBALLOCS_SHARED_CACHE_DIR names a directory, the first process to load
+ * such an object instead writes out a sorted, bucketed index of each table
+ * (in the same shape as a build-time struct allocsites_table, see
+ * allocsmt.h) to a file there. Frame entries also keep their offset from
+ * the frame base.
+ * Every process, including that one, then maps the file read-only and
+ * shared, so the index costs memory once per host rather than once per
+ * process. A pre-fork parent that loads its metadata passes the mapping
+ * on to its children for free.
+ *
+ * Uniqtype addresses differ from process to process, so the file records
+ * each site's type as an index into a table of type symbol names. Attaching
+ * resolves each distinct name once; that table is the only per-process part.
+ * If any name fails to resolve, we don't attach, and the caller chains the
+ * table as before, so a cached site never comes back with a null type.
+ *
+ * The file's name and header are keyed on the kind of table and on the
+ * metadata object's path, inode, size and mtime, so rebuilding the object
+ * invalidates its cache.
+ * Processes that race to create the same file each write a private
+ * temporary and rename() it into place; any of the results is correct.
+ * A file that fails any of our checks on attaching is ignored, and we build
+ * the table afresh and rename() it over the bad one. */
+
+#define CACHE_MAGIC "LAALLOCC"
+#define CACHE_VERSION 2
+#define CACHE_LOG_BUCKET_SIZE 12
+
+struct cache_header
+{
+	char magic[8];
+	unsigned version;
+	unsigned log_bucket_size;
+	unsigned kind;                   /* enum shared_allocsites_kind */
+	unsigned long key_dev;
+	unsigned long key_ino;
+	unsigned long key_size;
+	unsigned long key_mtime_ns;
+	unsigned long file_size;
+	unsigned long nsites;
+	unsigned long nbuckets;
+	unsigned long ntypes;
+	unsigned long vaddrs_off;        /* unsigned long[nsites] */
+	unsigned long bucket_starts_off; /* unsigned[nbuckets + 1] */
+	unsigned long type_indices_off;  /* unsigned[nsites] */
+	unsigned long extras_off;        /* unsigned[nsites], frames only, else 0 */
+	unsigned long type_names_off;    /* unsigned long[ntypes], offsets of strings */
+	unsigned long strtab_off;
+};
+
+static const char *kind_suffixes[] = {
+	[SHARED_ALLOCSITES] = "allocsites",
+	[SHARED_FRAMES] = "frames",
+	[SHARED_STATICS] = "statics"
+};
+
+static unsigned nattached;
+static unsigned nbuilt;
+
+static const char *cache_dir(void)
+{
+	static const char *dir;
+	static _Bool checked;
+	if (!checked)
+	{
+		dir = getenv("LIBALLOCS_SHARED_CACHE_DIR");
+		checked = 1;
+	}
+	return dir;
+}
+
+static unsigned long hash_path(const char *s)
+{
+	unsigned long h = 0xcbf29ce484222325ul; /* FNV-1a */
+	for (; *s; ++s) h = (h ^ (unsigned char) *s) * 0x100000001b3ul;
+	return h;
+}
+
+static int cache_file_name(const char *meta_name, unsigned kind, const struct stat *s,
+	char *buf, size_t len)
+{
+	int ret = snprintf(buf, len, "%s/%016lx-%lx-%lx.%s-cache", cache_dir(),
+		hash_path(meta_name), (unsigned long) s->st_ino,
+		(unsigned long) s->st_mtim.tv_sec * 1000000000ul + s->st_mtim.tv_nsec,
+		kind_suffixes[kind]);
+	return (ret > 0 && (size_t) ret < len) ? 0 : -1;
+}
+
+static void fill_key(struct cache_header *h, const struct stat *s)
+{
+	h->key_dev = s->st_dev;
+	h->key_ino = s->st_ino;
+	h->key_size = s->st_size;
+	h->key_mtime_ns = s->st_mtim.tv_sec * 1000000000ul + s->st_mtim.tv_nsec;
+}
+
+/* Is there room for n things of the given size at off, in a file of
+ * file_size bytes? Careful not to overflow. */
+static _Bool table_fits(unsigned long off, unsigned long n, unsigned long size,
+	unsigned long align, unsigned long file_size)
+{
+	if (off % align != 0 || off > file_size) return 0;
+	return n <= (file_size - off) / size;
+}
+
+/* Anybody who can write to the cache directory can put anything in the
+ * file, and the lookups index by what it says, so before using a file we
+ * check every offset, count and index in it. */
+static _Bool header_ok(const struct cache_header *h, unsigned kind)
+{
+	return h->log_bucket_size == CACHE_LOG_BUCKET_SIZE
+		&& h->nsites <= UINT_MAX
+		&& h->ntypes <= UINT_MAX
+		&& h->nbuckets < UINT_MAX
+		&& table_fits(h->vaddrs_off, h->nsites, sizeof (unsigned long),
+				_Alignof (unsigned long), h->file_size)
+		&& table_fits(h->bucket_starts_off, h->nbuckets + 1, sizeof (unsigned),
+				_Alignof (unsigned), h->file_size)
+		&& table_fits(h->type_indices_off, h->nsites, sizeof (unsigned),
+				_Alignof (unsigned), h->file_size)
+		&& (kind == SHARED_FRAMES
+			? table_fits(h->extras_off, h->nsites, sizeof (unsigned),
+				_Alignof (unsigned), h->file_size)
+			: h->extras_off == 0)
+		&& table_fits(h->type_names_off, h->ntypes, sizeof (unsigned long),
+				_Alignof (unsigned long), h->file_size)
+		&& h->strtab_off <= h->file_size;
+}
+
+static _Bool tables_ok(const char *mapping, const struct cache_header *h)
+{
+	const unsigned long *vaddrs = (const unsigned long *)(mapping + h->vaddrs_off);
+	const unsigned *starts = (const unsigned *)(mapping + h->bucket_starts_off);
+	const unsigned *type_indices = (const unsigned *)(mapping + h->type_indices_off);
+	const unsigned long *type_names = (const unsigned long *)(mapping + h->type_names_off);
+	/* Sites are sorted by vaddr, and each bucket's run of sites lies in it. */
+	if (starts[0] != 0 || starts[h->nbuckets] != h->nsites) return 0;
+	for (unsigned long b = 0; b < h->nbuckets; ++b)
+	{
+		if (starts[b] > starts[b + 1]) return 0;
+		for (unsigned long i = starts[b]; i < starts[b + 1]; ++i)
+		{
+			if ((vaddrs[i] >> h->log_bucket_size) != b) return 0;
+			if (i > 0 && vaddrs[i - 1] > vaddrs[i]) return 0;
+		}
+	}
+	for (unsigned long i = 0; i < h->nsites; ++i)
+	{
+		if (type_indices[i] >= h->ntypes) return 0;
+	}
+	/* Every name must be a NUL-terminated string within the string table. */
+	const char *strtab = mapping + h->strtab_off;
+	unsigned long strtab_size = h->file_size - h->strtab_off;
+	for (unsigned long i = 0; i < h->ntypes; ++i)
+	{
+		if (type_names[i] >= strtab_size
+				|| !memchr(strtab + type_names[i], '\0', strtab_size - type_names[i])) return 0;
+	}
+	return 1;
+}
+
+static int attach(const char *cache_name, unsigned kind, const struct stat *key,
+	struct shared_allocsites *out)
+{
+	int fd = open(cache_name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return 0;
+	struct cache_header h;
+	struct cache_header expected_key;
+	fill_key(&expected_key, key);
+	struct stat s;
+	if (fstat(fd, &s) != 0
+			|| pread(fd, &h, sizeof h, 0) != sizeof h
+			|| 0 != memcmp(h.magic, CACHE_MAGIC, sizeof h.magic)
+			|| h.version != CACHE_VERSION
+			|| h.kind != kind
+			|| h.file_size != (unsigned long) s.st_size
+			|| h.key_dev != expected_key.key_dev
+			|| h.key_ino != expected_key.key_ino
+			|| h.key_size != expected_key.key_size
+			|| h.key_mtime_ns != expected_key.key_mtime_ns
+			|| !header_ok(&h, kind))
+	{
+		debug_printf(1, "ignoring stale or bad allocsites cache %s\n", cache_name);
+		close(fd);
+		return 0;
+	}
+	const char *mapping = mmap(NULL, h.file_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) return 0;
+	if (!tables_ok(mapping, &h))
+	{
+		debug_printf(1, "ignoring bad allocsites cache %s\n", cache_name);
+		munmap((void*) mapping, h.file_size);
+		return 0;
+	}
+	struct uniqtype **types = __wrap_dlmalloc(h.ntypes * sizeof (struct uniqtype *));
+	if (h.ntypes > 0 && !types)
+	{
+		munmap((void*) mapping, h.file_size);
+		return 0;
+	}
+	const unsigned long *type_names = (const unsigned long *)(mapping + h.type_names_off);
+	for (unsigned long i = 0; i < h.ntypes; ++i)
+	{
+		/* Our -types.so is loaded already, and RTLD_GLOBAL, so this gets
+		 * whatever the metadata object's own relocations would. */
+		types[i] = dlsym(RTLD_DEFAULT, mapping + h.strtab_off + type_names[i]);
+		if (!types[i])
+		{
+			debug_printf(1, "not using allocsites cache %s: no type %s\n",
+				cache_name, mapping + h.strtab_off + type_names[i]);
+			__wrap_dlfree(types);
+			munmap((void*) mapping, h.file_size);
+			return 0;
+		}
+	}
+	*out = (struct shared_allocsites) {
+		.table = {
+			.nsites = h.nsites,
+			.nbuckets = h.nbuckets,
+			.log_bucket_size = h.log_bucket_size,
+			.vaddrs = (const unsigned long *)(mapping + h.vaddrs_off),
+			.bucket_starts = (const unsigned *)(mapping + h.bucket_starts_off),
+			.uniqtypes = NULL
+		},
+		.type_indices = (const unsigned *)(mapping + h.type_indices_off),
+		.types = types,
+		.extras = h.extras_off ? (const unsigned *)(mapping + h.extras_off) : NULL
+	};
+	++nattached;
+	return 1;
+}
+
+struct site
+{
+	unsigned long vaddr;
+	struct uniqtype *t;
+	unsigned extra;
+};
+static int compare_sites(const void *a, const void *b)
+{
+	unsigned long va = ((const struct site *) a)->vaddr;
+	unsigned long vb = ((const struct site *) b)->vaddr;
+	return (va > vb) - (va < vb);
+}
+static int compare_types(const void *a, const void *b)
+{
+	uintptr_t ta = (uintptr_t) *(struct uniqtype *const *) a;
+	uintptr_t tb = (uintptr_t) *(struct uniqtype *const *) b;
+	return (ta > tb) - (ta < tb);
+}
+
+/* Each kind of table has its own entry layout and terminator. Sites with
+ * no type are left out: a lookup on them misses, just as it would if they
+ * were chained. */
+static unsigned long count_entries(unsigned kind, const void *first_entry)
+{
+	unsigned long n = 0;
+	switch (kind)
+	{
+		case SHARED_ALLOCSITES:
+			while (((const struct allocsite_entry *) first_entry)[n].allocsite) ++n;
+			break;
+		case SHARED_FRAMES:
+			while (((const struct frame_allocsite_entry *) first_entry)[n].entry.allocsite) ++n;
+			break;
+		case SHARED_STATICS:
+			while (!STATIC_ALLOCSITE_IS_NULL(&((const struct static_allocsite_entry *) first_entry)[n])) ++n;
+			break;
+		default: abort();
+	}
+	return n;
+}
+static struct site get_entry(unsigned kind, const void *first_entry, unsigned long i)
+{
+	switch (kind)
+	{
+		case SHARED_ALLOCSITES: {
+			const struct allocsite_entry *e = &((const struct allocsite_entry *) first_entry)[i];
+			return (struct site) { (unsigned long) e->allocsite, e->uniqtype, 0 };
+		}
+		case SHARED_FRAMES: {
+			const struct frame_allocsite_entry *e = &((const struct frame_allocsite_entry *) first_entry)[i];
+			return (struct site) { (unsigned long) e->entry.allocsite, e->entry.uniqtype,
+				e->offset_from_frame_base };
+		}
+		case SHARED_STATICS: {
+			const struct static_allocsite_entry *e = &((const struct static_allocsite_entry *) first_entry)[i];
+			return (struct site) { (unsigned long) e->entry.allocsite, e->entry.uniqtype, 0 };
+		}
+		default: abort();
+	}
+}
+
+static int build(const char *cache_name, unsigned kind, const struct stat *key,
+	const void *first_entry)
+{
+	int ret = 0;
+	unsigned long nentries = count_entries(kind, first_entry);
+	if (nentries == 0) return 0;
+
+	struct site *sites = __wrap_dlmalloc(nentries * sizeof (struct site));
+	struct uniqtype **types = __wrap_dlmalloc(nentries * sizeof (struct uniqtype *));
+	char *buf = NULL;
+	if (!sites || !types) goto out;
+	unsigned long nsites = 0;
+	for (unsigned long i = 0; i < nentries; ++i)
+	{
+		struct site s = get_entry(kind, first_entry, i);
+		if (!s.t) continue;
+		sites[nsites] = s;
+		types[nsites] = s.t;
+		++nsites;
+	}
+	if (nsites == 0) goto out;
+	qsort(sites, nsites, sizeof (struct site), compare_sites);
+	qsort(types, nsites, sizeof (struct uniqtype *), compare_types);
+	unsigned long ntypes = 0;
+	for (unsigned long i = 0; i < nsites; ++i)
+	{
+		if (ntypes == 0 || types[ntypes - 1] != types[i]) types[ntypes++] = types[i];
+	}
+
+	/* We need a name for every type, or we can't find it again. */
+	unsigned long strtab_size = 0;
+	for (unsigned long i = 0; i < ntypes; ++i)
+	{
+		const char *name = __liballocs_uniqtype_symbol_name(types[i]);
+		if (!name)
+		{
+			debug_printf(1, "not caching allocsites: type at %p has no symbol\n", types[i]);
+			goto out;
+		}
+		strtab_size += strlen(name) + 1;
+	}
+
+	unsigned long nbuckets = (sites[nsites - 1].vaddr >> CACHE_LOG_BUCKET_SIZE) + 1;
+	struct cache_header h = {
+		.version = CACHE_VERSION,
+		.log_bucket_size = CACHE_LOG_BUCKET_SIZE,
+		.kind = kind,
+		.nsites = nsites,
+		.nbuckets = nbuckets,
+		.ntypes = ntypes
+	};
+	memcpy(h.magic, CACHE_MAGIC, sizeof h.magic);
+	fill_key(&h, key);
+	h.vaddrs_off = sizeof h;
+	h.bucket_starts_off = h.vaddrs_off + nsites * sizeof (unsigned long);
+	h.type_indices_off = h.bucket_starts_off + (nbuckets + 1) * sizeof (unsigned);
+	unsigned long type_indices_end = h.type_indices_off + nsites * sizeof (unsigned);
+	if (kind == SHARED_FRAMES)
+	{
+		h.extras_off = type_indices_end;
+		type_indices_end += nsites * sizeof (unsigned);
+	}
+	h.type_names_off = (type_indices_end + 7) & ~7ul;
+	h.strtab_off = h.type_names_off + ntypes * sizeof (unsigned long);
+	h.file_size = h.strtab_off + strtab_size;
+
+	buf = __wrap_dlmalloc(h.file_size);
+	if (!buf) goto out;
+	memcpy(buf, &h, sizeof h);
+	unsigned long *vaddrs = (unsigned long *)(buf + h.vaddrs_off);
+	unsigned *starts = (unsigned *)(buf + h.bucket_starts_off);
+	unsigned *type_indices = (unsigned *)(buf + h.type_indices_off);
+	unsigned *extras = h.extras_off ? (unsigned *)(buf + h.extras_off) : NULL;
+	unsigned long *type_names = (unsigned long *)(buf + h.type_names_off);
+	unsigned long bucket = 0;
+	starts[0] = 0;
+	for (unsigned long i = 0; i < nsites; ++i)
+	{
+		vaddrs[i] = sites[i].vaddr;
+		while (bucket < (sites[i].vaddr >> CACHE_LOG_BUCKET_SIZE)) starts[++bucket] = i;
+		struct uniqtype **found = bsearch(&sites[i].t, types, ntypes,
+			sizeof (struct uniqtype *), compare_types);
+		assert(found);
+		type_indices[i] = found - types;
+		if (extras) extras[i] = sites[i].extra;
+	}
+	while (bucket < nbuckets) starts[++bucket] = nsites;
+	unsigned long strtab_pos = 0;
+	for (unsigned long i = 0; i < ntypes; ++i)
+	{
+		const char *name = __liballocs_uniqtype_symbol_name(types[i]);
+		type_names[i] = strtab_pos;
+		strcpy(buf + h.strtab_off + strtab_pos, name);
+		strtab_pos += strlen(name) + 1;
+	}
+
+	char tmp_name[4096];
+	if (snprintf(tmp_name, sizeof tmp_name, "%s.XXXXXX", cache_name)
+			>= (int) sizeof tmp_name) goto out;
+	/* mkostemp() gives us an unguessable name, created afresh with mode 0600. */
+	int fd = mkostemp(tmp_name, O_CLOEXEC);
+	if (fd == -1) goto out;
+	unsigned long written = 0;
+	while (written < h.file_size)
+	{
+		ssize_t n = write(fd, buf + written, h.file_size - written);
+		if (n <= 0) break;
+		written += n;
+	}
+	close(fd);
+	if (written != h.file_size || 0 != rename(tmp_name, cache_name))
+	{
+		unlink(tmp_name);
+		goto out;
+	}
+	debug_printf(2, "wrote %s cache %s (%lu sites, %lu types)\n", kind_suffixes[kind],
+		cache_name, nsites, ntypes);
+	++nbuilt;
+	ret = 1;
+out:
+	if (buf) __wrap_dlfree(buf);
+	if (types) __wrap_dlfree(types);
+	if (sites) __wrap_dlfree(sites);
+	return ret;
+}
+
+int __liballocs_shared_allocsites_attach(const char *meta_name, unsigned kind,
+	const void *first_entry, struct shared_allocsites *out)
+{
+	if (!cache_dir()) return 0;
+	struct stat key;
+	if (stat(meta_name, &key) != 0) return 0;
+	char cache_name[4096];
+	if (cache_file_name(meta_name, kind, &key, cache_name, sizeof cache_name) != 0) return 0;
+	if (attach(cache_name, kind, &key, out)) return 1;
+	/* Map what we just wrote, so our copy is shared too. */
+	return build(cache_name, kind, &key, first_entry) && attach(cache_name, kind, &key, out);
+}
+
+void __liballocs_shared_allocsites_get_stats(unsigned *out_nattached, unsigned *out_nbuilt)
+{
+	*out_nattached = nattached;
+	*out_nbuilt = nbuilt;
+}
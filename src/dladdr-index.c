@@ -0,0 +1,407 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <pthread.h>
+#include "relf.h"
+#include "liballocs_private.h"
+
+/* A sorted interval index of every loaded object's dynamic symbols, to
+ * answer dladdr() without glibc's linear walk over the symbol table.
+ *
+ * We mimic glibc's matching rules: an address matches a defined,
+ * non-TLS, non-absolute dynsym entry if it lies within [value, value+size),
+ * or equals value for zero-sized symbols; of several matches, the one
+ * with the highest value wins, and of those the first in dynsym order.
+ * Addresses outside every segment of every indexed object are not ours to
+ * answer, and the caller falls back to the real dladdr().
+ *
+ * Symbols within an object are sorted by start address, and each entry
+ * also records the greatest end address of any entry up to and including
+ * it, so that a lookup can scan backwards from the last start at or below
+ * the address and stop as soon as nothing earlier can contain it.
+ *
+ * We index everything on the link map when first asked, then reconcile
+ * against the link map after each dlopen() and each dlclose() that really
+ * unloads something, since either can bring in or take away dependencies
+ * too. An object stays indexed only if the same link map entry is still
+ * there with the same load address, dynamic section and name, so a link
+ * map entry recycled for a different object gets indexed afresh.
+ *
+ * Lookups dereference only our own memory: we copy the file name and
+ * every symbol's name when indexing, so a lookup racing with an unload
+ * never reads the departing object's dynsym or dynstr. (The ElfW(Sym)
+ * pointer we hand back to dladdr1() is just passed through, as glibc's is.)
+ *
+ * The object array is rebuilt once per reconciliation and published with
+ * a release store, so lookups take no lock. Lookups count themselves in
+ * and out of nreaders; after publishing, the writer frees replaced arrays
+ * and dropped objects once it sees no lookup in flight, since any lookup
+ * that starts after that will see only the new array. */
+
+struct sym_interval
+{
+	uintptr_t begin;
+	uintptr_t end;     /* equal to begin for zero-sized symbols */
+	uintptr_t max_end; /* max of end over this and all earlier entries */
+	const char *name;  /* our copy */
+	const ElfW(Sym) *sym; /* never dereferenced after indexing */
+};
+
+#define MAX_INDEXED_SEGMENTS 8
+struct indexed_object
+{
+	uintptr_t begin; /* extent of all segments */
+	uintptr_t end;
+	unsigned nsegs;
+	struct { uintptr_t begin, end; } segs[MAX_INDEXED_SEGMENTS];
+	/* identity of the object on the link map */
+	struct link_map *l;
+	ElfW(Addr) l_addr;
+	ElfW(Dyn) *l_ld;
+	char *l_name; /* our copy */
+	char *fname;  /* our copy of what the real dladdr() calls it */
+	void *fbase;
+	unsigned long nsyms;
+	struct sym_interval *syms;
+	char *names;  /* all the symbol names, copied */
+	_Bool kept;   /* scratch, for reconcile() */
+	struct indexed_object *next_retired;
+};
+
+struct indexed_object_array
+{
+	unsigned n;
+	struct indexed_object_array *next_retired;
+	struct indexed_object *objs[];
+};
+static struct indexed_object_array *indexed_objects;
+static pthread_mutex_t indexed_objects_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static _Bool initialized;
+static unsigned long nreaders;
+static struct indexed_object_array *retired_arrays;
+static struct indexed_object *retired_objects;
+
+static int (*real_dladdr)(const void *, Dl_info *);
+
+static int compare_intervals(const void *a, const void *b)
+{
+	const struct sym_interval *ia = a;
+	const struct sym_interval *ib = b;
+	if (ia->begin != ib->begin) return (ia->begin > ib->begin) - (ia->begin < ib->begin);
+	/* dynsym order breaks ties */
+	return (ia->sym > ib->sym) - (ia->sym < ib->sym);
+}
+
+static int compare_objects(const void *a, const void *b)
+{
+	uintptr_t ba = (*(struct indexed_object *const *) a)->begin;
+	uintptr_t bb = (*(struct indexed_object *const *) b)->begin;
+	return (ba > bb) - (ba < bb);
+}
+
+static int fill_segments_cb(struct dl_phdr_info *info, size_t size, void *data)
+{
+	struct indexed_object *o = data;
+	o->begin = UINTPTR_MAX;
+	o->end = 0;
+	o->nsegs = 0;
+	for (int i = 0; i < info->dlpi_phnum; ++i)
+	{
+		if (info->dlpi_phdr[i].p_type != PT_LOAD) continue;
+		uintptr_t begin = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+		uintptr_t end = begin + info->dlpi_phdr[i].p_memsz;
+		if (o->nsegs == MAX_INDEXED_SEGMENTS) { o->nsegs = 0; break; }
+		o->segs[o->nsegs].begin = begin;
+		o->segs[o->nsegs].end = end;
+		++o->nsegs;
+		if (begin < o->begin) o->begin = begin;
+		if (end > o->end) o->end = end;
+	}
+	return 1;
+}
+
+static void free_indexed_object(struct indexed_object *o)
+{
+	if (o->syms) __wrap_dlfree(o->syms);
+	if (o->names) __wrap_dlfree(o->names);
+	if (o->l_name) __wrap_dlfree(o->l_name);
+	if (o->fname) __wrap_dlfree(o->fname);
+	__wrap_dlfree(o);
+}
+
+static _Bool is_symbol_indexable(const ElfW(Sym) *p_sym)
+{
+	return !(p_sym->st_shndx == SHN_UNDEF || p_sym->st_shndx == SHN_ABS
+			|| ELF64_ST_TYPE(p_sym->st_info) == STT_TLS
+			|| p_sym->st_value == 0);
+}
+
+static char *copy_string(const char *s)
+{
+	size_t len = s ? strlen(s) : 0;
+	char *copy = __wrap_dlmalloc(len + 1);
+	if (!copy) return NULL;
+	if (len) memcpy(copy, s, len);
+	copy[len] = '\0';
+	return copy;
+}
+
+static struct indexed_object *make_indexed_object(struct link_map *l)
+{
+	struct indexed_object *o = __wrap_dlmalloc(sizeof (struct indexed_object));
+	if (!o) return NULL;
+	*o = (struct indexed_object) { .l = l, .l_addr = l->l_addr, .l_ld = l->l_ld };
+	dl_for_one_object_phdrs(l, fill_segments_cb, o);
+	/* Objects we can't describe (e.g. the vdso, or weird segment layouts)
+	 * are left to the real dladdr(). */
+	if (o->nsegs == 0 || (intptr_t) l->l_addr < 0) goto fail;
+	Dl_info info;
+	if (!real_dladdr((void*) o->segs[0].begin, &info)) goto fail;
+	o->l_name = copy_string(l->l_name);
+	o->fname = copy_string(info.dli_fname);
+	if (!o->l_name || !o->fname) goto fail;
+	o->fbase = info.dli_fbase;
+
+	ElfW(Dyn) *dynsym_ent = l->l_ld ? dynamic_lookup(l->l_ld, DT_SYMTAB) : NULL;
+	ElfW(Dyn) *dynstr_ent = l->l_ld ? dynamic_lookup(l->l_ld, DT_STRTAB) : NULL;
+	if (!dynsym_ent || !dynstr_ent) return o; /* no symbols; still ours to answer */
+	ElfW(Sym) *dynsym = (ElfW(Sym) *) dynsym_ent->d_un.d_ptr;
+	if ((intptr_t) dynsym < 0 || (uintptr_t) dynsym < o->begin) goto fail; /* unrelocated, e.g. vdso */
+	const char *dynstr = (const char *) dynstr_ent->d_un.d_ptr;
+	unsigned long nsyms = dynamic_symbol_count(l->l_ld, l);
+	size_t names_size = 0;
+	for (ElfW(Sym) *p_sym = dynsym; p_sym < dynsym + nsyms; ++p_sym)
+	{
+		if (is_symbol_indexable(p_sym)) names_size += strlen(dynstr + p_sym->st_name) + 1;
+	}
+	o->syms = __wrap_dlmalloc((nsyms ? nsyms : 1) * sizeof (struct sym_interval));
+	o->names = __wrap_dlmalloc(names_size ? names_size : 1);
+	if (!o->syms || !o->names) goto fail;
+	char *names_pos = o->names;
+	for (ElfW(Sym) *p_sym = dynsym; p_sym < dynsym + nsyms; ++p_sym)
+	{
+		if (!is_symbol_indexable(p_sym)) continue;
+		size_t len = strlen(dynstr + p_sym->st_name);
+		memcpy(names_pos, dynstr + p_sym->st_name, len + 1);
+		uintptr_t begin = l->l_addr + p_sym->st_value;
+		o->syms[o->nsyms++] = (struct sym_interval) {
+			.begin = begin,
+			.end = begin + p_sym->st_size,
+			.name = names_pos,
+			.sym = p_sym
+		};
+		names_pos += len + 1;
+	}
+	qsort(o->syms, o->nsyms, sizeof (struct sym_interval), compare_intervals);
+	uintptr_t max_end = 0;
+	for (unsigned long i = 0; i < o->nsyms; ++i)
+	{
+		if (o->syms[i].end > max_end) max_end = o->syms[i].end;
+		o->syms[i].max_end = max_end;
+	}
+	return o;
+fail:
+	free_indexed_object(o);
+	return NULL;
+}
+
+static _Bool is_same_object(const struct indexed_object *o, const struct link_map *l)
+{
+	return o->l == l && o->l_addr == l->l_addr && o->l_ld == l->l_ld
+		&& 0 == strcmp(o->l_name, l->l_name ? l->l_name : "");
+}
+
+static int compare_objects_by_link_map(const void *a, const void *b)
+{
+	uintptr_t la = (uintptr_t) (*(struct indexed_object *const *) a)->l;
+	uintptr_t lb = (uintptr_t) (*(struct indexed_object *const *) b)->l;
+	return (la > lb) - (la < lb);
+}
+
+/* by_l is sorted by link map address */
+static struct indexed_object *find_indexed(struct indexed_object **by_l, unsigned n, struct link_map *l)
+{
+	unsigned lo = 0, hi = n;
+	while (lo < hi)
+	{
+		unsigned mid = lo + (hi - lo) / 2;
+		if ((uintptr_t) by_l[mid]->l < (uintptr_t) l) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo < n && is_same_object(by_l[lo], l)) return by_l[lo];
+	return NULL;
+}
+
+/* Free whatever we've retired, if no lookup is in flight. A lookup that
+ * starts after the publishing store can only see the new array. */
+static void reclaim_retired(void)
+{
+	if (__atomic_load_n(&nreaders, __ATOMIC_SEQ_CST) != 0) return;
+	while (retired_arrays)
+	{
+		struct indexed_object_array *a = retired_arrays;
+		retired_arrays = a->next_retired;
+		__wrap_dlfree(a);
+	}
+	while (retired_objects)
+	{
+		struct indexed_object *o = retired_objects;
+		retired_objects = o->next_retired;
+		free_indexed_object(o);
+	}
+}
+
+/* Call with the mutex held. Rebuild the array from the link map, keeping
+ * the objects we have already indexed and that are still there. */
+static void reconcile(void)
+{
+	struct indexed_object_array *old = indexed_objects;
+	unsigned n = 0;
+	for (struct link_map *l = _r_debug.r_map; l; l = l->l_next) ++n;
+	struct indexed_object_array *new = __wrap_dlmalloc(sizeof (struct indexed_object_array)
+		+ n * sizeof (struct indexed_object *));
+	/* Index the old objects by link map, to find the ones we can keep. */
+	unsigned nold = old ? old->n : 0;
+	struct indexed_object **by_l = nold ? __wrap_dlmalloc(nold * sizeof (struct indexed_object *)) : NULL;
+	if (by_l)
+	{
+		memcpy(by_l, old->objs, nold * sizeof (struct indexed_object *));
+		qsort(by_l, nold, sizeof (struct indexed_object *), compare_objects_by_link_map);
+	}
+	for (unsigned i = 0; i < nold; ++i) old->objs[i]->kept = 0;
+	/* If we can't rebuild, stop answering rather than answer stale. */
+	unsigned out = 0;
+	for (struct link_map *l = _r_debug.r_map; l && new; l = l->l_next)
+	{
+		struct indexed_object *o = by_l ? find_indexed(by_l, nold, l) : NULL;
+		if (o) o->kept = 1;
+		else o = make_indexed_object(l);
+		if (o) new->objs[out++] = o;
+	}
+	if (by_l) __wrap_dlfree(by_l);
+	if (new)
+	{
+		new->n = out;
+		new->next_retired = NULL;
+		qsort(new->objs, out, sizeof (struct indexed_object *), compare_objects);
+	}
+	__atomic_store_n(&indexed_objects, new, __ATOMIC_SEQ_CST);
+	if (old)
+	{
+		for (unsigned i = 0; i < old->n; ++i)
+		{
+			if (old->objs[i]->kept) continue;
+			/* It's gone, so anything cached about its addresses is too. */
+			__liballocs_dladdr_cache_invalidate();
+			__liballocs_uniqtype_ptrmaps_notify_unload((void*) old->objs[i]->begin,
+				(void*) old->objs[i]->end);
+			__liballocs_typedb_notify_unload(old->objs[i]->l_addr);
+			old->objs[i]->next_retired = retired_objects;
+			retired_objects = old->objs[i];
+		}
+		old->next_retired = retired_arrays;
+		retired_arrays = old;
+	}
+	reclaim_retired();
+}
+
+static void ensure_init(void)
+{
+	if (__atomic_load_n(&initialized, __ATOMIC_ACQUIRE)) return;
+	pthread_mutex_lock(&indexed_objects_mutex);
+	if (!initialized)
+	{
+		if (!real_dladdr) real_dladdr = dlsym(RTLD_NEXT, "dladdr");
+		if (real_dladdr) reconcile();
+		__atomic_store_n(&initialized, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&indexed_objects_mutex);
+}
+
+void __liballocs_dladdr_index_notify_load(void)
+{
+	/* Until someone asks, there's nothing to keep up to date. */
+	if (!__atomic_load_n(&initialized, __ATOMIC_ACQUIRE) || !real_dladdr) return;
+	pthread_mutex_lock(&indexed_objects_mutex);
+	reconcile();
+	pthread_mutex_unlock(&indexed_objects_mutex);
+}
+
+void __liballocs_dladdr_index_remove(struct link_map *l)
+{
+	/* Unloading l may have unloaded its dependencies too, so
+	 * look at the whole link map, not just l. */
+	if (!__atomic_load_n(&initialized, __ATOMIC_ACQUIRE) || !real_dladdr) return;
+	pthread_mutex_lock(&indexed_objects_mutex);
+	reconcile();
+	pthread_mutex_unlock(&indexed_objects_mutex);
+}
+
+static const struct sym_interval *lookup_sym(const struct indexed_object *o, uintptr_t addr)
+{
+	/* Find the last interval beginning at or below addr. */
+	unsigned long lo = 0, hi = o->nsyms;
+	while (lo < hi)
+	{
+		unsigned long mid = lo + (hi - lo) / 2;
+		if (o->syms[mid].begin <= addr) lo = mid + 1;
+		else hi = mid;
+	}
+	const struct sym_interval *found = NULL;
+	for (unsigned long i = lo; i > 0; --i)
+	{
+		const struct sym_interval *s = &o->syms[i - 1];
+		/* Once we have a match, we only go back through equal starts,
+		 * to get the first one in dynsym order. */
+		if (found && s->begin != found->begin) break;
+		/* Nothing from here back reaches addr, unless it's a zero-sized
+		 * symbol right at addr (and those sort last). */
+		if (s->max_end <= addr && s->begin != addr) break;
+		_Bool matches = (s->end == s->begin) ? (addr == s->begin) : (addr < s->end);
+		if (matches) found = s;
+	}
+	return found;
+}
+
+int __liballocs_dladdr_index_lookup(const void *addr, Dl_info *info,
+	struct link_map **out_l, const ElfW(Sym) **out_sym)
+{
+	ensure_init();
+	__atomic_add_fetch(&nreaders, 1, __ATOMIC_SEQ_CST);
+	int ret = 0;
+	struct indexed_object_array *a = __atomic_load_n(&indexed_objects, __ATOMIC_SEQ_CST);
+	if (!a || a->n == 0) goto out;
+	uintptr_t u = (uintptr_t) addr;
+	unsigned lo = 0, hi = a->n;
+	while (hi - lo > 1)
+	{
+		unsigned mid = lo + (hi - lo) / 2;
+		if (a->objs[mid]->begin <= u) lo = mid;
+		else hi = mid;
+	}
+	const struct indexed_object *o = a->objs[lo];
+	if (u < o->begin || u >= o->end) goto out;
+	_Bool in_segment = 0;
+	for (unsigned i = 0; i < o->nsegs; ++i)
+	{
+		if (u >= o->segs[i].begin && u < o->segs[i].end) { in_segment = 1; break; }
+	}
+	if (!in_segment) goto out;
+
+	const struct sym_interval *s = lookup_sym(o, u);
+	info->dli_fname = o->fname;
+	info->dli_fbase = o->fbase;
+	info->dli_sname = s ? s->name : NULL;
+	info->dli_saddr = s ? (void*) s->begin : NULL;
+	if (out_l) *out_l = o->l;
+	if (out_sym) *out_sym = s ? s->sym : NULL;
+	ret = 1;
+out:
+	__atomic_sub_fetch(&nreaders, 1, __ATOMIC_SEQ_CST);
+	return ret;
+}
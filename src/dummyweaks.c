@@ -99,6 +99,21 @@ struct liballocs_err *__liballocs_get_alloc_info(const void *obj, struct allocat
 	return NULL;
 }
 
+_Bool __liballocs_query_latency_enabled;
+struct liballocs_err *__liballocs_get_alloc_info_timed(const void *obj, struct allocator **out_allocator,
+	const void **out_alloc_start, unsigned long *out_alloc_size_bytes, 
+	struct uniqtype **out_alloc_uniqtype, const void **out_alloc_site)
+{
+	return NULL;
+}
+
+struct liballocs_err *__liballocs_get_alloc_info_signal_safe(const void *obj, struct allocator **out_allocator,
+	const void **out_alloc_start, unsigned long *out_alloc_size_bytes, 
+	struct uniqtype **out_alloc_uniqtype, const void **out_alloc_site)
+{
+	return NULL;
+}
+
 struct mcontext;
 struct uniqtype *
 __liballocs_make_array_precise_with_memory_bounds(struct uniqtype *in,
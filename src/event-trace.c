@@ -0,0 +1,231 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "relf.h"
+#include "liballocs_private.h"
+#include "eventtrace.h"
+
+/* A binary trace of index operations (see include/eventtrace.h), for
+ * when the fprintf()s of TRACE_HEAP_INDEX would disturb things too much.
+ *
+ * Each thread writes records into its own ring, then, every
+ * TRACE_RING_BATCH records, claims what it has written by advancing the
+ * ring's flushed index with a CAS, reserves that much space in the file
+ * and copies the records there. Nothing takes a lock. The CAS is there
+ * because at exit, the exiting thread flushes every thread's ring; a
+ * thread still running at that point could in principle lap its ring
+ * while its records are being copied, but it would have to write a few
+ * thousand records meanwhile.
+ *
+ * The heap path makes a thread's ring on first use. The bigalloc path
+ * can't, since it may be in the mmap trap handler, so every thread we see
+ * start (via our pthread_create() wrapper, or this file's constructor for
+ * the initial thread) gets its ring straight away. Bigalloc events on a
+ * thread with no ring are counted as dropped.
+ *
+ * When a thread exits, a key destructor flushes its ring and frees it.
+ * After fork(), the child gets on with the same file (its records have
+ * its own tids), but forgets the other threads' rings and the records it
+ * inherited in its own, which the parent will write. */
+
+#define TRACE_RING_NRECORDS 1024
+#define TRACE_RING_BATCH 256
+
+_Bool __liballocs_trace_enabled;
+
+struct trace_ring
+{
+	unsigned long head;    /* next record to write */
+	unsigned long flushed; /* records before this are claimed by a flush */
+	uint32_t tid;
+	struct trace_ring *next;
+	struct eventtrace_record records[TRACE_RING_NRECORDS];
+};
+__thread struct trace_ring *__liballocs_trace_thread_ring;
+static struct trace_ring *rings;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_exit_key;
+static pthread_once_t thread_exit_key_once = PTHREAD_ONCE_INIT;
+
+static struct eventtrace_header *trace_file;
+static size_t trace_file_size;
+
+unsigned long __liballocs_trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+static void flush_ring(struct trace_ring *r)
+{
+	unsigned long from = __atomic_load_n(&r->flushed, __ATOMIC_RELAXED);
+	unsigned long to = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	if (from == to) return;
+	/* If someone else claimed these, they'll write them. */
+	if (!__atomic_compare_exchange_n(&r->flushed, &from, to, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) return;
+	unsigned long n = to - from;
+	unsigned long pos = __atomic_fetch_add(&trace_file->nreserved, n, __ATOMIC_RELAXED);
+	unsigned long nfit = (pos >= trace_file->capacity) ? 0
+		: (pos + n > trace_file->capacity) ? trace_file->capacity - pos : n;
+	if (nfit < n) __atomic_add_fetch(&trace_file->ndropped, n - nfit, __ATOMIC_RELAXED);
+	struct eventtrace_record *out = (struct eventtrace_record *)
+		((char*) trace_file + EVENTTRACE_HEADER_SIZE) + pos;
+	for (unsigned long i = 0; i < nfit; ++i)
+	{
+		out[i] = r->records[(from + i) % TRACE_RING_NRECORDS];
+	}
+}
+
+static void thread_exiting(void *arg)
+{
+	struct trace_ring *r = arg;
+	pthread_mutex_lock(&rings_mutex);
+	flush_ring(r);
+	for (struct trace_ring **p = &rings; *p; p = &(*p)->next)
+	{
+		if (*p == r) { *p = r->next; break; }
+	}
+	pthread_mutex_unlock(&rings_mutex);
+	/* Anything after this goes in a fresh ring. */
+	__liballocs_trace_thread_ring = NULL;
+	munmap(r, sizeof (struct trace_ring));
+}
+
+static void create_thread_exit_key(void)
+{
+	if (0 != pthread_key_create(&thread_exit_key, thread_exiting)) abort();
+}
+
+static struct trace_ring *new_ring(void)
+{
+	/* We're called from inside malloc, so don't use it. */
+	void *mem = mmap(NULL, sizeof (struct trace_ring), PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) return NULL;
+	struct trace_ring *r = mem;
+	r->tid = syscall(SYS_gettid);
+	/* Set this first, in case what follows reenters malloc. */
+	__liballocs_trace_thread_ring = r;
+	pthread_mutex_lock(&rings_mutex);
+	r->next = rings;
+	rings = r;
+	pthread_mutex_unlock(&rings_mutex);
+	pthread_once(&thread_exit_key_once, create_thread_exit_key);
+	pthread_setspecific(thread_exit_key, r);
+	return r;
+}
+
+void __liballocs_trace_event(unsigned kind, const void *addr, unsigned long size,
+	const void *site, unsigned long begin_ns)
+{
+	unsigned long end_ns = __liballocs_trace_now();
+	struct trace_ring *r = __liballocs_trace_thread_ring;
+	if (__builtin_expect(!r, 0) && !(r = new_ring())) return;
+	unsigned long head = r->head;
+	r->records[head % TRACE_RING_NRECORDS] = (struct eventtrace_record) {
+		.time_ns = begin_ns,
+		.kind = kind,
+		.tid = r->tid,
+		.addr = (uintptr_t) addr,
+		.size = size,
+		.site = (uintptr_t) site,
+		.duration_ns = end_ns - begin_ns
+	};
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	if (head + 1 - __atomic_load_n(&r->flushed, __ATOMIC_RELAXED) >= TRACE_RING_BATCH)
+	{
+		flush_ring(r);
+	}
+}
+
+void __liballocs_trace_thread_start(void)
+{
+	if (__atomic_load_n(&__liballocs_trace_enabled, __ATOMIC_ACQUIRE)
+			&& !__liballocs_trace_thread_ring)
+	{
+		new_ring();
+	}
+}
+
+void __liballocs_trace_note_dropped(void)
+{
+	if (trace_file) __atomic_add_fetch(&trace_file->ndropped, 1, __ATOMIC_RELAXED);
+}
+
+static void flush_all_rings(void)
+{
+	pthread_mutex_lock(&rings_mutex);
+	for (struct trace_ring *r = rings; r; r = r->next) flush_ring(r);
+	pthread_mutex_unlock(&rings_mutex);
+}
+
+static void forget_other_threads_in_child(void)
+{
+	struct trace_ring *r = __liballocs_trace_thread_ring;
+	if (r)
+	{
+		r->flushed = r->head;
+		r->next = NULL;
+		r->tid = syscall(SYS_gettid);
+	}
+	rings = r;
+	pthread_mutex_init(&rings_mutex, NULL);
+}
+
+static void (__attribute__((constructor)) init)(void)
+{
+	const char *path = getenv("LIBALLOCS_TRACE");
+	if (!path || !*path) return;
+	const char *mb_str = getenv("LIBALLOCS_TRACE_MB");
+	unsigned long mb = (mb_str && atol(mb_str) > 0) ? atol(mb_str) : 256;
+	unsigned long capacity = (mb << 20) / sizeof (struct eventtrace_record);
+	trace_file_size = EVENTTRACE_HEADER_SIZE + capacity * sizeof (struct eventtrace_record);
+
+	int fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd == -1)
+	{
+		debug_printf(0, "could not open trace file %s\n", path);
+		return;
+	}
+	/* Pages we never write stay as holes. */
+	if (0 != ftruncate(fd, trace_file_size))
+	{
+		debug_printf(0, "could not size trace file %s\n", path);
+		close(fd);
+		return;
+	}
+	void *mem = mmap(NULL, trace_file_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+	{
+		debug_printf(0, "could not map trace file %s\n", path);
+		return;
+	}
+	trace_file = mem;
+	*trace_file = (struct eventtrace_header) {
+		.magic = EVENTTRACE_MAGIC,
+		.version = EVENTTRACE_VERSION,
+		.record_size = sizeof (struct eventtrace_record),
+		.pid = getpid(),
+		.capacity = capacity,
+		.start_time_ns = __liballocs_trace_now()
+	};
+	atexit(flush_all_rings);
+	pthread_atfork(NULL, NULL, forget_other_threads_in_child);
+	__atomic_store_n(&__liballocs_trace_enabled, 1, __ATOMIC_RELEASE);
+	__liballocs_trace_thread_start();
+	debug_printf(1, "tracing to %s (room for %lu records)\n", path, capacity);
+}
@@ -0,0 +1,319 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "relf.h"
+#include "liballocs_private.h"
+
+/* A census of live malloc chunks, kept up to date by index_insert and
+ * index_delete.
+ *
+ * Chunks are counted under a key: the allocation site from their insert,
+ * or, once a query has rewritten the insert to hold a uniqtype, that
+ * uniqtype (see census_key()). The malloc index moves a chunk's count
+ * between keys when it sees a query rewrite the insert. Clients that
+ * rewrite inserts behind our back will leave counts under the old key.
+ *
+ * Keys go in a process-wide table, lock-free like the typestr index: a
+ * key's slot is claimed by CAS and never released. Slot 0 collects the
+ * chunks with no site, and everything that arrives after the table fills.
+ *
+ * Each thread adds its deltas to its own shard, an array of counts
+ * parallel to the key table, so updates need no atomic read-modify-write
+ * and don't bounce cache lines. A chunk is often freed by a different
+ * thread from the one that allocated it, so one shard's counts can be
+ * negative; only the sum over all shards means anything. When a thread
+ * exits, a key destructor folds its shard into the retired shard. */
+
+#ifndef CENSUS_LOG_NSLOTS
+#define CENSUS_LOG_NSLOTS 14
+#endif
+#define CENSUS_NSLOTS (1ul<<CENSUS_LOG_NSLOTS)
+#define CENSUS_MAX_LOAD ((CENSUS_NSLOTS / 8) * 7)
+#define CENSUS_OTHER_SLOT 0
+
+_Bool __liballocs_heap_census_enabled = 1;
+
+static uintptr_t keys[CENSUS_NSLOTS]; /* zero means free */
+static unsigned long nkeys;
+
+struct census_counts
+{
+	long nobjects;
+	long nbytes;
+};
+struct census_shard
+{
+	struct census_counts counts[CENSUS_NSLOTS];
+	struct census_shard *next;
+};
+static __thread struct census_shard *this_thread_shard;
+static struct census_shard *shards;
+static struct census_shard retired;
+static pthread_mutex_t shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_exit_key;
+static pthread_once_t thread_exit_key_once = PTHREAD_ONCE_INIT;
+
+static unsigned long slot_for_key(uintptr_t key)
+{
+	if (!key) return CENSUS_OTHER_SLOT;
+	unsigned long mask = CENSUS_NSLOTS - 1;
+	for (unsigned long i = (key * 0x9e3779b97f4a7c15ul) >> (64 - CENSUS_LOG_NSLOTS); ;
+			i = (i + 1) & mask)
+	{
+		if (i == CENSUS_OTHER_SLOT) continue;
+		uintptr_t k = __atomic_load_n(&keys[i], __ATOMIC_ACQUIRE);
+		if (k == key) return i;
+		if (k) continue;
+		/* Once full, new keys always land here, so they do so consistently. */
+		if (__atomic_load_n(&nkeys, __ATOMIC_RELAXED) >= CENSUS_MAX_LOAD) return CENSUS_OTHER_SLOT;
+		if (__atomic_compare_exchange_n(&keys[i], &k, key, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			__atomic_add_fetch(&nkeys, 1, __ATOMIC_RELAXED);
+			return i;
+		}
+		if (k == key) return i;
+	}
+}
+
+static void fold_into(struct census_shard *dest, struct census_shard *src)
+{
+	for (unsigned long i = 0; i < CENSUS_NSLOTS; ++i)
+	{
+		dest->counts[i].nobjects += __atomic_load_n(&src->counts[i].nobjects, __ATOMIC_RELAXED);
+		dest->counts[i].nbytes += __atomic_load_n(&src->counts[i].nbytes, __ATOMIC_RELAXED);
+	}
+}
+
+static void thread_exiting(void *arg)
+{
+	struct census_shard *s = arg;
+	pthread_mutex_lock(&shards_mutex);
+	fold_into(&retired, s);
+	for (struct census_shard **p = &shards; *p; p = &(*p)->next)
+	{
+		if (*p == s) { *p = s->next; break; }
+	}
+	pthread_mutex_unlock(&shards_mutex);
+	/* If anything is freed after this, it goes in a fresh shard. */
+	this_thread_shard = NULL;
+	munmap(s, sizeof (struct census_shard));
+}
+
+static void create_thread_exit_key(void)
+{
+	if (0 != pthread_key_create(&thread_exit_key, thread_exiting)) abort();
+}
+
+static struct census_shard *new_shard(void)
+{
+	/* We're called from inside malloc, so don't use it. Untouched slots
+	 * cost nothing. */
+	void *mem = mmap(NULL, sizeof (struct census_shard), PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED) return NULL;
+	struct census_shard *s = mem;
+	/* Set this first, in case what follows reenters malloc. */
+	this_thread_shard = s;
+	pthread_mutex_lock(&shards_mutex);
+	s->next = shards;
+	shards = s;
+	pthread_mutex_unlock(&shards_mutex);
+	pthread_once(&thread_exit_key_once, create_thread_exit_key);
+	pthread_setspecific(thread_exit_key, s);
+	return s;
+}
+
+void __liballocs_heap_census_add(uintptr_t key, long nobjects, long nbytes)
+{
+	struct census_shard *s = this_thread_shard;
+	if (__builtin_expect(!s, 0) && !(s = new_shard())) return;
+	struct census_counts *c = &s->counts[slot_for_key(key)];
+	__atomic_store_n(&c->nobjects, c->nobjects + nobjects, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->nbytes, c->nbytes + nbytes, __ATOMIC_RELAXED);
+}
+
+static int compare_by_bytes(const void *a, const void *b)
+{
+	const struct liballocs_census_entry *ea = a;
+	const struct liballocs_census_entry *eb = b;
+	return (ea->nbytes < eb->nbytes) - (ea->nbytes > eb->nbytes);
+}
+
+static int compare_by_type(const void *a, const void *b)
+{
+	const struct liballocs_census_entry *ea = a;
+	const struct liballocs_census_entry *eb = b;
+	return (ea->type > eb->type) - (ea->type < eb->type);
+}
+
+size_t __liballocs_get_heap_census(struct liballocs_census_entry *out, size_t max,
+	_Bool by_type)
+{
+	if (!__liballocs_heap_census_enabled) return 0;
+	struct census_shard *sum = mmap(NULL, sizeof (struct census_shard), PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (sum == MAP_FAILED) return 0;
+	pthread_mutex_lock(&shards_mutex);
+	fold_into(sum, &retired);
+	for (struct census_shard *s = shards; s; s = s->next) fold_into(sum, s);
+	pthread_mutex_unlock(&shards_mutex);
+
+	struct liballocs_census_entry *entries = __wrap_dlmalloc(
+		CENSUS_NSLOTS * sizeof (struct liballocs_census_entry));
+	if (!entries) { munmap(sum, sizeof *sum); return 0; }
+	size_t n = 0;
+	for (unsigned long i = 0; i < CENSUS_NSLOTS; ++i)
+	{
+		if (sum->counts[i].nobjects <= 0) continue;
+		uintptr_t key = __atomic_load_n(&keys[i], __ATOMIC_ACQUIRE);
+		struct liballocs_census_entry e = {
+			.nobjects = sum->counts[i].nobjects,
+			.nbytes = sum->counts[i].nbytes > 0 ? sum->counts[i].nbytes : 0
+		};
+		if (key & CENSUS_KEY_IS_TYPE) e.type = (struct uniqtype *)(key & ~CENSUS_KEY_IS_TYPE);
+		else if (key)
+		{
+			e.alloc_site = (const void *) key;
+			e.type = allocsite_to_uniqtype(e.alloc_site);
+		}
+		if (by_type) e.alloc_site = NULL;
+		entries[n++] = e;
+	}
+	munmap(sum, sizeof *sum);
+
+	if (by_type && n > 0)
+	{
+		qsort(entries, n, sizeof *entries, compare_by_type);
+		size_t merged = 0;
+		for (size_t i = 1; i < n; ++i)
+		{
+			if (entries[i].type == entries[merged].type)
+			{
+				entries[merged].nobjects += entries[i].nobjects;
+				entries[merged].nbytes += entries[i].nbytes;
+			}
+			else entries[++merged] = entries[i];
+		}
+		n = merged + 1;
+	}
+	qsort(entries, n, sizeof *entries, compare_by_bytes);
+	if (out) memcpy(out, entries, (n < max ? n : max) * sizeof *entries);
+	__wrap_dlfree(entries);
+	return n;
+}
+
+int __liballocs_dump_heap_census(const char *path)
+{
+	size_t n = __liballocs_get_heap_census(NULL, 0, 0);
+	struct liballocs_census_entry *entries = __wrap_dlmalloc(
+		(n ? n : 1) * sizeof (struct liballocs_census_entry));
+	if (!entries) return -1;
+	/* More sites may have appeared meanwhile; we print the biggest n. */
+	size_t now = __liballocs_get_heap_census(entries, n, 0);
+	if (now < n) n = now;
+	FILE *f = fopen(path, "w");
+	if (!f) { __wrap_dlfree(entries); return -1; }
+	fprintf(f, "alloc_site,type,objects,bytes\n");
+	for (size_t i = 0; i < n; ++i)
+	{
+		fprintf(f, "%p,%s,%lu,%lu\n", entries[i].alloc_site,
+			entries[i].type ? UNIQTYPE_NAME(entries[i].type) : "",
+			entries[i].nobjects, entries[i].nbytes);
+	}
+	__wrap_dlfree(entries);
+	return (0 == fclose(f)) ? 0 : -1;
+}
+
+/* On LIBALLOCS_CENSUS_SIGNAL, the handler just pokes a pipe; a thread of
+ * our own does the dumping, since that takes locks and calls malloc. */
+static int dump_pipe[2] = { -1, -1 };
+static unsigned long ndumps;
+
+static void census_signal_handler(int signum)
+{
+	int saved_errno = errno;
+	char c = 0;
+	(void) !write(dump_pipe[1], &c, 1);
+	errno = saved_errno;
+}
+
+static void *dumper_main(void *arg)
+{
+	const char *file = getenv("LIBALLOCS_CENSUS_FILE");
+	for (;;)
+	{
+		char c;
+		ssize_t ret = read(dump_pipe[0], &c, 1);
+		if (ret == -1 && errno == EINTR) continue;
+		if (ret != 1) return NULL;
+		char path[4096];
+		if (file) snprintf(path, sizeof path, "%s", file);
+		else snprintf(path, sizeof path, "/tmp/liballocs-census.%d.%lu.csv",
+			(int) getpid(), ndumps);
+		++ndumps;
+		if (0 != __liballocs_dump_heap_census(path))
+		{
+			debug_printf(0, "could not write the heap census to %s\n", path);
+		}
+		else debug_printf(1, "wrote the heap census to %s\n", path);
+	}
+}
+
+static int parse_signal(const char *s)
+{
+	if (0 == strncmp(s, "SIG", 3)) s += 3;
+	if (0 == strcmp(s, "USR1")) return SIGUSR1;
+	if (0 == strcmp(s, "USR2")) return SIGUSR2;
+	if (0 == strcmp(s, "HUP")) return SIGHUP;
+	char *end;
+	long n = strtol(s, &end, 10);
+	return (*s && !*end && n > 0 && n < NSIG) ? (int) n : -1;
+}
+
+static void (__attribute__((constructor)) init)(void)
+{
+	const char *enabled = getenv("LIBALLOCS_HEAP_CENSUS");
+	if (enabled && 0 == strcmp(enabled, "0")) __liballocs_heap_census_enabled = 0;
+	const char *sigstr = getenv("LIBALLOCS_CENSUS_SIGNAL");
+	if (!sigstr || !__liballocs_heap_census_enabled) return;
+	int signum = parse_signal(sigstr);
+	if (signum == -1)
+	{
+		debug_printf(0, "did not understand LIBALLOCS_CENSUS_SIGNAL=%s\n", sigstr);
+		return;
+	}
+	/* The handler mustn't block, even if nobody is reading (e.g. after fork()). */
+	if (0 != pipe2(dump_pipe, O_CLOEXEC)
+			|| -1 == fcntl(dump_pipe[1], F_SETFL, O_NONBLOCK))
+	{
+		debug_printf(0, "could not make a pipe for heap census dumps\n");
+		return;
+	}
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_t t;
+	int ret = pthread_create(&t, NULL, dumper_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0)
+	{
+		debug_printf(0, "could not start the heap census dumper thread\n");
+		return;
+	}
+	pthread_detach(t);
+	struct sigaction sa = { .sa_handler = census_signal_handler, .sa_flags = SA_RESTART };
+	sigemptyset(&sa.sa_mask);
+	sigaction(signum, &sa, NULL);
+}
@@ -13,6 +13,9 @@
 #include <errno.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
 #ifdef USE_REAL_LIBUNWIND
 #include <libunwind.h>
 #endif
@@ -134,6 +137,10 @@ struct liballocs_err __liballocs_err_unrecognised_static_object
  = { "unrecognised static object" };
 struct liballocs_err __liballocs_err_object_of_unknown_storage
  = { "object of unknown storage" };
+struct liballocs_err __liballocs_err_retry
+ = { "index changed during query; retry" };
+struct liballocs_err __liballocs_err_not_signal_safe
+ = { "query not possible from a signal handler" };
 
 const char *__liballocs_errstring(struct liballocs_err *err)
 {
@@ -282,6 +289,11 @@ int __liballocs_iterate_types(void *typelib_handle, int (*cb)(struct uniqtype *t
 					dynstr + p_sym->st_name + strlen(name)
 						 - (sizeof "_subobj_names" - 1)
 				)
+			) &&
+			(0 != strcmp("_ptrmap", 
+					dynstr + p_sym->st_name + strlen(name)
+						 - (sizeof "_ptrmap" - 1)
+				)
 			)
 		)
 		{
@@ -302,17 +314,33 @@ int __liballocs_iterate_types(void *typelib_handle, int (*cb)(struct uniqtype *t
 	
 	return cb_ret;
 }
-/* FIXME: invalidate cache entries on dlclose(). */
 #ifndef DLADDR_CACHE_SIZE
 #define DLADDR_CACHE_SIZE 16
 #endif
+/* Bumped whenever an object goes away; each thread's cache empties itself
+ * when it sees a new value. */
+static unsigned long dladdr_cache_generation;
+void __liballocs_dladdr_cache_invalidate(void)
+{
+	__atomic_add_fetch(&dladdr_cache_generation, 1, __ATOMIC_RELEASE);
+}
 Dl_info dladdr_with_cache(const void *addr); // __attribute__((visibility("protected")));
 Dl_info dladdr_with_cache(const void *addr)
 {
 	struct cache_rec { const void *addr; Dl_info info; };
 	
-	static struct cache_rec cache[DLADDR_CACHE_SIZE];
-	static unsigned next_free;
+	/* Per thread, since walkers call us from several at once. */
+	static __thread struct cache_rec cache[DLADDR_CACHE_SIZE];
+	static __thread unsigned next_free;
+	static __thread unsigned long generation;
+	
+	unsigned long current_generation = __atomic_load_n(&dladdr_cache_generation, __ATOMIC_ACQUIRE);
+	if (generation != current_generation)
+	{
+		memset(cache, 0, sizeof cache);
+		next_free = 0;
+		generation = current_generation;
+	}
 	
 	for (unsigned i = 0; i < DLADDR_CACHE_SIZE; ++i)
 	{
@@ -342,6 +370,8 @@ Dl_info dladdr_with_cache(const void *addr)
 const char *(__attribute__((pure)) __liballocs_uniqtype_symbol_name)(const struct uniqtype *u)
 {
 	if (!u) return NULL;
+	const char *typedb_name = __liballocs_typedb_loaded_symbol_name(u);
+	if (typedb_name) return typedb_name;
 	Dl_info i = dladdr_with_cache(u);
 	if (i.dli_saddr == u)
 	{
@@ -488,6 +518,16 @@ static const char *helper_libfile_name(const char *objname, const char *suffix)
 	return &libfile_name[0];
 }	
 
+/* Once an object's -types.so is loaded, map its -types.db if it has one,
+ * so that we can name its uniqtypes without dladdr(). */
+static void register_typedb_for_object(const char *canon_objname, ElfW(Addr) load_addr,
+	void *types_handle)
+{
+	const char *db_name = helper_libfile_name(canon_objname, "-types.db");
+	if (!db_name) return;
+	__liballocs_typedb_register_object(db_name, load_addr, types_handle);
+}
+
 // HACK
 extern void __libcrunch_scan_lazy_typenames(void *handle) __attribute__((weak));
 
@@ -510,13 +550,18 @@ int load_types_for_one_object(struct dl_phdr_info *info, size_t size, void *mayb
 	{
 		return 0;
 	}
-
 	// fprintf(stream_err, "liballocs: trying to open %s\n", libfile_name);
 
 	dlerror();
 	// load with NOLOAD first, so that duplicate loads are harmless
 	void *handle = (orig_dlopen ? orig_dlopen :dlopen)(libfile_name, RTLD_NOW | RTLD_GLOBAL | RTLD_NOLOAD);
-	if (handle) return 0;
+	if (handle)
+	{
+		/* Already loaded, maybe by someone else; index it if nobody has. */
+		register_typedb_for_object(canon_objname, info->dlpi_addr, handle);
+		__liballocs_typestr_index_add_object(handle);
+		return 0;
+	}
 	
 	dlerror();
 	handle = (orig_dlopen ? orig_dlopen :dlopen)(libfile_name, RTLD_NOW | RTLD_GLOBAL);
@@ -526,6 +571,8 @@ int load_types_for_one_object(struct dl_phdr_info *info, size_t size, void *mayb
 		return 0;
 	}
 	debug_printf(3, "loaded types object: %s\n", libfile_name);
+	register_typedb_for_object(canon_objname, info->dlpi_addr, handle);
+	__liballocs_typestr_index_add_object(handle);
 	if (maybe_out_handle) *(void**) maybe_out_handle = handle;
 	
 	// if we want maximum output, print it
@@ -559,8 +606,31 @@ _Bool is_meta_object_for_lib(struct link_map *maybe_types, struct link_map *l, c
 	else return 0;
 }
 
+/* Lookups walk the allocsmt buckets without taking a lock, possibly while
+ * another thread is loading an object's metadata. So we don't make a bucket
+ * visible until its chain is complete: each bucket head is release-stored
+ * only once we have moved past the bucket's last entry (or in
+ * finish_chaining_allocsite_entries(), for the last bucket). Lookups load
+ * bucket heads with acquire ordering. */
+struct allocsite_chaining_state
+{
+	struct allocsite_entry **pending_bucketpos;
+	struct allocsite_entry *pending_head;
+	unsigned current_bucket_size; // out of curiosity...
+};
+
+static void publish_pending_bucket(struct allocsite_chaining_state *state)
+{
+	if (!state->pending_bucketpos) return;
+	// fresh bucket, so should be null
+	assert(*state->pending_bucketpos == NULL);
+	__atomic_store_n(state->pending_bucketpos, state->pending_head, __ATOMIC_RELEASE);
+	state->pending_bucketpos = NULL;
+	state->pending_head = NULL;
+}
+
 static void chain_allocsite_entries(struct allocsite_entry *cur_ent, 
-	struct allocsite_entry *prev_ent, unsigned *p_current_bucket_size, 
+	struct allocsite_entry *prev_ent, struct allocsite_chaining_state *state,
 	intptr_t load_addr, intptr_t extrabits)
 {
 #define FIXADDR(a) 	((void*)((intptr_t)(a) | extrabits))
@@ -572,7 +642,7 @@ static void chain_allocsite_entries(struct allocsite_entry *cur_ent,
 	debug_printf(4, "allocsite entry: %p, extrabits %p, to uniqtype at %p\n", 
 		cur_ent->allocsite, (void*) extrabits, cur_ent->uniqtype);
 
-	// if we've moved to a different bucket, point the table entry at us
+	// if we've moved to a different bucket, the previous one is complete
 	struct allocsite_entry **bucketpos = ALLOCSMT_FUN(ADDR, FIXADDR(cur_ent->allocsite));
 	struct allocsite_entry **prev_ent_bucketpos
 	 = prev_ent ? ALLOCSMT_FUN(ADDR, FIXADDR(prev_ent->allocsite)) : NULL;
@@ -581,11 +651,11 @@ static void chain_allocsite_entries(struct allocsite_entry *cur_ent,
 	// but we do need to set up the first bucket
 	if (!prev_ent || bucketpos != prev_ent_bucketpos)
 	{
-		// fresh bucket, so should be null
-		assert(*bucketpos == NULL);
+		publish_pending_bucket(state);
 		debug_printf(4, "starting a new bucket for allocsite %p, mapped from %p\n", 
 			cur_ent->allocsite, bucketpos);
-		*bucketpos = cur_ent;
+		state->pending_bucketpos = bucketpos;
+		state->pending_head = cur_ent;
 	}
 	if (!prev_ent) return;
 
@@ -598,8 +668,8 @@ static void chain_allocsite_entries(struct allocsite_entry *cur_ent,
 		prev_ent->next = cur_ent;
 		cur_ent->prev = prev_ent;
 
-		++(*p_current_bucket_size);
-	} else *p_current_bucket_size = 1; 
+		++state->current_bucket_size;
+	} else state->current_bucket_size = 1; 
 	// we don't (currently) distinguish buckets of zero from buckets of one
 
 	// last iteration doesn't need special handling -- next will be null,
@@ -607,6 +677,170 @@ static void chain_allocsite_entries(struct allocsite_entry *cur_ent,
 #undef FIXADDR
 }
 
+static void finish_chaining_allocsite_entries(struct allocsite_chaining_state *state)
+{
+	publish_pending_bucket(state);
+}
+
+/* Objects whose allocsites came as a prebuilt struct allocsites_table (see
+ * allocsmt.h), or whose allocsites, frame or static tables came from the
+ * shared cache (see allocsites-cache.c), one array per kind of table, each
+ * sorted by the address of its objects' first site. Each addition
+ * replaces the whole array, so lookups take no lock. Additions only happen
+ * when loading an object's metadata, so we just leak the old array, which
+ * lookups on other threads might still be reading. */
+struct prechained_allocsites
+{
+	uintptr_t first_site;
+	uintptr_t last_site;
+	ElfW(Addr) load_addr;
+	const struct allocsites_table *table;
+	const unsigned *type_indices; /* if non-null, types come from here... */
+	struct uniqtype *const *types; /* ... not from table->uniqtypes */
+	const unsigned *extras; /* frames only: offset_from_frame_base */
+};
+struct prechained_allocsites_array
+{
+	unsigned n;
+	struct prechained_allocsites objs[];
+};
+static struct prechained_allocsites_array *prechained_allocsites[SHARED_NKINDS];
+static pthread_mutex_t prechained_allocsites_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void register_prechained_allocsites(unsigned kind, const struct allocsites_table *t,
+	ElfW(Addr) load_addr, const unsigned *type_indices, struct uniqtype *const *types,
+	const unsigned *extras)
+{
+	if (t->nsites == 0) return;
+	struct prechained_allocsites new_obj = {
+		.first_site = load_addr + t->vaddrs[0],
+		.last_site = load_addr + t->vaddrs[t->nsites - 1],
+		.load_addr = load_addr,
+		.table = t,
+		.type_indices = type_indices,
+		.types = types,
+		.extras = extras
+	};
+	pthread_mutex_lock(&prechained_allocsites_mutex);
+	struct prechained_allocsites_array *old = prechained_allocsites[kind];
+	unsigned n = old ? old->n : 0;
+	struct prechained_allocsites_array *new = __wrap_dlmalloc(sizeof (struct prechained_allocsites_array)
+		+ (n + 1) * sizeof (struct prechained_allocsites));
+	if (!new) abort();
+	unsigned pos = 0;
+	for (; pos < n && old->objs[pos].first_site < new_obj.first_site; ++pos) new->objs[pos] = old->objs[pos];
+	new->objs[pos] = new_obj;
+	for (; pos < n; ++pos) new->objs[pos + 1] = old->objs[pos];
+	new->n = n + 1;
+	__atomic_store_n(&prechained_allocsites[kind], new, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&prechained_allocsites_mutex);
+}
+
+static struct prechained_allocsites *prechained_object_for(unsigned kind, const void *addr)
+{
+	struct prechained_allocsites_array *a = __atomic_load_n(&prechained_allocsites[kind], __ATOMIC_ACQUIRE);
+	if (!a) return NULL;
+	unsigned lo = 0, hi = a->n;
+	while (hi - lo > 1)
+	{
+		unsigned mid = lo + (hi - lo) / 2;
+		if (a->objs[mid].first_site <= (uintptr_t) addr) lo = mid;
+		else hi = mid;
+	}
+	if ((uintptr_t) addr < a->objs[lo].first_site) return NULL;
+	return &a->objs[lo];
+}
+
+static struct uniqtype *prechained_type(struct prechained_allocsites *o, unsigned long i)
+{
+	return o->type_indices ? o->types[o->type_indices[i]] : o->table->uniqtypes[i];
+}
+
+int __liballocs_prechained_allocsite_lookup(const void *allocsite, struct uniqtype **out)
+{
+	struct prechained_allocsites *o = prechained_object_for(SHARED_ALLOCSITES, allocsite);
+	if (!o || (uintptr_t) allocsite > o->last_site) return 0;
+	
+	const struct allocsites_table *t = o->table;
+	unsigned long vaddr = (uintptr_t) allocsite - o->load_addr;
+	unsigned long bucket = vaddr >> t->log_bucket_size;
+	*out = NULL;
+	if (bucket >= t->nbuckets) return 1;
+	/* Binary search within the bucket. */
+	unsigned long begin = t->bucket_starts[bucket];
+	unsigned long end = t->bucket_starts[bucket + 1];
+	while (begin < end)
+	{
+		unsigned long mid = begin + (end - begin) / 2;
+		if (t->vaddrs[mid] < vaddr) begin = mid + 1;
+		else end = mid;
+	}
+	if (begin < t->bucket_starts[bucket + 1] && t->vaddrs[begin] == vaddr)
+	{
+		*out = prechained_type(o, begin);
+	}
+	return 1;
+}
+
+/* Frame and static sites cover everything from their own address up to the
+ * next site's, much as when chained in the allocsmt, where the lookup walks
+ * down through lower buckets until max_distance. */
+int __liballocs_prechained_range_lookup(unsigned kind, const void *addr,
+	unsigned long max_distance, struct uniqtype **out_type, void **out_start,
+	unsigned *out_extra)
+{
+	struct prechained_allocsites *o = prechained_object_for(kind, addr);
+	if (!o || ((uintptr_t) addr > o->last_site
+			&& (uintptr_t) addr - o->last_site >= max_distance)) return 0;
+	const struct allocsites_table *t = o->table;
+	unsigned long vaddr = (uintptr_t) addr - o->load_addr;
+	unsigned long bucket = vaddr >> t->log_bucket_size;
+	/* Find the last site at or below vaddr; nothing in a later bucket can be. */
+	unsigned long begin = 0;
+	unsigned long end = (bucket < t->nbuckets) ? t->bucket_starts[bucket + 1] : t->nsites;
+	while (begin < end)
+	{
+		unsigned long mid = begin + (end - begin) / 2;
+		if (t->vaddrs[mid] <= vaddr) begin = mid + 1;
+		else end = mid;
+	}
+	if (begin == 0) return 0;
+	unsigned long i = begin - 1;
+	if (vaddr - t->vaddrs[i] >= max_distance) return 0;
+	struct uniqtype *u = prechained_type(o, i);
+	if (!u) return 0;
+	if (out_type) *out_type = u;
+	if (out_start) *out_start = (void*)(o->load_addr + t->vaddrs[i]);
+	if (out_extra) *out_extra = o->extras ? o->extras[i] : 0;
+	return 1;
+}
+
+_Bool __liballocs_statics_are_prechained(ElfW(Addr) load_addr)
+{
+	struct prechained_allocsites_array *a = __atomic_load_n(&prechained_allocsites[SHARED_STATICS],
+		__ATOMIC_ACQUIRE);
+	for (unsigned i = 0; a && i < a->n; ++i)
+	{
+		if (a->objs[i].load_addr == load_addr) return 1;
+	}
+	return 0;
+}
+
+/* If there's a shared cache, use (or make) the index there instead of chaining. */
+static _Bool attach_shared_allocsites(const char *meta_name, unsigned kind,
+	const void *first_entry, ElfW(Addr) load_addr)
+{
+	struct shared_allocsites *shared = __wrap_dlmalloc(sizeof (struct shared_allocsites));
+	if (shared && __liballocs_shared_allocsites_attach(meta_name, kind, first_entry, shared))
+	{
+		register_prechained_allocsites(kind, &shared->table, load_addr,
+			shared->type_indices, shared->types, shared->extras);
+		return 1;
+	}
+	if (shared) __wrap_dlfree(shared);
+	return 0;
+}
+
 int load_and_init_allocsites_for_one_object(struct dl_phdr_info *info, size_t size, void *maybe_out_handle)
 {
 	// write_string("Blah10000\n");
@@ -644,22 +878,37 @@ int load_and_init_allocsites_for_one_object(struct dl_phdr_info *info, size_t si
 	debug_printf(3, "loaded allocsites object: %s\n", libfile_name);
 	if (maybe_out_handle) *(void**) maybe_out_handle = allocsites_handle;
 	
+	/* Newer allocsites objects come prechained; we just remember where. */
+	const struct allocsites_table *table
+	 = (const struct allocsites_table *) dlsym(allocsites_handle, "allocsites_table");
+	if (table)
+	{
+		register_prechained_allocsites(SHARED_ALLOCSITES, table, info->dlpi_addr, NULL, NULL, NULL);
+		return 0;
+	}
+	
 	dlerror();
 	struct allocsite_entry *first_entry = (struct allocsite_entry *) dlsym(allocsites_handle, "allocsites");
 	// allocsites cannot be null anyhow
-	assert(first_entry && "symbol 'allocsites' must be present in -allocsites.so"); 
+	assert(first_entry && "symbol 'allocsites' or 'allocsites_table' must be present in -allocsites.so"); 
+
+	if (attach_shared_allocsites(libfile_name, SHARED_ALLOCSITES, first_entry, info->dlpi_addr))
+	{
+		return 0;
+	}
 
 	/* We walk through allocsites in this object, chaining together those which
 	 * should be in the same bucket. NOTE that this is the kind of thing we'd
 	 * like to get the linker to do for us, but it's not quite expressive enough. */
 	struct allocsite_entry *cur_ent = first_entry;
 	struct allocsite_entry *prev_ent = NULL;
-	unsigned current_bucket_size = 1; // out of curiosity...
+	struct allocsite_chaining_state state = { .current_bucket_size = 1 };
 	for (; cur_ent->allocsite; prev_ent = cur_ent++)
 	{
-		chain_allocsite_entries(cur_ent, prev_ent, &current_bucket_size, 
+		chain_allocsite_entries(cur_ent, prev_ent, &state, 
 			info->dlpi_addr, 0);
 	}
+	finish_chaining_allocsite_entries(&state);
 
 	// debugging: check that we can look up the first entry, if we are non-empty
 	assert(!first_entry || !first_entry->allocsite || 
@@ -679,7 +928,7 @@ int link_stackaddr_and_static_allocs_for_one_object(struct dl_phdr_info *info, s
 	// skip objects that are themselves types/allocsites objects
 	if (0 == strncmp(canon_objname, allocsites_base, allocsites_base_len)) return 0;
 	
-	// get the -allocsites.so object's name
+	// get the -types.so object's name
 	const char *libfile_name = helper_libfile_name(canon_objname, TYPES_OBJ_SUFFIX);
 	if (!libfile_name) return 0;
 	// don't load if we end with "-types.so"
@@ -705,19 +954,24 @@ int link_stackaddr_and_static_allocs_for_one_object(struct dl_phdr_info *info, s
 			debug_printf(1, "Could not load frame vaddrs (%s)\n", dlerror());
 			return 0;
 		}
+		if (attach_shared_allocsites(libfile_name, SHARED_FRAMES, first_frame_entry, info->dlpi_addr))
+		{
+			goto statics;
+		}
 
 		/* We chain these much like the allocsites, BUT we OR each vaddr with 
 		 * STACK_BEGIN first.  */
 		struct frame_allocsite_entry *cur_frame_ent = first_frame_entry;
 		struct frame_allocsite_entry *prev_frame_ent = NULL;
-		unsigned current_frame_bucket_size = 1; // out of curiosity...
+		struct allocsite_chaining_state frame_state = { .current_bucket_size = 1 };
 		for (; cur_frame_ent->entry.allocsite; prev_frame_ent = cur_frame_ent++)
 		{
 			chain_allocsite_entries(cur_frame_ent ? &cur_frame_ent->entry : NULL, 
 				prev_frame_ent ? &prev_frame_ent->entry : NULL, 
-				&current_frame_bucket_size,
+				&frame_state,
 				info->dlpi_addr, 0x800000000000ul);
 		}
+		finish_chaining_allocsite_entries(&frame_state);
 
 		// debugging: check that we can look up the first entry, if we are non-empty
 		assert(!first_frame_entry || !first_frame_entry->entry.allocsite || 
@@ -725,6 +979,7 @@ int link_stackaddr_and_static_allocs_for_one_object(struct dl_phdr_info *info, s
 	}
 	
 	/* Now a similar job for the statics. */
+statics:
 	{
 		dlerror();
 		struct static_allocsite_entry *first_static_entry
@@ -734,19 +989,24 @@ int link_stackaddr_and_static_allocs_for_one_object(struct dl_phdr_info *info, s
 			debug_printf(1, "Could not load statics (%s)", dlerror());
 			return 0;
 		}
+		if (attach_shared_allocsites(libfile_name, SHARED_STATICS, first_static_entry, info->dlpi_addr))
+		{
+			return 0;
+		}
 
 		/* We chain these much like the allocsites, BUT we OR each vaddr with 
 		 * STACK_BEGIN<<1 first.  */
 		struct static_allocsite_entry *cur_static_ent = first_static_entry;
 		struct static_allocsite_entry *prev_static_ent = NULL;
-		unsigned current_static_bucket_size = 1; // out of curiosity...
+		struct allocsite_chaining_state static_state = { .current_bucket_size = 1 };
 		for (; !STATIC_ALLOCSITE_IS_NULL(cur_static_ent); prev_static_ent = cur_static_ent++)
 		{
 			chain_allocsite_entries(cur_static_ent ? &cur_static_ent->entry : NULL, 
 					prev_static_ent ? &prev_static_ent->entry : NULL,
-					&current_static_bucket_size,
+					&static_state,
 				info->dlpi_addr, 0x800000000000ul<<1);
 		}
+		finish_chaining_allocsite_entries(&static_state);
 
 		// debugging: check that we can look up the first entry, if we are non-empty
 		assert(!first_static_entry || STATIC_ALLOCSITE_IS_NULL(first_static_entry) || 
@@ -758,8 +1018,16 @@ int link_stackaddr_and_static_allocs_for_one_object(struct dl_phdr_info *info, s
 	return 0;
 }
 
+/* for the exit summary */
+static unsigned long metadata_nobjects_loaded;
+static unsigned long metadata_nobjects_loaded_lazily;
+static unsigned long metadata_lazy_load_ns;
+static unsigned long global_init_ns;
+static long global_init_maxrss_kb;
+
 int load_and_init_all_metadata_for_one_object(struct dl_phdr_info *info, size_t size, void *data)
 {
+	++metadata_nobjects_loaded;
 	void *types_handle = NULL;
 	int types_said_stop = load_types_for_one_object(info, size, &types_handle);
 	void *allocsites_handle = NULL;
@@ -777,6 +1045,248 @@ int load_and_init_all_metadata_for_one_object(struct dl_phdr_info *info, size_t
 	;
 }
 
+/* Lazy metadata loading.
+ * 
+ * Loading every -types.so and -allocsites.so at startup costs a dlopen()
+ * and a pass over every allocsite per loaded object, which adds up when
+ * there are hundreds of libraries. Instead, at startup we just record the
+ * vaddr range of each object already loaded, sorted by start address. A
+ * lookup that misses in an object whose metadata we haven't loaded yet
+ * loads it there and then, under lazy_meta_mutex, and looks again, so no
+ * lookup fails for want of metadata. At the end of global init we also
+ * start a thread that prefetches the rest in the background, so that most
+ * lookups never have to wait. The executable itself is always loaded
+ * eagerly. Objects that arrive later by dlopen() are loaded eagerly, as
+ * before, by our dlopen wrapper. Setting LIBALLOCS_EAGER_METADATA restores
+ * the old behaviour.
+ * 
+ * Loading calls dlopen(), which mallocs, and the prefetcher holds
+ * lazy_meta_mutex while it does so. So a lookup made with the heap index's
+ * lock held must load what it needs before taking the lock (see
+ * generic_malloc.c's get_info). */
+struct lazy_meta_object
+{
+	uintptr_t begin;
+	uintptr_t end;
+	ElfW(Addr) load_addr;
+	const char *name;
+	const ElfW(Phdr) *phdr;
+	ElfW(Half) phnum;
+	_Bool loading; /* under lazy_meta_mutex */
+	_Bool loaded;
+};
+#define MAX_LAZY_META_OBJECTS 4096
+static struct lazy_meta_object lazy_meta_objects[MAX_LAZY_META_OBJECTS];
+static unsigned lazy_meta_nobjects;
+static pthread_mutex_t lazy_meta_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static _Bool metadata_loader_finished;
+static _Bool metadata_prefetch_started;
+static unsigned long metadata_loader_ns;
+static unsigned long metadata_nloads_on_miss;
+
+static unsigned long monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+static int register_one_object_for_lazy_metadata(struct dl_phdr_info *info, size_t size, void *data)
+{
+	uintptr_t begin = UINTPTR_MAX;
+	uintptr_t end = 0;
+	for (int i = 0; i < info->dlpi_phnum; ++i)
+	{
+		if (info->dlpi_phdr[i].p_type != PT_LOAD) continue;
+		uintptr_t seg_begin = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+		uintptr_t seg_end = seg_begin + info->dlpi_phdr[i].p_memsz;
+		if (seg_begin < begin) begin = seg_begin;
+		if (seg_end > end) end = seg_end;
+	}
+	if (begin >= end) return 0;
+	
+	const char *canon_objname = dynobj_name_from_dlpi_name(info->dlpi_name, (void *) info->dlpi_addr);
+	_Bool is_exe = (info->dlpi_addr == 0) || 
+		(canon_objname && 0 == strcmp(canon_objname, get_exe_fullname()));
+	if (is_exe || lazy_meta_nobjects == MAX_LAZY_META_OBJECTS)
+	{
+		return load_and_init_all_metadata_for_one_object(info, size, data);
+	}
+	
+	/* Insert in order of begin address. */
+	unsigned pos = lazy_meta_nobjects;
+	while (pos > 0 && lazy_meta_objects[pos - 1].begin > begin)
+	{
+		lazy_meta_objects[pos] = lazy_meta_objects[pos - 1];
+		--pos;
+	}
+	lazy_meta_objects[pos] = (struct lazy_meta_object) {
+		.begin = begin,
+		.end = end,
+		.load_addr = info->dlpi_addr,
+		.name = info->dlpi_name,
+		.phdr = info->dlpi_phdr,
+		.phnum = info->dlpi_phnum
+	};
+	++lazy_meta_nobjects;
+	return 0;
+}
+
+/* Returns once o's metadata is loaded, unless we're already inside loading
+ * it. Returns 1 if o is loaded now but wasn't when we were called. */
+static int load_lazy_meta_object(struct lazy_meta_object *o)
+{
+	if (__atomic_load_n(&o->loaded, __ATOMIC_ACQUIRE)) return 0;
+	pthread_mutex_lock(&lazy_meta_mutex);
+	/* Either somebody loaded it while we waited, or loading it got us
+	 * called again. */
+	if (o->loading)
+	{
+		_Bool loaded = o->loaded;
+		pthread_mutex_unlock(&lazy_meta_mutex);
+		return loaded;
+	}
+	o->loading = 1;
+	struct dl_phdr_info info = {
+		.dlpi_addr = o->load_addr,
+		.dlpi_name = o->name,
+		.dlpi_phdr = o->phdr,
+		.dlpi_phnum = o->phnum
+	};
+	unsigned long start_ns = monotonic_ns();
+	load_and_init_all_metadata_for_one_object(&info, sizeof info, NULL);
+	metadata_lazy_load_ns += monotonic_ns() - start_ns;
+	++metadata_nobjects_loaded_lazily;
+	debug_printf(2, "lazily loaded metadata for %s\n", o->name);
+	__atomic_store_n(&o->loaded, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&lazy_meta_mutex);
+	return 1;
+}
+
+static void load_remaining_lazy_meta_objects(void)
+{
+	_Bool all_loaded = 1;
+	for (unsigned i = 0; i < lazy_meta_nobjects; ++i)
+	{
+		load_lazy_meta_object(&lazy_meta_objects[i]);
+		/* Not if we're inside loading it. */
+		if (!__atomic_load_n(&lazy_meta_objects[i].loaded, __ATOMIC_ACQUIRE)) all_loaded = 0;
+	}
+	if (all_loaded) __atomic_store_n(&metadata_loader_finished, 1, __ATOMIC_RELEASE);
+}
+
+static struct lazy_meta_object *lazy_meta_object_for_addr(const void *addr)
+{
+	/* Binary search for the last object beginning at or below addr. */
+	unsigned lo = 0, hi = lazy_meta_nobjects;
+	while (hi - lo > 1)
+	{
+		unsigned mid = lo + (hi - lo) / 2;
+		if (lazy_meta_objects[mid].begin <= (uintptr_t) addr) lo = mid;
+		else hi = mid;
+	}
+	if (lo < lazy_meta_nobjects
+			&& lazy_meta_objects[lo].begin <= (uintptr_t) addr
+			&& (uintptr_t) addr < lazy_meta_objects[lo].end)
+	{
+		return &lazy_meta_objects[lo];
+	}
+	return NULL;
+}
+
+static void start_metadata_prefetch(void);
+
+/* Our caller looked before we got here, and the prefetcher may have loaded
+ * the object since, so for a deferred object we say "look again" whenever
+ * it's loaded now, not only when we loaded it. */
+int __liballocs_load_metadata_on_miss(const void *addr)
+{
+	if (__atomic_load_n(&metadata_loader_finished, __ATOMIC_ACQUIRE)) return 0;
+	/* A fork()ed child gets no prefetcher until it first misses. */
+	if (!__atomic_exchange_n(&metadata_prefetch_started, 1, __ATOMIC_ACQ_REL))
+	{
+		start_metadata_prefetch();
+	}
+	if (!addr)
+	{
+		__atomic_add_fetch(&metadata_nloads_on_miss, 1, __ATOMIC_RELAXED);
+		load_remaining_lazy_meta_objects();
+		return 1;
+	}
+	struct lazy_meta_object *o = lazy_meta_object_for_addr(addr);
+	if (!o) return 0;
+	if (!__atomic_load_n(&o->loaded, __ATOMIC_ACQUIRE))
+	{
+		__atomic_add_fetch(&metadata_nloads_on_miss, 1, __ATOMIC_RELAXED);
+		load_lazy_meta_object(o);
+	}
+	return __atomic_load_n(&o->loaded, __ATOMIC_ACQUIRE);
+}
+
+/* Only for lookups that need a particular object's metadata but don't go
+ * through a miss (see static.c's __lookup_static_allocation_by_name). */
+int __liballocs_ensure_metadata_for_load_addr(ElfW(Addr) load_addr)
+{
+	for (unsigned i = 0; i < lazy_meta_nobjects; ++i)
+	{
+		if (lazy_meta_objects[i].load_addr == load_addr)
+		{
+			return load_lazy_meta_object(&lazy_meta_objects[i]);
+		}
+	}
+	return 0;
+}
+
+static void *metadata_prefetch_main(void *ignored)
+{
+	unsigned long start_ns = monotonic_ns();
+	load_remaining_lazy_meta_objects();
+	metadata_loader_ns = monotonic_ns() - start_ns;
+	debug_printf(2, "finished prefetching deferred metadata\n");
+	return NULL;
+}
+
+static void start_metadata_prefetch(void)
+{
+	if (lazy_meta_nobjects == 0 || metadata_loader_finished)
+	{
+		__atomic_store_n(&metadata_loader_finished, 1, __ATOMIC_RELEASE);
+		return;
+	}
+	/* Signals are for the application's threads, not ours. */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_t t;
+	int ret = pthread_create(&t, NULL, metadata_prefetch_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	/* Without it, lookups still load what they need as they miss. */
+	if (ret != 0)
+	{
+		debug_printf(0, "could not start the metadata prefetch thread\n");
+		return;
+	}
+	pthread_detach(t);
+}
+
+/* Don't fork() while somebody is half-way through loading an object. The
+ * child's copy of the lock is held by a thread the child doesn't have, so
+ * the child gets a fresh one. It gets no prefetcher until it first misses,
+ * because we don't create threads from an atfork handler. */
+static void lock_lazy_meta_for_fork(void)
+{
+	pthread_mutex_lock(&lazy_meta_mutex);
+}
+static void unlock_lazy_meta_after_fork_in_parent(void)
+{
+	pthread_mutex_unlock(&lazy_meta_mutex);
+}
+static void reset_lazy_meta_in_child(void)
+{
+	lazy_meta_mutex = (pthread_mutex_t) PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+	__atomic_store_n(&metadata_prefetch_started, 0, __ATOMIC_RELAXED);
+}
+
 static _Bool check_blacklist(const void *obj)
 {
 #ifndef NO_BLACKLIST
@@ -889,32 +1399,39 @@ static void consider_blacklisting(const void *obj)
 void *__liballocs_main_bp; // beginning of main's stack frame
 
 /* counters */
-unsigned long __liballocs_aborted_stack;
-unsigned long __liballocs_aborted_static;
-unsigned long __liballocs_aborted_unknown_storage;
-unsigned long __liballocs_hit_heap_case;
-unsigned long __liballocs_hit_stack_case;
-unsigned long __liballocs_hit_static_case;
-unsigned long __liballocs_aborted_unindexed_heap;
-unsigned long __liballocs_aborted_unrecognised_allocsite;
 
 static void print_exit_summary(void)
 {
-	if (__liballocs_aborted_unknown_storage + __liballocs_hit_static_case + __liballocs_hit_stack_case
-			 + __liballocs_hit_heap_case > 0)
+	struct liballocs_stats stats;
+	__liballocs_get_stats(&stats);
+	for (unsigned i = 0; i < stats.nallocators; ++i)
+	{
+		if (i == 0) fprintf(stream_err, "queries by allocator%s:\n", __liballocs_query_latency_enabled
+				? " (and per log2-ns latency bucket)" : "");
+		fprintf(stream_err, "%-20s %9lu:", stats.by_allocator[i].allocator_name,
+				stats.by_allocator[i].nqueries);
+		for (unsigned j = 0; j < LIBALLOCS_LATENCY_NBUCKETS; ++j)
+		{
+			if (stats.by_allocator[i].ns_log2[j]) fprintf(stream_err, " %u:%lu", j,
+					stats.by_allocator[i].ns_log2[j]);
+		}
+		fprintf(stream_err, "\n");
+	}
+	if (stats.aborted_unknown_storage + stats.hit_static_case + stats.hit_stack_case
+			 + stats.hit_heap_case > 0)
 	{
 		fprintf(stream_err, "====================================================\n");
 		fprintf(stream_err, "liballocs summary: \n");
 		fprintf(stream_err, "----------------------------------------------------\n");
-		fprintf(stream_err, "queries aborted for unknown storage:       % 9ld\n", __liballocs_aborted_unknown_storage);
-		fprintf(stream_err, "queries handled by static case:            % 9ld\n", __liballocs_hit_static_case);
-		fprintf(stream_err, "queries handled by stack case:             % 9ld\n", __liballocs_hit_stack_case);
-		fprintf(stream_err, "queries handled by heap case:              % 9ld\n", __liballocs_hit_heap_case);
+		fprintf(stream_err, "queries aborted for unknown storage:       % 9ld\n", stats.aborted_unknown_storage);
+		fprintf(stream_err, "queries handled by static case:            % 9ld\n", stats.hit_static_case);
+		fprintf(stream_err, "queries handled by stack case:             % 9ld\n", stats.hit_stack_case);
+		fprintf(stream_err, "queries handled by heap case:              % 9ld\n", stats.hit_heap_case);
 		fprintf(stream_err, "----------------------------------------------------\n");
-		fprintf(stream_err, "queries aborted for unindexed heap:        % 9ld\n", __liballocs_aborted_unindexed_heap);
-		fprintf(stream_err, "queries aborted for unknown heap allocsite:% 9ld\n", __liballocs_aborted_unrecognised_allocsite);
-		fprintf(stream_err, "queries aborted for unknown stackframes:   % 9ld\n", __liballocs_aborted_stack);
-		fprintf(stream_err, "queries aborted for unknown static obj:    % 9ld\n", __liballocs_aborted_static);
+		fprintf(stream_err, "queries aborted for unindexed heap:        % 9ld\n", stats.aborted_unindexed_heap);
+		fprintf(stream_err, "queries aborted for unknown heap allocsite:% 9ld\n", stats.aborted_unrecognised_allocsite);
+		fprintf(stream_err, "queries aborted for unknown stackframes:   % 9ld\n", stats.aborted_stack);
+		fprintf(stream_err, "queries aborted for unknown static obj:    % 9ld\n", stats.aborted_static);
 		fprintf(stream_err, "====================================================\n");
 		for (unsigned i = 0; i < __liballocs_unrecognised_heap_alloc_sites.count; ++i)
 		{
@@ -926,7 +1443,58 @@ static void print_exit_summary(void)
 					format_symbolic_address(__liballocs_unrecognised_heap_alloc_sites.addrs[i]));
 		}
 	}
-	
+
+	struct liballocs_array_type_stats array_stats;
+	if (__liballocs_get_array_type_stats) __liballocs_get_array_type_stats(&array_stats);
+	if (__liballocs_get_array_type_stats && array_stats.nmisses > 0 && __liballocs_debug_level >= 1)
+	{
+		fprintf(stream_err, "synthesised array types: %lu in table (of %lu slots), "
+				"%lu created, %lu after the table filled; %lu hits, %lu misses, %lu races lost\n",
+				array_stats.nentries, array_stats.table_nslots,
+				array_stats.ncreated, array_stats.noverflow,
+				array_stats.nhits, array_stats.nmisses, array_stats.nraces_lost);
+	}
+
+	if (__liballocs_debug_level >= 1)
+	{
+		struct rusage ru;
+		getrusage(RUSAGE_SELF, &ru);
+		fprintf(stream_err, "metadata: %lu objects loaded, %lu of them lazily (of %u deferred), "
+				"%lu.%06lu ms loading lazily, prefetcher %s (%lu.%06lu ms), "
+				"%lu loads on a lookup miss; global init took %lu.%06lu ms, "
+				"max RSS %ld kB after init, %ld kB at exit\n",
+				metadata_nobjects_loaded, metadata_nobjects_loaded_lazily, lazy_meta_nobjects,
+				metadata_lazy_load_ns / 1000000, metadata_lazy_load_ns % 1000000,
+				__atomic_load_n(&metadata_loader_finished, __ATOMIC_ACQUIRE) ? "finished" : "still running",
+				metadata_loader_ns / 1000000, metadata_loader_ns % 1000000,
+				metadata_nloads_on_miss,
+				global_init_ns / 1000000, global_init_ns % 1000000,
+				global_init_maxrss_kb, ru.ru_maxrss);
+		unsigned ntypedbs;
+		unsigned long typedb_bytes, typedb_lookups;
+		__liballocs_typedb_get_stats(&ntypedbs, &typedb_bytes, &typedb_lookups);
+		unsigned nshared_attached, nshared_built;
+		__liballocs_shared_allocsites_get_stats(&nshared_attached, &nshared_built);
+		if (nshared_attached > 0)
+		{
+			fprintf(stream_err, "shared allocsites cache: %u tables attached, %u of them built by us\n",
+					nshared_attached, nshared_built);
+		}
+		if (ntypedbs > 0)
+		{
+			fprintf(stream_err, "type databases: %u mapped (%lu bytes), "
+					"%lu typestr lookups resolved through them\n",
+					ntypedbs, typedb_bytes, typedb_lookups);
+		}
+		unsigned long nmunmaps, nmunmap_spans;
+		__mmap_allocator_get_munmap_stats(&nmunmaps, &nmunmap_spans);
+		if (nmunmaps > 0)
+		{
+			fprintf(stream_err, "munmap notifications: %lu, coalesced into %lu index updates\n",
+					nmunmaps, nmunmap_spans);
+		}
+	}
+
 	if (getenv("LIBALLOCS_DUMP_SMAPS_AT_EXIT"))
 	{
 		char buffer[4096];
@@ -1002,6 +1570,9 @@ void *__notify_copy(void *dest, const void *src, unsigned long n)
 	/* We do nothing here. But libcrunch will wrap us. */
 	return dest;
 }
+/* So that the memcpy resolver can tell whether anyone has. */
+void *__liballocs_nop_notify_copy(void *dest, const void *src, unsigned long n)
+	__attribute__((alias("__notify_copy"), visibility("hidden")));
 
 /* These have hidden visibility */
 struct uniqtype *pointer_to___uniqtype__void;
@@ -1029,6 +1600,7 @@ int __liballocs_global_init(void)
 	static _Bool trying_to_initialize;
 	if (trying_to_initialize) return 0;
 	trying_to_initialize = 1;
+	unsigned long init_start_ns = monotonic_ns();
 	
 	// print a summary when the program exits
 	atexit(print_exit_summary);
@@ -1099,7 +1671,9 @@ int __liballocs_global_init(void)
 	if (__liballocs_allocsmt == MAP_FAILED) abort();
 	debug_printf(3, "allocsmt at %p\n", __liballocs_allocsmt);
 #endif
-	int ret_hook = dl_iterate_phdr(load_and_init_all_metadata_for_one_object, NULL);
+	_Bool eager_metadata = (getenv("LIBALLOCS_EAGER_METADATA") != NULL);
+	int ret_hook = dl_iterate_phdr(eager_metadata ?
+		load_and_init_all_metadata_for_one_object : register_one_object_for_lazy_metadata, NULL);
 	
 	/* Don't do this. They all have constructors, so it's not necessary.
 	 * Moreover, the mmap allocator's constructor 
@@ -1118,6 +1692,20 @@ int __liballocs_global_init(void)
 	trying_to_initialize = 0;
 	__liballocs_is_initialized = 1;
 
+	global_init_ns = monotonic_ns() - init_start_ns;
+	if (!eager_metadata)
+	{
+		pthread_atfork(lock_lazy_meta_for_fork, unlock_lazy_meta_after_fork_in_parent,
+			reset_lazy_meta_in_child);
+		if (!__atomic_exchange_n(&metadata_prefetch_started, 1, __ATOMIC_ACQ_REL))
+		{
+			start_metadata_prefetch();
+		}
+	}
+	else __atomic_store_n(&metadata_loader_finished, 1, __ATOMIC_RELEASE);
+	struct rusage ru;
+	if (0 == getrusage(RUSAGE_SELF, &ru)) global_init_maxrss_kb = ru.ru_maxrss;
+
 	debug_printf(1, "liballocs successfully initialized\n");
 	
 	return 0;
@@ -1283,7 +1871,15 @@ const void *__liballocs_typestr_to_uniqtype(const char *typestr)
 }	
 static const void *typestr_to_uniqtype_from_lib(void *handle, const char *typestr)
 {
-	void *returned = dlsym(RTLD_DEFAULT, typestr);
+	void *returned = __liballocs_typestr_index_lookup(typestr);
+	if (returned) return returned;
+	returned = dlsym(RTLD_DEFAULT, typestr);
+	/* The type might live in a types object we haven't loaded yet. */
+	if (!returned && __liballocs_load_metadata_on_miss(NULL))
+	{
+		returned = __liballocs_typestr_index_lookup(typestr);
+		if (!returned) returned = dlsym(RTLD_DEFAULT, typestr);
+	}
 	if (!returned) return NULL;
 
 	return (struct uniqtype *) returned;
@@ -1297,7 +1893,7 @@ liballocs_err_t extract_and_output_alloc_site_and_type(
 {
 	if (!p_ins)
 	{
-		++__liballocs_aborted_unindexed_heap;
+		count_query(QUERY_ABORTED_UNINDEXED_HEAP);
 		return &__liballocs_err_unindexed_heap_object;
 	}
 	void *alloc_site_addr = (void *) ((uintptr_t) p_ins->alloc_site);
@@ -1348,9 +1944,9 @@ liballocs_err_t extract_and_output_alloc_site_and_type(
 	{
 		//if (__builtin_expect(k == HEAP, 1))
 		//{
-			++__liballocs_aborted_unrecognised_allocsite;
+			count_query(QUERY_ABORTED_UNRECOGNISED_ALLOCSITE);
 		//}
-		//else ++__liballocs_aborted_stack;
+		//else count_query(QUERY_ABORTED_STACK);
 			
 		/* We used to do this in clear_alloc_site_metadata in libcrunch... 
 		 * In cases where heap classification failed, we null out the allocsite 
@@ -1378,6 +1974,88 @@ liballocs_err_t extract_and_output_alloc_site_and_type(
 	return NULL;
 }
 
+/* As above, but only from what's already loaded, and without counting
+ * anything or rewriting the insert. */
+liballocs_err_t extract_alloc_site_and_type_signal_safe(
+    struct insert *p_ins,
+    struct uniqtype **out_type,
+    void **out_site
+)
+{
+	uintptr_t alloc_site = p_ins->alloc_site;
+	if (__builtin_expect(p_ins->alloc_site_flag, 1))
+	{
+		if (out_site) *out_site = NULL;
+		if (!(alloc_site & ~0x1ul)) return &__liballocs_err_unrecognised_alloc_site;
+		if (out_type) *out_type = (struct uniqtype *)(alloc_site & ~0x1ul);
+		return NULL;
+	}
+	if (out_site) *out_site = (void*) alloc_site;
+	struct uniqtype *found = NULL;
+	if (alloc_site && !__liballocs_prechained_allocsite_lookup((void*) alloc_site, &found)
+			&& __liballocs_allocsmt)
+	{
+		/* The loader publishes each bucket's head with a release store. */
+		for (struct allocsite_entry *p = __atomic_load_n(ALLOCSMT_FUN(ADDR, (void*) alloc_site),
+					__ATOMIC_ACQUIRE);
+				p; p = (struct allocsite_entry *) p->next)
+		{
+			if (p->allocsite == (void*) alloc_site) { found = p->uniqtype; break; }
+		}
+	}
+	if (!found) return &__liballocs_err_unrecognised_alloc_site;
+	if (out_type) *out_type = found;
+	return NULL;
+}
+
+struct liballocs_err *__liballocs_get_alloc_info_signal_safe(const void *obj, 
+	struct allocator **out_allocator, const void **out_alloc_start,
+	unsigned long *out_alloc_size_bytes,
+	struct uniqtype **out_alloc_uniqtype, const void **out_alloc_site)
+{
+	if (!pageindex) return &__liballocs_err_object_of_unknown_storage;
+	unsigned long seq = index_seq_read_begin(&__liballocs_pageindex_seq);
+	if (seq & 1) return &__liballocs_err_retry;
+	/* Pages awaiting a deferred munmap are gone, though still indexed. */
+	if ((char*) obj >= (char*) __mmap_allocator_pending_unmap.begin
+			&& (char*) obj < (char*) __mmap_allocator_pending_unmap.end)
+	{
+		return &__liballocs_err_object_of_unknown_storage;
+	}
+	/* Walk down as in __liballocs_leaf_allocator_for, but without flushing,
+	 * and bounded, since a concurrent writer can leave the sibling lists
+	 * briefly inconsistent. */
+	struct big_allocation *deepest = NULL;
+	bigalloc_num_t num = pageindex[PAGENUM(obj)];
+	unsigned nsteps = 0;
+	for (struct big_allocation *cur = num ? &big_allocations[num] : NULL; cur; )
+	{
+		deepest = cur;
+		for (struct big_allocation *child = cur->first_child; child; child = child->next_sib)
+		{
+			if (++nsteps > NBIGALLOCS) return &__liballocs_err_retry;
+			if ((char*) child->begin <= (char*) obj && (char*) child->end > (char*) obj)
+			{
+				cur = child;
+				break;
+			}
+		}
+		if (cur == deepest) cur = NULL;
+	}
+	liballocs_err_t err;
+	struct allocator *a = !deepest ? NULL
+		: deepest->suballocator ? deepest->suballocator : deepest->allocated_by;
+	struct big_allocation *maybe_the_allocation = (deepest && !deepest->suballocator)
+		? deepest : NULL;
+	if (!a) err = &__liballocs_err_object_of_unknown_storage;
+	else if (!a->get_info_signal_safe) err = &__liballocs_err_not_signal_safe;
+	else err = a->get_info_signal_safe((void*) obj, maybe_the_allocation, out_alloc_uniqtype,
+			(void**) out_alloc_start, out_alloc_size_bytes, out_alloc_site);
+	if (index_seq_read_changed(&__liballocs_pageindex_seq, seq)) return &__liballocs_err_retry;
+	if (out_allocator) *out_allocator = a;
+	return err;
+}
+
 extern inline _Bool 
 (__attribute__((gnu_inline)) __liballocs_find_matching_subobject)(signed target_offset_within_uniqtype,
 	struct uniqtype *cur_obj_uniqtype, struct uniqtype *test_uniqtype, 
@@ -1500,6 +2178,10 @@ __liballocs_make_array_precise_with_memory_bounds(struct uniqtype *in,
    void *obj, void *memrange_base, unsigned long memrange_sz, void *ip, struct mcontext *ctxt);
 
 /* Instantiate inlines from liballocs.h. */
+extern inline struct liballocs_err *__liballocs_get_alloc_info_untimed(const void *obj, 
+	struct allocator **out_allocator, const void **out_alloc_start,
+	unsigned long *out_alloc_size_bytes,
+	struct uniqtype **out_alloc_uniqtype, const void **out_alloc_site);
 extern inline struct liballocs_err *__liballocs_get_alloc_info(const void *obj, 
 	struct allocator **out_allocator, const void **out_alloc_start,
 	unsigned long *out_alloc_size_bytes,
@@ -70,7 +70,57 @@ extern _Bool __thread __private_malloc_usable_size_active __attribute__((visibil
 // void *__private_malloc(size_t);
 // void __private_free(void *);
 void *__wrap_dlmalloc(size_t);
+void *__wrap_dlcalloc(size_t, size_t);
 void __wrap_dlfree(void *);
+void *__wrap_dlrealloc(void *, size_t);
+
+/* The bounds of the current thread's stack, if we know them. Threads made
+ * by our pthread_create() wrapper have them filled in from the start. */
+struct thread_stack_bounds
+{
+	char *begin;
+	char *end;
+	_Bool looked_up;
+	_Bool has_bigalloc; /* we registered [begin, end) as a stack bigalloc */
+};
+extern __thread struct thread_stack_bounds __stack_allocator_thread_stack __attribute__((visibility("hidden")));
+
+/* A sequence count for an index that signal-safe queries read without its
+ * lock (see __liballocs_get_alloc_info_signal_safe). Writers make it odd
+ * while they're changing the index, counting only the outermost level of
+ * their (recursive) lock; readers retry if it's odd or has moved. */
+struct index_seq
+{
+	unsigned long seq;
+	unsigned depth; /* only touched under the index's lock */
+};
+extern struct index_seq __liballocs_pageindex_seq __attribute__((visibility("hidden")));
+void __liballocs_pageindex_lock(void) __attribute__((visibility("hidden")));
+void __liballocs_pageindex_unlock(void) __attribute__((visibility("hidden")));
+unsigned __liballocs_nbigallocs_free(void) __attribute__((visibility("hidden")));
+static inline void index_seq_begin_write(struct index_seq *s)
+{
+	if (s->depth++ == 0)
+	{
+		__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+}
+static inline void index_seq_end_write(struct index_seq *s)
+{
+	if (--s->depth == 0) __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+static inline unsigned long index_seq_read_begin(struct index_seq *s)
+{
+	return __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+}
+static inline _Bool index_seq_read_changed(struct index_seq *s, unsigned long begun)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return (begun & 1) || __atomic_load_n(&s->seq, __ATOMIC_RELAXED) != begun;
+}
+liballocs_err_t extract_alloc_site_and_type_signal_safe(struct insert *p_ins,
+	struct uniqtype **out_type, void **out_site) __attribute__((visibility("hidden")));
 
 extern FILE *stream_err;
 #define debug_printf(lvl, fmt, ...) do { \
@@ -118,15 +168,75 @@ void __assert_fail(const char *assertion,
 void warnx(const char *fmt, ...);
 unsigned long malloc_usable_size (void *ptr);
 
-/* counters */
-extern unsigned long __liballocs_aborted_stack;
-extern unsigned long __liballocs_aborted_static;
-extern unsigned long __liballocs_aborted_unknown_storage;
-extern unsigned long __liballocs_hit_heap_case;
-extern unsigned long __liballocs_hit_stack_case;
-extern unsigned long __liballocs_hit_static_case;
-extern unsigned long __liballocs_aborted_unindexed_heap;
-extern unsigned long __liballocs_aborted_unrecognised_allocsite;
+/* counters (per-thread; see query-stats.c) */
+enum query_counter
+{
+	QUERY_ABORTED_STACK,
+	QUERY_ABORTED_STATIC,
+	QUERY_ABORTED_UNKNOWN_STORAGE,
+	QUERY_HIT_HEAP_CASE,
+	QUERY_HIT_STACK_CASE,
+	QUERY_HIT_STATIC_CASE,
+	QUERY_ABORTED_UNINDEXED_HEAP,
+	QUERY_ABORTED_UNRECOGNISED_ALLOCSITE,
+	QUERY_LOOKUP_CACHE_HIT,
+	QUERY_LOOKUP_CACHE_MISS,
+	NQUERY_COUNTERS
+};
+#define QUERY_STATS_ALIGN 64 /* a cache line */
+struct query_stats_block
+{
+	unsigned long counters[NQUERY_COUNTERS];
+	unsigned long nqueries[LIBALLOCS_STATS_MAX_ALLOCATORS];
+	unsigned long latency[LIBALLOCS_STATS_MAX_ALLOCATORS][LIBALLOCS_LATENCY_NBUCKETS];
+	struct allocator *last_allocator; /* ... and its slot, so we rarely search */
+	int last_allocator_slot;
+	struct query_stats_block *next;
+	void *raw; /* as allocated, before aligning */
+} __attribute__((aligned(QUERY_STATS_ALIGN)));
+extern __thread struct query_stats_block *__liballocs_thread_query_stats __attribute__((visibility("hidden")));
+struct query_stats_block *__liballocs_register_thread_query_stats(void) __attribute__((visibility("hidden")));
+int __liballocs_allocator_stats_slot(struct allocator *a) __attribute__((visibility("hidden")));
+static inline void count_query(enum query_counter which)
+{
+	struct query_stats_block *b = __liballocs_thread_query_stats;
+	if (__builtin_expect(!b, 0)) b = __liballocs_register_thread_query_stats();
+	__atomic_store_n(&b->counters[which], b->counters[which] + 1, __ATOMIC_RELAXED);
+}
+/* Each allocator's get_info calls this with its own allocator. */
+static inline void count_allocator_query(struct allocator *a)
+{
+	struct query_stats_block *b = __liballocs_thread_query_stats;
+	if (__builtin_expect(!b, 0)) b = __liballocs_register_thread_query_stats();
+	if (__builtin_expect(b->last_allocator != a, 0))
+	{
+		b->last_allocator_slot = __liballocs_allocator_stats_slot(a);
+		b->last_allocator = a;
+	}
+	int slot = b->last_allocator_slot;
+	if (slot != -1) __atomic_store_n(&b->nqueries[slot], b->nqueries[slot] + 1, __ATOMIC_RELAXED);
+}
+
+/* heap census (per-thread deltas; see heap-census.c) */
+#define CENSUS_KEY_IS_TYPE (1ul<<63)
+static inline uintptr_t census_key(const struct insert *ins)
+{
+	/* A rewritten insert holds a uniqtype, maybe with libcrunch's low bit. */
+	return ins->alloc_site_flag ? ((ins->alloc_site & ~0x1ul) | CENSUS_KEY_IS_TYPE)
+		: (uintptr_t) ins->alloc_site;
+}
+extern _Bool __liballocs_heap_census_enabled __attribute__((visibility("hidden")));
+void __liballocs_heap_census_add(uintptr_t key, long nobjects, long nbytes) __attribute__((visibility("hidden")));
+
+/* binary event trace (see event-trace.c and include/eventtrace.h) */
+extern _Bool __liballocs_trace_enabled __attribute__((visibility("hidden")));
+struct trace_ring;
+extern __thread struct trace_ring *__liballocs_trace_thread_ring __attribute__((visibility("hidden")));
+unsigned long __liballocs_trace_now(void) __attribute__((visibility("hidden")));
+void __liballocs_trace_event(unsigned kind, const void *addr, unsigned long size,
+	const void *site, unsigned long begin_ns) __attribute__((visibility("hidden")));
+void __liballocs_trace_thread_start(void) __attribute__((visibility("hidden")));
+void __liballocs_trace_note_dropped(void) __attribute__((visibility("hidden")));
 
 /* We're allowed to malloc, thanks to __private_malloc(), but we 
  * we shouldn't call strdup because libc will do the malloc. */
@@ -136,6 +246,8 @@ char *__liballocs_private_strndup(const char *s, size_t n) __attribute__((visibi
 /* Our handling of mmap is in two phases: before systrapping enabled,
  * and after. */
 extern _Bool __liballocs_systrap_is_initialized;
+/* Set if the systrap uses its seccomp backend, which owns SIGSYS. */
+extern _Bool __liballocs_systrap_seccomp_active;
 void __liballocs_post_systrap_init(void) __attribute__((visibility("hidden")));
 
 /* If this weak function is defined, it will be called when we've loaded
@@ -148,6 +260,50 @@ struct object_metadata
 int __hook_loaded_one_object_meta(struct dl_phdr_info *info, size_t size, void *object_metadata) __attribute__((weak));
 int load_and_init_all_metadata_for_one_object(struct dl_phdr_info *info, size_t size, void *data)
 	__attribute__((visibility("hidden")));
+int __liballocs_ensure_metadata_for_load_addr(ElfW(Addr) load_addr) __attribute__((visibility("hidden")));
+void __liballocs_typedb_register_object(const char *db_path, ElfW(Addr) load_addr,
+	void *types_handle) __attribute__((visibility("hidden")));
+void __liballocs_typedb_notify_unload(ElfW(Addr) l_addr) __attribute__((visibility("hidden")));
+const char *__liballocs_typedb_loaded_symbol_name(const struct uniqtype *u) __attribute__((visibility("hidden")));
+void __liballocs_typedb_get_stats(unsigned *out_nobjects, unsigned long *out_nbytes_mapped,
+	unsigned long *out_nlookups) __attribute__((visibility("hidden")));
+/* An allocsites index mapped from the shared cache (allocsites-cache.c).
+ * Its table has no uniqtypes; site i's type is types[type_indices[i]].
+ * For frame tables, extras[i] is the site's offset_from_frame_base. */
+enum shared_allocsites_kind
+{
+	SHARED_ALLOCSITES,
+	SHARED_FRAMES,
+	SHARED_STATICS,
+	SHARED_NKINDS
+};
+struct shared_allocsites
+{
+	struct allocsites_table table;
+	const unsigned *type_indices;
+	struct uniqtype **types;
+	const unsigned *extras;
+};
+int __liballocs_shared_allocsites_attach(const char *meta_name, unsigned kind,
+	const void *first_entry, struct shared_allocsites *out) __attribute__((visibility("hidden")));
+/* Look up the cached frame or static site at or below addr, no further than
+ * max_distance below. Returns 0 if there's none, so callers try the allocsmt. */
+int __liballocs_prechained_range_lookup(unsigned kind, const void *addr,
+	unsigned long max_distance, struct uniqtype **out_type, void **out_start,
+	unsigned *out_extra) __attribute__((visibility("hidden")));
+_Bool __liballocs_statics_are_prechained(ElfW(Addr) load_addr) __attribute__((visibility("hidden")));
+void __liballocs_shared_allocsites_get_stats(unsigned *out_nattached, unsigned *out_nbuilt) __attribute__((visibility("hidden")));
+void __mmap_allocator_get_munmap_stats(unsigned long *out_notified, unsigned long *out_flushed) __attribute__((visibility("hidden")));
+unsigned long __generic_malloc_allocator_nindexed_chunks(void) __attribute__((visibility("hidden")));
+void __liballocs_typestr_index_add_object(void *types_handle) __attribute__((visibility("hidden")));
+void __liballocs_typestr_index_remove_object(const void *types_handle) __attribute__((visibility("hidden")));
+struct uniqtype *__liballocs_typestr_index_lookup(const char *name) __attribute__((visibility("hidden")));
+void __liballocs_dladdr_index_notify_load(void) __attribute__((visibility("hidden")));
+void __liballocs_dladdr_index_remove(struct link_map *l) __attribute__((visibility("hidden")));
+int __liballocs_dladdr_index_lookup(const void *addr, Dl_info *info,
+	struct link_map **out_l, const ElfW(Sym) **out_sym) __attribute__((visibility("hidden")));
+void __liballocs_uniqtype_ptrmaps_notify_unload(const void *begin, const void *end) __attribute__((visibility("hidden")));
+void __liballocs_dladdr_cache_invalidate(void) __attribute__((visibility("hidden")));
 
 void *__notify_copy(void *dest, const void *src, unsigned long n);
 
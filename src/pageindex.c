@@ -8,6 +8,7 @@
 #include "relf.h"
 #include "liballocs_private.h"
 #include "raw-syscalls.h"
+#include "eventtrace.h"
 
 #ifndef NO_PTHREADS
 #include <pthread.h>
@@ -23,6 +24,30 @@ static pthread_mutex_t mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 #define BIG_LOCK
 #define BIG_UNLOCK
 #endif
+/* Anything that changes the index also bumps its sequence count. */
+#define BIG_LOCK_FOR_WRITE \
+	BIG_LOCK \
+	index_seq_begin_write(&__liballocs_pageindex_seq);
+#define BIG_UNLOCK_FOR_WRITE \
+	index_seq_end_write(&__liballocs_pageindex_seq); \
+	BIG_UNLOCK
+struct index_seq __liballocs_pageindex_seq;
+
+/* For metadata that hangs off a bigalloc and is changed along with it,
+ * like the mmap allocator's mapping sequences. Take any allocator-private
+ * lock first: flushing pending unmaps takes the mmap allocator's, then ours. */
+void __liballocs_pageindex_lock(void) __attribute__((visibility("hidden")));
+void __liballocs_pageindex_lock(void)
+{
+	int lock_ret;
+	BIG_LOCK
+}
+void __liballocs_pageindex_unlock(void) __attribute__((visibility("hidden")));
+void __liballocs_pageindex_unlock(void)
+{
+	int lock_ret;
+	BIG_UNLOCK
+}
 
 /* How many big allocs? 256 is a bit stingy. 
  * Each bigalloc record is 48--64 bytes, so 4096 of them would take 256KB.
@@ -187,8 +212,18 @@ static _Bool path_is_realpath(const char *path)
 	return 0 == strcmp(path, rp);
 }
 
+/* How many of big_allocations are in use; changed only under the lock. */
+static unsigned nbigallocs_in_use;
+unsigned __liballocs_nbigallocs_free(void) __attribute__((visibility("hidden")));
+unsigned __liballocs_nbigallocs_free(void)
+{
+	/* We never use big_allocations[0]. */
+	return NBIGALLOCS - 1 - __atomic_load_n(&nbigallocs_in_use, __ATOMIC_RELAXED);
+}
+
 static void clear_bigalloc_nomemset(struct big_allocation *b)
 {
+	if (BIGALLOC_IN_USE(b)) __atomic_store_n(&nbigallocs_in_use, nbigallocs_in_use - 1, __ATOMIC_RELAXED);
 	b->begin = b->end = NULL;
 }
 static void clear_bigalloc(struct big_allocation *b)
@@ -314,6 +349,7 @@ void __liballocs_print_l0_to_stream_err(void)
 
 void __liballocs_report_wild_address(const void *ptr)
 {
+	count_query(QUERY_ABORTED_UNKNOWN_STORAGE);
 	if (ROUND_DOWN_PTR(ptr, PAGE_SIZE) == 0
 			|| ROUND_UP_PTR(ptr, PAGE_SIZE) == 0)
 	{
@@ -327,6 +363,20 @@ void __liballocs_report_wild_address(const void *ptr)
 	}
 }
 
+#define TRACE_BEGIN() \
+	(__liballocs_trace_enabled ? __liballocs_trace_now() : 0)
+/* We may be in the mmap trap handler, where making a trace ring (with
+ * mmap()) is a bad idea, so we don't make one here. Every thread gets one
+ * when it starts (see event-trace.c), so this only drops events from a
+ * thread whose ring is already gone, i.e. one that is exiting. Those we
+ * count in the trace file's ndropped. */
+static void trace_bigalloc_event(unsigned kind, const void *addr, unsigned long size,
+	unsigned long begin_ns)
+{
+	if (__liballocs_trace_thread_ring) __liballocs_trace_event(kind, addr, size, NULL, begin_ns);
+	else __liballocs_trace_note_dropped();
+}
+
 static struct big_allocation *get_common_parent_bigalloc(const void *ptr, const void *end);
 static struct big_allocation *bigalloc_new(const void *ptr, size_t size, struct big_allocation *parent, 
 	struct meta_info meta, struct allocator *allocated_by);
@@ -340,8 +390,9 @@ struct big_allocation *__liballocs_new_bigalloc(const void *ptr, size_t size, st
 	 * it out in get_alloc_info. */
 	if (!pageindex) init();
 	// write_string("BlahA001\n");
+	unsigned long begin_ns = TRACE_BEGIN();
 	int lock_ret;
-	BIG_LOCK
+	BIG_LOCK_FOR_WRITE
 	
 	char *chunk_lastbyte = (char*) ptr + size - 1;
 	if (size > BIGGEST_SANE_USER_ALLOC) 
@@ -384,7 +435,8 @@ struct big_allocation *__liballocs_new_bigalloc(const void *ptr, size_t size, st
 	// write_string("BlahA006\n");
 	struct big_allocation *b = bigalloc_new(ptr, size, parent, meta, allocated_by);
 	
-	BIG_UNLOCK
+	BIG_UNLOCK_FOR_WRITE
+	if (begin_ns) trace_bigalloc_event(EVENTTRACE_BIGALLOC_NEW, ptr, size, begin_ns);
 	return b;
 }
 
@@ -405,6 +457,7 @@ static void bigalloc_init_nomemset(struct big_allocation *b, const void *ptr, si
 	struct meta_info meta, struct allocator *allocated_by, struct allocator *suballocator,
 	void *suballocator_meta, void (*suballocator_free_func)(void*))
 {
+	if (!BIGALLOC_IN_USE(b)) __atomic_store_n(&nbigallocs_in_use, nbigallocs_in_use + 1, __ATOMIC_RELAXED);
 	b->begin = (void*) ptr;
 	b->end = (char*) ptr + size;
 	b->meta = meta;
@@ -460,7 +513,7 @@ _Bool __liballocs_extend_bigalloc(struct big_allocation *b, const void *new_end)
 {
 	if (!pageindex) init();
 	int lock_ret;
-	BIG_LOCK
+	BIG_LOCK_FOR_WRITE
 	const void *old_end = b->end;
 	b->end = (void*) new_end;
 	bigalloc_num_t parent_num = b->parent ? b->parent - &big_allocations[0] : 0;
@@ -474,7 +527,7 @@ _Bool __liballocs_extend_bigalloc(struct big_allocation *b, const void *new_end)
 	
 	SANITY_CHECK_BIGALLOC(b);
 	
-	BIG_UNLOCK
+	BIG_UNLOCK_FOR_WRITE
 	return 1;
 }
 
@@ -501,7 +554,7 @@ _Bool __liballocs_pre_extend_bigalloc(struct big_allocation *b, const void *new_
 {
 	if (!pageindex) init();
 	int lock_ret;
-	BIG_LOCK
+	BIG_LOCK_FOR_WRITE
 	const void *old_begin = b->begin;
 	b->begin = (void*) new_begin;
 	bigalloc_num_t parent_num = b->parent ? b->parent - &big_allocations[0] : 0;
@@ -524,7 +577,7 @@ _Bool __liballocs_pre_extend_bigalloc(struct big_allocation *b, const void *new_
 	
 	SANITY_CHECK_BIGALLOC(b);
 	
-	BIG_UNLOCK
+	BIG_UNLOCK_FOR_WRITE
 	return 1;
 }
 
@@ -550,10 +603,10 @@ _Bool __liballocs_truncate_bigalloc_at_end(struct big_allocation *b, const void
 {
 	if (!pageindex) init();
 	int lock_ret;
-	BIG_LOCK
+	BIG_LOCK_FOR_WRITE
 	_Bool ret = bigalloc_truncate_at_end(b, new_end);
 	SANITY_CHECK_BIGALLOC(b);
-	BIG_UNLOCK
+	BIG_UNLOCK_FOR_WRITE
 	return ret;
 }
 
@@ -561,7 +614,7 @@ _Bool __liballocs_truncate_bigalloc_at_beginning(struct big_allocation *b, const
 {
 	if (!pageindex) init();
 	int lock_ret;
-	BIG_LOCK
+	BIG_LOCK_FOR_WRITE
 	const void *old_begin = b->begin;
 	b->begin = (void*) new_begin;
 	bigalloc_num_t parent_num = b->parent ? b->parent - &big_allocations[0] : 0;
@@ -573,7 +626,7 @@ _Bool __liballocs_truncate_bigalloc_at_beginning(struct big_allocation *b, const
 			          ROUND_UP((unsigned long) new_begin, PAGE_SIZE))
 	);
 	SANITY_CHECK_BIGALLOC(b);
-	BIG_UNLOCK
+	BIG_UNLOCK_FOR_WRITE
 	return 1;
 }
 
@@ -581,7 +634,7 @@ struct big_allocation *__liballocs_split_bigalloc_at_page_boundary(struct big_al
 {
 	if (!pageindex) init();
 	int lock_ret;
-	BIG_LOCK
+	BIG_LOCK_FOR_WRITE
 	struct big_allocation tmp = *b;
 	
 	/* Partition the children between the two halves. It's an error
@@ -636,7 +689,7 @@ struct big_allocation *__liballocs_split_bigalloc_at_page_boundary(struct big_al
 	}
 	SANITY_CHECK_BIGALLOC(b);
 	SANITY_CHECK_BIGALLOC(new_bigalloc);
-	BIG_UNLOCK
+	BIG_UNLOCK_FOR_WRITE
 	return new_bigalloc;
 }
 
@@ -699,27 +752,46 @@ static struct big_allocation *find_deepest_bigalloc_recursive(struct big_allocat
 	return start;
 }
 
+/* Call with the lock held. Only the stack allocator gets asked about an
+ * unindexed address here: the mmap allocator's lock comes before ours, so
+ * it gets asked by lookup_deepest_bigalloc_or_resync, with ours dropped. */
 static struct big_allocation *find_deepest_bigalloc(const void *addr)
 {
 	bigalloc_num_t start_idx = pageindex[PAGENUM(addr)];
 	if (unlikely(start_idx == 0))
 	{
-		__liballocs_notify_unindexed_address(addr);
+		__stack_allocator_notify_unindexed_address(addr);
 		start_idx = pageindex[PAGENUM(addr)];
 		if (start_idx == 0) return NULL;
 	}
 	return find_deepest_bigalloc_recursive(&big_allocations[start_idx], addr);
 }
 
+static struct big_allocation *lookup_deepest_bigalloc_or_resync(const void *mem)
+{
+	int lock_ret;
+	BIG_LOCK
+	struct big_allocation *b = find_deepest_bigalloc(mem);
+	BIG_UNLOCK
+	if (!b && __mmap_allocator_notify_unindexed_address(mem))
+	{
+		BIG_LOCK
+		b = find_deepest_bigalloc(mem);
+		BIG_UNLOCK
+	}
+	return b;
+}
+
 _Bool __liballocs_delete_bigalloc_at(const void *begin, struct allocator *a) __attribute__((visibility("hidden")));
 _Bool __liballocs_delete_bigalloc_at(const void *begin, struct allocator *a)
 {
 	if (!pageindex) init();
+	unsigned long begin_ns = TRACE_BEGIN();
 	int lock_ret;
-	BIG_LOCK
+	BIG_LOCK_FOR_WRITE
 	
 	struct big_allocation *b = find_bigalloc(begin, a);
-	if (!b) { BIG_UNLOCK; return 0; }
+	if (!b) { BIG_UNLOCK_FOR_WRITE return 0; }
 	
 	// save the info we need for the memset
 	void *old_begin = b->begin;
@@ -733,7 +805,9 @@ _Bool __liballocs_delete_bigalloc_at(const void *begin, struct allocator *a)
 		PAGE_DIST(ROUND_UP((unsigned long) old_begin, PAGE_SIZE),
 			      ROUND_DOWN((unsigned long) old_end, PAGE_SIZE))
 	);
-	BIG_UNLOCK;
+	BIG_UNLOCK_FOR_WRITE
+	if (begin_ns) trace_bigalloc_event(EVENTTRACE_BIGALLOC_DELETE, old_begin,
+		(char*) old_end - (char*) old_begin, begin_ns);
 	return 1;
 }
 
@@ -741,6 +815,8 @@ struct big_allocation *__lookup_bigalloc(const void *mem, struct allocator *a, v
 struct big_allocation *__lookup_bigalloc(const void *mem, struct allocator *a, void **out_object_start)
 {
 	if (!pageindex) init();
+	/* Not under the big lock: flushing takes it, after the mmap allocator's. */
+	FLUSH_PENDING_UNMAPS_COVERING(mem);
 	int lock_ret;
 	BIG_LOCK
 	
@@ -761,6 +837,7 @@ struct insert *__lookup_bigalloc_with_insert(const void *mem, struct allocator *
 struct insert *__lookup_bigalloc_with_insert(const void *mem, struct allocator *a, void **out_object_start)
 {
 	if (!pageindex) init();
+	FLUSH_PENDING_UNMAPS_COVERING(mem);
 	int lock_ret;
 	BIG_LOCK
 	
@@ -782,10 +859,8 @@ struct big_allocation *__lookup_bigalloc_top_level(const void *mem) __attribute_
 struct big_allocation *__lookup_bigalloc_top_level(const void *mem)
 {
 	if (!pageindex) init();
-	int lock_ret;
-	BIG_LOCK
-	struct big_allocation *b = find_deepest_bigalloc(mem);
-	BIG_UNLOCK
+	FLUSH_PENDING_UNMAPS_COVERING(mem);
+	struct big_allocation *b = lookup_deepest_bigalloc_or_resync(mem);
 	while (b && b->parent) b = b->parent;
 	return b;
 }
@@ -793,11 +868,8 @@ struct big_allocation *__lookup_bigalloc_top_level(const void *mem)
 struct big_allocation *__lookup_deepest_bigalloc(const void *mem) __attribute__((visibility("hidden")));
 struct big_allocation *__lookup_deepest_bigalloc(const void *mem)
 {
-	int lock_ret;
-	BIG_LOCK
-	struct big_allocation *b = find_deepest_bigalloc(mem);
-	BIG_UNLOCK
-	return b;
+	FLUSH_PENDING_UNMAPS_COVERING(mem);
+	return lookup_deepest_bigalloc_or_resync(mem);
 }
 
 static struct big_allocation *get_common_parent_bigalloc_recursive(struct big_allocation *b1,
@@ -836,9 +908,12 @@ _Bool __liballocs_notify_unindexed_address(const void *ptr)
 	/* We get called if the caller finds an address that's not indexed anywhere. 
 	 * It's a way of asking us to check. 
 	 * We ask all our allocators in turn whether they own this address.
-	 * Only stack is expected to reply positively. */
+	 * Usually only stack will reply positively, but the mmap allocator
+	 * can pick up a mapping that it never heard about. */
 	_Bool ret = __stack_allocator_notify_unindexed_address(ptr);
 	if (ret) return 1;
+	ret = __mmap_allocator_notify_unindexed_address(ptr);
+	if (ret) return 1;
 	// FIXME: loop through the others
 	return 0;
 }
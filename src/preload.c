@@ -33,6 +33,8 @@ size_t __mallochooks_malloc_usable_size(void *ptr) __attribute__((visibility("pr
 #include <errno.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <pthread.h>
+#include <limits.h>
 #include "liballocs_private.h"
 #include "relf.h"
 #include "raw-syscalls.h"
@@ -73,6 +75,53 @@ _Bool __avoid_libdl_calls;
 #pragma GCC optimize("no-optimize-sibling-calls")
 
 extern void *__curbrk;
+
+/* We need the bounds of the current thread's stack, if it's one that
+ * pthreads mapped (the initial stack we check separately). Threads we saw
+ * created have them already; for others, we try once to look them up, on
+ * the thread's first malloc_usable_size() call. After that, telling an
+ * alloca chunk on our own stack from a heap chunk is just a range check. */
+#define thread_stack __stack_allocator_thread_stack
+
+#define INITIAL_STACK_MINIMUM_SIZE 81920
+static inline _Bool is_on_initial_stack(const void *ptr)
+{
+	/* Austin-style unsigned wrap-around hack... */
+	return ((uintptr_t) __top_of_initial_stack - (uintptr_t) ptr)
+		< (__stack_lim_cur == RLIM_INFINITY ? INITIAL_STACK_MINIMUM_SIZE : __stack_lim_cur);
+}
+
+/* If the mmap allocator can't tell us, e.g. because it never saw the stack
+ * mapped, we don't ask again: we leave the bounds empty, and the thread's
+ * allocas get found by is_alloca_chunk_elsewhere, like other threads'. */
+static void __attribute__((noinline)) look_up_thread_stack(void *sp)
+{
+	thread_stack.looked_up = 1;
+	if (is_on_initial_stack(sp)) return;
+	void *begin;
+	void *end;
+	if (1 == __mmap_allocator_get_stack_mapping_bounds(sp, &begin, &end))
+	{
+		thread_stack.begin = begin;
+		thread_stack.end = end;
+	}
+}
+
+/* ptr is not on our own stack or the initial stack, but it might still be
+ * an alloca chunk, on another thread's stack. As we always used to, rule
+ * out the heap by the pageindex, without locking. Only if that can't tell
+ * do we ask the alloca allocator, which finds the owning thread's index. */
+static _Bool __attribute__((noinline)) is_alloca_chunk_elsewhere(void *ptr)
+{
+	if ((char*) ptr <= (char*) __curbrk) return 0;
+	struct big_allocation *b = &big_allocations[pageindex[(uintptr_t) ptr >> LOG_PAGE_SIZE]];
+	if (b->allocated_by == &__generic_malloc_allocator
+			|| b->suballocator == &__generic_malloc_allocator) return 0;
+	if (b->allocated_by == &__stack_allocator
+			|| b->allocated_by == &__stackframe_allocator) return 1;
+	return NULL != __alloca_allocator_lookup(ptr, NULL, NULL);
+}
+
 size_t __wrap_malloc_usable_size (void *ptr) __attribute__((visibility("protected")));
 size_t malloc_usable_size (void *ptr) __attribute__((alias("__wrap_malloc_usable_size"),visibility("default")));
 size_t __wrap_malloc_usable_size (void *ptr)
@@ -82,19 +131,11 @@ size_t __wrap_malloc_usable_size (void *ptr)
 	 * in the case of alloca, we need to intercept this case
 	 * and handle it appropriately. 
 	 * 
-	 * How can we detect the stack case quickly?
-	 * We could just ask the pageindex.
-	 * 
-	 * If we wanted a faster-but-less-general common case, 
-	 * - If ptr is on the same page as our thread's rsp, 
-	 *   it's definitely a stack pointer.
-	 * - If ptr is within MAXIMUM_STACK_SIZE of our thread's rsp, 
-	 *   it's *probably* a stack ptr, but to be certain it seems
-	 *   that we still have to consult the l0 index.
-	 * - Can we *rule out* the stack case quickly?
-	 *   HMM... all this is only using the same tricks we have in 
-	 *   get_object_memory_kind, so use that.
-	 * 
+	 * The only time a stack address (any suballocator) can be valid for us
+	 * is if the arg is the base of an alloca. If so, we stored the size
+	 * one word below the base. Allocas are mostly queried by the thread
+	 * that made them, so we check the current thread's stack and the
+	 * initial stack first, then anyone else's.
 	 */
 	void *sp;
 	 #ifdef UNW_TARGET_X86
@@ -102,46 +143,27 @@ size_t __wrap_malloc_usable_size (void *ptr)
 	#else // assume X86_64 for now
 		__asm__("movq %%rsp, %0\n" : "=r"(sp));
 	#endif
+	if (__builtin_expect(!thread_stack.looked_up, 0)) look_up_thread_stack(sp);
 
-	/* The only time a stack address (any suballocator) can be valid for us
-	 * is if the arg is the base of an alloca. If so, we stored the size
-	 * one word below the base. */
-	// FIXME: none of this should be necessary. Use a separate memtable for alloca?
-	// NOTE: this isn't as unsound as it looks, since our mmap nudger won't ever place
-	// a new mapping here
-#define INITIAL_STACK_MINIMUM_SIZE 81920
-	_Bool is_definitely_not_stack = (char*) ptr <= (char*) __curbrk
-			|| 
-			big_allocations[pageindex[(uintptr_t) ptr >> LOG_PAGE_SIZE]].allocated_by
-				== &__mmap_allocator
-			||
-			big_allocations[pageindex[(uintptr_t) ptr >> LOG_PAGE_SIZE]].allocated_by
-				== &__generic_malloc_allocator
-			;
 	_Bool is_definitely_stack = 
-		(   // anywhere on the initial stack
-			/* Austin-style unsigned wrap-around hack... */
-			((uintptr_t) __top_of_initial_stack - (uintptr_t) ptr)
-			< (__stack_lim_cur == RLIM_INFINITY ? INITIAL_STACK_MINIMUM_SIZE : __stack_lim_cur)
+		(   // on this thread's stack
+			(uintptr_t) ptr - (uintptr_t) thread_stack.begin
+			< (uintptr_t) thread_stack.end - (uintptr_t) thread_stack.begin
 		)
+		|| is_on_initial_stack(ptr)
 		|| // same page on the current stack
 		(
 			(((uintptr_t) ptr & ~(PAGE_SIZE - 1))
 			    == ((uintptr_t) sp & ~(PAGE_SIZE - 1)))
-		);
+		)
+		|| is_alloca_chunk_elsewhere(ptr);
 	
-	if (is_definitely_stack)
+	if (__builtin_expect(is_definitely_stack, 0))
 	{
 		return *(((unsigned long *) ptr) - 1);
 	}
-	if (is_definitely_not_stack)
-	{
-		return //__real_malloc_usable_size(ptr);
-			__mallochooks_malloc_usable_size(ptr);
-	}
-	return (__liballocs_get_allocator_upper_bound(ptr) == &__stack_allocator)
-		? *(((unsigned long *) ptr) - 1)
-		: __mallochooks_malloc_usable_size(ptr);
+	return //__real_malloc_usable_size(ptr);
+		__mallochooks_malloc_usable_size(ptr);
 }
 #pragma GCC pop_options
 
@@ -333,6 +355,7 @@ skip_load:
 		if (__libcrunch_scan_lazy_typenames) __libcrunch_scan_lazy_typenames(ret);
 
 		__static_allocator_notify_load(ret);
+		__liballocs_dladdr_index_notify_load();
 
 		/* Also load the types and allocsites for this object. These callbacks
 		 * also have to be tolerant of already-loadedness. */
@@ -382,6 +405,12 @@ int dlclose(void *handle)
 			{
 				// yes, it was unloaded
 				__static_allocator_notify_unload(copied_filename);
+				/* This also drops cached pointer maps for the types of
+				 * whatever went, l and any dependencies alike, and their
+				 * type databases. */
+				__liballocs_dladdr_index_remove((struct link_map *) handle);
+				/* If it was a types object, drop its types from the typestr index. */
+				__liballocs_typestr_index_remove_object(handle);
 			}
 			else 
 			{
@@ -453,7 +482,8 @@ int dladdr(const void *addr, Dl_info *info)
 		orig_dladdr = dlsym(RTLD_NEXT, "dladdr");
 		if (!orig_dladdr) abort();
 	}
-	int ret = orig_dladdr(addr, info);
+	int ret = __liballocs_dladdr_index_lookup(addr, info, NULL, NULL)
+		|| orig_dladdr(addr, info);
 	
 	if (we_set_flag) __avoid_libdl_calls = 0;
 	return ret;
@@ -508,7 +538,16 @@ int dladdr1(const void *addr, Dl_info *info, void **extra, int flags)
 		orig_dladdr1 = dlsym(RTLD_NEXT, "dladdr1");
 		if (!orig_dladdr1) abort();
 	}
-	int ret = orig_dladdr1(addr, info, extra, flags);
+	struct link_map *l;
+	const ElfW(Sym) *sym;
+	int ret;
+	if (__liballocs_dladdr_index_lookup(addr, info, &l, &sym))
+	{
+		ret = 1;
+		if (flags == RTLD_DL_LINKMAP) *extra = l;
+		else if (flags == RTLD_DL_SYMENT) *extra = (void*) sym;
+	}
+	else ret = orig_dladdr1(addr, info, extra, flags);
 	
 	if (we_set_flag) __avoid_libdl_calls = 0;
 	return ret;
@@ -604,6 +643,12 @@ sighandler_t signal(int signum, sighandler_t handler)
 		debug_printf(0, "Ignoring program's request to install a SIGILL handler.\n");
 		errno = ENOTSUP;
 		ret = SIG_ERR;
+	}
+	else if (signum == SIGSYS && __liballocs_systrap_seccomp_active)
+	{
+		debug_printf(0, "Ignoring program's request to install a SIGSYS handler.\n");
+		errno = ENOTSUP;
+		ret = SIG_ERR;
 	} else ret = orig_signal(signum, handler);
 out:
 	if (we_set_flag) __avoid_libdl_calls = 0;
@@ -629,38 +674,157 @@ int sigaction(int signum, const struct __libc_sigaction *act,
 	{
 		debug_printf(0, "Ignoring program's request to install a SIGILL handler.\n");
 		ret = orig_sigaction(SIGILL, NULL, oldact);
+	}
+	else if (signum == SIGSYS && act != NULL && __liballocs_systrap_seccomp_active)
+	{
+		debug_printf(0, "Ignoring program's request to install a SIGSYS handler.\n");
+		ret = orig_sigaction(SIGSYS, NULL, oldact);
 	} else ret = orig_sigaction(signum, act, oldact);
 out:
 	if (we_set_flag) __avoid_libdl_calls = 0;
 	return ret;
 }
 
-void *memcpy(void *dest, const void *src, size_t n)
+/* memcpy and memmove are GNU ifuncs. Unless an extender (libcrunch) has
+ * hooked __notify_copy, whether by interposing it or by --wrap, they
+ * resolve straight to the next definition, i.e. libc's, and cost nothing.
+ * Otherwise they resolve to a wrapper that notifies copies big enough to
+ * hold a pointer.
+ *
+ * Resolvers can run while ld.so is relocating some other object, before it
+ * has relocated us. Then we can't use our GOT (to check for a hook, or
+ * walk the link map), so we fall back to the notifying wrapper, which
+ * looks up the real function when first called. */
+typedef void *copy_fn_t(void *dest, const void *src, size_t n);
+void *__liballocs_nop_notify_copy(void *dest, const void *src, unsigned long n) __attribute__((visibility("hidden")));
+#ifndef NOTIFY_COPY_MIN_SIZE
+#define NOTIFY_COPY_MIN_SIZE (sizeof (void*))
+#endif
+
+static void *volatile relocation_check = (void*) &relocation_check;
+static _Bool safe_to_resolve(void)
+{
+	/* Our relative relocations are done first, then the GOT. */
+	void *volatile notify_copy_addr = (void*) __notify_copy;
+	void *volatile r_debug_addr = (void*) &_r_debug;
+	return relocation_check == (void*) &relocation_check
+		&& notify_copy_addr && r_debug_addr;
+}
+
+static copy_fn_t *orig_memcpy;
+static void *notifying_memcpy(void *dest, const void *src, size_t n)
 {
-	static void *(*orig_memcpy)(void *, const void *, size_t);
 	if (!orig_memcpy)
 	{
 		/* Use fake_dlsym because it understands ifuncs. */
 		orig_memcpy = fake_dlsym(RTLD_NEXT, "memcpy");
-		assert(orig_memcpy);
+		assert(orig_memcpy && orig_memcpy != (void*) -1);
 	}
 	
 	orig_memcpy(dest, src, n);
 	
+	if (n < NOTIFY_COPY_MIN_SIZE) return dest;
 	return __notify_copy(dest, src, n);
 }
+static copy_fn_t *resolve_memcpy(void)
+{
+	if (!safe_to_resolve() || (void*) __notify_copy != (void*) __liballocs_nop_notify_copy)
+	{
+		return notifying_memcpy;
+	}
+	copy_fn_t *next = fake_dlsym(RTLD_NEXT, "memcpy");
+	return (next && next != (void*) -1) ? next : notifying_memcpy;
+}
+void *memcpy(void *dest, const void *src, size_t n) __attribute__((ifunc("resolve_memcpy")));
 
-void *(*orig_memmove)(void *, const void *, size_t);
-void *memmove(void *dest, const void *src, size_t n)
+static void *notifying_memmove(void *dest, const void *src, size_t n)
 {
 	if (!orig_memmove)
 	{
 		/* Use fake_dlsym because it understands ifuncs. */
 		orig_memmove = fake_dlsym(RTLD_NEXT, "memmove");
-		assert(orig_memmove);
+		assert(orig_memmove && orig_memmove != (void*) -1);
 	}
 	
 	orig_memmove(dest, src, n);
 	
+	if (n < NOTIFY_COPY_MIN_SIZE) return dest;
 	return __notify_copy(dest, src, n);
 }
+static copy_fn_t *resolve_memmove(void)
+{
+	if (!safe_to_resolve() || (void*) __notify_copy != (void*) __liballocs_nop_notify_copy)
+	{
+		return notifying_memmove;
+	}
+	copy_fn_t *next = fake_dlsym(RTLD_NEXT, "memmove");
+	return (next && next != (void*) -1) ? next : notifying_memmove;
+}
+void *memmove(void *dest, const void *src, size_t n) __attribute__((ifunc("resolve_memmove")));
+
+/* We wrap every thread's start routine, so that its stack is registered
+ * before it runs any code, and retired when the thread is gone.
+ *
+ * Retiring it from a cleanup handler would be too early: TLS and pthread
+ * key destructors run after cleanup handlers, still on the thread's stack,
+ * and may query or alloca. So we retire it from a key destructor instead.
+ * Key destructors run in rounds, in no particular order within a round, so
+ * ours puts its value back until the last round. Only if we have no key do
+ * we fall back on a cleanup handler. */
+struct thread_start_args
+{
+	void *(*start_routine)(void *);
+	void *arg;
+};
+static pthread_key_t thread_exit_key;
+static _Bool thread_exit_key_ok;
+static pthread_once_t thread_exit_key_once = PTHREAD_ONCE_INIT;
+static void thread_exit_key_destructor(void *round_as_ptr)
+{
+	uintptr_t round = (uintptr_t) round_as_ptr;
+	if (round < PTHREAD_DESTRUCTOR_ITERATIONS
+			&& 0 == pthread_setspecific(thread_exit_key, (void*)(round + 1))) return;
+	__stack_allocator_notify_thread_exit();
+}
+static void create_thread_exit_key(void)
+{
+	thread_exit_key_ok = (0 == pthread_key_create(&thread_exit_key, thread_exit_key_destructor));
+}
+static void thread_cleanup(void *retire_by_key_as_void)
+{
+	/* This runs on pthread_exit() and cancellation too, whatever we pop. */
+	if (!*(_Bool *) retire_by_key_as_void) __stack_allocator_notify_thread_exit();
+}
+static void *thread_start(void *args_as_void)
+{
+	struct thread_start_args args = *(struct thread_start_args *) args_as_void;
+	__wrap_dlfree(args_as_void);
+	/* Before anything we might trace, i.e. the stack's bigalloc. */
+	__liballocs_trace_thread_start();
+	__stack_allocator_notify_thread_start();
+	_Bool retire_by_key = thread_exit_key_ok
+		&& 0 == pthread_setspecific(thread_exit_key, (void*) 1);
+	void *ret;
+	pthread_cleanup_push(thread_cleanup, &retire_by_key);
+	ret = args.start_routine(args.arg);
+	pthread_cleanup_pop(1);
+	return ret;
+}
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+	void *(*start_routine)(void *), void *arg)
+{
+	static int (*orig_pthread_create)(pthread_t *, const pthread_attr_t *,
+		void *(*)(void *), void *);
+	if (!orig_pthread_create)
+	{
+		orig_pthread_create = fake_dlsym(RTLD_NEXT, "pthread_create");
+		if (!orig_pthread_create || orig_pthread_create == (void*) -1) abort();
+	}
+	pthread_once(&thread_exit_key_once, create_thread_exit_key);
+	struct thread_start_args *args = __wrap_dlmalloc(sizeof (struct thread_start_args));
+	if (!args) return orig_pthread_create(thread, attr, start_routine, arg);
+	*args = (struct thread_start_args) { .start_routine = start_routine, .arg = arg };
+	int ret = orig_pthread_create(thread, attr, thread_start, args);
+	if (ret != 0) __wrap_dlfree(args);
+	return ret;
+}
@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <time.h>
+#include <pthread.h>
+#include "relf.h"
+#include "liballocs_private.h"
+
+/* Per-thread query counters and latency histograms.
+ *
+ * Each thread gets its own cache-line-aligned block the first time it
+ * counts anything, and links it onto a list so that __liballocs_get_stats
+ * can add them all up. Only the owning thread writes its block, so the
+ * increments need no atomic read-modify-write; readers on other threads
+ * may see slightly stale counts. When a thread exits, a key destructor
+ * folds its counts into the retired block and frees its own.
+ *
+ * Queries are counted per allocator whether or not we're timing them;
+ * counts and histograms go in the slot that allocator was given the first
+ * time any thread counted a query on it. */
+
+_Bool __liballocs_query_latency_enabled __attribute__((visibility("protected")));
+__thread struct query_stats_block *__liballocs_thread_query_stats;
+
+static struct query_stats_block *blocks;
+static struct query_stats_block retired;
+static pthread_mutex_t blocks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_exit_key;
+static pthread_once_t thread_exit_key_once = PTHREAD_ONCE_INIT;
+
+static struct allocator *stats_allocators[LIBALLOCS_STATS_MAX_ALLOCATORS];
+
+/* The old global counters, which clients may still read or even bump.
+ * Each time we sum the blocks, we keep whatever was added to a global
+ * since we last wrote it, and write it the new total. */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+unsigned long __liballocs_aborted_stack;
+unsigned long __liballocs_aborted_static;
+unsigned long __liballocs_aborted_unknown_storage;
+unsigned long __liballocs_hit_heap_case;
+unsigned long __liballocs_hit_stack_case;
+unsigned long __liballocs_hit_static_case;
+unsigned long __liballocs_aborted_unindexed_heap;
+unsigned long __liballocs_aborted_unrecognised_allocsite;
+static unsigned long *const legacy_counters[NQUERY_COUNTERS] = {
+	[QUERY_ABORTED_STACK] = &__liballocs_aborted_stack,
+	[QUERY_ABORTED_STATIC] = &__liballocs_aborted_static,
+	[QUERY_ABORTED_UNKNOWN_STORAGE] = &__liballocs_aborted_unknown_storage,
+	[QUERY_HIT_HEAP_CASE] = &__liballocs_hit_heap_case,
+	[QUERY_HIT_STACK_CASE] = &__liballocs_hit_stack_case,
+	[QUERY_HIT_STATIC_CASE] = &__liballocs_hit_static_case,
+	[QUERY_ABORTED_UNINDEXED_HEAP] = &__liballocs_aborted_unindexed_heap,
+	[QUERY_ABORTED_UNRECOGNISED_ALLOCSITE] = &__liballocs_aborted_unrecognised_allocsite
+};
+#pragma GCC diagnostic pop
+static unsigned long legacy_written[NQUERY_COUNTERS];
+static unsigned long legacy_added[NQUERY_COUNTERS];
+
+/* Call with blocks_mutex held. */
+static void sync_legacy_counters(struct query_stats_block *sum)
+{
+	for (unsigned i = 0; i < NQUERY_COUNTERS; ++i)
+	{
+		if (!legacy_counters[i]) continue;
+		legacy_added[i] += __atomic_load_n(legacy_counters[i], __ATOMIC_RELAXED) - legacy_written[i];
+		sum->counters[i] += legacy_added[i];
+		__atomic_store_n(legacy_counters[i], sum->counters[i], __ATOMIC_RELAXED);
+		legacy_written[i] = sum->counters[i];
+	}
+}
+
+static void (__attribute__((constructor)) init)(void)
+{
+	const char *s = getenv("LIBALLOCS_QUERY_LATENCY");
+	__liballocs_query_latency_enabled = (s && *s && 0 != strcmp(s, "0"));
+}
+
+static void fold_into(struct query_stats_block *dest, struct query_stats_block *src)
+{
+	for (unsigned i = 0; i < NQUERY_COUNTERS; ++i)
+	{
+		dest->counters[i] += __atomic_load_n(&src->counters[i], __ATOMIC_RELAXED);
+	}
+	for (unsigned i = 0; i < LIBALLOCS_STATS_MAX_ALLOCATORS; ++i)
+	{
+		dest->nqueries[i] += __atomic_load_n(&src->nqueries[i], __ATOMIC_RELAXED);
+		for (unsigned j = 0; j < LIBALLOCS_LATENCY_NBUCKETS; ++j)
+		{
+			dest->latency[i][j] += __atomic_load_n(&src->latency[i][j], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void thread_exiting(void *arg)
+{
+	struct query_stats_block *b = arg;
+	pthread_mutex_lock(&blocks_mutex);
+	fold_into(&retired, b);
+	for (struct query_stats_block **p = &blocks; *p; p = &(*p)->next)
+	{
+		if (*p == b) { *p = b->next; break; }
+	}
+	pthread_mutex_unlock(&blocks_mutex);
+	/* If anything counts after this, it gets a fresh block. */
+	__liballocs_thread_query_stats = NULL;
+	__wrap_dlfree(b->raw);
+}
+
+static void create_thread_exit_key(void)
+{
+	if (0 != pthread_key_create(&thread_exit_key, thread_exiting)) abort();
+}
+
+struct query_stats_block *__liballocs_register_thread_query_stats(void)
+{
+	void *raw = __wrap_dlmalloc(sizeof (struct query_stats_block) + QUERY_STATS_ALIGN);
+	if (!raw) abort();
+	struct query_stats_block *b = (struct query_stats_block *)
+		ROUND_UP_PTR(raw, QUERY_STATS_ALIGN);
+	memset(b, 0, sizeof *b);
+	b->raw = raw;
+	b->last_allocator_slot = -1;
+	pthread_once(&thread_exit_key_once, create_thread_exit_key);
+	pthread_setspecific(thread_exit_key, b);
+	pthread_mutex_lock(&blocks_mutex);
+	b->next = blocks;
+	blocks = b;
+	pthread_mutex_unlock(&blocks_mutex);
+	__liballocs_thread_query_stats = b;
+	return b;
+}
+
+int __liballocs_allocator_stats_slot(struct allocator *a)
+{
+	for (unsigned i = 0; i < LIBALLOCS_STATS_MAX_ALLOCATORS; ++i)
+	{
+		struct allocator *seen = __atomic_load_n(&stats_allocators[i], __ATOMIC_ACQUIRE);
+		if (seen == a) return i;
+		if (!seen)
+		{
+			if (__atomic_compare_exchange_n(&stats_allocators[i], &seen, a, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return i;
+			if (seen == a) return i;
+		}
+	}
+	return -1; /* out of slots; don't count it */
+}
+
+static unsigned latency_bucket(unsigned long ns)
+{
+	unsigned bucket = ns ? 63 - __builtin_clzl(ns) : 0;
+	return bucket < LIBALLOCS_LATENCY_NBUCKETS ? bucket : LIBALLOCS_LATENCY_NBUCKETS - 1;
+}
+
+struct liballocs_err *
+__liballocs_get_alloc_info_timed
+	(const void *obj,
+	struct allocator **out_allocator,
+	const void **out_alloc_start,
+	unsigned long *out_alloc_size_bytes,
+	struct uniqtype **out_alloc_uniqtype,
+	const void **out_alloc_site)
+{
+	struct allocator *a = NULL;
+	struct timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	struct liballocs_err *err = __liballocs_get_alloc_info_untimed(obj, &a, out_alloc_start,
+		out_alloc_size_bytes, out_alloc_uniqtype, out_alloc_site);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (out_allocator && a) *out_allocator = a;
+	int slot = a ? __liballocs_allocator_stats_slot(a) : -1;
+	if (slot != -1)
+	{
+		unsigned long ns = (end.tv_sec - begin.tv_sec) * 1000000000ul
+			+ end.tv_nsec - begin.tv_nsec;
+		struct query_stats_block *b = __liballocs_thread_query_stats;
+		if (!b) b = __liballocs_register_thread_query_stats();
+		unsigned long *p = &b->latency[slot][latency_bucket(ns)];
+		__atomic_store_n(p, *p + 1, __ATOMIC_RELAXED);
+	}
+	return err;
+}
+
+void __liballocs_get_stats(struct liballocs_stats *out)
+{
+	struct query_stats_block sum;
+	pthread_mutex_lock(&blocks_mutex);
+	sum = retired;
+	for (struct query_stats_block *b = blocks; b; b = b->next) fold_into(&sum, b);
+	sync_legacy_counters(&sum);
+	pthread_mutex_unlock(&blocks_mutex);
+
+	*out = (struct liballocs_stats) {
+		.aborted_stack = sum.counters[QUERY_ABORTED_STACK],
+		.aborted_static = sum.counters[QUERY_ABORTED_STATIC],
+		.aborted_unknown_storage = sum.counters[QUERY_ABORTED_UNKNOWN_STORAGE],
+		.hit_heap_case = sum.counters[QUERY_HIT_HEAP_CASE],
+		.hit_stack_case = sum.counters[QUERY_HIT_STACK_CASE],
+		.hit_static_case = sum.counters[QUERY_HIT_STATIC_CASE],
+		.aborted_unindexed_heap = sum.counters[QUERY_ABORTED_UNINDEXED_HEAP],
+		.aborted_unrecognised_allocsite = sum.counters[QUERY_ABORTED_UNRECOGNISED_ALLOCSITE],
+		.lookup_cache_hits = sum.counters[QUERY_LOOKUP_CACHE_HIT],
+		.lookup_cache_misses = sum.counters[QUERY_LOOKUP_CACHE_MISS]
+	};
+	for (unsigned i = 0; i < LIBALLOCS_STATS_MAX_ALLOCATORS; ++i)
+	{
+		struct allocator *a = __atomic_load_n(&stats_allocators[i], __ATOMIC_ACQUIRE);
+		if (!a) break;
+		struct liballocs_allocator_latency *l = &out->by_allocator[out->nallocators++];
+		l->allocator_name = a->name;
+		l->nqueries = sum.nqueries[i];
+		for (unsigned j = 0; j < LIBALLOCS_LATENCY_NBUCKETS; ++j)
+		{
+			l->ns_log2[j] = sum.latency[i][j];
+		}
+	}
+}
@@ -0,0 +1,259 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "relf.h"
+#include "liballocs_private.h"
+#include "pageindex.h"
+#include "heap_index.h"
+#include "memtable.h"
+#include "statsshm.h"
+
+/* Publishing our counters in /dev/shm (see include/statsshm.h).
+ *
+ * Rather than have every query write to the shared file, a background
+ * thread wakes up every interval, gathers a snapshot (summing the
+ * per-thread query counters, counting bigallocs, and asking mincore()
+ * how much of our two big indexes is resident) and copies it into the
+ * file under the sequence count. Only that thread writes the file, so
+ * it needs no lock; readers never block it.
+ *
+ * Both indexes are sparse reservations of many gigabytes, so we don't
+ * mincore() all of them. Only the parts covering live bigallocs can have
+ * been written: the pageindex for top-level bigallocs, and the heap index
+ * for bigallocs that malloc suballocates. So we probe just those. Pages
+ * that once covered a bigalloc since freed are missed, so this can
+ * undercount.
+ *
+ * After a fork(), the child has no publishing thread. We unmap the
+ * parent's file in the child, and leave it to the parent to remove. */
+
+static struct statsshm *shm;
+static char shm_path[64];
+static pid_t owner_pid;
+static unsigned interval_ms = 1000;
+
+static unsigned long resident_bytes(const void *begin, size_t len)
+{
+	/* One byte of vector per page; 64kB of vector covers 256MB. */
+	static unsigned char vec[65536];
+	const size_t chunk = sizeof vec * PAGE_SIZE;
+	unsigned long npages = 0;
+	for (const char *pos = begin; pos < (const char *) begin + len; pos += chunk)
+	{
+		size_t this_len = ((const char *) begin + len - pos < chunk)
+			? (const char *) begin + len - pos : chunk;
+		if (0 != mincore((void*) pos, this_len, vec)) continue;
+		for (size_t i = 0; i < (this_len + PAGE_SIZE - 1) / PAGE_SIZE; ++i)
+		{
+			npages += vec[i] & 1;
+		}
+	}
+	return npages * PAGE_SIZE;
+}
+
+struct probe_range
+{
+	uintptr_t begin;
+	uintptr_t end;
+};
+/* Only the publisher thread uses these. */
+static struct probe_range pageindex_ranges[NBIGALLOCS];
+static struct probe_range index_region_ranges[NBIGALLOCS];
+
+static void add_range(struct probe_range *ranges, unsigned *n, const void *begin, const void *end)
+{
+	ranges[(*n)++] = (struct probe_range) {
+		.begin = ROUND_DOWN((uintptr_t) begin, PAGE_SIZE),
+		.end = ROUND_UP((uintptr_t) end, PAGE_SIZE)
+	};
+}
+
+static int compare_ranges(const void *p1, const void *p2)
+{
+	const struct probe_range *r1 = p1;
+	const struct probe_range *r2 = p2;
+	return (r1->begin > r2->begin) - (r1->begin < r2->begin);
+}
+
+/* Sort and merge the ranges, so that we count each page once. */
+static unsigned long resident_bytes_in_ranges(struct probe_range *ranges, unsigned n)
+{
+	qsort(ranges, n, sizeof *ranges, compare_ranges);
+	unsigned long total = 0;
+	for (unsigned i = 0; i < n; )
+	{
+		uintptr_t begin = ranges[i].begin;
+		uintptr_t end = ranges[i].end;
+		for (++i; i < n && ranges[i].begin <= end; ++i)
+		{
+			if (ranges[i].end > end) end = ranges[i].end;
+		}
+		total += resident_bytes((void*) begin, end - begin);
+	}
+	return total;
+}
+
+static void publish(void)
+{
+	struct liballocs_stats stats;
+	__liballocs_get_stats(&stats);
+
+	unsigned npageindex_ranges = 0;
+	unsigned nindex_region_ranges = 0;
+	__liballocs_pageindex_lock();
+	for (unsigned i = 1; pageindex && i < NBIGALLOCS; ++i)
+	{
+		struct big_allocation *b = &big_allocations[i];
+		if (!BIGALLOC_IN_USE(b)) continue;
+		if (!b->parent)
+		{
+			add_range(pageindex_ranges, &npageindex_ranges,
+				&pageindex[PAGENUM(b->begin)], &pageindex[PAGENUM((char*) b->end - 1) + 1]);
+		}
+		if (index_region && b->suballocator == &__generic_malloc_allocator
+				&& (char*) b->end > (char*) index_begin_addr
+				&& (char*) b->begin < (char*) index_end_addr)
+		{
+			char *begin = ((char*) b->begin < (char*) index_begin_addr)
+				? (char*) index_begin_addr : (char*) b->begin;
+			char *last = ((char*) b->end > (char*) index_end_addr)
+				? (char*) index_end_addr - 1 : (char*) b->end - 1;
+			add_range(index_region_ranges, &nindex_region_ranges,
+				INDEX_LOC_FOR_ADDR(begin), INDEX_LOC_FOR_ADDR(last) + 1);
+		}
+	}
+	__liballocs_pageindex_unlock();
+	unsigned long nbigallocs = (NBIGALLOCS - 1) - __liballocs_nbigallocs_free();
+	unsigned long pageindex_rss = resident_bytes_in_ranges(pageindex_ranges, npageindex_ranges);
+	unsigned long index_region_rss = resident_bytes_in_ranges(index_region_ranges,
+		nindex_region_ranges);
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	++shm->nupdates;
+	shm->update_time_ns = now.tv_sec * 1000000000ul + now.tv_nsec;
+	shm->nindexed_chunks = __generic_malloc_allocator_nindexed_chunks();
+	shm->nbigallocs = nbigallocs;
+	shm->pageindex_rss_bytes = pageindex_rss;
+	shm->index_region_rss_bytes = index_region_rss;
+	shm->lookup_cache_hits = stats.lookup_cache_hits;
+	shm->lookup_cache_misses = stats.lookup_cache_misses;
+	shm->aborted_stack = stats.aborted_stack;
+	shm->aborted_static = stats.aborted_static;
+	shm->aborted_unknown_storage = stats.aborted_unknown_storage;
+	shm->hit_heap_case = stats.hit_heap_case;
+	shm->hit_stack_case = stats.hit_stack_case;
+	shm->hit_static_case = stats.hit_static_case;
+	shm->aborted_unindexed_heap = stats.aborted_unindexed_heap;
+	shm->aborted_unrecognised_allocsite = stats.aborted_unrecognised_allocsite;
+	shm->nallocators = stats.nallocators;
+	for (unsigned i = 0; i < stats.nallocators; ++i)
+	{
+		struct statsshm_allocator *a = &shm->by_allocator[i];
+		strncpy(a->name, stats.by_allocator[i].allocator_name ?
+			stats.by_allocator[i].allocator_name : "(unnamed)", sizeof a->name - 1);
+		a->nqueries = stats.by_allocator[i].nqueries;
+		memcpy(a->ns_log2, stats.by_allocator[i].ns_log2, sizeof a->ns_log2);
+	}
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+}
+
+static void *publisher_main(void *arg)
+{
+	struct timespec interval = {
+		.tv_sec = interval_ms / 1000,
+		.tv_nsec = (interval_ms % 1000) * 1000000l
+	};
+	for (;;)
+	{
+		if (!shm) return NULL;
+		publish();
+		nanosleep(&interval, NULL);
+	}
+}
+
+static void remove_file(void)
+{
+	/* Only the process that created the file removes it, not its children. */
+	if (shm && getpid() == owner_pid) unlink(shm_path);
+}
+
+static void forget_file_in_child(void)
+{
+	if (!shm) return;
+	struct statsshm *old = shm;
+	shm = NULL; /* the publisher thread didn't survive the fork anyway */
+	munmap(old, sizeof (struct statsshm));
+}
+
+static void (__attribute__((constructor)) init)(void)
+{
+	const char *s = getenv("LIBALLOCS_STATS_SHM");
+	if (!s || !*s || 0 == strcmp(s, "0")) return;
+	const char *interval_str = getenv("LIBALLOCS_STATS_SHM_INTERVAL_MS");
+	if (interval_str && atoi(interval_str) > 0) interval_ms = atoi(interval_str);
+
+	owner_pid = getpid();
+	snprintf(shm_path, sizeof shm_path, STATSSHM_PATH_FORMAT, (int) owner_pid);
+	int fd = open(shm_path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd == -1)
+	{
+		debug_printf(0, "could not create %s for publishing stats\n", shm_path);
+		return;
+	}
+	if (0 != ftruncate(fd, sizeof (struct statsshm)))
+	{
+		debug_printf(0, "could not size %s for publishing stats\n", shm_path);
+		close(fd);
+		unlink(shm_path);
+		return;
+	}
+	void *mem = mmap(NULL, sizeof (struct statsshm), PROT_READ|PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+	{
+		debug_printf(0, "could not map %s for publishing stats\n", shm_path);
+		unlink(shm_path);
+		return;
+	}
+	shm = mem;
+	shm->version = STATSSHM_VERSION;
+	shm->size = sizeof (struct statsshm);
+	shm->pid = owner_pid;
+	shm->interval_ms = interval_ms;
+	atexit(remove_file);
+	pthread_atfork(NULL, NULL, forget_file_in_child);
+
+	/* The publisher must not take signals meant for the program. */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_t t;
+	int ret = pthread_create(&t, NULL, publisher_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0)
+	{
+		debug_printf(0, "could not start the stats publisher thread\n");
+		return;
+	}
+	pthread_detach(t);
+	/* Write the magic last, so readers never see a half-made header. */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(shm->magic, STATSSHM_MAGIC, sizeof STATSSHM_MAGIC);
+	debug_printf(1, "publishing stats in %s every %ums\n", shm_path, interval_ms);
+}
@@ -8,6 +8,8 @@
 #include "pageindex.h"
 #define RELF_DEFINE_STRUCTURES
 #include "relf.h"
+#include <linux/filter.h>
+#include <linux/seccomp.h>
 
 /* Our secret private channel with libdlbind. This must always be linked in,
  * even in libcrunch stubs. */
@@ -40,6 +42,7 @@ char *realpath(const char *path, char *resolved_path);
 int snprintf(char *str, size_t size, const char *format, ...);
 int open(const char *pathname, int flags, ...);
 int close(int fd);
+char *getenv(const char *name);
 
 #define GUESS_CALLER(uc) \
 	( (&pageindex && pageindex[ ((uintptr_t) ((uc).rsp)) >> LOG_PAGE_SIZE ] != 0) \
@@ -185,6 +188,286 @@ void open_replacement(struct generic_syscall *s, post_handler *post)
 	resume_from_sigframe(ret, s->saved_context, /* HACK */ 2);
 }
 
+/* The seccomp backend.
+ *
+ * Rather than rewriting the syscall instructions in ld.so and libc into
+ * trapping instructions, we can ask the kernel to do the trapping: a seccomp
+ * filter returns SECCOMP_RET_TRAP for the syscalls we replace, and we get a
+ * SIGSYS whose siginfo already tells us the syscall number. The filter only
+ * traps calls made from the same code ranges that the trap path would patch
+ * (ld.so, libdl and libc's mmap-family entry points), so that, as before, calls
+ * made through the preload wrappers are handled there and not here. Calls
+ * from our own text, including the one the handler makes, are never trapped.
+ *
+ * This leaves the text untouched and skips decoding the trapping instruction,
+ * but a trap is still a signal delivery. It is opt-in, by setting
+ * LIBALLOCS_SYSTRAP_BACKEND=seccomp, because it has process-wide effects that
+ * the trap path doesn't: it must set no_new_privs, and the filter outlives
+ * execve(), so it would also trap in a new image that happened to put code at
+ * one of our trapped addresses. The latter is only a real risk without ASLR,
+ * so we decline to install the filter when address randomization is off. If
+ * the kernel refuses the filter, we fall back to the trap path. */
+_Bool __liballocs_systrap_seccomp_active; /* globally visible, like __liballocs_systrap_is_initialized */
+
+#ifndef AUDIT_ARCH_X86_64
+#define AUDIT_ARCH_X86_64 0xc000003eu
+#endif
+#define SECCOMP_SYS_CODE 1 /* si_code for SIGSYS raised by SECCOMP_RET_TRAP */
+#define SA_SIGINFO_FLAG 0x4
+#define SA_NODEFER_FLAG 0x40000000
+#define SA_RESTORER_FLAG 0x04000000
+#define PR_SET_NO_NEW_PRIVS_OPTION 38
+#define ADDR_NO_RANDOMIZE_FLAG 0x0040000
+
+/* The bits of the kernel's x86-64 signal ABI that our SIGSYS handler needs.
+ * We spell them out rather than pull in headers that fight with libsystrap's.
+ * The register block is laid out as the kernel's struct sigcontext. */
+struct sigsys_info
+{
+	int si_signo;
+	int si_errno;
+	int si_code;
+	int pad;
+	void *call_addr;
+	int syscall;
+	unsigned arch;
+};
+struct sigsys_ucontext
+{
+	unsigned long uc_flags;
+	void *uc_link;
+	struct { void *ss_sp; int ss_flags; unsigned long ss_size; } uc_stack;
+	struct
+	{
+		unsigned long r8, r9, r10, r11, r12, r13, r14, r15,
+			rdi, rsi, rbp, rbx, rdx, rax, rcx, rsp, rip;
+	} uc_mcontext;
+};
+struct kernel_sigaction
+{
+	void *handler;
+	unsigned long flags;
+	void (*restorer)(void);
+	unsigned long mask;
+};
+
+/* The syscall instruction here lies in our own text, so it is never trapped. */
+static long seccomp_raw_syscall6(long nr, long a0, long a1, long a2, long a3, long a4, long a5)
+{
+	long ret;
+	register long r10 __asm__("r10") = a3;
+	register long r8 __asm__("r8") = a4;
+	register long r9 __asm__("r9") = a5;
+	__asm__ volatile ("syscall" : "=a"(ret)
+		: "0"(nr), "D"(a0), "S"(a1), "d"(a2), "r"(r10), "r"(r8), "r"(r9)
+		: "rcx", "r11", "memory");
+	return ret;
+}
+#define IS_SYSCALL_ERROR(ret) ((unsigned long) (ret) > -4096ul)
+
+void seccomp_sigsys_restorer(void) __attribute__((visibility("hidden")));
+__asm__(".pushsection .text\n"
+	".align 16\n"
+	"seccomp_sigsys_restorer:\n"
+	"\tmov $15, %rax\n" /* SYS_rt_sigreturn */
+	"\tsyscall\n"
+	".popsection\n");
+
+static void handle_sigsys(int sig, struct sigsys_info *info, void *ucontext_as_void)
+{
+	struct sigsys_ucontext *uc = (struct sigsys_ucontext *) ucontext_as_void;
+	/* Only the filter's traps are ours to emulate. */
+	if (info->si_code != SECCOMP_SYS_CODE || info->arch != AUDIT_ARCH_X86_64) return;
+	long nr = info->syscall;
+	long args[6] = { uc->uc_mcontext.rdi, uc->uc_mcontext.rsi, uc->uc_mcontext.rdx,
+		uc->uc_mcontext.r10, uc->uc_mcontext.r8, uc->uc_mcontext.r9 };
+	void *caller = GUESS_CALLER(uc->uc_mcontext);
+	long ret;
+	switch (nr)
+	{
+		case SYS_mmap: {
+			void *addr = (void*) args[0];
+			size_t length = args[1];
+			int prot = args[2];
+			int flags = args[3];
+			int fd = args[4];
+			off_t offset = args[5];
+			__liballocs_nudge_mmap(&addr, &length, &prot, &flags, &fd, &offset, caller);
+			ret = seccomp_raw_syscall6(SYS_mmap, (long) addr, length, prot, flags, fd, offset);
+			if (!IS_SYSCALL_ERROR(ret) && &__mmap_allocator_notify_mmap)
+			{
+				__mmap_allocator_notify_mmap((void*) ret, addr, length, prot, flags, fd, offset,
+					caller);
+			}
+		} break;
+		case SYS_munmap:
+			ret = seccomp_raw_syscall6(SYS_munmap, args[0], args[1], 0, 0, 0, 0);
+			if (ret == 0 && &__mmap_allocator_notify_munmap)
+			{
+				__mmap_allocator_notify_munmap((void*) args[0], args[1], caller);
+			}
+			break;
+		case SYS_mremap:
+			if (&__mmap_allocator_notify_mremap_before)
+			{
+				__mmap_allocator_notify_mremap_before((void*) args[0], args[1], args[2],
+					args[3], (void*) args[4], caller);
+			}
+			ret = seccomp_raw_syscall6(SYS_mremap, args[0], args[1], args[2], args[3], args[4], 0);
+			if (&__mmap_allocator_notify_mremap_after)
+			{
+				/* Like the trap path, report failure as MAP_FAILED. */
+				__mmap_allocator_notify_mremap_after(IS_SYSCALL_ERROR(ret) ? (void*) -1 : (void*) ret,
+					(void*) args[0], args[1], args[2], args[3], (void*) args[4], caller);
+			}
+			break;
+		case SYS_brk:
+			ret = seccomp_raw_syscall6(SYS_brk, args[0], 0, 0, 0, 0, 0);
+			if (&__mmap_allocator_notify_brk) __mmap_allocator_notify_brk((void*) ret);
+			break;
+		case SYS_open: {
+			const char *path = (const char *) args[0];
+			int flags = args[1];
+			mode_t mode = args[2];
+			__liballocs_nudge_open(&path, &flags, &mode, caller);
+			ret = seccomp_raw_syscall6(SYS_open, (long) path, flags, mode, 0, 0, 0);
+		} break;
+		default:
+			ret = seccomp_raw_syscall6(nr, args[0], args[1], args[2], args[3], args[4], args[5]);
+			break;
+	}
+	/* Returning from the handler resumes after the syscall instruction. */
+	uc->uc_mcontext.rax = ret;
+}
+
+/* The code ranges we trap, gathered during init. Each becomes a handful of
+ * BPF instructions, so there is a (generous) limit. */
+#define MAX_SECCOMP_RANGES 64
+struct trapped_range
+{
+	unsigned char *begin;
+	unsigned char *end;
+	const char *fname; /* non-null for whole executable regions */
+	_Bool is_writable;
+	_Bool is_readable;
+};
+static struct trapped_range seccomp_ranges[MAX_SECCOMP_RANGES];
+static unsigned seccomp_nranges;
+static _Bool use_seccomp;
+
+static void trap_range_now(struct trapped_range *r)
+{
+	if (r->fname) trap_one_executable_region(r->begin, r->end, r->fname, r->is_writable, r->is_readable);
+	else trap_one_instruction_range(r->begin, r->end, 0, 1);
+}
+
+/* Give up on seccomp and patch everything we'd recorded. */
+static void fall_back_to_trap_path(void)
+{
+	use_seccomp = 0;
+	for (unsigned i = 0; i < seccomp_nranges; ++i) trap_range_now(&seccomp_ranges[i]);
+	seccomp_nranges = 0;
+}
+
+static void trap_range(unsigned char *begin, unsigned char *end, const char *fname,
+	_Bool is_writable, _Bool is_readable)
+{
+	struct trapped_range r = { begin, end, fname, is_writable, is_readable };
+	if (!use_seccomp) { trap_range_now(&r); return; }
+	/* Our filter compares the low words of addresses within one high word,
+	 * so split any range that crosses a 4GB boundary. */
+	while (begin < end)
+	{
+		uintptr_t hi_limit = (((uintptr_t) begin >> 32) + 1) << 32;
+		unsigned char *piece_end = ((uintptr_t) end > hi_limit) ? (unsigned char *) hi_limit : end;
+		if (seccomp_nranges == MAX_SECCOMP_RANGES)
+		{
+			fall_back_to_trap_path();
+			r.begin = begin;
+			trap_range_now(&r);
+			return;
+		}
+		seccomp_ranges[seccomp_nranges++] = (struct trapped_range) {
+			begin, piece_end, fname, is_writable, is_readable
+		};
+		begin = piece_end;
+	}
+}
+
+static _Bool seccomp_backend_requested(void)
+{
+	const char *backend = getenv("LIBALLOCS_SYSTRAP_BACKEND");
+	if (!backend || 0 != strcmp(backend, "seccomp")) return 0;
+	/* See above: without ASLR, a later execve() could hit our filter. */
+	long persona = seccomp_raw_syscall6(SYS_personality, 0xffffffff, 0, 0, 0, 0, 0);
+	if (IS_SYSCALL_ERROR(persona) || (persona & ADDR_NO_RANDOMIZE_FLAG)) return 0;
+	return 1;
+}
+
+static _Bool install_seccomp_filter(void)
+{
+#define FILTER_HEADER_LEN 10
+#define FILTER_INSNS_PER_RANGE 6
+	static struct sock_filter insns[FILTER_HEADER_LEN
+		+ FILTER_INSNS_PER_RANGE * MAX_SECCOMP_RANGES + 1];
+	unsigned n = 0;
+	insns[n++] = (struct sock_filter) BPF_STMT(BPF_LD|BPF_W|BPF_ABS,
+		__builtin_offsetof(struct seccomp_data, arch));
+	insns[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, AUDIT_ARCH_X86_64, 1, 0);
+	insns[n++] = (struct sock_filter) BPF_STMT(BPF_RET|BPF_K, SECCOMP_RET_ALLOW);
+	insns[n++] = (struct sock_filter) BPF_STMT(BPF_LD|BPF_W|BPF_ABS,
+		__builtin_offsetof(struct seccomp_data, nr));
+	/* Any of these syscalls jumps to the range checks; others are allowed. */
+	const unsigned nrs[] = { SYS_mmap, SYS_munmap, SYS_mremap, SYS_brk, SYS_open };
+	const unsigned nnrs = sizeof nrs / sizeof nrs[0];
+	for (unsigned i = 0; i < nnrs; ++i)
+	{
+		insns[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, nrs[i], nnrs - i, 0);
+	}
+	insns[n++] = (struct sock_filter) BPF_STMT(BPF_RET|BPF_K, SECCOMP_RET_ALLOW);
+	assert(n == FILTER_HEADER_LEN);
+	/* Each range: if the high word matches and begin <= low word <= last, trap. */
+	for (unsigned i = 0; i < seccomp_nranges; ++i)
+	{
+		uintptr_t begin = (uintptr_t) seccomp_ranges[i].begin;
+		uintptr_t last = (uintptr_t) seccomp_ranges[i].end - 1;
+		insns[n++] = (struct sock_filter) BPF_STMT(BPF_LD|BPF_W|BPF_ABS,
+			__builtin_offsetof(struct seccomp_data, instruction_pointer) + 4);
+		insns[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, begin >> 32, 0, 4);
+		insns[n++] = (struct sock_filter) BPF_STMT(BPF_LD|BPF_W|BPF_ABS,
+			__builtin_offsetof(struct seccomp_data, instruction_pointer));
+		insns[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP|BPF_JGE|BPF_K, (unsigned) begin, 0, 2);
+		insns[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP|BPF_JGT|BPF_K, (unsigned) last, 1, 0);
+		insns[n++] = (struct sock_filter) BPF_STMT(BPF_RET|BPF_K, SECCOMP_RET_TRAP);
+	}
+	insns[n++] = (struct sock_filter) BPF_STMT(BPF_RET|BPF_K, SECCOMP_RET_ALLOW);
+	struct sock_fprog prog = { .len = n, .filter = insns };
+
+	/* Install the handler first, so that no trap can find it missing. */
+	struct kernel_sigaction sa = {
+		.handler = (void*) handle_sigsys,
+		.flags = SA_SIGINFO_FLAG | SA_NODEFER_FLAG | SA_RESTORER_FLAG,
+		.restorer = seccomp_sigsys_restorer,
+		.mask = 0
+	};
+	struct kernel_sigaction old_sa;
+	long ret = seccomp_raw_syscall6(SYS_rt_sigaction, SIGSYS, (long) &sa, (long) &old_sa,
+		sizeof sa.mask, 0, 0);
+	if (IS_SYSCALL_ERROR(ret)) return 0;
+	ret = seccomp_raw_syscall6(SYS_prctl, PR_SET_NO_NEW_PRIVS_OPTION, 1, 0, 0, 0, 0);
+	if (!IS_SYSCALL_ERROR(ret))
+	{
+		ret = seccomp_raw_syscall6(SYS_seccomp, SECCOMP_SET_MODE_FILTER,
+			SECCOMP_FILTER_FLAG_TSYNC, (long) &prog, 0, 0, 0);
+	}
+	if (ret != 0)
+	{
+		seccomp_raw_syscall6(SYS_rt_sigaction, SIGSYS, (long) &old_sa, 0, sizeof sa.mask, 0, 0);
+		return 0;
+	}
+	return 1;
+}
+
 static int trap_ldso_or_libdl_cb(struct proc_entry *ent, char *linebuf, void *interpreter_fname_as_void)
 {
 	const char *interpreter_fname = (const char *) interpreter_fname_as_void;
@@ -192,7 +475,7 @@ static int trap_ldso_or_libdl_cb(struct proc_entry *ent, char *linebuf, void *in
 		|| 0 == strcmp(basename(ent->rest), "libdl.so.2")))
 	{
 		/* It's an executable mapping in the ld.so or libdl, so trap it. */
-		trap_one_executable_region((unsigned char *) ent->first, (unsigned char *) ent->second,
+		trap_range((unsigned char *) ent->first, (unsigned char *) ent->second,
 			interpreter_fname, ent->w == 'w', ent->r == 'r');
 	}
 	
@@ -207,9 +490,9 @@ static _Bool trap_syscalls_in_symbol_named(const char *name, struct link_map *l,
 		dynsym, dynstr, name) : NULL;
 	if (found && found->st_shndx != STN_UNDEF)
 	{
-		trap_one_instruction_range((unsigned char *)(l->l_addr + found->st_value),
+		trap_range((unsigned char *)(l->l_addr + found->st_value),
 			(unsigned char *)(l->l_addr + found->st_value + found->st_size),
-			0, 1);
+			NULL, 0, 1);
 		return 1;
 	} else return 0;
 }
@@ -250,6 +533,8 @@ void __liballocs_systrap_init(void)
 	replaced_syscalls[SYS_mremap] = mremap_replacement;
 	replaced_syscalls[SYS_brk] = brk_replacement;
 	replaced_syscalls[SYS_open] = open_replacement;
+	/* Choose the backend before we trap anything. */
+	use_seccomp = seccomp_backend_requested();
 	/* Get a hold of the ld.so's link map entry. How? We get it from the auxiliary
 	 * vector. */
 	const char *interpreter_fname = NULL;
@@ -340,8 +625,8 @@ void __liballocs_systrap_init(void)
 					_Bool success = __lookup_static_allocation_by_name(l, "__brk", &addr, &len);
 					if (success)
 					{
-						trap_one_instruction_range((unsigned char*) addr, 
-							(unsigned char*) addr + len, 0, 1);
+						trap_range((unsigned char*) addr,
+							(unsigned char*) addr + len, NULL, 0, 1);
 					}
 				}
 			}
@@ -353,7 +638,12 @@ void __liballocs_systrap_init(void)
 	// if (!found_an_mmap) abort();
 	// if (!found_a_brk_or_sbrk) abort();
 
-	install_sigill_handler();
+	if (use_seccomp && install_seccomp_filter()) __liballocs_systrap_seccomp_active = 1;
+	else
+	{
+		if (use_seccomp) fall_back_to_trap_path();
+		install_sigill_handler();
+	}
 	__liballocs_systrap_is_initialized = 1;
 }
 
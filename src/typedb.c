@@ -0,0 +1,459 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "liballocs_private.h"
+#include "uniqtype.h"
+#include "typedb.h"
+
+/* Type databases (format described in typedb.h).
+ *
+ * We use them in two ways. Out-of-process readers (tools, or anything that
+ * wants to look at types without dlopen()ing a -types.so) use
+ * __liballocs_typedb_open(), which maps the whole file and gives them the
+ * records as struct uniqtypes.
+ *
+ * In-process, the uniqtypes that count are the ones in the -types.so, since
+ * allocsites and frame/static tables refer to those by symbol. So here we
+ * only use each object's database as an index, to name a uniqtype by binary
+ * search on its offset within its -types.so rather than by dladdr(), which
+ * scans every symbol in the object. We map an object's database only once
+ * its -types.so is loaded, so objects that have no types loaded cost
+ * nothing, and startup does no extra file probing. This use never touches
+ * the record images, so those pages are never faulted in. */
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+struct typedb
+{
+	const char *base;     /* the mapping */
+	unsigned long len;
+	struct typedb_header h; /* our checked copy */
+	const struct typedb_record *records;
+	const struct typedb_name *names;
+	const unsigned *by_so_offset;
+	const char *strtab;
+};
+
+static unsigned long nbytes_mapped;
+
+/* Is there room for n things of the given size at off, in a file of
+ * file_size bytes? Careful not to overflow. */
+static _Bool table_fits(unsigned long off, unsigned long n, unsigned long size,
+	unsigned long align, unsigned long file_size)
+{
+	if (off % align != 0 || off > file_size) return 0;
+	return n <= (file_size - off) / size;
+}
+
+/* We don't trust anything in the file: it may be truncated, stale or just
+ * junk, and everything below indexes by what it says. */
+static _Bool header_ok(const struct typedb_header *h)
+{
+	unsigned long page_size = sysconf(_SC_PAGESIZE);
+	return table_fits(h->records_off, h->nrecords, sizeof (struct typedb_record),
+				_Alignof (struct typedb_record), h->file_size)
+		&& table_fits(h->names_off, h->nnames, sizeof (struct typedb_name),
+				_Alignof (struct typedb_name), h->file_size)
+		&& table_fits(h->by_so_offset_off, h->nrecords, sizeof (unsigned),
+				_Alignof (unsigned), h->file_size)
+		&& table_fits(h->relocs_off, h->nrelocs, sizeof (unsigned long),
+				_Alignof (unsigned long), h->file_size)
+		&& (h->strtab_size > 0 || (h->nrecords == 0 && h->nnames == 0))
+		&& table_fits(h->strtab_off, h->strtab_size, 1, 1, h->file_size)
+		&& table_fits(h->images_off, h->images_size, 1, 1, h->file_size)
+		&& (h->patch_size == 0 || h->patch_off % page_size == 0)
+		&& h->patch_off >= h->images_off
+		&& table_fits(h->patch_off - h->images_off, h->patch_size, 1, 1, h->images_size);
+}
+
+/* Check every index the tables hold, before we follow any of them. We
+ * only check the relocs if we are going to apply them. */
+static _Bool tables_ok(const char *base, const struct typedb_header *h, _Bool check_relocs)
+{
+	const char *strtab = base + h->strtab_off;
+	if (h->strtab_size > 0 && strtab[h->strtab_size - 1] != '\0') return 0;
+	unsigned long images_end = h->images_off + h->images_size;
+	unsigned long patch_end = h->patch_off + h->patch_size;
+	const struct typedb_record *records = (const struct typedb_record *)(base + h->records_off);
+	for (unsigned long i = 0; i < h->nrecords; ++i)
+	{
+		const struct typedb_record *r = &records[i];
+		if (r->name_off >= h->strtab_size
+				|| r->image_off < h->images_off
+				|| r->image_off % _Alignof (struct uniqtype) != 0
+				|| r->image_off > images_end
+				|| images_end - r->image_off < offsetof(struct uniqtype, related)) return 0;
+		if ((r->flags & TYPEDB_RECORD_MAKE_PRECISE)
+				&& (r->image_off < h->patch_off
+					|| r->image_off > patch_end
+					|| patch_end - r->image_off < offsetof(struct uniqtype, related))) return 0;
+	}
+	const struct typedb_name *names = (const struct typedb_name *)(base + h->names_off);
+	for (unsigned long i = 0; i < h->nnames; ++i)
+	{
+		if (names[i].record >= h->nrecords || names[i].name_off >= h->strtab_size) return 0;
+	}
+	const unsigned *by_so_offset = (const unsigned *)(base + h->by_so_offset_off);
+	for (unsigned long i = 0; i < h->nrecords; ++i)
+	{
+		if (by_so_offset[i] >= h->nrecords) return 0;
+	}
+	if (check_relocs)
+	{
+		const unsigned long *relocs = (const unsigned long *)(base + h->relocs_off);
+		for (unsigned long i = 0; i < h->nrelocs; ++i)
+		{
+			if (relocs[i] < h->images_off
+					|| relocs[i] % _Alignof (unsigned long) != 0
+					|| relocs[i] > images_end
+					|| images_end - relocs[i] < sizeof (unsigned long)) return 0;
+		}
+	}
+	return 1;
+}
+
+static int map_file(const char *path, _Bool want_images, struct typedb *db)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return -1;
+	struct typedb_header h;
+	struct stat s;
+	if (fstat(fd, &s) != 0
+			|| pread(fd, &h, sizeof h, 0) != sizeof h
+			|| 0 != memcmp(h.magic, TYPEDB_MAGIC, sizeof h.magic)
+			|| h.version != TYPEDB_VERSION
+			|| h.file_size != (unsigned long) s.st_size
+			|| !header_ok(&h))
+	{
+		debug_printf(1, "ignoring bad type database %s\n", path);
+		close(fd);
+		return -1;
+	}
+	void *mapping = MAP_FAILED;
+	if (want_images)
+	{
+		/* If we get the address the images were written for, there is
+		 * nothing to relocate and every page stays shared. */
+		mapping = mmap((void*) h.preferred_base, h.file_size, PROT_READ,
+			MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+		if (mapping != MAP_FAILED && mapping != (void*) h.preferred_base)
+		{
+			/* Kernels without MAP_FIXED_NOREPLACE treat it as a hint. */
+			munmap(mapping, h.file_size);
+			mapping = MAP_FAILED;
+		}
+		if (mapping == MAP_FAILED)
+		{
+			mapping = mmap(NULL, h.file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+			if (mapping == MAP_FAILED) goto fail;
+		}
+		if (!tables_ok(mapping, &h, mapping != (void*) h.preferred_base))
+		{
+			munmap(mapping, h.file_size);
+			goto bad;
+		}
+		if (mapping != (void*) h.preferred_base)
+		{
+			unsigned long delta = (unsigned long) mapping - h.preferred_base;
+			const unsigned long *relocs = (const unsigned long *)((char*) mapping + h.relocs_off);
+			for (unsigned long i = 0; i < h.nrelocs; ++i)
+			{
+				*(unsigned long *)((char*) mapping + relocs[i]) += delta;
+			}
+			debug_printf(1, "relocated type database %s (%lu words)\n", path, h.nrelocs);
+		}
+		if (h.patch_size > 0)
+		{
+			/* Only the patch area needs to be private. Unconditionally
+			 * remapping it is harmless if the whole file is already private. */
+			if ((char*) mapping + h.patch_off != mmap((char*) mapping + h.patch_off, h.patch_size,
+					PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, h.patch_off))
+			{
+				munmap(mapping, h.file_size);
+				goto fail;
+			}
+			if (mapping != (void*) h.preferred_base)
+			{
+				unsigned long delta = (unsigned long) mapping - h.preferred_base;
+				const unsigned long *relocs = (const unsigned long *)((char*) mapping + h.relocs_off);
+				for (unsigned long i = 0; i < h.nrelocs; ++i)
+				{
+					if (relocs[i] < h.patch_off || relocs[i] >= h.patch_off + h.patch_size) continue;
+					*(unsigned long *)((char*) mapping + relocs[i]) += delta;
+				}
+			}
+			const struct typedb_record *records
+			 = (const struct typedb_record *)((char*) mapping + h.records_off);
+			for (unsigned long i = 0; i < h.nrecords; ++i)
+			{
+				if (!(records[i].flags & TYPEDB_RECORD_MAKE_PRECISE)) continue;
+				struct uniqtype *t = (struct uniqtype *)((char*) mapping + records[i].image_off);
+				/* The tools only ever emit this one, for flexible arrays. */
+				if (UNIQTYPE_IS_ARRAY_TYPE(t) && t->un.array.nelems == UNIQTYPE_ARRAY_LENGTH_UNBOUNDED)
+				{
+					t->make_precise = __liballocs_make_array_precise_with_memory_bounds;
+				}
+			}
+			mprotect((char*) mapping + h.patch_off, h.patch_size, PROT_READ);
+		}
+		if (mapping != (void*) h.preferred_base) mprotect(mapping, h.file_size, PROT_READ);
+	}
+	else
+	{
+		mapping = mmap(NULL, h.file_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (mapping == MAP_FAILED) goto fail;
+		if (!tables_ok(mapping, &h, 0))
+		{
+			munmap(mapping, h.file_size);
+			goto bad;
+		}
+	}
+	close(fd);
+
+	db->base = mapping;
+	db->len = h.file_size;
+	db->h = h;
+	db->records = (const struct typedb_record *)(db->base + h.records_off);
+	db->names = (const struct typedb_name *)(db->base + h.names_off);
+	db->by_so_offset = (const unsigned *)(db->base + h.by_so_offset_off);
+	db->strtab = db->base + h.strtab_off;
+	__atomic_add_fetch(&nbytes_mapped, db->len, __ATOMIC_RELAXED);
+	return 0;
+bad:
+	debug_printf(1, "ignoring bad type database %s\n", path);
+	close(fd);
+	return -1;
+fail:
+	debug_printf(0, "could not map type database %s\n", path);
+	close(fd);
+	return -1;
+}
+
+static const struct typedb_record *find_by_name(const struct typedb *db, const char *symname)
+{
+	unsigned long lo = 0, hi = db->h.nnames;
+	while (lo < hi)
+	{
+		unsigned long mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(symname, db->strtab + db->names[mid].name_off);
+		if (cmp == 0) return &db->records[db->names[mid].record];
+		if (cmp < 0) hi = mid;
+		else lo = mid + 1;
+	}
+	return NULL;
+}
+
+static const struct typedb_record *find_by_so_offset(const struct typedb *db, unsigned long so_offset)
+{
+	unsigned long lo = 0, hi = db->h.nrecords;
+	while (lo < hi)
+	{
+		unsigned long mid = lo + (hi - lo) / 2;
+		const struct typedb_record *r = &db->records[db->by_so_offset[mid]];
+		if (r->so_offset == so_offset) return r;
+		if (so_offset < r->so_offset) hi = mid;
+		else lo = mid + 1;
+	}
+	return NULL;
+}
+
+struct typedb *__liballocs_typedb_open(const char *path)
+{
+	struct typedb *db = malloc(sizeof (struct typedb));
+	if (!db) return NULL;
+	if (map_file(path, 1, db) != 0)
+	{
+		free(db);
+		return NULL;
+	}
+	return db;
+}
+
+void __liballocs_typedb_close(struct typedb *db)
+{
+	if (!db) return;
+	munmap((void*) db->base, db->len);
+	__atomic_sub_fetch(&nbytes_mapped, db->len, __ATOMIC_RELAXED);
+	free(db);
+}
+
+struct uniqtype *__liballocs_typedb_lookup(struct typedb *db, const char *symname)
+{
+	const struct typedb_record *r = find_by_name(db, symname);
+	return r ? (struct uniqtype *)(db->base + r->image_off) : NULL;
+}
+
+const char *__liballocs_typedb_symbol_name(struct typedb *db, const struct uniqtype *t)
+{
+	unsigned long off = (const char *) t - db->base;
+	if ((const char *) t < db->base || off >= db->len) return NULL;
+	/* The record table is sorted by image offset. */
+	unsigned long lo = 0, hi = db->h.nrecords;
+	while (lo < hi)
+	{
+		unsigned long mid = lo + (hi - lo) / 2;
+		if (db->records[mid].image_off == off) return db->strtab + db->records[mid].name_off;
+		if (off < db->records[mid].image_off) hi = mid;
+		else lo = mid + 1;
+	}
+	return NULL;
+}
+
+/* In-process use: one database per object. Slots are published by the
+ * release-store of object_typedbs_count, or of dead when a freed slot is
+ * reused, so readers need no lock. When the object or its -types.so is
+ * unloaded, the dladdr index tells us and we mark the slot dead. Readers
+ * count themselves in and out of nreaders, as in dladdr-index.c, and we
+ * unmap a dead slot's database and make the slot free for reuse only once
+ * we see no reader in flight, since any reader that starts after that
+ * skips it. */
+struct object_typedb
+{
+	ElfW(Addr) load_addr;
+	uintptr_t types_base;  /* where the -types.so is loaded */
+	unsigned long so_begin; /* range of record offsets within the -types.so */
+	unsigned long so_end;
+	_Bool dead;             /* skipped by readers */
+	_Bool freed;            /* dead and unmapped; under the mutex */
+	struct typedb db;
+};
+#define MAX_OBJECT_TYPEDBS 4096
+static struct object_typedb object_typedbs[MAX_OBJECT_TYPEDBS];
+static unsigned object_typedbs_count;
+static pthread_mutex_t object_typedbs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long nreaders;
+static unsigned long nlookups_by_typedb;
+
+static struct object_typedb *find_object(ElfW(Addr) load_addr)
+{
+	unsigned n = __atomic_load_n(&object_typedbs_count, __ATOMIC_ACQUIRE);
+	for (unsigned i = 0; i < n; ++i)
+	{
+		if (__atomic_load_n(&object_typedbs[i].dead, __ATOMIC_ACQUIRE)) continue;
+		if (object_typedbs[i].load_addr == load_addr) return &object_typedbs[i];
+	}
+	return NULL;
+}
+
+/* Under the mutex. */
+static void reclaim_dead(void)
+{
+	if (__atomic_load_n(&nreaders, __ATOMIC_SEQ_CST) != 0) return;
+	for (unsigned i = 0; i < object_typedbs_count; ++i)
+	{
+		struct object_typedb *o = &object_typedbs[i];
+		if (!o->dead || o->freed) continue;
+		munmap((void*) o->db.base, o->db.len);
+		__atomic_sub_fetch(&nbytes_mapped, o->db.len, __ATOMIC_RELAXED);
+		o->freed = 1;
+	}
+}
+
+void __liballocs_typedb_register_object(const char *db_path, ElfW(Addr) load_addr,
+	void *types_handle)
+{
+	struct link_map *l;
+	if (dlinfo(types_handle, RTLD_DI_LINKMAP, &l) != 0) return;
+	pthread_mutex_lock(&object_typedbs_mutex);
+	if (find_object(load_addr)) goto out;
+	reclaim_dead();
+	struct object_typedb *o = NULL;
+	for (unsigned i = 0; i < object_typedbs_count; ++i)
+	{
+		if (object_typedbs[i].freed) { o = &object_typedbs[i]; break; }
+	}
+	if (!o && object_typedbs_count == MAX_OBJECT_TYPEDBS) goto out;
+	if (!o)
+	{
+		o = &object_typedbs[object_typedbs_count];
+		o->dead = 1;
+	}
+	if (map_file(db_path, 0, &o->db) != 0) goto out;
+	o->load_addr = load_addr;
+	o->types_base = (uintptr_t) l->l_addr;
+	if (o->db.h.nrecords > 0)
+	{
+		const struct typedb_record *first = &o->db.records[o->db.by_so_offset[0]];
+		const struct typedb_record *last = &o->db.records[o->db.by_so_offset[o->db.h.nrecords - 1]];
+		o->so_begin = first->so_offset;
+		o->so_end = last->so_offset + last->size;
+	} else o->so_begin = o->so_end = 0;
+	debug_printf(3, "mapped type database %s\n", db_path);
+	o->freed = 0;
+	__atomic_store_n(&o->dead, 0, __ATOMIC_RELEASE);
+	if (o == &object_typedbs[object_typedbs_count])
+	{
+		__atomic_store_n(&object_typedbs_count, object_typedbs_count + 1, __ATOMIC_RELEASE);
+	}
+out:
+	pthread_mutex_unlock(&object_typedbs_mutex);
+}
+
+/* The dladdr index calls this for each object it sees go away. Either the
+ * object or its -types.so going makes the database useless. */
+void __liballocs_typedb_notify_unload(ElfW(Addr) l_addr)
+{
+	if (0 == __atomic_load_n(&object_typedbs_count, __ATOMIC_ACQUIRE)) return;
+	pthread_mutex_lock(&object_typedbs_mutex);
+	for (unsigned i = 0; i < object_typedbs_count; ++i)
+	{
+		struct object_typedb *o = &object_typedbs[i];
+		if (o->dead) continue;
+		if (o->load_addr == l_addr || o->types_base == (uintptr_t) l_addr)
+		{
+			__atomic_store_n(&o->dead, 1, __ATOMIC_SEQ_CST);
+		}
+	}
+	reclaim_dead();
+	pthread_mutex_unlock(&object_typedbs_mutex);
+}
+
+const char *__liballocs_typedb_loaded_symbol_name(const struct uniqtype *u)
+{
+	const char *ret = NULL;
+	__atomic_add_fetch(&nreaders, 1, __ATOMIC_SEQ_CST);
+	unsigned n = __atomic_load_n(&object_typedbs_count, __ATOMIC_ACQUIRE);
+	for (unsigned i = 0; i < n; ++i)
+	{
+		struct object_typedb *o = &object_typedbs[i];
+		if (__atomic_load_n(&o->dead, __ATOMIC_SEQ_CST)) continue;
+		uintptr_t types_base = o->types_base;
+		if ((uintptr_t) u < types_base + o->so_begin || (uintptr_t) u >= types_base + o->so_end) continue;
+		const struct typedb_record *r = find_by_so_offset(&o->db, (uintptr_t) u - types_base);
+		/* Not every symbol in the object is a record, so a miss here
+		 * is not definitive; let the caller fall back to dladdr(). */
+		if (!r) break;
+		__atomic_add_fetch(&nlookups_by_typedb, 1, __ATOMIC_RELAXED);
+		ret = o->db.strtab + r->name_off;
+		break;
+	}
+	__atomic_sub_fetch(&nreaders, 1, __ATOMIC_SEQ_CST);
+	return ret;
+}
+
+void __liballocs_typedb_get_stats(unsigned *out_nobjects, unsigned long *out_nbytes_mapped,
+	unsigned long *out_nlookups)
+{
+	unsigned n = __atomic_load_n(&object_typedbs_count, __ATOMIC_ACQUIRE);
+	unsigned nlive = 0;
+	for (unsigned i = 0; i < n; ++i)
+	{
+		if (!__atomic_load_n(&object_typedbs[i].dead, __ATOMIC_ACQUIRE)) ++nlive;
+	}
+	*out_nobjects = nlive;
+	*out_nbytes_mapped = __atomic_load_n(&nbytes_mapped, __ATOMIC_RELAXED);
+	*out_nlookups = __atomic_load_n(&nlookups_by_typedb, __ATOMIC_RELAXED);
+}
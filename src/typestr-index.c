@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <link.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "relf.h"
+#include "liballocs_private.h"
+#include "uniqtype.h"
+
+/* Process-wide index from uniqtype symbol name to uniqtype.
+ *
+ * Resolving a typestr by dlsym(RTLD_DEFAULT, ...) walks the hash table of
+ * every object in the global scope. Instead, whenever we load a -types.so,
+ * we add every uniqtype symbol in its dynsym, aliases included, to this
+ * table; typestr lookups try it before falling back to dlsym().
+ *
+ * Like dlsym() on the global scope, the first definition of a name wins,
+ * since we add objects in load order. Adding an object that is already in
+ * the index does nothing. We remember which entries each object added, and
+ * remove (tombstone) just those when its -types.so is unloaded. We copy the
+ * names, and never free entries, so a lookup racing with a removal never
+ * touches freed memory.
+ *
+ * Lookup is a lock-free linear probe. Insertion CASes into an empty slot,
+ * and removal clears an entry's type pointer, so neither needs a lock
+ * either. Tombstoned slots are not reused. If the table gets too full we
+ * stop adding to it, and lookups of the missing names go to dlsym(). */
+
+#ifndef TYPESTR_INDEX_LOG_SIZE
+#define TYPESTR_INDEX_LOG_SIZE 20
+#endif
+#define TYPESTR_INDEX_SIZE (1ul<<TYPESTR_INDEX_LOG_SIZE)
+#define TYPESTR_INDEX_MAX_LOAD ((TYPESTR_INDEX_SIZE / 8) * 7)
+
+struct typestr_entry
+{
+	unsigned long hash;
+	struct uniqtype *t; /* null once removed */
+	char name[];
+};
+
+static struct typestr_entry **table;
+static unsigned long table_nused;
+
+/* The entries each object added, so that removing it touches only those. */
+struct typestr_object
+{
+	const void *handle;
+	struct typestr_entry **entries;
+	unsigned long nentries;
+	unsigned long capacity;
+	struct typestr_object *next;
+};
+static struct typestr_object *objects;
+static pthread_mutex_t objects_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void remember_entry(struct typestr_object *o, struct typestr_entry *e)
+{
+	if (o->nentries == o->capacity)
+	{
+		unsigned long new_capacity = o->capacity ? 2 * o->capacity : 64;
+		struct typestr_entry **new_entries = __wrap_dlrealloc(o->entries,
+			new_capacity * sizeof (struct typestr_entry *));
+		/* If we can't remember it, we couldn't remove it on unload, so
+		 * retire it now; lookups of its name will go to dlsym(). */
+		if (!new_entries)
+		{
+			__atomic_store_n(&e->t, NULL, __ATOMIC_RELEASE);
+			return;
+		}
+		o->entries = new_entries;
+		o->capacity = new_capacity;
+	}
+	o->entries[o->nentries++] = e;
+}
+
+static unsigned long hash_name(const char *s)
+{
+	unsigned long h = 0xcbf29ce484222325ul; /* FNV-1a */
+	for (; *s; ++s) h = (h ^ (unsigned char) *s) * 0x100000001b3ul;
+	return h;
+}
+
+static _Bool init(void)
+{
+	void *mem = mmap(NULL, TYPESTR_INDEX_SIZE * sizeof (struct typestr_entry *),
+		PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED)
+	{
+		debug_printf(0, "could not reserve memory for the typestr index\n");
+		return 0;
+	}
+	struct typestr_entry **expected = NULL;
+	if (!__atomic_compare_exchange_n(&table, &expected, (struct typestr_entry **) mem, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		munmap(mem, TYPESTR_INDEX_SIZE * sizeof (struct typestr_entry *));
+	}
+	return 1;
+}
+
+/* Returns the entry we created, or null if the name was there already
+ * (or we couldn't add it). */
+static struct typestr_entry *add(const char *name, struct uniqtype *t)
+{
+	unsigned long h = hash_name(name);
+	unsigned long mask = TYPESTR_INDEX_SIZE - 1;
+	struct typestr_entry *created = NULL;
+	for (unsigned long i = h & mask; ; i = (i + 1) & mask)
+	{
+		struct typestr_entry *e = __atomic_load_n(&table[i], __ATOMIC_ACQUIRE);
+		if (e)
+		{
+			if (e->hash == h && __atomic_load_n(&e->t, __ATOMIC_ACQUIRE)
+					&& 0 == strcmp(e->name, name)) break; /* first one wins */
+			continue;
+		}
+		if (__atomic_load_n(&table_nused, __ATOMIC_RELAXED) >= TYPESTR_INDEX_MAX_LOAD) break;
+		if (!created)
+		{
+			size_t len = strlen(name);
+			created = __wrap_dlmalloc(sizeof (struct typestr_entry) + len + 1);
+			if (!created) return NULL;
+			created->hash = h;
+			created->t = t;
+			memcpy(created->name, name, len + 1);
+		}
+		struct typestr_entry *expected = NULL;
+		if (__atomic_compare_exchange_n(&table[i], &expected, created, 0,
+				__ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+		{
+			__atomic_add_fetch(&table_nused, 1, __ATOMIC_RELAXED);
+			return created;
+		}
+		/* Someone filled the slot; re-examine it (it may be our name). */
+		i = (i - 1) & mask;
+	}
+	if (created) __wrap_dlfree(created);
+	return NULL;
+}
+
+void __liballocs_typestr_index_add_object(void *types_handle)
+{
+	if (!table && !init()) return;
+	struct link_map *l = types_handle;
+	pthread_mutex_lock(&objects_mutex);
+	for (struct typestr_object *o = objects; o; o = o->next)
+	{
+		if (o->handle == types_handle) goto out;
+	}
+	ElfW(Dyn) *dynsym_ent = dynamic_lookup(l->l_ld, DT_SYMTAB);
+	ElfW(Dyn) *dynstr_ent = dynamic_lookup(l->l_ld, DT_STRTAB);
+	if (!dynsym_ent || !dynstr_ent) goto out;
+	struct typestr_object *o = __wrap_dlcalloc(1, sizeof (struct typestr_object));
+	if (!o) goto out;
+	o->handle = types_handle;
+	ElfW(Sym) *dynsym = (ElfW(Sym) *) dynsym_ent->d_un.d_ptr;
+	const char *dynstr = (const char *) dynstr_ent->d_un.d_ptr;
+	unsigned long nsyms = dynamic_symbol_count(l->l_ld, l);
+	for (ElfW(Sym) *p_sym = dynsym; p_sym < dynsym + nsyms; ++p_sym)
+	{
+		if (ELF64_ST_TYPE(p_sym->st_info) != STT_OBJECT
+				|| p_sym->st_shndx == SHN_UNDEF || !p_sym->st_name) continue;
+		const char *name = dynstr + p_sym->st_name;
+		if (0 != strncmp(name, "__uniqtype_", sizeof "__uniqtype_" - 1)) continue;
+		size_t len = strlen(name);
+		if ((len >= sizeof "_subobj_names" - 1
+				&& 0 == strcmp(name + len - (sizeof "_subobj_names" - 1), "_subobj_names"))
+			|| (len >= sizeof "_ptrmap" - 1
+				&& 0 == strcmp(name + len - (sizeof "_ptrmap" - 1), "_ptrmap"))) continue;
+		struct typestr_entry *e = add(name, (struct uniqtype *)(l->l_addr + p_sym->st_value));
+		if (e) remember_entry(o, e);
+	}
+	o->next = objects;
+	objects = o;
+out:
+	pthread_mutex_unlock(&objects_mutex);
+}
+
+void __liballocs_typestr_index_remove_object(const void *types_handle)
+{
+	pthread_mutex_lock(&objects_mutex);
+	for (struct typestr_object **p = &objects; *p; p = &(*p)->next)
+	{
+		struct typestr_object *o = *p;
+		if (o->handle != types_handle) continue;
+		for (unsigned long i = 0; i < o->nentries; ++i)
+		{
+			__atomic_store_n(&o->entries[i]->t, NULL, __ATOMIC_RELEASE);
+		}
+		*p = o->next;
+		if (o->entries) __wrap_dlfree(o->entries);
+		__wrap_dlfree(o);
+		break;
+	}
+	pthread_mutex_unlock(&objects_mutex);
+}
+
+struct uniqtype *__liballocs_typestr_index_lookup(const char *name)
+{
+	if (!table) return NULL;
+	unsigned long h = hash_name(name);
+	unsigned long mask = TYPESTR_INDEX_SIZE - 1;
+	for (unsigned long i = h & mask; ; i = (i + 1) & mask)
+	{
+		struct typestr_entry *e = __atomic_load_n(&table[i], __ATOMIC_ACQUIRE);
+		if (!e) return NULL;
+		if (e->hash != h) continue;
+		struct uniqtype *t = __atomic_load_n(&e->t, __ATOMIC_ACQUIRE);
+		if (t && 0 == strcmp(e->name, name)) return t;
+	}
+}
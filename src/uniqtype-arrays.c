@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "liballocs_private.h"
+#include "uniqtype.h"
+
+/* Hash-consing of synthesised array uniqtypes.
+ *
+ * Every make_precise of an unbounded array, and every dynamically sized
+ * allocation, asks for an (element type, length) array type. Previously we
+ * went through dlsym() on every request, which is a string hash and a walk
+ * of every loaded object's symbol table. Instead we keep an open-addressing
+ * table keyed on (element_t, array_len) whose slots are just uniqtype
+ * pointers; the key is read back out of the uniqtype itself (related[0] and
+ * un.array.nelems). Lookup is a lock-free probe.
+ *
+ * A uniqtype, once returned, is held by callers for ever (in statics, in
+ * heap inserts) and compared by address, so we never free, recycle or
+ * duplicate one. On a miss we create the type as before, with dlalloc() in
+ * the run-time uniqtypes object, fill it in, then try to CAS it into the
+ * first empty slot of its probe sequence. Only the winner of that CAS goes
+ * on to dlbind() its record, so only one type per key is ever published; a
+ * loser returns the winner and abandons its own record (never seen by
+ * anyone, so harmless, but not reclaimable either).
+ *
+ * Slots are never deleted from this table, so we need no tombstones. If the
+ * table fills, we fall back to the old dlsym-then-create path, serialised by
+ * a mutex so that it too never creates a type twice.
+ */
+
+#ifndef ARRAY_TYPE_TABLE_LOG_SIZE
+#define ARRAY_TYPE_TABLE_LOG_SIZE 20 /* 1M slots, 8MB of (NORESERVE) VAS */
+#endif
+#define ARRAY_TYPE_TABLE_SIZE (1ul<<ARRAY_TYPE_TABLE_LOG_SIZE)
+#define ARRAY_TYPE_TABLE_MAX_LOAD ((ARRAY_TYPE_TABLE_SIZE / 8) * 7)
+
+#define ARRAY_TYPE_SIZE (offsetof(struct uniqtype, related) + 1 * (sizeof (struct uniqtype_rel_info)))
+
+static struct uniqtype **table;
+static unsigned long table_nused;
+static unsigned long ncreated;
+static unsigned long noverflow;
+static unsigned long nhits;
+static unsigned long nmisses;
+static unsigned long nraces_lost;
+static pthread_mutex_t overflow_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static inline unsigned long hash_array_key(struct uniqtype *element_t, unsigned array_len)
+{
+	unsigned long h = ((uintptr_t) element_t >> 3) * 0x9e3779b97f4a7c15ul;
+	h ^= (unsigned long) array_len * 0xc2b2ae3d27d4eb4ful;
+	h ^= h >> 29;
+	return h;
+}
+
+static inline _Bool matches(struct uniqtype *t, struct uniqtype *element_t, unsigned array_len)
+{
+	return t->un.array.is_array
+		&& t->un.array.nelems == array_len
+		&& t->related[0].un.t.ptr == element_t;
+}
+
+static _Bool init(void)
+{
+	size_t total = ARRAY_TYPE_TABLE_SIZE * sizeof (struct uniqtype *);
+	void *mem = mmap(NULL, total, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED)
+	{
+		debug_printf(0, "could not reserve memory for array types\n");
+		return 0;
+	}
+	/* If another thread got there first, use its memory. */
+	struct uniqtype **expected = NULL;
+	if (!__atomic_compare_exchange_n(&table, &expected, (struct uniqtype **) mem, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		munmap(mem, total);
+	}
+	return 1;
+}
+
+static struct uniqtype *table_lookup(struct uniqtype *element_t, unsigned array_len,
+	unsigned long h)
+{
+	for (unsigned long i = h & (ARRAY_TYPE_TABLE_SIZE - 1); ; i = (i + 1) & (ARRAY_TYPE_TABLE_SIZE - 1))
+	{
+		struct uniqtype *t = __atomic_load_n(&table[i], __ATOMIC_ACQUIRE);
+		if (!t) return NULL;
+		if (matches(t, element_t, array_len)) return t;
+	}
+}
+
+/* Publish t, unless somebody else beat us to the same key; return the winner. */
+static struct uniqtype *table_insert(struct uniqtype *t, struct uniqtype *element_t,
+	unsigned array_len, unsigned long h)
+{
+	for (unsigned long i = h & (ARRAY_TYPE_TABLE_SIZE - 1); ; i = (i + 1) & (ARRAY_TYPE_TABLE_SIZE - 1))
+	{
+		struct uniqtype *expected = NULL;
+		if (__atomic_compare_exchange_n(&table[i], &expected, t, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			__atomic_add_fetch(&table_nused, 1, __ATOMIC_RELAXED);
+			return t;
+		}
+		if (matches(expected, element_t, array_len))
+		{
+			__atomic_add_fetch(&nraces_lost, 1, __ATOMIC_RELAXED);
+			return expected;
+		}
+	}
+}
+
+static struct uniqtype *new_record(struct uniqtype *element_t, unsigned array_len)
+{
+	if (!&__liballocs_rt_uniqtypes_obj || !__liballocs_rt_uniqtypes_obj) return NULL;
+	struct uniqtype *t = dlalloc(__liballocs_rt_uniqtypes_obj, ARRAY_TYPE_SIZE, SHF_WRITE);
+	if (!t) return NULL;
+	*t = (struct uniqtype) {
+		.pos_maxoff = array_len * element_t->pos_maxoff,
+		.un = {
+			array: {
+				.is_array = 1,
+				.nelems = array_len
+			}
+		},
+		.make_precise = NULL
+	};
+	t->related[0] = (struct uniqtype_rel_info) {
+		.un = {
+			t: {
+				.ptr = element_t
+			}
+		}
+	};
+	return t;
+}
+
+static void bind_record(struct uniqtype *t, const char *symname)
+{
+	void *reloaded = dlbind(__liballocs_rt_uniqtypes_obj, symname, t, ARRAY_TYPE_SIZE, STT_OBJECT);
+	if (!reloaded) debug_printf(0, "could not bind %s\n", symname);
+	__atomic_add_fetch(&ncreated, 1, __ATOMIC_RELAXED);
+}
+
+/* The table is full: do what we did before there was one, but one thread at a time. */
+static struct uniqtype *create_outside_table(struct uniqtype *element_t, unsigned array_len,
+	const char *symname)
+{
+	pthread_mutex_lock(&overflow_mutex);
+	struct uniqtype *t = dlsym(NULL, symname);
+	if (!t)
+	{
+		t = new_record(element_t, array_len);
+		if (t) bind_record(t, symname);
+	}
+	pthread_mutex_unlock(&overflow_mutex);
+	__atomic_add_fetch(&noverflow, 1, __ATOMIC_RELAXED);
+	return t;
+}
+
+struct uniqtype *__liballocs_intern_array_type(struct uniqtype *element_t, unsigned array_len)
+{
+	if (!__atomic_load_n(&table, __ATOMIC_ACQUIRE) && !init())
+	{
+		return NULL; /* caller falls back to dlbind */
+	}
+
+	unsigned long h = hash_array_key(element_t, array_len);
+	struct uniqtype *found = table_lookup(element_t, array_len, h);
+	if (found)
+	{
+		__atomic_add_fetch(&nhits, 1, __ATOMIC_RELAXED);
+		return found;
+	}
+	__atomic_add_fetch(&nmisses, 1, __ATOMIC_RELAXED);
+
+	/* Miss. The type might exist statically, e.g. in some -types.so;
+	 * if so, that one is canonical. */
+	char precise_uniqtype_name[4096];
+	const char *element_name = UNIQTYPE_NAME(element_t);
+	snprintf(precise_uniqtype_name, sizeof precise_uniqtype_name,
+			"__uniqtype____ARR%d_%s", array_len, element_name);
+	if (__atomic_load_n(&table_nused, __ATOMIC_RELAXED) >= ARRAY_TYPE_TABLE_MAX_LOAD)
+	{
+		return create_outside_table(element_t, array_len, precise_uniqtype_name);
+	}
+	struct uniqtype *t = dlsym(NULL, precise_uniqtype_name);
+	if (t) return table_insert(t, element_t, array_len, h);
+	t = new_record(element_t, array_len);
+	if (!t) return NULL;
+	struct uniqtype *winner = table_insert(t, element_t, array_len, h);
+	if (winner == t) bind_record(t, precise_uniqtype_name);
+	return winner;
+}
+
+void __liballocs_get_array_type_stats(struct liballocs_array_type_stats *out)
+{
+	*out = (struct liballocs_array_type_stats) {
+		.nentries = __atomic_load_n(&table_nused, __ATOMIC_RELAXED),
+		.ncreated = __atomic_load_n(&ncreated, __ATOMIC_RELAXED),
+		.noverflow = __atomic_load_n(&noverflow, __ATOMIC_RELAXED),
+		.nhits = __atomic_load_n(&nhits, __ATOMIC_RELAXED),
+		.nmisses = __atomic_load_n(&nmisses, __ATOMIC_RELAXED),
+		.nraces_lost = __atomic_load_n(&nraces_lost, __ATOMIC_RELAXED),
+		.table_nslots = ARRAY_TYPE_TABLE_SIZE
+	};
+}
@@ -0,0 +1,529 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "uniqtype.h"
+#include "uniqtype-bfs.h"
+
+/* Parallel heap-graph traversal.
+ *
+ * Each worker owns a Chase-Lev work-stealing deque of node records: it pushes
+ * and pops at the bottom, and idle workers steal from the top of a victim's.
+ * The visited set is a fixed-size open-addressing table of object addresses,
+ * claimed by CAS, so each object is expanded by exactly one worker (the one
+ * that claimed it). Note that an object reachable through differently-typed
+ * pointers is seen at whichever type the claiming worker saw; the serial BFS
+ * has the same ambiguity, just with a deterministic winner.
+ *
+ * Termination: a worker whose own deque is empty counts itself idle, and only
+ * un-idles to attempt a steal from a deque that looks non-empty. Idle workers
+ * never push, so once every worker is idle, every deque is empty.
+ *
+ * The walk can fail: when more objects are reachable than the visited set
+ * was sized for, or when we run out of memory. This is library code running
+ * in somebody else's process, so we don't abort; the worker that notices
+ * sets the walk's error, every worker stops at its next look, and the
+ * caller gets -1 with errno set. Whatever was blackened so far stays
+ * blackened (except in ADDRESS_ORDER, where nothing is reported). */
+
+typedef __uniqtype_node_rec node_rec;
+
+/* Chase-Lev deque, as in Le, Pop, Cohen and Zappa Nardelli (PPoPP 2013). */
+struct deque_array
+{
+	long size; /* power of two */
+	struct deque_array *retired_next;
+	node_rec *buf[];
+};
+struct deque
+{
+	long top;
+	long bottom;
+	struct deque_array *array;
+	struct deque_array *retired; /* freed when the walk finishes */
+} __attribute__((aligned(64)));
+#define DEQUE_INITIAL_SIZE 1024
+#define DEQUE_EMPTY ((node_rec *) 0)
+#define DEQUE_ABORT ((node_rec *) 1)
+
+static struct deque_array *new_deque_array(long size)
+{
+	struct deque_array *a = malloc(sizeof (struct deque_array) + size * sizeof (node_rec *));
+	if (!a) return NULL;
+	a->size = size;
+	a->retired_next = NULL;
+	return a;
+}
+
+static _Bool deque_init(struct deque *q)
+{
+	q->top = q->bottom = 0;
+	q->array = new_deque_array(DEQUE_INITIAL_SIZE);
+	q->retired = NULL;
+	return q->array != NULL;
+}
+
+static void deque_destroy(struct deque *q)
+{
+	free(q->array);
+	for (struct deque_array *a = q->retired; a; )
+	{
+		struct deque_array *next = a->retired_next;
+		free(a);
+		a = next;
+	}
+}
+
+static struct deque_array *deque_grow(struct deque *q, struct deque_array *a, long b, long t)
+{
+	struct deque_array *bigger = new_deque_array(a->size * 2);
+	if (!bigger) return NULL;
+	for (long i = t; i < b; ++i)
+	{
+		bigger->buf[i & (bigger->size - 1)] = a->buf[i & (a->size - 1)];
+	}
+	/* Thieves may still be reading the old array, so we can't free it yet. */
+	a->retired_next = q->retired;
+	q->retired = a;
+	__atomic_store_n(&q->array, bigger, __ATOMIC_RELEASE);
+	return bigger;
+}
+
+static _Bool deque_push(struct deque *q, node_rec *n)
+{
+	long b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED);
+	long t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+	struct deque_array *a = __atomic_load_n(&q->array, __ATOMIC_RELAXED);
+	if (b - t > a->size - 1 && !(a = deque_grow(q, a, b, t))) return 0;
+	/* Release on the slot as well as the fence, so the node's contents are
+	 * visibly published to a thief that reads the slot. */
+	__atomic_store_n(&a->buf[b & (a->size - 1)], n, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+static node_rec *deque_take(struct deque *q)
+{
+	long b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED) - 1;
+	struct deque_array *a = __atomic_load_n(&q->array, __ATOMIC_RELAXED);
+	__atomic_store_n(&q->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long t = __atomic_load_n(&q->top, __ATOMIC_RELAXED);
+	node_rec *n = DEQUE_EMPTY;
+	if (t <= b)
+	{
+		n = __atomic_load_n(&a->buf[b & (a->size - 1)], __ATOMIC_RELAXED);
+		if (t == b)
+		{
+			/* Last element: race against thieves for it. */
+			if (!__atomic_compare_exchange_n(&q->top, &t, t + 1, 0,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) n = DEQUE_EMPTY;
+			__atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+		}
+	}
+	else __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+	return n;
+}
+
+static node_rec *deque_steal(struct deque *q)
+{
+	long t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long b = __atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b) return DEQUE_EMPTY;
+	struct deque_array *a = __atomic_load_n(&q->array, __ATOMIC_ACQUIRE);
+	node_rec *n = __atomic_load_n(&a->buf[t & (a->size - 1)], __ATOMIC_ACQUIRE);
+	if (!__atomic_compare_exchange_n(&q->top, &t, t + 1, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) return DEQUE_ABORT;
+	return n;
+}
+
+static _Bool deque_looks_nonempty(struct deque *q)
+{
+	return __atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE)
+		> __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+}
+
+/* Per-worker node blocks. Nodes migrate between workers by stealing, so
+ * we never free them individually; every block goes when the walk ends. */
+#define NODE_BLOCK_NNODES 4096
+struct node_block
+{
+	struct node_block *next;
+	node_rec nodes[NODE_BLOCK_NNODES];
+};
+
+static void arena_node_free(void *ignored) {}
+
+struct walk;
+struct worker
+{
+	struct deque q;
+	struct walk *w;
+	unsigned idx;
+	pthread_t thread;
+	struct node_block *blocks;
+	unsigned nused_in_first;
+	node_rec *free_list;
+	unsigned long seed;
+	unsigned long nblackened;
+	unsigned long nedges;
+	/* for UNIQTYPE_PARALLEL_WALK_ADDRESS_ORDER */
+	struct uniqtype_parallel_walk_item *out;
+	unsigned long nout;
+	unsigned long out_cap;
+} __attribute__((aligned(64)));
+
+struct walk
+{
+	struct worker *workers;
+	unsigned nworkers;
+	void **visited;
+	unsigned long visited_nslots;
+	follow_ptr_fn *follow_ptr;
+	void *fp_arg;
+	on_blacken_fn *on_blacken;
+	void *ob_arg;
+	enum uniqtype_parallel_walk_ordering ordering;
+	pthread_mutex_t blacken_mutex;
+	unsigned nidle __attribute__((aligned(64)));
+	int error; /* an errno value, once the walk has failed */
+};
+
+static void fail(struct walk *w, int error)
+{
+	int expected = 0;
+	__atomic_compare_exchange_n(&w->error, &expected, error, 0,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+static _Bool failed(struct walk *w)
+{
+	return __atomic_load_n(&w->error, __ATOMIC_ACQUIRE) != 0;
+}
+
+static node_rec *make_node(struct worker *me, void *obj, struct uniqtype *t)
+{
+	node_rec *node;
+	if (me->free_list)
+	{
+		node = me->free_list;
+		me->free_list = node->next;
+	}
+	else
+	{
+		if (!me->blocks || me->nused_in_first == NODE_BLOCK_NNODES)
+		{
+			struct node_block *b = malloc(sizeof (struct node_block));
+			if (!b) return NULL;
+			b->next = me->blocks;
+			me->blocks = b;
+			me->nused_in_first = 0;
+		}
+		node = &me->blocks->nodes[me->nused_in_first++];
+	}
+	*node = (node_rec) { .obj = obj, .t = t, .free = arena_node_free };
+	return node;
+}
+
+static inline unsigned long hash_addr(const void *k)
+{
+	unsigned long h = ((uintptr_t) k >> 3) * 0x9e3779b97f4a7c15ul;
+	return h ^ (h >> 32);
+}
+
+/* Returns 1 iff we are the first to claim obj, 0 if someone else did,
+ * or -1 if the visited set is full (the caller's max_objects was too small). */
+static int claim(struct walk *w, void *obj)
+{
+	unsigned long mask = w->visited_nslots - 1;
+	unsigned long i = hash_addr(obj) & mask;
+	for (unsigned long nprobed = 0; nprobed < w->visited_nslots; ++nprobed, i = (i + 1) & mask)
+	{
+		void *k = __atomic_load_n(&w->visited[i], __ATOMIC_RELAXED);
+		if (k == obj) return 0;
+		if (!k)
+		{
+			void *expected = NULL;
+			if (__atomic_compare_exchange_n(&w->visited[i], &expected, obj, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) return 1;
+			if (expected == obj) return 0;
+		}
+	}
+	return -1;
+}
+
+/* Claim obj and queue it on me; false if the walk has failed. */
+static _Bool claim_and_push(struct worker *me, void *obj, struct uniqtype *t)
+{
+	int claimed = claim(me->w, obj);
+	if (claimed == 0) return 1;
+	if (claimed < 0) { fail(me->w, ENOSPC); return 0; }
+	node_rec *n = make_node(me, obj, t);
+	if (!n || !deque_push(&me->q, n)) { fail(me->w, ENOMEM); return 0; }
+	return 1;
+}
+
+static void push_if_unclaimed(void *from_obj, struct uniqtype *from_t,
+	void *to_obj, struct uniqtype *to_t, void *arg)
+{
+	struct worker *me = arg;
+	++me->nedges;
+	if (!failed(me->w)) claim_and_push(me, to_obj, to_t);
+}
+
+static void blacken(struct worker *me, node_rec *u)
+{
+	struct walk *w = me->w;
+	++me->nblackened;
+	switch (w->ordering)
+	{
+		case UNIQTYPE_PARALLEL_WALK_UNORDERED:
+			w->on_blacken(u->obj, u->t, w->ob_arg);
+			break;
+		case UNIQTYPE_PARALLEL_WALK_SERIALISED:
+			pthread_mutex_lock(&w->blacken_mutex);
+			w->on_blacken(u->obj, u->t, w->ob_arg);
+			pthread_mutex_unlock(&w->blacken_mutex);
+			break;
+		case UNIQTYPE_PARALLEL_WALK_ADDRESS_ORDER:
+			if (me->nout == me->out_cap)
+			{
+				unsigned long new_cap = me->out_cap ? 2 * me->out_cap : 4096;
+				void *new_out = realloc(me->out, new_cap * sizeof *me->out);
+				if (!new_out) { fail(w, ENOMEM); return; }
+				me->out = new_out;
+				me->out_cap = new_cap;
+			}
+			me->out[me->nout++] = (struct uniqtype_parallel_walk_item) { u->obj, u->t };
+			break;
+		default: abort();
+	}
+}
+
+static void process(struct worker *me, node_rec *u)
+{
+	__uniqtype_for_each_pointer_edge(u->obj, u->t,
+		me->w->follow_ptr, me->w->fp_arg,
+		push_if_unclaimed, me);
+	blacken(me, u);
+	if (u->free == arena_node_free)
+	{
+		u->next = me->free_list;
+		me->free_list = u;
+	}
+	else u->free(u);
+}
+
+static node_rec *try_steal(struct worker *me)
+{
+	struct walk *w = me->w;
+	/* xorshift, to pick a starting victim */
+	me->seed ^= me->seed << 13; me->seed ^= me->seed >> 7; me->seed ^= me->seed << 17;
+	unsigned start = me->seed % w->nworkers;
+	for (unsigned i = 0; i < w->nworkers; ++i)
+	{
+		struct worker *victim = &w->workers[(start + i) % w->nworkers];
+		if (victim == me) continue;
+		node_rec *n;
+		do { n = deque_steal(&victim->q); } while (n == DEQUE_ABORT);
+		if (n) return n;
+	}
+	return NULL;
+}
+
+static _Bool any_looks_nonempty(struct walk *w)
+{
+	for (unsigned i = 0; i < w->nworkers; ++i)
+	{
+		if (deque_looks_nonempty(&w->workers[i].q)) return 1;
+	}
+	return 0;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *me = arg;
+	struct walk *w = me->w;
+	for (;;)
+	{
+		node_rec *u;
+		while (!failed(w) && NULL != (u = deque_take(&me->q))) process(me, u);
+		if (failed(w)) return NULL;
+		if (NULL != (u = try_steal(me))) { process(me, u); continue; }
+
+		/* Nothing for us. Go idle until there's something to steal, or we're done. */
+		__atomic_add_fetch(&w->nidle, 1, __ATOMIC_ACQ_REL);
+		for (;;)
+		{
+			if (__atomic_load_n(&w->nidle, __ATOMIC_ACQUIRE) == w->nworkers
+					|| failed(w)) return NULL;
+			if (any_looks_nonempty(w))
+			{
+				__atomic_sub_fetch(&w->nidle, 1, __ATOMIC_ACQ_REL);
+				if (NULL != (u = try_steal(me))) { process(me, u); break; }
+				__atomic_add_fetch(&w->nidle, 1, __ATOMIC_ACQ_REL);
+			}
+			else sched_yield();
+		}
+	}
+}
+
+static int compare_items(const void *p1, const void *p2)
+{
+	uintptr_t a1 = (uintptr_t) ((const struct uniqtype_parallel_walk_item *) p1)->obj;
+	uintptr_t a2 = (uintptr_t) ((const struct uniqtype_parallel_walk_item *) p2)->obj;
+	return (a1 > a2) - (a1 < a2);
+}
+
+static unsigned long next_power_of_two_ge(unsigned long n)
+{
+	unsigned long p = 1;
+	while (p < n) p <<= 1;
+	return p;
+}
+
+static unsigned long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+static void destroy_workers(struct walk *w, unsigned ninitialised)
+{
+	for (unsigned i = 0; i < ninitialised; ++i)
+	{
+		deque_destroy(&w->workers[i].q);
+		for (struct node_block *b = w->workers[i].blocks; b; )
+		{
+			struct node_block *next = b->next;
+			free(b);
+			b = next;
+		}
+		free(w->workers[i].out);
+	}
+	free(w->workers);
+}
+
+int __uniqtype_walk_parallel_from_objects(
+	void **objects, struct uniqtype **types, unsigned nobjects,
+	follow_ptr_fn *follow_ptr, void *fp_arg,
+	on_blacken_fn *on_blacken, void *ob_arg,
+	const struct uniqtype_parallel_walk_opts *opts,
+	struct uniqtype_bfs_stats *out_stats)
+{
+	unsigned long begin_ns = now_ns();
+	/* sysconf() can fail, giving -1. */
+	long nthreads = (opts && opts->nthreads) ? (long) opts->nthreads : sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1) nthreads = 1;
+	if (nthreads > UNIQTYPE_PARALLEL_WALK_MAX_THREADS) nthreads = UNIQTYPE_PARALLEL_WALK_MAX_THREADS;
+	unsigned nworkers = nthreads;
+	unsigned long max_objects = (opts && opts->max_objects) ? opts->max_objects
+		: UNIQTYPE_PARALLEL_WALK_DEFAULT_MAX_OBJECTS;
+	struct walk w = {
+		.nworkers = nworkers,
+		.visited_nslots = next_power_of_two_ge(2 * max_objects),
+		.follow_ptr = follow_ptr,
+		.fp_arg = fp_arg,
+		.on_blacken = on_blacken,
+		.ob_arg = ob_arg,
+		.ordering = opts ? opts->ordering : UNIQTYPE_PARALLEL_WALK_UNORDERED,
+		.blacken_mutex = PTHREAD_MUTEX_INITIALIZER
+	};
+	/* The visited set is sized up front; NORESERVE means we only pay for
+	 * the pages the hash actually touches. */
+	w.visited = mmap(NULL, w.visited_nslots * sizeof (void *), PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (w.visited == MAP_FAILED) { errno = ENOMEM; return -1; }
+	if (0 != posix_memalign((void**) &w.workers, 64, nworkers * sizeof (struct worker)))
+	{
+		munmap(w.visited, w.visited_nslots * sizeof (void *));
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(w.workers, 0, nworkers * sizeof (struct worker));
+	unsigned ninitialised = 0;
+	for (; ninitialised < nworkers; ++ninitialised)
+	{
+		struct worker *me = &w.workers[ninitialised];
+		me->w = &w;
+		me->idx = ninitialised;
+		me->seed = 0x2545f4914f6cdd1dul * (ninitialised + 1);
+		if (!deque_init(&me->q)) { fail(&w, ENOMEM); break; }
+	}
+	/* Deal the roots out round-robin, before anyone starts. */
+	for (unsigned i = 0; i < nobjects && !failed(&w); ++i)
+	{
+		if (!objects[i]) continue;
+		claim_and_push(&w.workers[i % nworkers], objects[i], types[i]);
+	}
+	/* The calling thread is worker 0. If we can't start the others, the walk
+	 * fails (they hold some of the roots), and any we did start stop at once. */
+	unsigned nstarted = 1;
+	for (; nstarted < nworkers && !failed(&w); ++nstarted)
+	{
+		if (0 != pthread_create(&w.workers[nstarted].thread, NULL, worker_main,
+				&w.workers[nstarted]))
+		{
+			fail(&w, EAGAIN);
+			break;
+		}
+	}
+	if (!failed(&w)) worker_main(&w.workers[0]);
+	for (unsigned i = 1; i < nstarted; ++i) pthread_join(w.workers[i].thread, NULL);
+
+	unsigned long nblackened = 0, nedges = 0, nout = 0;
+	for (unsigned i = 0; i < ninitialised; ++i)
+	{
+		nblackened += w.workers[i].nblackened;
+		nedges += w.workers[i].nedges;
+		nout += w.workers[i].nout;
+	}
+	struct uniqtype_parallel_walk_item *all = NULL;
+	if (w.ordering == UNIQTYPE_PARALLEL_WALK_ADDRESS_ORDER && !failed(&w)
+			&& !(all = malloc((nout ? nout : 1) * sizeof *all)))
+	{
+		fail(&w, ENOMEM);
+	}
+	if (all)
+	{
+		/* Deterministic (for a given reachable set), whatever the interleaving. */
+		unsigned long pos = 0;
+		for (unsigned i = 0; i < nworkers; ++i)
+		{
+			memcpy(all + pos, w.workers[i].out, w.workers[i].nout * sizeof *all);
+			pos += w.workers[i].nout;
+		}
+		qsort(all, nout, sizeof *all, compare_items);
+		for (unsigned long i = 0; i < nout; ++i) on_blacken(all[i].obj, all[i].t, ob_arg);
+		free(all);
+	}
+	destroy_workers(&w, ninitialised);
+	munmap(w.visited, w.visited_nslots * sizeof (void *));
+
+	if (out_stats)
+	{
+		unsigned long elapsed_ns = now_ns() - begin_ns;
+		*out_stats = (struct uniqtype_bfs_stats) {
+			.nblackened = nblackened,
+			.nedges = nedges,
+			.elapsed_ns = elapsed_ns,
+			.objects_per_sec = elapsed_ns ? (double) nblackened * 1.0e9 / elapsed_ns : 0.0
+		};
+	}
+	if (failed(&w))
+	{
+		errno = w.error;
+		return -1;
+	}
+	return 0;
+}
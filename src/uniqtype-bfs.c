@@ -3,13 +3,17 @@
 #include <stdint.h>
 #include <limits.h>
 #include <stdio.h>
-#include <search.h>
+#include <time.h>
 #include <assert.h>
 #include <string.h>
-#include <err.h>
+#include <pthread.h>
+#include "liballocs_private.h"
 #include "uniqtype.h"
 #include "uniqtype-bfs.h"
 
+/* The incremental walk's notify hooks run inside the generic malloc hooks,
+ * so all our memory comes from the private malloc, never the hooked one. */
+
 /* debugging */
 FILE* debug_out = NULL;
 #ifndef DEBUGGING_OUTPUT_FILENAME
@@ -20,94 +24,246 @@ const char *debugging_output_filename = DEBUGGING_OUTPUT_FILENAME;
 
 typedef __uniqtype_node_rec node_rec;
 
-static void build_adjacency_list_recursive(
-	node_rec **p_adj_u_head, node_rec **p_adj_u_tail, 
-	void *obj_start, struct uniqtype *obj_t, 
-	unsigned long start_offset, struct uniqtype *t_at_offset, 
-	follow_ptr_fn *follow_ptr, void *fp_arg);
-
-enum node_colour { WHITE, GREY, BLACK }; // WHITE == 0, so "absent" pair->v 0 means WHITE
-
-static node_rec *make_node(void *obj, struct uniqtype *t);
+enum node_colour { WHITE, GREY, BLACK }; // WHITE == 0, so an absent key means WHITE
 
-struct pair
+/* Visited set: open addressing on object address, linear probing.
+ * We only ever add or recolour, never remove, so no tombstones. */
+struct visited_entry
 {
 	const void *k;
-	uintptr_t v;
+	uintptr_t colour;
+	void *aux; /* if GREY, the queued node_rec; if BLACK, the uniqtype we saw */
 };
-/* The tsearch man page says 
- * "The first field in each node of the tree is a pointer to the corresponding
- * data item." */
-typedef struct internal_treenode_s
+struct visited_set
+{
+	struct visited_entry *slots;
+	unsigned long nslots; /* power of two */
+	unsigned long nused;
+};
+#define VISITED_SET_INITIAL_NSLOTS 4096
+
+static inline unsigned long hash_addr(const void *k)
 {
-	void *key;
-} internal_treenode;
-#define TREENODE_TO_PAIR_PTR(n) ((struct pair *)((n)->key))
+	unsigned long h = ((uintptr_t) k >> 3) * 0x9e3779b97f4a7c15ul;
+	return h ^ (h >> 32);
+}
 
-static int compar(const void *key1, const void *key2)
+static struct visited_entry *visited_find(struct visited_set *s, const void *k)
 {
-	return (uintptr_t) ((struct pair *) key1)->k - (uintptr_t) ((struct pair *) key2)->k;
+	unsigned long mask = s->nslots - 1;
+	for (unsigned long i = hash_addr(k) & mask; ; i = (i + 1) & mask)
+	{
+		if (s->slots[i].k == k || s->slots[i].k == NULL) return &s->slots[i];
+	}
 }
 
-static uintptr_t treemap_get(void *const *rootp, const void *key)
+static _Bool visited_init(struct visited_set *s, unsigned long nslots)
 {
-	/* Find an existing pair, if there is one. */
-	struct pair p = { key, 0 };
-	internal_treenode *found = tfind(&p, rootp, compar);
-	if (found)
+	s->slots = __wrap_dlcalloc(nslots, sizeof (struct visited_entry));
+	if (!s->slots) return 0;
+	s->nslots = nslots;
+	s->nused = 0;
+	return 1;
+}
+
+static _Bool visited_grow(struct visited_set *s)
+{
+	struct visited_set bigger;
+	if (!visited_init(&bigger, s->nslots * 2)) return 0;
+	for (unsigned long i = 0; i < s->nslots; ++i)
 	{
-		assert(TREENODE_TO_PAIR_PTR(found)->v != 0);
-		return TREENODE_TO_PAIR_PTR(found)->v; 
+		if (s->slots[i].k) *visited_find(&bigger, s->slots[i].k) = s->slots[i];
 	}
-	return 0ul;
+	bigger.nused = s->nused;
+	__wrap_dlfree(s->slots);
+	*s = bigger;
+	return 1;
 }
 
-static void treemap_set(void **rootp, const void *key, uintptr_t value)
+static uintptr_t visited_get(struct visited_set *s, const void *k)
+{
+	return visited_find(s, k)->colour; /* empty slots are zeroed, i.e. WHITE */
+}
+
+/* Returns false if k is new and there's no room for it. Null is our empty
+ * key, so it is never coloured. */
+static _Bool visited_set_colour(struct visited_set *s, const void *k, uintptr_t colour, void *aux)
+{
+	assert(k);
+	struct visited_entry *e = visited_find(s, k);
+	if (!e->k)
+	{
+		/* Keep the load factor under 1/2, or failing that, under 1. */
+		if (2 * (s->nused + 1) > s->nslots)
+		{
+			if (!visited_grow(s) && s->nused + 1 >= s->nslots) return 0;
+			e = visited_find(s, k);
+		}
+		e->k = k;
+		++s->nused;
+	}
+	e->colour = colour;
+	e->aux = aux;
+	return 1;
+}
+
+static void visited_destroy(struct visited_set *s)
+{
+	__wrap_dlfree(s->slots);
+	s->slots = NULL;
+	s->nslots = s->nused = 0;
+}
+
+/* Node records for the objects we discover are carved out of big blocks,
+ * recycled through a free list within a walk, and freed in bulk at the end.
+ * Their "free" member is a no-op marker so that callers holding one (e.g. in
+ * on_blacken) can't double-free it; we recognise the marker ourselves. */
+#define NODE_BLOCK_NNODES 4096
+struct node_block
+{
+	struct node_block *next;
+	node_rec nodes[NODE_BLOCK_NNODES];
+};
+struct node_arena
+{
+	struct node_block *blocks;
+	unsigned nused_in_first;
+	node_rec *free_list;
+};
+
+static void arena_node_free(void *ignored) {}
+
+static node_rec *make_node(struct node_arena *a, void *obj, struct uniqtype *t)
 {
-	/* Find an existing pair, if there is one. */
-	struct pair p = { key, value };
-	internal_treenode *found = tfind(&p, rootp, compar);
-	if (found)
+	node_rec *node;
+	if (a->free_list)
 	{
-		TREENODE_TO_PAIR_PTR(found)->v = value;
+		node = a->free_list;
+		a->free_list = node->next;
 	}
 	else
 	{
-		/* malloc a new node */
-		struct pair *p_new_pair = malloc(sizeof (struct pair));
-		if (!p_new_pair) { warn("insufficient memory"); abort(); }
-		/* initialize the new node with p's k/v */
-		memcpy(p_new_pair, &p, sizeof (struct pair));
-		/* tsearch will add it */
-		internal_treenode *inserted = tsearch(p_new_pair, rootp, compar);
-		assert(inserted->key == p_new_pair);
-		assert(treemap_get(rootp, key) == value);
+		if (!a->blocks || a->nused_in_first == NODE_BLOCK_NNODES)
+		{
+			struct node_block *b = __wrap_dlmalloc(sizeof (struct node_block));
+			if (!b) return NULL;
+			b->next = a->blocks;
+			a->blocks = b;
+			a->nused_in_first = 0;
+		}
+		node = &a->blocks->nodes[a->nused_in_first++];
 	}
+	*node = (node_rec) { .obj = obj, .t = t, .free = arena_node_free };
+	return node;
 }
 
-static void treemap_delete(void **rootp)
+static void release_node(struct node_arena *a, node_rec *n)
 {
-	tdestroy(*rootp, free);
+	if (n->free == arena_node_free)
+	{
+		n->next = a->free_list;
+		a->free_list = n;
+	}
+	else n->free(n);
+}
+
+static void arena_destroy(struct node_arena *a)
+{
+	for (struct node_block *b = a->blocks; b; )
+	{
+		struct node_block *next = b->next;
+		__wrap_dlfree(b);
+		b = next;
+	}
+	*a = (struct node_arena) { NULL, 0, NULL };
+}
+
+/* Everything one walk needs, so we don't thread six arguments everywhere. */
+struct bfs_state
+{
+	node_rec **p_q_head;
+	node_rec **p_q_tail;
+	struct visited_set visited;
+	struct node_arena arena;
+	follow_ptr_fn *follow_ptr;
+	void *fp_arg;
+	unsigned long nedges;
+	/* While an incremental slice has dropped its lock to call out, the
+	 * notify hooks log frees here (see process_bfs_queue_budgeted). */
+	_Bool calling_out;
+	_Bool freed_log_overflowed;
+	void **freed_log;
+	unsigned long freed_log_n;
+	unsigned long freed_log_cap;
+};
+
+static __thread struct uniqtype_bfs_stats last_stats;
+void __uniqtype_bfs_get_last_stats(struct uniqtype_bfs_stats *out)
+{
+	*out = last_stats;
+}
+
+static unsigned long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ul + ts.tv_nsec;
 }
 
 /* HACK: archdep */
 #define IS_PLAUSIBLE_POINTER(p) (!(p) || ((p) == (void*) -1) || (((uintptr_t) (p)) >= 4194304 && ((uintptr_t) (p)) < 0x800000000000ul))
 
-/* This function builds an adjacency list for the current node, by adding
- * *all* nodes, not just (despite the name) those pointed to by subobjects.
- * i.e. the top-level object is a zero-degree subobject. */
-static void build_adjacency_list_recursive(
-	node_rec **p_adj_u_head, node_rec **p_adj_u_tail, 
+/* Report the pointer held at obj_start + offset, whose static type is ptr_t,
+ * if it's a plausible non-null pointer. */
+static void visit_pointer_slot(void *obj_start, struct uniqtype *obj_t,
+	unsigned long offset, struct uniqtype *ptr_t,
+	follow_ptr_fn *follow_ptr, void *fp_arg,
+	on_edge_fn *on_edge, void *oe_arg)
+{
+	struct uniqtype *pointed_to_static_t = UNIQTYPE_POINTEE_TYPE(ptr_t);
+	// get the address of the pointed-to object
+	void *pointed_to_object = *(void**)((char*) obj_start + offset);
+	/* Check sanity of the pointer. We might be reading some union'd storage
+	 * that is currently holding a non-pointer. */
+	if (pointed_to_object && IS_PLAUSIBLE_POINTER(pointed_to_object))
+	{
+		void *ptr = pointed_to_object;
+		struct uniqtype *t = pointed_to_static_t;
+		follow_ptr(&ptr, &t, fp_arg);
+		if (ptr)
+		{
+			DEBUG_GUARD(fprintf(debug_out, "\t%s_at_%p -> %s_at_%p;\n", 
+				NAME_FOR_UNIQTYPE(obj_t), obj_start,
+				NAME_FOR_UNIQTYPE(t), ptr));
+			on_edge(obj_start, obj_t, ptr, t, oe_arg);
+		}
+	}
+	else if (!pointed_to_object || pointed_to_object == (void*) -1)
+	{
+		/* null pointer */
+	}
+	else
+	{
+		DEBUG_GUARD(fprintf(debug_out, "/* insane pointer value %p found at offset %lu "
+			"in object %p, type %s */\n",
+			pointed_to_object,
+			offset,
+			obj_start,
+			NAME_FOR_UNIQTYPE(obj_t)
+		));
+	}
+}
+
+/* This function reports every outgoing edge of the current node, by walking
+ * *all* its subobjects, not just those directly at the top level. */
+static void for_each_edge_recursive(
 	void *obj_start, struct uniqtype *obj_t, 
-	unsigned long start_offset, struct uniqtype *t_at_offset, 
-	follow_ptr_fn *follow_ptr, void *fp_arg)
+	unsigned long start_offset, struct uniqtype *t_at_offset,
+	follow_ptr_fn *follow_ptr, void *fp_arg,
+	on_edge_fn *on_edge, void *oe_arg)
 {
 	if (t_at_offset == &__uniqtype__void) return;
 	
-	fprintf(stderr, "Descending through subobjects of object at %p, "
-		"currently at subobject offset %ld of type %s\n",
-		obj_start, start_offset, NAME_FOR_UNIQTYPE(t_at_offset));
-	
 	// If someone tries to walk_bfs from a function pointer, we will try to
 	// bootstrap the list from a queue consisting of a single object (the function)
 	// and no type. If so, the list is already complete (i.e. empty), so return
@@ -140,120 +296,308 @@ static void build_adjacency_list_recursive(
 		long memb_offset = is_array ? (i * UNIQTYPE_ARRAY_ELEMENT_TYPE(t_at_offset)->pos_maxoff) 
 			: related->un.memb.off;
 		
-		/* Is it a pointer? If so, add it to the adjacency list. */
+		/* Is it a pointer? If so, it's an edge. */
 		if (UNIQTYPE_IS_POINTER_TYPE(element_type))
 		{
-			struct uniqtype *pointed_to_static_t = UNIQTYPE_POINTEE_TYPE(element_type);
-			// get the address of the pointed-to object
-			void *pointed_to_object = *(void**)((char*) obj_start + start_offset + memb_offset);
-			/* Check sanity of the pointer. We might be reading some union'd storage
-			 * that is currently holding a non-pointer. */
-			node_rec *to_enqueue = NULL;
-			if (pointed_to_object && IS_PLAUSIBLE_POINTER(pointed_to_object))
-			{
-				/* make a node and put it in the adjacency list */
-				void *ptr = pointed_to_object;
-				struct uniqtype *t = pointed_to_static_t;
-				follow_ptr(&ptr, &t, fp_arg);
-				if (ptr)
-				{
-					to_enqueue = make_node(ptr, t);
-					__uniqtype_node_queue_push_tail(p_adj_u_head, p_adj_u_tail, to_enqueue);
-
-					DEBUG_GUARD(fprintf(debug_out, "\t%s_at_%p -> %s_at_%p;\n", 
-						NAME_FOR_UNIQTYPE(obj_t), obj_start,
-						NAME_FOR_UNIQTYPE(to_enqueue->t), to_enqueue->obj));
-				}
-			}
-			else if (!pointed_to_object || pointed_to_object == (void*) -1)
-			{
-				/* null pointer */
-			}
-			else
-			{
-				fprintf(stderr, "Warning: insane pointer value %p found in field index %d in object %p, type %s\n",
-					pointed_to_object,
-					i,
-					(char*) obj_start + start_offset,
-					NAME_FOR_UNIQTYPE(t_at_offset)
-				);
-			}
-			if (to_enqueue && to_enqueue->obj) fprintf(stderr, "Found a pointed-to object at %p, statically of type %s, "
-				"added as %p of type %s\n",
-				pointed_to_object, NAME_FOR_UNIQTYPE(pointed_to_static_t),
-				to_enqueue->obj, NAME_FOR_UNIQTYPE(to_enqueue->t));
+			visit_pointer_slot(obj_start, obj_t, start_offset + memb_offset, element_type,
+				follow_ptr, fp_arg, on_edge, oe_arg);
 		}
 		else if (UNIQTYPE_IS_COMPOSITE_TYPE(element_type)) /* Else is it a thing with structure? If so, recurse. */
 		{
-			build_adjacency_list_recursive(
-				p_adj_u_head, p_adj_u_tail, 
+			for_each_edge_recursive(
 				obj_start, obj_t, 
 				start_offset + memb_offset, element_type,
-				follow_ptr, fp_arg
+				follow_ptr, fp_arg,
+				on_edge, oe_arg
 			);
 		}
 	}
 }
 
-static void process_bfs_queue_and_maps(
-	node_rec **p_q_head,
-	node_rec **p_q_tail,
-	void **p_colours_root,
-	void **p_distances_root,
-	void **p_predecessors_root,
+/* Visit the pointer slots of a t at obj_start + offset, using its pointer map
+ * (see uniqtype-ptrmaps.c). Returns 0 if there is no usable map. */
+static _Bool for_each_edge_from_map(
+	void *obj_start, struct uniqtype *obj_t,
+	unsigned long offset, struct uniqtype *t,
 	follow_ptr_fn *follow_ptr, void *fp_arg,
-	on_blacken_fn *on_blacken, void *ob_arg)
+	on_edge_fn *on_edge, void *oe_arg)
 {
-	while (!__uniqtype_node_queue_empty(*p_q_head))
+	const unsigned long *map = __liballocs_uniqtype_ptrmap(t);
+	if (!UNIQTYPE_PTRMAP_IS_KNOWN(map)) return 0;
+	if (UNIQTYPE_PTRMAP_HAS_NO_POINTERS(map)) return 1;
+	struct uniqtype *const *slot_types = __liballocs_uniqtype_ptrmap_slot_types(t);
+	if (!slot_types) return 0;
+	for (unsigned long w = 0; w < UNIQTYPE_PTRMAP_NWORDS(map); ++w)
 	{
-		node_rec *u = __uniqtype_node_queue_pop_head(p_q_head, p_q_tail);
-	
-		treemap_set(p_colours_root, u->obj, GREY);
-		
-		/* create the adjacency list for u, by flattening the subobject hierarchy */
-		node_rec *adj_u_head = NULL;
-		node_rec *adj_u_tail = NULL;
-		build_adjacency_list_recursive(&adj_u_head, &adj_u_tail, 
-			u->obj, u->t, 
-			/* start offset */ 0, u->t, 
-			follow_ptr, fp_arg
-		);
-		/* ^-- this starts at the top-level subobject, i.e. the object, so it builds
-		 * the complete adjacency list for this node. */
+		for (unsigned long bits = map[1 + w]; bits; bits &= bits - 1)
+		{
+			unsigned long slot = w * UNIQTYPE_PTRMAP_SLOTS_PER_WORD + __builtin_ctzl(bits);
+			visit_pointer_slot(obj_start, obj_t, offset + slot * sizeof (void*),
+				*slot_types++, follow_ptr, fp_arg, on_edge, oe_arg);
+		}
+	}
+	return 1;
+}
 
-		/* now that we have the adjacency list, enqueue any adjacent nodes that are white */
-		node_rec *v;
-		while ((v = __uniqtype_node_queue_pop_head(&adj_u_head, &adj_u_tail)) != NULL)
+void __uniqtype_for_each_pointer_edge(void *obj, struct uniqtype *t,
+	follow_ptr_fn *follow_ptr, void *fp_arg,
+	on_edge_fn *on_edge, void *oe_arg)
+{
+	if (!t || t == &__uniqtype__void || !UNIQTYPE_HAS_SUBOBJECTS(t)) return;
+	/* Fast path: use pointer maps. Arrays, including the synthesised ones
+	 * we get for heap chunks, are scanned as repetitions of their element. */
+	if (__liballocs_uniqtype_ptrmap)
+	{
+		if (!UNIQTYPE_IS_ARRAY_TYPE(t))
 		{
-			/* We initialise all nodes' colours to NULL a.k.a. WHITE */
-			uintptr_t colour = treemap_get(p_colours_root, v->obj);
-			fprintf(stderr, "From object at %p, type %s, considering adjacent object at %p, of type %s, colour %s\n",
-				u->obj, NAME_FOR_UNIQTYPE(u->t),
-				v->obj, NAME_FOR_UNIQTYPE(v->t), 
-				(colour == WHITE) ? "white" : (colour == GREY) ? "grey" : (colour == BLACK) ? "black" : "unknown"
-			);
-			if (colour == WHITE)
+			if (for_each_edge_from_map(obj, t, 0, t, follow_ptr, fp_arg, on_edge, oe_arg)) return;
+		}
+		else
+		{
+			struct uniqtype *element_t = UNIQTYPE_ARRAY_ELEMENT_TYPE(t);
+			if (__liballocs_uniqtype_has_no_pointers(element_t)) return;
+			if (t->un.array.nelems != UNIQTYPE_ARRAY_LENGTH_UNBOUNDED
+				&& UNIQTYPE_HAS_KNOWN_LENGTH(element_t)
+				&& UNIQTYPE_PTRMAP_IS_KNOWN(__liballocs_uniqtype_ptrmap(element_t)))
 			{
-				treemap_set(p_colours_root, v->obj, GREY);
-				treemap_set(p_distances_root, v->obj, treemap_get(p_distances_root, v->obj) + 1);
-				treemap_set(p_predecessors_root, v->obj, (uintptr_t) v->obj);
-				fprintf(stderr, "Enqueued object at %p, type %s\n", 
-					v->obj, NAME_FOR_UNIQTYPE(v->t));
-				__uniqtype_node_queue_push_tail(p_q_head, p_q_tail, v); // the queue takes our copy of v, which we're finished with
+				/* Whether the map is usable depends only on the element type,
+				 * so if it isn't, we find out at i == 0, before any edges. */
+				unsigned i;
+				for (i = 0; i < t->un.array.nelems; ++i)
+				{
+					if (!for_each_edge_from_map(obj, t, i * element_t->pos_maxoff, element_t,
+						follow_ptr, fp_arg, on_edge, oe_arg)) break;
+				}
+				if (i == t->un.array.nelems) return;
+				assert(i == 0);
 			}
-			else v->free(v);
 		}
+	}
+	for_each_edge_recursive(obj, t, 0, t, follow_ptr, fp_arg, on_edge, oe_arg);
+}
+
+/* We used to build a separate adjacency list and then filter it; colouring
+ * as we go enqueues the same nodes, in the same order, without allocating
+ * the rejects. */
+static void enqueue_if_white(void *from_obj, struct uniqtype *from_t,
+	void *to_obj, struct uniqtype *to_t, void *arg)
+{
+	struct bfs_state *st = arg;
+	++st->nedges;
+	if (visited_get(&st->visited, to_obj) == WHITE)
+	{
+		/* If we're out of memory, we just don't walk this object. */
+		node_rec *n = make_node(&st->arena, to_obj, to_t);
+		if (!n) return;
+		if (!visited_set_colour(&st->visited, to_obj, GREY, n))
+		{
+			release_node(&st->arena, n);
+			return;
+		}
+		__uniqtype_node_queue_push_tail(st->p_q_head, st->p_q_tail, n);
+	}
+}
 
-		/* blacken u, and call the function for it */
-		treemap_set(p_colours_root, u->obj, BLACK);
-		on_blacken(u->obj, u->t, ob_arg);
-		u->free(u);
+/* For incremental walks, we collect a node's edges under the lock, but
+ * call follow_ptr on them without it. */
+struct pending_edge
+{
+	void *obj;
+	struct uniqtype *t;
+};
+struct pending_edges
+{
+	struct pending_edge *edges;
+	unsigned long n;
+	unsigned long cap;
+	_Bool overflowed;
+};
+
+static void collect_edge(void *from_obj, struct uniqtype *from_t,
+	void *to_obj, struct uniqtype *to_t, void *arg)
+{
+	struct pending_edges *p = arg;
+	if (p->n == p->cap)
+	{
+		unsigned long new_cap = p->cap ? 2 * p->cap : 64;
+		void *new_edges = __wrap_dlrealloc(p->edges, new_cap * sizeof (struct pending_edge));
+		if (!new_edges) { p->overflowed = 1; return; }
+		p->edges = new_edges;
+		p->cap = new_cap;
+	}
+	p->edges[p->n++] = (struct pending_edge) { to_obj, to_t };
+}
+
+static void log_freed(struct bfs_state *st, void *obj)
+{
+	if (st->freed_log_n == st->freed_log_cap)
+	{
+		unsigned long new_cap = st->freed_log_cap ? 2 * st->freed_log_cap : 16;
+		void *new_log = __wrap_dlrealloc(st->freed_log, new_cap * sizeof (void *));
+		if (!new_log) { st->freed_log_overflowed = 1; return; }
+		st->freed_log = new_log;
+		st->freed_log_cap = new_cap;
+	}
+	st->freed_log[st->freed_log_n++] = obj;
+}
+
+static _Bool freed_while_calling_out(struct bfs_state *st, void *obj)
+{
+	if (st->freed_log_overflowed) return 1;
+	for (unsigned long i = 0; i < st->freed_log_n; ++i)
+	{
+		if (st->freed_log[i] == obj) return 1;
+	}
+	return 0;
+}
+
+static void begin_calling_out(struct bfs_state *st, pthread_mutex_t *lock)
+{
+	st->calling_out = 1;
+	st->freed_log_n = 0;
+	st->freed_log_overflowed = 0;
+	pthread_mutex_unlock(lock);
+}
+
+static void end_calling_out(struct bfs_state *st, pthread_mutex_t *lock)
+{
+	pthread_mutex_lock(lock);
+	st->calling_out = 0;
+}
+
+/* Enqueue u's white neighbours, by flattening the subobject hierarchy. This
+ * starts at the top-level subobject, i.e. the object, so it considers every
+ * outgoing edge of this node. Without a lock, that's all there is to it. With
+ * one, follow_ptr may do anything, including free things, so we read the
+ * pointers under the lock, call follow_ptr without it, and then drop any
+ * target that was freed meanwhile: nobody told us it was grey. */
+static void enqueue_white_neighbours(struct bfs_state *st, node_rec *u,
+	pthread_mutex_t *lock, struct pending_edges *pending)
+{
+	if (!lock)
+	{
+		__uniqtype_for_each_pointer_edge(u->obj, u->t,
+			st->follow_ptr, st->fp_arg,
+			enqueue_if_white, st
+		);
+		return;
+	}
+	pending->n = 0;
+	pending->overflowed = 0;
+	st->freed_log_n = 0;
+	st->freed_log_overflowed = 0;
+	__uniqtype_for_each_pointer_edge(u->obj, u->t,
+		__uniqtype_default_follow_ptr, NULL,
+		collect_edge, pending
+	);
+	if (pending->overflowed) debug_printf(1, "incremental walk: dropped edges from %p\n", u->obj);
+	if (st->follow_ptr != __uniqtype_default_follow_ptr)
+	{
+		begin_calling_out(st, lock);
+		for (unsigned long i = 0; i < pending->n; ++i)
+		{
+			st->follow_ptr(&pending->edges[i].obj, &pending->edges[i].t, st->fp_arg);
+		}
+		end_calling_out(st, lock);
+	}
+	for (unsigned long i = 0; i < pending->n; ++i)
+	{
+		struct pending_edge *e = &pending->edges[i];
+		if (!e->obj || freed_while_calling_out(st, e->obj)) continue;
+		enqueue_if_white(u->obj, u->t, e->obj, e->t, st);
+	}
+}
+
+/* Process the queue until it empties, or max_objects have been blackened,
+ * or the clock passes deadline_ns (0 means no limit). We check the clock every
+ * few objects. If lock is non-null, we hold it while touching the queue, the
+ * visited set or any object, but never while calling out to follow_ptr or
+ * on_blacken, which may do anything (including free the object we're on,
+ * or wait for another thread that is freeing something). That is also what
+ * lets the malloc hooks (see below) get in. Returns nonzero if work remains. */
+#define BUDGET_CHECK_INTERVAL 16
+static _Bool process_bfs_queue_budgeted(struct bfs_state *st,
+	on_blacken_fn *on_blacken, void *ob_arg,
+	unsigned long max_objects, unsigned long deadline_ns, pthread_mutex_t *lock,
+	unsigned long *p_nblackened)
+{
+	unsigned long nblackened = 0;
+	struct pending_edges pending = { NULL, 0, 0, 0 };
+	_Bool more;
+	if (lock) pthread_mutex_lock(lock);
+	while ((more = !__uniqtype_node_queue_empty(*st->p_q_head)))
+	{
+		if (max_objects && nblackened >= max_objects) break;
+		if (nblackened % BUDGET_CHECK_INTERVAL == BUDGET_CHECK_INTERVAL - 1)
+		{
+			if (deadline_ns && now_ns() >= deadline_ns) break;
+		}
+		node_rec *u = __uniqtype_node_queue_pop_head(st->p_q_head, st->p_q_tail);
+		if (!u->obj)
+		{
+			/* Freed while grey (see __uniqtype_bfs_notify_free). */
+			release_node(&st->arena, u);
+			continue;
+		}
 		
+		enqueue_white_neighbours(st, u, lock, &pending);
+		/* If u was freed while follow_ptr ran, it's no longer grey (its
+		 * visited entry is now white), so don't blacken it. Its edges were
+		 * read while it was live, so we keep them. */
+		if (!u->obj)
+		{
+			release_node(&st->arena, u);
+			continue;
+		}
+
+		/* blacken u, and call the function for it */
+		void *obj = u->obj;
+		struct uniqtype *t = u->t;
+		visited_set_colour(&st->visited, obj, BLACK, t);
+		release_node(&st->arena, u);
 		/* Note that it doesn't matter if u's address gets recycled, because 
 		 * we don't use it as a key in a map -- object addresses are keys. */
+		if (lock) begin_calling_out(st, lock);
+		on_blacken(obj, t, ob_arg);
+		if (lock) end_calling_out(st, lock);
+		++nblackened;
 	}
+	if (lock) pthread_mutex_unlock(lock);
+	__wrap_dlfree(pending.edges);
+	*p_nblackened = nblackened;
+	return more;
+}
+
+static void record_stats(struct bfs_state *st, unsigned long nblackened, unsigned long elapsed_ns)
+{
+	last_stats = (struct uniqtype_bfs_stats) {
+		.nblackened = nblackened,
+		.nedges = st->nedges,
+		.elapsed_ns = elapsed_ns,
+		.objects_per_sec = elapsed_ns ? (double) nblackened * 1.0e9 / elapsed_ns : 0.0
+	};
+	DEBUG_GUARD(fprintf(debug_out, "/* blackened %lu objects (%lu edges) in %lu ns: %.0f objects/s */\n",
+		nblackened, st->nedges, elapsed_ns, last_stats.objects_per_sec));
 	DEBUG_GUARD(fflush(debug_out));
-	DEBUG_GUARD(fprintf(debug_out, "}\n"));
+}
+
+static void grey_initial_queue(struct bfs_state *st)
+{
+	/* Anything already in the queue (from our caller) is grey. */
+	for (node_rec *n = *st->p_q_head; n; n = n->next)
+	{
+		visited_set_colour(&st->visited, n->obj, GREY, n);
+	}
+}
+
+static void process_bfs_queue(struct bfs_state *st,
+	on_blacken_fn *on_blacken, void *ob_arg)
+{
+	unsigned long nblackened;
+	unsigned long begin_ns = now_ns();
+	grey_initial_queue(st);
+	process_bfs_queue_budgeted(st, on_blacken, ob_arg, 0, 0, NULL, &nblackened);
+	record_stats(st, nblackened, now_ns() - begin_ns);
 }
 void __uniqtype_process_bfs_queue(
 	node_rec **p_q_head,
@@ -261,18 +605,16 @@ void __uniqtype_process_bfs_queue(
 	follow_ptr_fn *follow_ptr, void *fp_arg,
 	on_blacken_fn *on_blacken, void *ob_arg)
 {
-	void *colours_root = NULL; /* map void* -> node_colour */
-	void *distances_root = NULL; /* map void* -> int */
-	void *predecessors_root = NULL; /* map void* -> void* */
-	
-	process_bfs_queue_and_maps(p_q_head, p_q_tail, 
-		&colours_root, &distances_root, &predecessors_root,
-		follow_ptr, fp_arg,
-		on_blacken, ob_arg
-	);
-	treemap_delete(&colours_root);
-	treemap_delete(&distances_root);
-	treemap_delete(&predecessors_root);
+	struct bfs_state st = {
+		.p_q_head = p_q_head,
+		.p_q_tail = p_q_tail,
+		.follow_ptr = follow_ptr,
+		.fp_arg = fp_arg
+	};
+	if (!visited_init(&st.visited, VISITED_SET_INITIAL_NSLOTS)) return;
+	process_bfs_queue(&st, on_blacken, ob_arg);
+	visited_destroy(&st.visited);
+	arena_destroy(&st.arena);
 }
 void __uniqtype_walk_bfs_from_object(
 	void *object, struct uniqtype *t,
@@ -293,28 +635,214 @@ void __uniqtype_walk_bfs_from_object(
 	
 	node_rec *q_head = NULL;
 	node_rec *q_tail = NULL;
+	struct bfs_state st = {
+		.p_q_head = &q_head,
+		.p_q_tail = &q_tail,
+		.follow_ptr = follow_ptr,
+		.fp_arg = fp_arg
+	};
+	if (!visited_init(&st.visited, VISITED_SET_INITIAL_NSLOTS)) return;
 	
 	/* Make an initial node. Don't adjust the pointer. */
-	node_rec *to_enqueue = make_node(object, t);
+	node_rec *to_enqueue = make_node(&st.arena, object, t);
+	if (!to_enqueue)
+	{
+		visited_destroy(&st.visited);
+		return;
+	}
 	__uniqtype_node_queue_push_tail(&q_head, &q_tail, to_enqueue);
 	
 	/* Sanity check: assert that our object's start is non-null and within 128MB of our pointer. */
 	assert(!to_enqueue || ((char*) to_enqueue->obj <= (char*) object
 						&& (char*) object - (char*)to_enqueue->obj < (1U<<27)));
 	
-	__uniqtype_process_bfs_queue(&q_head, &q_tail, follow_ptr, fp_arg, on_blacken, ob_arg);
+	process_bfs_queue(&st, on_blacken, ob_arg);
+	visited_destroy(&st.visited);
+	arena_destroy(&st.arena);
 	
 	DEBUG_GUARD(fprintf(debug_out, "}\n"));
 }
 
-static node_rec *make_node(void *obj, struct uniqtype *t)
+/* Incremental walks. The grey queue and the visited set live in a
+ * continuation between slices, so a request-serving process can do a bounded
+ * amount of work (in objects or nanoseconds) between requests.
+ *
+ * The mutator keeps running between slices. We do not have a write barrier,
+ * so this is a best-effort snapshot, with the following documented rules.
+ * - An object freed while grey is dropped from the queue; one freed while
+ *   black is forgotten (whitened), so a new object at the same address
+ *   will be walked if it becomes reachable from a grey object.
+ * - An object realloc'd in place while black is re-greyed, since it may now
+ *   hold more pointers; one moved by realloc keeps its colour at its new
+ *   address (black objects are re-greyed there, grey ones stay queued).
+ * - A pointer stored into an already-black object after it was blackened is
+ *   not seen, so objects only reachable that way may be missed.
+ * The generic malloc hooks call __uniqtype_bfs_notify_free and _realloc; a
+ * client with its own allocator can call them too. They run inside the
+ * allocator, so they must not use it; we use the private malloc throughout.
+ * If we run out of memory, the objects concerned are simply not walked.
+ * All incremental walks share one (recursive) lock, which a slice drops
+ * around every callback; frees on other threads wait for at most one
+ * object's scan, and only while some incremental walk is active. */
+struct uniqtype_bfs_continuation
 {
-	node_rec *node = calloc(1, sizeof (node_rec));
-	if (!node) { warn("insufficient memory"); abort(); }
-	node->obj = obj;
-	node->t = t;
-	node->free = free;
-	return node;
+	node_rec *q_head;
+	node_rec *q_tail;
+	struct bfs_state st;
+	on_blacken_fn *on_blacken;
+	void *ob_arg;
+	struct uniqtype_bfs_stats total;
+	struct uniqtype_bfs_continuation *next_active;
+};
+static pthread_mutex_t incremental_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static struct uniqtype_bfs_continuation *active_walks;
+static unsigned nactive_walks;
+
+struct uniqtype_bfs_continuation *__uniqtype_bfs_begin_incremental(
+	void *object, struct uniqtype *t,
+	follow_ptr_fn *follow_ptr, void *fp_arg,
+	on_blacken_fn *on_blacken, void *ob_arg)
+{
+	struct uniqtype_bfs_continuation *k = __wrap_dlcalloc(1, sizeof (struct uniqtype_bfs_continuation));
+	if (!k) return NULL;
+	k->st = (struct bfs_state) {
+		.p_q_head = &k->q_head,
+		.p_q_tail = &k->q_tail,
+		.follow_ptr = follow_ptr,
+		.fp_arg = fp_arg
+	};
+	k->on_blacken = on_blacken;
+	k->ob_arg = ob_arg;
+	if (!visited_init(&k->st.visited, VISITED_SET_INITIAL_NSLOTS))
+	{
+		__wrap_dlfree(k);
+		return NULL;
+	}
+	if (object)
+	{
+		node_rec *n = make_node(&k->st.arena, object, t);
+		if (!n)
+		{
+			visited_destroy(&k->st.visited);
+			__wrap_dlfree(k);
+			return NULL;
+		}
+		visited_set_colour(&k->st.visited, object, GREY, n);
+		__uniqtype_node_queue_push_tail(&k->q_head, &k->q_tail, n);
+	}
+	pthread_mutex_lock(&incremental_lock);
+	k->next_active = active_walks;
+	active_walks = k;
+	__atomic_add_fetch(&nactive_walks, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&incremental_lock);
+	return k;
+}
+
+int __uniqtype_bfs_resume(struct uniqtype_bfs_continuation *k,
+	unsigned long max_objects, unsigned long max_ns)
+{
+	unsigned long begin_ns = now_ns();
+	unsigned long nblackened;
+	unsigned long nedges_before = k->st.nedges;
+	_Bool more = process_bfs_queue_budgeted(&k->st, k->on_blacken, k->ob_arg,
+		max_objects, max_ns ? begin_ns + max_ns : 0, &incremental_lock, &nblackened);
+	unsigned long elapsed_ns = now_ns() - begin_ns;
+	record_stats(&k->st, nblackened, elapsed_ns);
+	last_stats.nedges = k->st.nedges - nedges_before;
+	k->total.nblackened += nblackened;
+	k->total.nedges = k->st.nedges;
+	k->total.elapsed_ns += elapsed_ns;
+	k->total.objects_per_sec = k->total.elapsed_ns ?
+		(double) k->total.nblackened * 1.0e9 / k->total.elapsed_ns : 0.0;
+	return more;
+}
+
+void __uniqtype_bfs_get_incremental_stats(struct uniqtype_bfs_continuation *k,
+	struct uniqtype_bfs_stats *out)
+{
+	*out = k->total;
+}
+
+void __uniqtype_bfs_finish_incremental(struct uniqtype_bfs_continuation *k)
+{
+	pthread_mutex_lock(&incremental_lock);
+	for (struct uniqtype_bfs_continuation **p = &active_walks; *p; p = &(*p)->next_active)
+	{
+		if (*p == k) { *p = k->next_active; break; }
+	}
+	__atomic_sub_fetch(&nactive_walks, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&incremental_lock);
+	/* Any nodes still queued belong to our arena, unless the caller gave them. */
+	node_rec *n;
+	while (NULL != (n = __uniqtype_node_queue_pop_head(&k->q_head, &k->q_tail)))
+	{
+		release_node(&k->st.arena, n);
+	}
+	visited_destroy(&k->st.visited);
+	arena_destroy(&k->st.arena);
+	__wrap_dlfree(k->st.freed_log);
+	__wrap_dlfree(k);
+}
+
+static void regrey(struct uniqtype_bfs_continuation *k, void *obj, struct uniqtype *t)
+{
+	node_rec *n = make_node(&k->st.arena, obj, t);
+	if (!n) return;
+	if (!visited_set_colour(&k->st.visited, obj, GREY, n))
+	{
+		release_node(&k->st.arena, n);
+		return;
+	}
+	__uniqtype_node_queue_push_tail(&k->q_head, &k->q_tail, n);
+}
+
+void __uniqtype_bfs_notify_free(void *obj)
+{
+	if (!__atomic_load_n(&nactive_walks, __ATOMIC_ACQUIRE)) return;
+	pthread_mutex_lock(&incremental_lock);
+	for (struct uniqtype_bfs_continuation *k = active_walks; k; k = k->next_active)
+	{
+		if (k->st.calling_out) log_freed(&k->st, obj);
+		struct visited_entry *e = visited_find(&k->st.visited, obj);
+		if (!e->k || e->colour == WHITE) continue;
+		if (e->colour == GREY) ((node_rec *) e->aux)->obj = NULL; /* skipped when popped */
+		e->colour = WHITE;
+		e->aux = NULL;
+	}
+	pthread_mutex_unlock(&incremental_lock);
+}
+
+void __uniqtype_bfs_notify_realloc(void *old_obj, void *new_obj)
+{
+	if (!__atomic_load_n(&nactive_walks, __ATOMIC_ACQUIRE)) return;
+	pthread_mutex_lock(&incremental_lock);
+	for (struct uniqtype_bfs_continuation *k = active_walks; k; k = k->next_active)
+	{
+		if (k->st.calling_out && new_obj != old_obj) log_freed(&k->st, old_obj);
+		struct visited_entry *e = visited_find(&k->st.visited, old_obj);
+		if (!e->k || e->colour == WHITE) continue;
+		if (new_obj == old_obj)
+		{
+			/* In place: only black objects need another look. */
+			if (e->colour == BLACK) regrey(k, new_obj, (struct uniqtype *) e->aux);
+			continue;
+		}
+		uintptr_t old_colour = e->colour;
+		void *old_aux = e->aux;
+		e->colour = WHITE;
+		e->aux = NULL;
+		if (!new_obj) continue; /* failed realloc that freed? treat as free */
+		if (old_colour == GREY)
+		{
+			/* Retarget the queued node. */
+			node_rec *n = old_aux;
+			n->obj = new_obj;
+			/* No room? Then it's as if it were freed. */
+			if (!visited_set_colour(&k->st.visited, new_obj, GREY, n)) n->obj = NULL;
+		}
+		else regrey(k, new_obj, (struct uniqtype *) old_aux);
+	}
+	pthread_mutex_unlock(&incremental_lock);
 }
 
 void __uniqtype_default_follow_ptr(void **p_obj, struct uniqtype **p_t, void *arg)
@@ -0,0 +1,281 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <link.h>
+#include "relf.h"
+#include "liballocs_private.h"
+#include "uniqtype.h"
+
+/* Pointer maps (format described in uniqtype-defs.h).
+ *
+ * The tools emit "<sym>_ptrmap" alongside every uniqtype they write out. We
+ * find it once per type, by dladdr() and dlsym() just like the subobject names,
+ * and remember it in an open-addressing table keyed on the uniqtype address.
+ * Types with no emitted map (stack frame types, ARR0 types, older type objects)
+ * get one computed from related[], by the same rules the tools use.
+ *
+ * A bitmap alone doesn't tell a scanner the static type of each pointer, so
+ * for types that do hold pointers we also keep the pointer uniqtype of each
+ * set bit, in bit order. That is always computed here, and it must agree with
+ * any emitted map; if it doesn't, we treat the map as unknown.
+ *
+ * Lookup is a lock-free probe; insertion is a CAS into an empty slot, and the
+ * loser of a race frees its entry. When an object is unloaded, the entries
+ * for its types are killed by clearing their t, so that a new type at the
+ * same address gets a fresh entry. A dead entry stays in its slot, both to
+ * keep probe sequences intact and because a reader may still be looking at
+ * it. If the table fills up we stop caching, and report "unknown" for
+ * uncached types, which only ever costs scanners their fast path.
+ *
+ * Synthesised array types are cached like any other, since they are never
+ * freed or reused (see uniqtype-arrays.c). Arrays too long for a map get
+ * "unknown" unless their element has no pointers; scanners should treat
+ * them as repetitions of their element's map. */
+
+#ifndef PTRMAP_TABLE_LOG_SIZE
+#define PTRMAP_TABLE_LOG_SIZE 16
+#endif
+#define PTRMAP_TABLE_SIZE (1ul<<PTRMAP_TABLE_LOG_SIZE)
+#define PTRMAP_TABLE_MAX_LOAD ((PTRMAP_TABLE_SIZE / 8) * 7)
+#define PTRMAP_MAX_SLOTS (UNIQTYPE_PTRMAP_MAX_WORDS * UNIQTYPE_PTRMAP_SLOTS_PER_WORD)
+
+struct ptrmap_entry
+{
+	struct uniqtype *t;
+	const unsigned long *map;
+	struct uniqtype **slot_types; /* NULL unless the map is known and has pointers */
+	unsigned long words[]; /* our own copy of the map, if we had to compute one */
+};
+
+static const unsigned long no_pointers_map[] = { 0ul };
+static const unsigned long unknown_map[] = { UNIQTYPE_PTRMAP_UNKNOWN };
+
+static struct ptrmap_entry **table;
+static unsigned long table_nused;
+
+static inline unsigned long hash_uniqtype(struct uniqtype *t)
+{
+	unsigned long h = ((uintptr_t) t >> 3) * 0x9e3779b97f4a7c15ul;
+	return h ^ (h >> 29);
+}
+
+static _Bool init(void)
+{
+	void *mem = mmap(NULL, PTRMAP_TABLE_SIZE * sizeof (struct ptrmap_entry *),
+		PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED)
+	{
+		debug_printf(0, "could not reserve memory for pointer maps\n");
+		return 0;
+	}
+	struct ptrmap_entry **expected = NULL;
+	if (!__atomic_compare_exchange_n(&table, &expected, (struct ptrmap_entry **) mem, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		munmap(mem, PTRMAP_TABLE_SIZE * sizeof (struct ptrmap_entry *));
+	}
+	return 1;
+}
+
+struct ptrmap_builder
+{
+	unsigned long words[UNIQTYPE_PTRMAP_MAX_WORDS];
+	unsigned long nwords;
+	struct uniqtype *types_by_slot[PTRMAP_MAX_SLOTS];
+};
+
+static struct ptrmap_entry *lookup(struct uniqtype *t);
+
+/* Keep in sync with add_pointer_slots() in tools/uniqtypes.cpp. */
+static _Bool add_pointer_slots(struct uniqtype *t, unsigned long base_off,
+	struct ptrmap_builder *b)
+{
+	if (!t || t == &__uniqtype__void) return 1;
+	if (UNIQTYPE_IS_POINTER_TYPE(t))
+	{
+		if (t->pos_maxoff != sizeof (void*)) return 0;
+		if (base_off % sizeof (void*) != 0) return 0;
+		unsigned long slot = base_off / sizeof (void*);
+		unsigned long word = slot / UNIQTYPE_PTRMAP_SLOTS_PER_WORD;
+		unsigned long bit = 1ul << (slot % UNIQTYPE_PTRMAP_SLOTS_PER_WORD);
+		if (word >= UNIQTYPE_PTRMAP_MAX_WORDS) return 0;
+		if (b->words[word] & bit) return 0; /* overlapping pointers, e.g. in a union */
+		b->words[word] |= bit;
+		if (b->nwords <= word) b->nwords = word + 1;
+		b->types_by_slot[slot] = t;
+		return 1;
+	}
+	if (UNIQTYPE_IS_ARRAY_TYPE(t))
+	{
+		struct uniqtype *element_t = UNIQTYPE_ARRAY_ELEMENT_TYPE(t);
+		/* Use the element's cached map to skip pointer-free arrays of any length. */
+		struct ptrmap_entry *element_e = lookup(element_t);
+		if (!element_e || !UNIQTYPE_PTRMAP_IS_KNOWN(element_e->map)) return 0;
+		if (UNIQTYPE_PTRMAP_HAS_NO_POINTERS(element_e->map)) return 1;
+		if (t->un.array.nelems == UNIQTYPE_ARRAY_LENGTH_UNBOUNDED
+				|| !UNIQTYPE_HAS_KNOWN_LENGTH(element_t)) return 0;
+		for (unsigned i = 0; i < t->un.array.nelems; ++i)
+		{
+			if (!add_pointer_slots(element_t, base_off + i * element_t->pos_maxoff, b)) return 0;
+		}
+		return 1;
+	}
+	if (UNIQTYPE_IS_COMPOSITE_TYPE(t))
+	{
+		for (unsigned i = 0; i < UNIQTYPE_COMPOSITE_MEMBER_COUNT(t); ++i)
+		{
+			if (!add_pointer_slots(t->related[i].un.memb.ptr,
+					base_off + t->related[i].un.memb.off, b)) return 0;
+		}
+		return 1;
+	}
+	/* base, enumeration, subrange and subprogram types hold no pointers */
+	return 1;
+}
+
+/* Parallel walkers get here concurrently, so we use the dladdr index, which
+ * is safe to read from any thread, and look the map up in the types
+ * object's own symbol table, without dlopen() and its loader lock. */
+static const unsigned long *find_emitted_map(struct uniqtype *t)
+{
+	Dl_info i;
+	struct link_map *l;
+	if (!__liballocs_dladdr_index_lookup(t, &i, &l, NULL)) return NULL;
+	if (!i.dli_sname || (char*) i.dli_saddr != (char*) t) return NULL;
+	char *map_name = alloca(strlen(i.dli_sname) + sizeof "_ptrmap");
+	strcpy(map_name, i.dli_sname);
+	strcat(map_name, "_ptrmap");
+	ElfW(Sym) *map_sym = symbol_lookup_in_object(l, map_name);
+	if (!map_sym || map_sym->st_shndx == SHN_UNDEF) return NULL;
+	return (const unsigned long *) sym_to_addr(map_sym);
+}
+
+static struct ptrmap_entry *make_shared_entry(struct uniqtype *t, const unsigned long *map)
+{
+	struct ptrmap_entry *e = __wrap_dlmalloc(sizeof (struct ptrmap_entry));
+	if (!e) return NULL;
+	*e = (struct ptrmap_entry) { .t = t, .map = map, .slot_types = NULL };
+	return e;
+}
+
+static struct ptrmap_entry *make_entry(struct uniqtype *t)
+{
+	const unsigned long *emitted = find_emitted_map(t);
+	if (emitted && !UNIQTYPE_PTRMAP_IS_KNOWN(emitted)) return make_shared_entry(t, unknown_map);
+	if (emitted && UNIQTYPE_PTRMAP_HAS_NO_POINTERS(emitted)) return make_shared_entry(t, no_pointers_map);
+
+	struct ptrmap_builder *b = __wrap_dlcalloc(1, sizeof (struct ptrmap_builder));
+	if (!b) return NULL;
+	struct ptrmap_entry *e;
+	if (!add_pointer_slots(t, 0, b))
+	{
+		e = make_shared_entry(t, unknown_map);
+		goto out;
+	}
+	if (emitted && (UNIQTYPE_PTRMAP_NWORDS(emitted) != b->nwords
+			|| 0 != memcmp(&emitted[1], b->words, b->nwords * sizeof (unsigned long))))
+	{
+		debug_printf(1, "emitted pointer map for %s disagrees with its uniqtype\n",
+			UNIQTYPE_NAME(t));
+		e = make_shared_entry(t, unknown_map);
+		goto out;
+	}
+	if (b->nwords == 0)
+	{
+		e = make_shared_entry(t, no_pointers_map);
+		goto out;
+	}
+	unsigned long nslots = 0;
+	for (unsigned long w = 0; w < b->nwords; ++w) nslots += __builtin_popcountl(b->words[w]);
+	e = __wrap_dlmalloc(sizeof (struct ptrmap_entry)
+		+ (1 + b->nwords) * sizeof (unsigned long)
+		+ nslots * sizeof (struct uniqtype *));
+	if (!e) goto out;
+	e->t = t;
+	e->words[0] = b->nwords;
+	memcpy(&e->words[1], b->words, b->nwords * sizeof (unsigned long));
+	e->map = emitted ? emitted : e->words;
+	e->slot_types = (struct uniqtype **) &e->words[1 + b->nwords];
+	unsigned long n = 0;
+	for (unsigned long w = 0; w < b->nwords; ++w)
+	{
+		for (unsigned long bits = b->words[w]; bits; bits &= bits - 1)
+		{
+			unsigned long slot = w * UNIQTYPE_PTRMAP_SLOTS_PER_WORD + __builtin_ctzl(bits);
+			e->slot_types[n++] = b->types_by_slot[slot];
+		}
+	}
+out:
+	__wrap_dlfree(b);
+	return e;
+}
+
+static struct ptrmap_entry *lookup(struct uniqtype *t)
+{
+	if (!table && !init()) return NULL;
+	unsigned long mask = PTRMAP_TABLE_SIZE - 1;
+	unsigned long i = hash_uniqtype(t) & mask;
+	struct ptrmap_entry *created = NULL;
+	for (;;)
+	{
+		struct ptrmap_entry *e = __atomic_load_n(&table[i], __ATOMIC_ACQUIRE);
+		if (e && __atomic_load_n(&e->t, __ATOMIC_ACQUIRE) == t)
+		{
+			if (created) __wrap_dlfree(created);
+			return e;
+		}
+		if (e) { i = (i + 1) & mask; continue; }
+		/* Empty slot: t is not cached. */
+		if (__atomic_load_n(&table_nused, __ATOMIC_RELAXED) >= PTRMAP_TABLE_MAX_LOAD) return NULL;
+		if (!created && !(created = make_entry(t))) return NULL;
+		struct ptrmap_entry *expected = NULL;
+		if (__atomic_compare_exchange_n(&table[i], &expected, created, 0,
+				__ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+		{
+			__atomic_add_fetch(&table_nused, 1, __ATOMIC_RELAXED);
+			return created;
+		}
+		/* Someone filled the slot; re-examine it (it may be t). */
+	}
+}
+
+/* The dladdr index calls this for each object it sees go away. */
+void __liballocs_uniqtype_ptrmaps_notify_unload(const void *begin, const void *end)
+{
+	if (!table || 0 == __atomic_load_n(&table_nused, __ATOMIC_RELAXED)) return;
+	for (unsigned long i = 0; i < PTRMAP_TABLE_SIZE; ++i)
+	{
+		struct ptrmap_entry *e = __atomic_load_n(&table[i], __ATOMIC_ACQUIRE);
+		if (!e) continue;
+		struct uniqtype *t = __atomic_load_n(&e->t, __ATOMIC_ACQUIRE);
+		if ((char*) t >= (char*) begin && (char*) t < (char*) end)
+		{
+			__atomic_store_n(&e->t, NULL, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+const unsigned long *__liballocs_uniqtype_ptrmap(struct uniqtype *t)
+{
+	if (!t || t == &__uniqtype__void) return no_pointers_map;
+	struct ptrmap_entry *e = lookup(t);
+	return e ? e->map : unknown_map;
+}
+
+struct uniqtype *const *__liballocs_uniqtype_ptrmap_slot_types(struct uniqtype *t)
+{
+	if (!t) return NULL;
+	struct ptrmap_entry *e = lookup(t);
+	return e ? e->slot_types : NULL;
+}
+
+int __liballocs_uniqtype_has_no_pointers(struct uniqtype *t)
+{
+	return UNIQTYPE_PTRMAP_HAS_NO_POINTERS(__liballocs_uniqtype_ptrmap(t));
+}
@@ -0,0 +1,49 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <liballocs.h>
+
+struct point
+{
+	double x, y;
+	int label;
+};
+
+static unsigned long census_count(struct uniqtype *t)
+{
+	static struct liballocs_census_entry entries[4096];
+	size_t n = __liballocs_get_heap_census(entries, 4096, 1);
+	for (size_t i = 0; i < n && i < 4096; ++i)
+	{
+		if (entries[i].type == t) return entries[i].nobjects;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	struct point *ps[100];
+	for (int i = 0; i < 100; ++i) ps[i] = malloc(sizeof (struct point));
+
+	/* This query may rewrite the chunk's insert to hold the type; the
+	 * census should follow it. */
+	struct uniqtype *t = NULL;
+	struct liballocs_err *err = __liballocs_get_alloc_info(ps[0], NULL, NULL, NULL, &t, NULL);
+	assert(!err && t);
+	unsigned long nlive = census_count(t);
+	printf("%lu live objects of type %s\n", nlive, UNIQTYPE_NAME(t));
+	assert(nlive >= 100);
+
+	char path[64];
+	snprintf(path, sizeof path, "/tmp/heap-census.%d.csv", (int) getpid());
+	assert(0 == __liballocs_dump_heap_census(path));
+	unlink(path);
+
+	for (int i = 0; i < 100; ++i) free(ps[i]);
+	unsigned long nleft = census_count(t);
+	printf("%lu left after freeing\n", nleft);
+	assert(nleft == nlive - 100);
+	return 0;
+}
@@ -0,0 +1,88 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <liballocs.h>
+
+/* Checks that a fork()ed child can still look things up in objects whose
+ * metadata hadn't been loaded when it forked, and measures what deferring
+ * the metadata saves: we run ourselves with and without
+ * LIBALLOCS_EAGER_METADATA and print the wall time and max RSS of each. */
+
+#define NRUNS 20
+
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void query_deferred_objects(void)
+{
+	/* These live in libc, whose metadata is deferred. Whether or not libc
+	 * has any, the lookups must come back, not hang. */
+	struct uniqtype *t = __liballocs_get_alloc_type(stdout);
+	(void) t;
+	t = __liballocs_get_alloc_type(&environ);
+	(void) t;
+}
+
+static void time_runs(const char *self, _Bool eager)
+{
+	double total_ms = 0;
+	long max_rss_kb = 0;
+	for (int i = 0; i < NRUNS; ++i)
+	{
+		double begin = now_ms();
+		pid_t pid = fork();
+		assert(pid != -1);
+		if (pid == 0)
+		{
+			if (eager) setenv("LIBALLOCS_EAGER_METADATA", "1", 1);
+			else unsetenv("LIBALLOCS_EAGER_METADATA");
+			execl(self, self, "--child", (char *) NULL);
+			_exit(127);
+		}
+		int status;
+		struct rusage ru;
+		pid_t ret = wait4(pid, &status, 0, &ru);
+		assert(ret == pid);
+		assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+		total_ms += now_ms() - begin;
+		if (ru.ru_maxrss > max_rss_kb) max_rss_kb = ru.ru_maxrss;
+	}
+	printf("%s metadata: %.2f ms per run to exit, max RSS %ld kB\n",
+		eager ? "eager" : "lazy", total_ms / NRUNS, max_rss_kb);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && 0 == strcmp(argv[1], "--child"))
+	{
+		query_deferred_objects();
+		return 0;
+	}
+
+	pid_t pid = fork();
+	assert(pid != -1);
+	if (pid == 0)
+	{
+		alarm(10);
+		query_deferred_objects();
+		_exit(0);
+	}
+	int status;
+	pid_t ret = waitpid(pid, &status, 0);
+	assert(ret == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	time_runs("/proc/self/exe", 1);
+	time_runs("/proc/self/exe", 0);
+	return 0;
+}
@@ -0,0 +1,57 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <time.h>
+
+/* Measures small-copy throughput through memcpy and memmove as bound by
+ * the program, which under liballocs are its overrides, against calling
+ * libc's own definitions directly. Without an extender hooking
+ * __notify_copy, the two should be indistinguishable. */
+
+#define NITERS 10000000
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static char src[256];
+static char dest[256];
+
+static double time_copies(void *(*volatile copy)(void *, const void *, size_t), size_t len)
+{
+	double begin = now_ns();
+	for (int i = 0; i < NITERS; ++i)
+	{
+		copy(dest + (i & 7), src, len);
+	}
+	return (now_ns() - begin) / NITERS;
+}
+
+int main(void)
+{
+	/* Get libc's own definitions, not whatever our references bind to. */
+	void *libc = dlopen("libc.so.6", RTLD_NOW|RTLD_NOLOAD);
+	assert(libc);
+	void *(*libc_memcpy)(void *, const void *, size_t) = dlsym(libc, "memcpy");
+	void *(*libc_memmove)(void *, const void *, size_t) = dlsym(libc, "memmove");
+	assert(libc_memcpy && libc_memmove);
+
+	const char *preload = getenv("LD_PRELOAD");
+	const char *config = !preload || !*preload ? "no liballocs" : "liballocs";
+
+	size_t lens[] = { 8, 16, 64, 200 };
+	for (unsigned i = 0; i < sizeof lens / sizeof lens[0]; ++i)
+	{
+		printf("%s: %zu-byte memcpy: %.2f ns via symbol binding, %.2f ns via libc\n",
+			config, lens[i], time_copies(memcpy, lens[i]), time_copies(libc_memcpy, lens[i]));
+		printf("%s: %zu-byte memmove: %.2f ns via symbol binding, %.2f ns via libc\n",
+			config, lens[i], time_copies(memmove, lens[i]), time_copies(libc_memmove, lens[i]));
+	}
+	return 0;
+}
@@ -0,0 +1,61 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <sys/mman.h>
+
+/* Measures the cost of an mmap/munmap pair as made from inside libc, which
+ * is where the systrap (not the preload wrappers) sees them. Run it without
+ * liballocs, under liballocs with the default trap path, and under liballocs
+ * with LIBALLOCS_SYSTRAP_BACKEND=seccomp to compare the three. */
+
+#define NITERS 100000
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double time_pairs(void *(*do_mmap)(void *, size_t, int, int, int, off_t),
+	int (*do_munmap)(void *, size_t), size_t len)
+{
+	double begin = now_ns();
+	for (int i = 0; i < NITERS; ++i)
+	{
+		char *p = do_mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		assert(p != MAP_FAILED);
+		p[0] = 1;
+		int ret = do_munmap(p, len);
+		assert(ret == 0);
+	}
+	return (now_ns() - begin) / NITERS;
+}
+
+int main(void)
+{
+	/* Get libc's own definitions, not whatever our references bind to. */
+	void *libc = dlopen("libc.so.6", RTLD_NOW|RTLD_NOLOAD);
+	assert(libc);
+	void *(*libc_mmap)(void *, size_t, int, int, int, off_t) = dlsym(libc, "mmap");
+	int (*libc_munmap)(void *, size_t) = dlsym(libc, "munmap");
+	assert(libc_mmap && libc_munmap);
+
+	const char *preload = getenv("LD_PRELOAD");
+	const char *backend = getenv("LIBALLOCS_SYSTRAP_BACKEND");
+	const char *config = !preload || !*preload ? "no liballocs"
+		: (backend ? backend : "trap");
+
+	size_t lens[] = { 4096, 16 * 4096, 256 * 4096 };
+	for (unsigned i = 0; i < sizeof lens / sizeof lens[0]; ++i)
+	{
+		printf("%s: libc mmap+munmap of %zu bytes: %.0f ns per pair\n",
+			config, lens[i], time_pairs(libc_mmap, libc_munmap, lens[i]));
+	}
+	printf("%s: mmap+munmap of 4096 bytes via symbol binding: %.0f ns per pair\n",
+		config, time_pairs(mmap, munmap, 4096));
+	return 0;
+}
@@ -0,0 +1,39 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <liballocs.h>
+
+/* The mmap allocator defers munmap notifications and flushes them when
+ * asked about an address. Ask it about an address whose unmap is still
+ * pending: it must say it doesn't know, not describe a bogus allocation. */
+
+int main(void)
+{
+	char *live = mmap(NULL, 4 * 4096, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	assert(live != MAP_FAILED);
+	char *gone = mmap(NULL, 4 * 4096, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	assert(gone != MAP_FAILED);
+	int ret = munmap(gone, 4 * 4096);
+	assert(ret == 0);
+
+	/* Go straight to the allocator, as a query would if it had looked up
+	 * the address just before the munmap. */
+	void *base = NULL;
+	unsigned long size = 0;
+	struct liballocs_err *err = __mmap_allocator.get_info(gone + 4096, NULL, NULL,
+		&base, &size, NULL);
+	assert(err == &__liballocs_err_object_of_unknown_storage);
+
+	/* A live mapping is still described properly, with the unmap flushed. */
+	ret = munmap(gone, 4096); /* already gone, but makes a new pending span */
+	base = NULL;
+	err = __mmap_allocator.get_info(live + 4096, NULL, NULL, &base, &size, NULL);
+	assert(!err);
+	assert((char*) base <= live && (char*) base + size >= live + 4 * 4096);
+
+	printf("query into a pending unmap came back unknown, as it should\n");
+	return 0;
+}
@@ -0,0 +1,12 @@
+#include <stdlib.h>
+
+struct noptrs
+{
+	long a;
+	long b;
+};
+
+struct noptrs *make_noptrs(void)
+{
+	return malloc(sizeof (struct noptrs));
+}
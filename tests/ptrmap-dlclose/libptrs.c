@@ -0,0 +1,12 @@
+#include <stdlib.h>
+
+struct ptrs
+{
+	void *p;
+	struct ptrs *next;
+};
+
+struct ptrs *make_ptrs(void)
+{
+	return malloc(sizeof (struct ptrs));
+}
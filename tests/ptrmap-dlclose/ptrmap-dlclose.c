@@ -0,0 +1,75 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <liballocs.h>
+#include <uniqtype.h>
+
+/* Loads, unloads and reloads -types.so objects, checking that a pointer map
+ * cached for a type doesn't outlive the object the type was in. Our libs
+ * themselves are never loaded, so nothing else holds their types objects. */
+
+static const char *types_path(const char *lib)
+{
+	static char path[2 * PATH_MAX];
+	char lib_path[PATH_MAX];
+	char *ok = realpath(lib, lib_path);
+	assert(ok);
+	const char *base = getenv("ALLOCSITES_BASE");
+	snprintf(path, sizeof path, "%s%s-types.so", base ? base : "/usr/lib/allocsites", lib_path);
+	return path;
+}
+
+static void *load_types(const char *lib)
+{
+	void *h = dlopen(types_path(lib), RTLD_NOW | RTLD_LOCAL);
+	if (!h) fprintf(stderr, "%s\n", dlerror());
+	assert(h);
+	return h;
+}
+
+static void unload(void *h, const char *lib)
+{
+	int ret = dlclose(h);
+	assert(ret == 0);
+	assert(!dlopen(types_path(lib), RTLD_NOW | RTLD_NOLOAD));
+}
+
+static struct uniqtype *check_ptrs(void *h)
+{
+	struct uniqtype *t = dlsym(h, "__uniqtype__ptrs");
+	assert(t);
+	const unsigned long *map = __liballocs_uniqtype_ptrmap(t);
+	/* two pointers, in the first two slots */
+	assert(UNIQTYPE_PTRMAP_IS_KNOWN(map));
+	assert(!UNIQTYPE_PTRMAP_HAS_NO_POINTERS(map));
+	assert(UNIQTYPE_PTRMAP_NWORDS(map) == 1 && map[1] == 0x3ul);
+	return t;
+}
+
+int main(void)
+{
+	void *h = load_types("libptrs.so");
+	struct uniqtype *t1 = check_ptrs(h);
+	unload(h, "libptrs.so");
+
+	/* Reloading may or may not put the type where it was. Either way its
+	 * map must come from the new mapping. */
+	h = load_types("libptrs.so");
+	struct uniqtype *t2 = check_ptrs(h);
+	unload(h, "libptrs.so");
+
+	/* A different type at the same address must not get the old map. */
+	h = load_types("libnoptrs.so");
+	struct uniqtype *t3 = dlsym(h, "__uniqtype__noptrs");
+	assert(t3);
+	assert(UNIQTYPE_PTRMAP_HAS_NO_POINTERS(__liballocs_uniqtype_ptrmap(t3)));
+	unload(h, "libnoptrs.so");
+
+	printf("ptrs at %p then %p, noptrs at %p%s\n", t1, t2, t3,
+		(t3 == t1 || t3 == t2) ? " (reused an old address)" : "");
+	return 0;
+}
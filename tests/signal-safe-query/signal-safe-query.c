@@ -0,0 +1,53 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <liballocs.h>
+
+static int *target;
+static volatile int nsucceeded;
+static volatile int nretried;
+static volatile int nwrong;
+
+static void handle_sigprof(int signum)
+{
+	const void *start;
+	unsigned long size;
+	struct allocator *a;
+	struct liballocs_err *err = __liballocs_get_alloc_info_signal_safe(&target[7],
+		&a, &start, &size, NULL, NULL);
+	if (err == &__liballocs_err_retry) { ++nretried; return; }
+	if ((err && err != &__liballocs_err_unrecognised_alloc_site)
+			|| start != target || size < 42 * sizeof (int)) ++nwrong;
+	else ++nsucceeded;
+}
+
+int main(void)
+{
+	target = malloc(42 * sizeof (int));
+	struct sigaction sa;
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = handle_sigprof;
+	sigaction(SIGPROF, &sa, NULL);
+	struct itimerval every_100us = { { 0, 100 }, { 0, 100 } };
+	setitimer(ITIMER_PROF, &every_100us, NULL);
+
+	/* Keep the heap index busy, so that some samples land mid-update. */
+	while (nsucceeded + nretried < 1000)
+	{
+		void *ps[64];
+		for (int i = 0; i < 64; ++i) ps[i] = malloc(8 + 8 * i);
+		for (int i = 0; i < 64; ++i) free(ps[i]);
+	}
+	struct itimerval off = { { 0, 0 }, { 0, 0 } };
+	setitimer(ITIMER_PROF, &off, NULL);
+
+	printf("%d samples succeeded, %d retried, %d wrong\n", nsucceeded, nretried, nwrong);
+	assert(nwrong == 0);
+	assert(nsucceeded > 0);
+	free(target);
+	return 0;
+}
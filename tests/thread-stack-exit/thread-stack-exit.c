@@ -0,0 +1,72 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <liballocs.h>
+
+/* A thread's stack is registered as a bigalloc when it starts, and must stay
+ * registered until the thread is really done with it: its pthread key
+ * destructors still run on it. Once the thread is joined, the stack must be
+ * gone from the index, whether the thread returned or called pthread_exit(). */
+
+#define NTHREADS 8
+
+static struct big_allocation *stack_bigalloc(const void *addr)
+{
+	for (struct big_allocation *b = __liballocs_get_bigalloc_containing(addr);
+			b; b = b->parent)
+	{
+		if (b->allocated_by == &__stack_allocator) return b;
+	}
+	return NULL;
+}
+
+static pthread_key_t key;
+static int nseen_in_destructor;
+
+static void check_in_destructor(void *arg)
+{
+	int local;
+	if (stack_bigalloc(&local)) __atomic_add_fetch(&nseen_in_destructor, 1, __ATOMIC_RELAXED);
+}
+
+struct thread
+{
+	pthread_t t;
+	_Bool use_pthread_exit;
+	void *stack_addr;
+};
+
+static void *thread_main(void *arg)
+{
+	struct thread *self = arg;
+	int local;
+	self->stack_addr = &local;
+	assert(stack_bigalloc(&local));
+	pthread_setspecific(key, self);
+	if (self->use_pthread_exit) pthread_exit(NULL);
+	return NULL;
+}
+
+int main(void)
+{
+	int ret = pthread_key_create(&key, check_in_destructor);
+	assert(ret == 0);
+	struct thread threads[NTHREADS];
+	for (int i = 0; i < NTHREADS; ++i)
+	{
+		threads[i].use_pthread_exit = i % 2;
+		ret = pthread_create(&threads[i].t, NULL, thread_main, &threads[i]);
+		assert(ret == 0);
+	}
+	for (int i = 0; i < NTHREADS; ++i)
+	{
+		ret = pthread_join(threads[i].t, NULL);
+		assert(ret == 0);
+		assert(!stack_bigalloc(threads[i].stack_addr));
+	}
+	assert(nseen_in_destructor == NTHREADS);
+	printf("%d thread stacks stayed indexed through their key destructors, "
+		"and were gone once joined\n", NTHREADS);
+	return 0;
+}
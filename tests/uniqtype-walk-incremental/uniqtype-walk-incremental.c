@@ -0,0 +1,89 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <assert.h>
+#include <liballocs.h>
+#include "uniqtype-bfs.h"
+
+struct list_node
+{
+	int payload;
+	struct list_node *next;
+};
+
+static int blackened_count;
+static void on_blacken(void *obj, struct uniqtype *t, void *arg)
+{
+	++blackened_count;
+}
+
+/* Frees the node being scanned, i.e. the target's predecessor, while it's grey. */
+static struct list_node **freeing_nodes;
+static void free_predecessor(void **p_obj, struct uniqtype **p_t, void *arg)
+{
+	struct list_node *target = *p_obj;
+	free(freeing_nodes[target->payload - 1]);
+}
+
+int main(void)
+{
+	enum { n = 1000 };
+	struct list_node *head = NULL;
+	struct list_node *nodes[n];
+	for (int i = n - 1; i >= 0; --i)
+	{
+		struct list_node *new_node = calloc(1, sizeof (struct list_node));
+		assert(new_node);
+		new_node->payload = i;
+		new_node->next = head;
+		head = new_node;
+		nodes[i] = new_node;
+	}
+	struct uniqtype *list_node_t = __liballocs_get_outermost_type(head);
+	assert(list_node_t);
+
+	struct uniqtype_bfs_continuation *k = __uniqtype_bfs_begin_incremental(head, list_node_t,
+		__uniqtype_default_follow_ptr, NULL, on_blacken, NULL);
+	/* A slice of exactly 100 objects leaves nodes[100] grey. */
+	int more = __uniqtype_bfs_resume(k, 100, 0);
+	assert(more);
+	assert(blackened_count == 100);
+
+	/* Mutate between slices: unlink and free the grey node. The free hook
+	 * must drop it from the queue, so we never touch the freed memory. */
+	nodes[99]->next = NULL;
+	free(nodes[100]);
+
+	/* Finish in time-budgeted slices. */
+	int nslices = 1;
+	while (__uniqtype_bfs_resume(k, 0, 50000)) ++nslices;
+	struct uniqtype_bfs_stats stats;
+	__uniqtype_bfs_get_incremental_stats(k, &stats);
+	fprintf(stderr, "Walked %lu objects in %d slices (%.0f objects/s)\n",
+		stats.nblackened, nslices, stats.objects_per_sec);
+	__uniqtype_bfs_finish_incremental(k);
+	assert(blackened_count == 100);
+
+	/* Callbacks run without the walk's lock, and may free the very object
+	 * being scanned. Only the last node, with no successor, survives to be
+	 * blackened. */
+	struct list_node *more_nodes[n];
+	for (int i = n - 1; i >= 0; --i)
+	{
+		more_nodes[i] = calloc(1, sizeof (struct list_node));
+		assert(more_nodes[i]);
+		more_nodes[i]->payload = i;
+		more_nodes[i]->next = (i + 1 < n) ? more_nodes[i + 1] : NULL;
+	}
+	freeing_nodes = more_nodes;
+	blackened_count = 0;
+	k = __uniqtype_bfs_begin_incremental(more_nodes[0], list_node_t,
+		free_predecessor, NULL, on_blacken, NULL);
+	assert(k);
+	while (__uniqtype_bfs_resume(k, 10, 0));
+	__uniqtype_bfs_finish_incremental(k);
+	assert(blackened_count == 1);
+
+	return 0;
+}
@@ -0,0 +1,98 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <assert.h>
+#include <errno.h>
+#include <liballocs.h>
+#include "uniqtype-bfs.h"
+
+/* A synthetic pointer-heavy heap: every node points to its successor
+ * (so everything is reachable) and to three random others. */
+struct graph_node
+{
+	struct graph_node *next;
+	struct graph_node *random[3];
+	long payload;
+};
+
+static unsigned long blackened_count;
+static void on_blacken(void *obj, struct uniqtype *t, void *arg)
+{
+	__atomic_add_fetch(&blackened_count, 1, __ATOMIC_RELAXED);
+}
+
+static void *last_seen;
+static int saw_out_of_order;
+static void on_blacken_ordered(void *obj, struct uniqtype *t, void *arg)
+{
+	if (last_seen && (char*) obj <= (char*) last_seen) saw_out_of_order = 1;
+	last_seen = obj;
+	++blackened_count;
+}
+
+int main(void)
+{
+	const unsigned n = 1u<<18;
+	struct graph_node **nodes = malloc(n * sizeof (struct graph_node *));
+	assert(nodes);
+	for (unsigned i = 0; i < n; ++i)
+	{
+		nodes[i] = malloc(sizeof (struct graph_node));
+		assert(nodes[i]);
+	}
+	srand(42);
+	for (unsigned i = 0; i < n; ++i)
+	{
+		nodes[i]->next = (i + 1 < n) ? nodes[i + 1] : NULL;
+		for (unsigned j = 0; j < 3; ++j) nodes[i]->random[j] = nodes[rand() % n];
+		nodes[i]->payload = i;
+	}
+	struct uniqtype *node_t = __liballocs_get_outermost_type(nodes[0]);
+	assert(node_t);
+
+	void *roots[] = { nodes[0] };
+	struct uniqtype *root_types[] = { node_t };
+	struct uniqtype_bfs_stats stats;
+	double one_thread_rate = 0;
+	for (unsigned nthreads = 1; nthreads <= 16; nthreads *= 2)
+	{
+		blackened_count = 0;
+		struct uniqtype_parallel_walk_opts opts = {
+			.nthreads = nthreads,
+			.max_objects = n,
+			.ordering = UNIQTYPE_PARALLEL_WALK_UNORDERED
+		};
+		int ret = __uniqtype_walk_parallel_from_objects(roots, root_types, 1,
+			__uniqtype_default_follow_ptr, NULL, on_blacken, NULL, &opts, &stats);
+		assert(ret == 0);
+		assert(blackened_count == n);
+		assert(stats.nblackened == n);
+		if (nthreads == 1) one_thread_rate = stats.objects_per_sec;
+		fprintf(stderr, "%2u threads: %lu objects, %lu edges in %lu ns "
+			"(%.0f objects/s, speedup %.2f)\n",
+			nthreads, stats.nblackened, stats.nedges, stats.elapsed_ns,
+			stats.objects_per_sec, stats.objects_per_sec / one_thread_rate);
+	}
+
+	/* Address order is the same whatever the thread count. */
+	blackened_count = 0;
+	struct uniqtype_parallel_walk_opts opts = {
+		.nthreads = 4,
+		.max_objects = n,
+		.ordering = UNIQTYPE_PARALLEL_WALK_ADDRESS_ORDER
+	};
+	int ret = __uniqtype_walk_parallel_from_objects(roots, root_types, 1,
+		__uniqtype_default_follow_ptr, NULL, on_blacken_ordered, NULL, &opts, NULL);
+	assert(ret == 0);
+	assert(blackened_count == n);
+	assert(!saw_out_of_order);
+
+	/* Too many objects for the visited set: we get an error, not an abort. */
+	opts.max_objects = n / 4;
+	ret = __uniqtype_walk_parallel_from_objects(roots, root_types, 1,
+		__uniqtype_default_follow_ptr, NULL, on_blacken, NULL, &opts, NULL);
+	assert(ret == -1 && errno == ENOSPC);
+
+	return 0;
+}
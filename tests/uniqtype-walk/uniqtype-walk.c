@@ -46,6 +46,11 @@ int main(void)
 	__uniqtype_walk_bfs_from_object(head, list_node_t, 
 		__uniqtype_default_follow_ptr, NULL, 
 		on_blacken, NULL);
+	struct uniqtype_bfs_stats stats;
+	__uniqtype_bfs_get_last_stats(&stats);
+	fprintf(stderr, "Walked %lu objects in %lu ns (%.0f objects/s)\n",
+		stats.nblackened, stats.elapsed_ns, stats.objects_per_sec);
+	assert(stats.nblackened == blackened_count);
 	assert(blackened_count == 20); /* 10 nodes, 10 integers -- HMM.
 	 Nodes in the graph should really be <void*, uniqtype*> pairs, 
 	 to avoid the ambiguity of unadorned pointers.
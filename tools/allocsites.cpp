@@ -9,6 +9,8 @@
 #include <string>
 #include <cctype>
 #include <memory>
+#include <vector>
+#include <algorithm>
 #include <boost/algorithm/string.hpp>
 #include <boost/regex.hpp>
 // #include <regex> // broken in GNU libstdc++!
@@ -24,6 +26,10 @@ using std::cout;
 using std::cerr;
 using std::map;
 using std::multimap;
+using std::vector;
+using std::set;
+using std::pair;
+using std::make_pair;
 using std::ios;
 using std::ifstream;
 using std::unique_ptr;
@@ -87,59 +93,86 @@ int main(int argc, char **argv)
 		make_allocsites_relation(allocsites_relation, allocsites_to_add, types_by_codeless_name, *p_root);
 	}	
 	
-	cout << "struct allocsite_entry\n\
+	/* We output a pre-sorted, pre-bucketed table (struct allocsites_table in
+	 * allocsmt.h), so that liballocs never has to write to it. Site vaddrs are
+	 * relative to the object's load address; sites in bucket b, i.e. with
+	 * (vaddr >> log_bucket_size) == b, are vaddrs[bucket_starts[b]] up to
+	 * vaddrs[bucket_starts[b+1]]. Only the uniqtype pointers get relocated. */
+	const unsigned log_bucket_size = 12;
+	cout << "struct allocsites_table\n\
 { \n\
-	void *next; \n\
-	void *prev; \n\
-	void *allocsite; \n\
-	struct uniqtype *uniqtype; \n\
+	unsigned long nsites; \n\
+	unsigned long nbuckets; \n\
+	unsigned log_bucket_size; \n\
+	const unsigned long *vaddrs; \n\
+	const unsigned *bucket_starts; \n\
+	struct uniqtype *const *uniqtypes; \n\
 };\n";
 
-	// extern-declare the uniqtypes
+	/* Sort the sites by vaddr. The relation is keyed on (objname, vaddr),
+	 * and should only mention one object, but let's not rely on that. */
+	vector< pair< unsigned long, string > > sorted_sites;
 	for (auto i_site = allocsites_relation.begin(); i_site != allocsites_relation.end(); ++i_site)
 	{
+		string mangled;
 		if (i_site->second.second /* declare as array0 */)
 		{
 			pair<string, string> array_name =
 				make_pair(string(""), string("__ARR0_") + i_site->second.first.second);
-			cout << "extern struct uniqtype " << mangle_typename(array_name) << ";" << endl;
-		}
-		else
-		{
-			cout << "extern struct uniqtype " << mangle_typename(i_site->second.first) << ";" << endl;
+			mangled = mangle_typename(array_name);
 		}
+		else mangled = mangle_typename(i_site->second.first);
+		sorted_sites.push_back(make_pair(i_site->first.second, mangled));
 	}
-
-	cout << "struct allocsite_entry allocsites[] = {" << endl;
-	for (auto i_site = allocsites_relation.begin(); i_site != allocsites_relation.end(); ++i_site)
+	std::sort(sorted_sites.begin(), sorted_sites.end());
+	
+	// extern-declare the uniqtypes
+	set<string> declared;
+	for (auto i_site = sorted_sites.begin(); i_site != sorted_sites.end(); ++i_site)
 	{
-		if (i_site != allocsites_relation.begin()) cout << ",";
-		
-		cout << "\n\t/* allocsite info for " << i_site->first.first << "+"
-			<< std::hex << "0x" << i_site->first.second << std::dec << " */";
-		cout << "\n\t{ (void*)0, (void*)0, "
-			<< "(char*) " << "0" // will fix up at load time
-			<< " + 0x" << std::hex << i_site->first.second << std::dec << "UL, " 
-			<< "&";
-		
-		if (i_site->second.second /* declare as array0 */)
+		if (declared.insert(i_site->second).second)
 		{
-			pair<string, string> array_name =
-				make_pair(string(""), string("__ARR0_") + i_site->second.first.second);
-			cout << mangle_typename(array_name);
+			cout << "extern struct uniqtype " << i_site->second << ";" << endl;
 		}
-		else
-		{
-			cout << mangle_typename(i_site->second.first);
-		}
-		cout << " }";
 	}
-	// output a null terminator entry
-	if (allocsites_relation.size() > 0) cout << ",";
-	cout << "\n\t{ (void*)0, (void*)0, (void*)0, (struct uniqtype *)0 }";
 	
-	// close the list
-	cout << "\n};\n";
+	/* We always output at least one element, to keep the C compiler happy. */
+	cout << "static const unsigned long allocsites_vaddrs[] = {";
+	for (auto i_site = sorted_sites.begin(); i_site != sorted_sites.end(); ++i_site)
+	{
+		if (i_site != sorted_sites.begin()) cout << ",";
+		cout << "\n\t0x" << std::hex << i_site->first << std::dec << "UL";
+	}
+	if (sorted_sites.size() == 0) cout << "0";
+	cout << "\n};" << endl;
+	
+	unsigned long nbuckets = (sorted_sites.size() == 0) ? 0 : 
+		(sorted_sites.back().first >> log_bucket_size) + 1;
+	cout << "static const unsigned allocsites_bucket_starts[] = {";
+	unsigned long pos = 0;
+	for (unsigned long b = 0; b <= nbuckets; ++b)
+	{
+		while (pos < sorted_sites.size() && (sorted_sites[pos].first >> log_bucket_size) < b) ++pos;
+		if (b != 0) cout << ",";
+		if (b % 16 == 0) cout << "\n\t";
+		cout << pos;
+	}
+	cout << "\n};" << endl;
+	
+	cout << "static struct uniqtype *const allocsites_uniqtypes[] = {";
+	for (auto i_site = sorted_sites.begin(); i_site != sorted_sites.end(); ++i_site)
+	{
+		if (i_site != sorted_sites.begin()) cout << ",";
+		cout << "\n\t/* 0x" << std::hex << i_site->first << std::dec << " */ &" << i_site->second;
+	}
+	if (sorted_sites.size() == 0) cout << "(struct uniqtype *) 0";
+	cout << "\n};" << endl;
+	
+	cout << "const struct allocsites_table allocsites_table = { "
+		<< sorted_sites.size() << "UL, "
+		<< nbuckets << "UL, "
+		<< log_bucket_size << ", "
+		<< "allocsites_vaddrs, allocsites_bucket_starts, allocsites_uniqtypes };" << endl;
 	
 	return 0;
 }	
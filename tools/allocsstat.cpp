@@ -0,0 +1,196 @@
+/* This program prints the counters that a process running with
+ * LIBALLOCS_STATS_SHM set publishes under /dev/shm (see include/statsshm.h).
+ * It only maps the file read-only and copies it, so watching a process
+ * costs that process nothing.
+ *
+ * Usage: allocsstat [-i interval-ms] [-n count] pid | path
+ *
+ * With -i, it prints a line of the changing counters every interval,
+ * count times (or until the process goes away); otherwise it prints
+ * everything once.
+ */
+
+#include "statsshm.h"
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::setw;
+using std::string;
+
+static void usage(const char *argv0)
+{
+	cerr << "Usage: " << argv0 << " [-i interval-ms] [-n count] pid | path" << endl;
+	exit(1);
+}
+
+/* Take a consistent copy, retrying while the writer is mid-update. */
+static bool snapshot(const volatile struct statsshm *shm, struct statsshm *out)
+{
+	for (unsigned tries = 0; tries < 1000; ++tries)
+	{
+		unsigned long begun = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		if (begun % 2 == 1) { usleep(100); continue; }
+		memcpy(out, (const void *) shm, sizeof *out);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == begun) return true;
+	}
+	return false;
+}
+
+static double hit_rate(const struct statsshm& s)
+{
+	unsigned long total = s.lookup_cache_hits + s.lookup_cache_misses;
+	return total ? 100.0 * s.lookup_cache_hits / total : 0.0;
+}
+
+static void print_all(const struct statsshm& s)
+{
+	cout << "pid " << s.pid << ", " << s.nupdates << " updates every "
+		<< s.interval_ms << "ms" << endl;
+	cout << "indexed heap chunks          " << setw(12) << s.nindexed_chunks << endl;
+	cout << "live bigallocs               " << setw(12) << s.nbigallocs << endl;
+	cout << "pageindex resident kB        " << setw(12) << s.pageindex_rss_bytes / 1024 << endl;
+	cout << "heap index resident kB       " << setw(12) << s.index_region_rss_bytes / 1024 << endl;
+	cout << "lookup cache hits            " << setw(12) << s.lookup_cache_hits
+		<< " (" << std::fixed << std::setprecision(1) << hit_rate(s) << "%)" << endl;
+	cout << "lookup cache misses          " << setw(12) << s.lookup_cache_misses << endl;
+	cout << "queries aborted for stack    " << setw(12) << s.aborted_stack << endl;
+	cout << "queries aborted for static   " << setw(12) << s.aborted_static << endl;
+	cout << "queries aborted for unknown  " << setw(12) << s.aborted_unknown_storage << endl;
+	cout << "queries handled by heap      " << setw(12) << s.hit_heap_case << endl;
+	cout << "queries handled by stack     " << setw(12) << s.hit_stack_case << endl;
+	cout << "queries handled by static    " << setw(12) << s.hit_static_case << endl;
+	cout << "queries aborted for unindexed heap " << setw(6) << s.aborted_unindexed_heap << endl;
+	cout << "queries aborted for unknown allocsite " << setw(3) << s.aborted_unrecognised_allocsite << endl;
+	for (unsigned i = 0; i < s.nallocators && i < STATSSHM_MAX_ALLOCATORS; ++i)
+	{
+		const struct statsshm_allocator& a = s.by_allocator[i];
+		cout << "queries on " << setw(18) << std::left
+			<< string(a.name, strnlen(a.name, sizeof a.name)) << std::right
+			<< setw(12) << a.nqueries << endl;
+	}
+}
+
+static void print_header()
+{
+	cout << setw(10) << "chunks" << setw(8) << "bigas"
+		<< setw(10) << "pgidx kB" << setw(10) << "heapi kB"
+		<< setw(8) << "hit %" << setw(12) << "queries/s" << setw(12) << "aborts/s" << endl;
+}
+
+static unsigned long nqueries(const struct statsshm& s)
+{
+	return s.hit_heap_case + s.hit_stack_case + s.hit_static_case + s.aborted_stack
+		+ s.aborted_static + s.aborted_unknown_storage + s.aborted_unindexed_heap
+		+ s.aborted_unrecognised_allocsite;
+}
+
+static unsigned long naborts(const struct statsshm& s)
+{
+	return s.aborted_stack + s.aborted_static + s.aborted_unknown_storage
+		+ s.aborted_unindexed_heap + s.aborted_unrecognised_allocsite;
+}
+
+static void print_line(const struct statsshm& s, const struct statsshm& prev)
+{
+	double secs = (s.update_time_ns - prev.update_time_ns) / 1e9;
+	double qps = secs > 0 ? (nqueries(s) - nqueries(prev)) / secs : 0.0;
+	double aps = secs > 0 ? (naborts(s) - naborts(prev)) / secs : 0.0;
+	cout << setw(10) << s.nindexed_chunks << setw(8) << s.nbigallocs
+		<< setw(10) << s.pageindex_rss_bytes / 1024
+		<< setw(10) << s.index_region_rss_bytes / 1024
+		<< setw(8) << std::fixed << std::setprecision(1) << hit_rate(s)
+		<< setw(12) << std::setprecision(0) << qps
+		<< setw(12) << aps << endl;
+}
+
+int main(int argc, char **argv)
+{
+	int interval_ms = 0;
+	long count = -1;
+	int opt;
+	while ((opt = getopt(argc, argv, "i:n:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'i': interval_ms = atoi(optarg); if (interval_ms <= 0) usage(argv[0]); break;
+			case 'n': count = atol(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1) usage(argv[0]);
+
+	string path = argv[optind];
+	if (path.find('/') == string::npos)
+	{
+		char buf[64];
+		snprintf(buf, sizeof buf, STATSSHM_PATH_FORMAT, atoi(path.c_str()));
+		path = buf;
+	}
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd == -1)
+	{
+		cerr << "Could not open " << path << " (is LIBALLOCS_STATS_SHM set in the target?)" << endl;
+		return 1;
+	}
+	struct stat st;
+	if (0 != fstat(fd, &st) || (size_t) st.st_size < sizeof (struct statsshm))
+	{
+		cerr << path << " is too small to hold liballocs stats" << endl;
+		return 1;
+	}
+	void *mem = mmap(NULL, sizeof (struct statsshm), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+	{
+		cerr << "Could not map " << path << endl;
+		return 1;
+	}
+	const volatile struct statsshm *shm = (const volatile struct statsshm *) mem;
+
+	struct statsshm s;
+	if (!snapshot(shm, &s))
+	{
+		cerr << "Could not get a consistent snapshot from " << path << endl;
+		return 1;
+	}
+	if (0 != memcmp(s.magic, STATSSHM_MAGIC, sizeof STATSSHM_MAGIC)
+			|| s.version != STATSSHM_VERSION || s.size != sizeof (struct statsshm))
+	{
+		cerr << path << " does not hold liballocs stats of a version we understand" << endl;
+		return 1;
+	}
+	if (interval_ms == 0)
+	{
+		print_all(s);
+		return 0;
+	}
+
+	print_header();
+	struct statsshm prev = s;
+	struct timespec interval = { interval_ms / 1000, (interval_ms % 1000) * 1000000l };
+	for (long i = 0; count < 0 || i < count; ++i)
+	{
+		nanosleep(&interval, NULL);
+		/* Once the target exits, its file goes away and stops updating. */
+		if (0 != kill(s.pid, 0)) break;
+		if (!snapshot(shm, &s)) continue;
+		print_line(s, prev);
+		prev = s;
+	}
+	return 0;
+}
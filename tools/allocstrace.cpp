@@ -0,0 +1,232 @@
+/* This program decodes a trace written by a process running with
+ * LIBALLOCS_TRACE set (see include/eventtrace.h). It reports
+ *
+ * - object lifetimes, from each chunk's insert to its delete;
+ * - churn per allocation site: chunks and bytes allocated and freed,
+ *   and how many were still live when the trace ended;
+ * - the latency of each kind of index operation.
+ *
+ * Usage: allocstrace [-n nsites] trace-file
+ */
+
+#include "eventtrace.h"
+
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::setw;
+using std::map;
+using std::unordered_map;
+using std::vector;
+using std::string;
+
+static const char *kind_names[] = {
+	"none", "heap insert", "heap delete", "bigalloc new", "bigalloc delete"
+};
+
+/* Counts in power-of-two buckets, like the query latency histograms. */
+struct log2_histogram
+{
+	vector<unsigned long> buckets;
+	vector<unsigned long> samples; /* for percentiles */
+	unsigned long max = 0;
+	log2_histogram() : buckets(64) {}
+	void add(unsigned long v)
+	{
+		++buckets[v ? 63 - __builtin_clzl(v) : 0];
+		samples.push_back(v);
+		if (v > max) max = v;
+	}
+	unsigned long percentile(double p)
+	{
+		if (samples.empty()) return 0;
+		size_t i = (size_t)(p / 100.0 * (samples.size() - 1));
+		std::nth_element(samples.begin(), samples.begin() + i, samples.end());
+		return samples[i];
+	}
+	void print(const string& unit)
+	{
+		unsigned first = 64, last = 0;
+		for (unsigned i = 0; i < 64; ++i) if (buckets[i]) { first = std::min(first, i); last = i; }
+		for (unsigned i = first; i <= last && first < 64; ++i)
+		{
+			cout << "    >= " << setw(20) << (1ul << i) << " " << unit << ": "
+				<< setw(12) << buckets[i] << endl;
+		}
+	}
+};
+
+struct site_churn
+{
+	unsigned long nallocated = 0;
+	unsigned long bytes_allocated = 0;
+	unsigned long nfreed = 0;
+	unsigned long bytes_freed = 0;
+	unsigned long lifetime_total_ns = 0; /* over freed chunks */
+};
+
+static void usage(const char *argv0)
+{
+	cerr << "Usage: " << argv0 << " [-n nsites] trace-file" << endl;
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned nsites = 20;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'n': nsites = atoi(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1) usage(argv[0]);
+	const char *path = argv[optind];
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+	{
+		cerr << "Could not open " << path << endl;
+		return 1;
+	}
+	struct stat st;
+	if (0 != fstat(fd, &st) || (size_t) st.st_size < EVENTTRACE_HEADER_SIZE)
+	{
+		cerr << path << " is too small to be a liballocs trace" << endl;
+		return 1;
+	}
+	void *mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+	{
+		cerr << "Could not map " << path << endl;
+		return 1;
+	}
+	const struct eventtrace_header *h = (const struct eventtrace_header *) mem;
+	if (0 != memcmp(h->magic, EVENTTRACE_MAGIC, sizeof EVENTTRACE_MAGIC)
+			|| h->version != EVENTTRACE_VERSION
+			|| h->record_size != sizeof (struct eventtrace_record))
+	{
+		cerr << path << " is not a liballocs trace of a version we understand" << endl;
+		return 1;
+	}
+	unsigned long nrecords = std::min(h->nreserved, h->capacity);
+	if (EVENTTRACE_HEADER_SIZE + nrecords * sizeof (struct eventtrace_record) > (size_t) st.st_size)
+	{
+		cerr << path << " is truncated" << endl;
+		return 1;
+	}
+	const struct eventtrace_record *begin = (const struct eventtrace_record *)
+		((const char *) mem + EVENTTRACE_HEADER_SIZE);
+
+	/* Threads flush in batches, so put everything back in time order. */
+	vector<const struct eventtrace_record *> records;
+	records.reserve(nrecords);
+	unsigned long nunwritten = 0;
+	for (unsigned long i = 0; i < nrecords; ++i)
+	{
+		if (begin[i].kind == EVENTTRACE_NONE || begin[i].kind >= EVENTTRACE_NKINDS) ++nunwritten;
+		else records.push_back(&begin[i]);
+	}
+	std::stable_sort(records.begin(), records.end(),
+		[](const struct eventtrace_record *a, const struct eventtrace_record *b)
+		{ return a->time_ns < b->time_ns; });
+
+	cout << "pid " << h->pid << ": " << records.size() << " records";
+	if (h->ndropped) cout << ", " << h->ndropped << " dropped";
+	if (nunwritten) cout << ", " << nunwritten << " never written";
+	cout << endl;
+	if (records.empty()) return 0;
+	cout << "spanning " << (records.back()->time_ns - records.front()->time_ns) / 1000000.0
+		<< " ms" << endl;
+
+	/* Pair inserts with deletes by address. */
+	struct live_chunk { unsigned long time_ns; unsigned long site; };
+	unordered_map<unsigned long, live_chunk> live;
+	map<unsigned long, site_churn> churn;
+	log2_histogram lifetimes;
+	vector<log2_histogram> latencies(EVENTTRACE_NKINDS);
+	unsigned long nunmatched_deletes = 0;
+	for (const struct eventtrace_record *r : records)
+	{
+		latencies[r->kind].add(r->duration_ns);
+		if (r->kind == EVENTTRACE_HEAP_INSERT)
+		{
+			live[r->addr] = (live_chunk) { r->time_ns, r->site };
+			site_churn& c = churn[r->site];
+			++c.nallocated;
+			c.bytes_allocated += r->size;
+		}
+		else if (r->kind == EVENTTRACE_HEAP_DELETE)
+		{
+			auto found = live.find(r->addr);
+			/* Chunks allocated before tracing began have no insert. */
+			if (found == live.end()) { ++nunmatched_deletes; continue; }
+			unsigned long lifetime = r->time_ns - found->second.time_ns;
+			lifetimes.add(lifetime);
+			site_churn& c = churn[found->second.site];
+			++c.nfreed;
+			c.bytes_freed += r->size;
+			c.lifetime_total_ns += lifetime;
+			live.erase(found);
+		}
+	}
+
+	cout << endl << "Object lifetimes (" << lifetimes.samples.size() << " freed chunks, "
+		<< live.size() << " still live, " << nunmatched_deletes
+		<< " freed with no insert in the trace):" << endl;
+	if (!lifetimes.samples.empty())
+	{
+		cout << "  median " << lifetimes.percentile(50) << " ns, 90th percentile "
+			<< lifetimes.percentile(90) << " ns, max " << lifetimes.max << " ns" << endl;
+		lifetimes.print("ns");
+	}
+
+	vector<std::pair<unsigned long, site_churn> > by_churn(churn.begin(), churn.end());
+	std::sort(by_churn.begin(), by_churn.end(),
+		[](const std::pair<unsigned long, site_churn>& a, const std::pair<unsigned long, site_churn>& b)
+		{ return a.second.nallocated > b.second.nallocated; });
+	cout << endl << "Churn per allocation site (top " << std::min((size_t) nsites, by_churn.size())
+		<< " of " << by_churn.size() << " by chunks allocated):" << endl;
+	cout << setw(18) << "site" << setw(12) << "allocated" << setw(14) << "bytes"
+		<< setw(12) << "freed" << setw(12) << "live" << setw(16) << "mean life ns" << endl;
+	for (size_t i = 0; i < by_churn.size() && i < nsites; ++i)
+	{
+		const site_churn& c = by_churn[i].second;
+		char site[32];
+		snprintf(site, sizeof site, "0x%lx", by_churn[i].first);
+		cout << setw(18) << site << setw(12) << c.nallocated << setw(14) << c.bytes_allocated
+			<< setw(12) << c.nfreed << setw(12) << c.nallocated - std::min(c.nallocated, c.nfreed)
+			<< setw(16) << (c.nfreed ? c.lifetime_total_ns / c.nfreed : 0) << endl;
+	}
+
+	cout << endl << "Index operation latencies:" << endl;
+	for (unsigned k = EVENTTRACE_HEAP_INSERT; k < EVENTTRACE_NKINDS; ++k)
+	{
+		log2_histogram& l = latencies[k];
+		if (l.samples.empty()) continue;
+		cout << "  " << kind_names[k] << " (" << l.samples.size() << "): median "
+			<< l.percentile(50) << " ns, 99th percentile " << l.percentile(99)
+			<< " ns, max " << l.max << " ns" << endl;
+		l.print("ns");
+	}
+	return 0;
+}
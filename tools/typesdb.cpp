@@ -0,0 +1,327 @@
+/* This program writes a type database (see include/typedb.h) for
+ * a -types.so, i.e. the output of dumptypes once compiled. It is not built
+ * from uniqtypes.cpp and does not read DWARF: we dlopen() the -types.so and
+ * copy its uniqtypes, so the database always agrees with the .so it was
+ * generated from, and must be regenerated whenever that is.
+ *
+ * Usage: typesdb [-b preferred-base] input-types.so output.db
+ */
+
+#include "uniqtype-defs.h"
+#include "typedb.h"
+
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cstddef>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <gelf.h>
+
+using std::cerr;
+using std::endl;
+using std::map;
+using std::vector;
+using std::string;
+
+struct record
+{
+	vector<string> names; /* names[0] is the one dladdr() would give */
+	unsigned long so_offset;
+	unsigned long size;
+	bool make_precise;
+	vector<unsigned char> image;
+	unsigned long image_off;
+};
+
+static const unsigned long page_size = 4096;
+static unsigned long round_up(unsigned long n, unsigned long align)
+{ return (n + align - 1) & ~(align - 1); }
+
+static bool ends_with(const string& s, const string& suffix)
+{
+	return s.length() >= suffix.length()
+		&& 0 == s.compare(s.length() - suffix.length(), suffix.length(), suffix);
+}
+
+static void collect_uniqtype_symbols(Elf *elf, map<unsigned long, record>& records)
+{
+	/* dladdr() only sees .dynsym, so prefer that for the primary names. */
+	for (Elf64_Word wanted : { (Elf64_Word) SHT_DYNSYM, (Elf64_Word) SHT_SYMTAB })
+	{
+		Elf_Scn *scn = NULL;
+		while ((scn = elf_nextscn(elf, scn)) != NULL)
+		{
+			GElf_Shdr shdr;
+			if (!gelf_getshdr(scn, &shdr) || shdr.sh_type != wanted) continue;
+			Elf_Data *data = elf_getdata(scn, NULL);
+			unsigned long nsyms = shdr.sh_size / shdr.sh_entsize;
+			for (unsigned long i = 0; i < nsyms; ++i)
+			{
+				GElf_Sym sym;
+				if (!gelf_getsym(data, i, &sym)) continue;
+				if (GELF_ST_TYPE(sym.st_info) != STT_OBJECT
+						|| sym.st_shndx == SHN_UNDEF || sym.st_size == 0) continue;
+				const char *name = elf_strptr(elf, shdr.sh_link, sym.st_name);
+				if (!name || 0 != strncmp(name, "__uniqtype_", sizeof "__uniqtype_" - 1)) continue;
+				string s = name;
+				if (ends_with(s, "_subobj_names") || ends_with(s, "_ptrmap")) continue;
+				record& r = records[sym.st_value];
+				if (r.names.empty())
+				{
+					r.so_offset = sym.st_value;
+					r.size = sym.st_size;
+				}
+				/* Like dladdr(), the first name we see wins. */
+				if (std::find(r.names.begin(), r.names.end(), s) == r.names.end())
+				{
+					r.names.push_back(s);
+				}
+			}
+		}
+	}
+}
+
+/* Which related[] entries hold type pointers, by kind. */
+static void for_each_type_pointer(struct uniqtype *t, unsigned nrelated,
+	void (*f)(struct uniqtype **, void *), void *arg)
+{
+	unsigned npointers = 0;
+	if (t->un.array.is_array) npointers = 1;
+	else switch (t->un.info.kind)
+	{
+		case BASE: case ENUMERATION: case ADDRESS: case SUBRANGE:
+			npointers = 1; break;
+		case COMPOSITE:
+			npointers = t->un.composite.nmemb;
+			/* Anything after the members is the names vector, which we can't keep. */
+			for (unsigned i = npointers; i < nrelated; ++i)
+			{
+				memset(&t->related[i], 0, sizeof t->related[i]);
+			}
+			break;
+		case SUBPROGRAM:
+			npointers = t->un.subprogram.narg + t->un.subprogram.nret; break;
+		default: break;
+	}
+	for (unsigned i = 0; i < std::min(npointers, nrelated); ++i)
+	{
+		/* The member pointer is the first word of the entry, like t.ptr. */
+		f(&t->related[i].un.t.ptr, arg);
+	}
+}
+
+struct rewrite_state
+{
+	const map<unsigned long, record *> *by_addr;
+	record *r;
+	unsigned long preferred_base;
+	vector<unsigned long> *relocs;
+	unsigned long nunresolved;
+};
+
+static void rewrite_pointer(struct uniqtype **p, void *arg)
+{
+	rewrite_state& s = *static_cast<rewrite_state *>(arg);
+	unsigned long v = (unsigned long) *p;
+	if (!v) return;
+	auto found = s.by_addr->upper_bound(v);
+	if (found != s.by_addr->begin())
+	{
+		--found;
+		if (v < found->first + found->second->size)
+		{
+			*p = (struct uniqtype *)(s.preferred_base + found->second->image_off
+				+ (v - found->first));
+			s.relocs->push_back(s.r->image_off
+				+ ((unsigned char *) p - s.r->image.data()));
+			return;
+		}
+	}
+	/* A type defined elsewhere; a reader sees a null pointer. */
+	*p = NULL;
+	++s.nunresolved;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long preferred_base = 0;
+	int argi = 1;
+	if (argc > 2 && 0 == strcmp(argv[1], "-b"))
+	{
+		preferred_base = strtoul(argv[2], NULL, 0);
+		argi = 3;
+	}
+	if (argc - argi != 2)
+	{
+		cerr << "Usage: " << argv[0] << " [-b preferred-base] input-types.so output.db" << endl;
+		return 1;
+	}
+	const char *in_name = argv[argi];
+	const char *out_name = argv[argi + 1];
+	if (!preferred_base)
+	{
+		/* Spread databases over 4096 4GB slots, so that most of them map
+		 * where they want to even when a process uses many. */
+		const char *base = strrchr(out_name, '/');
+		std::hash<string> h;
+		preferred_base = 0x200000000000ul + ((h(base ? base + 1 : out_name) % 4096ul) << 32);
+	}
+
+	elf_version(EV_CURRENT);
+	int fd = open(in_name, O_RDONLY);
+	Elf *elf = (fd == -1) ? NULL : elf_begin(fd, ELF_C_READ, NULL);
+	if (!elf)
+	{
+		cerr << "Could not open " << in_name << " as ELF" << endl;
+		return 1;
+	}
+	map<unsigned long, record> records;
+	collect_uniqtype_symbols(elf, records);
+
+	/* Load it to get its pointers relocated. Make sure dlopen() takes
+	 * the name as a path, not something to search for. */
+	string in_path = strchr(in_name, '/') ? string(in_name) : string("./") + in_name;
+	void *handle = dlopen(in_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (!handle)
+	{
+		cerr << "Could not load " << in_name << ": " << dlerror() << endl;
+		return 1;
+	}
+	struct link_map *l;
+	dlinfo(handle, RTLD_DI_LINKMAP, &l);
+
+	/* Lay out the images: ordinary records first, in address order, then
+	 * those needing make_precise in their own pages. */
+	map<unsigned long, record *> by_addr;
+	for (auto& pair : records)
+	{
+		record& r = pair.second;
+		const unsigned char *p = (const unsigned char *)(l->l_addr + r.so_offset);
+		r.image.assign(p, p + r.size);
+		r.make_precise = ((struct uniqtype *) r.image.data())->make_precise != NULL;
+		by_addr[l->l_addr + r.so_offset] = &r;
+	}
+	vector<record *> layout;
+	for (auto& pair : records) if (!pair.second.make_precise) layout.push_back(&pair.second);
+	unsigned long npatch = 0;
+	for (auto& pair : records) if (pair.second.make_precise) { layout.push_back(&pair.second); ++npatch; }
+
+	vector<std::pair<string, unsigned long> > names; /* name, index in layout */
+	string strtab(1, '\0');
+	map<string, unsigned long> name_offs;
+	for (unsigned long i = 0; i < layout.size(); ++i)
+	{
+		for (auto& n : layout[i]->names)
+		{
+			names.push_back(std::make_pair(n, i));
+			name_offs[n] = strtab.size();
+			strtab += n;
+			strtab += '\0';
+		}
+	}
+	std::sort(names.begin(), names.end());
+	vector<unsigned> by_so_offset(layout.size());
+	for (unsigned i = 0; i < layout.size(); ++i) by_so_offset[i] = i;
+	std::sort(by_so_offset.begin(), by_so_offset.end(), [&layout](unsigned a, unsigned b) {
+		return layout[a]->so_offset < layout[b]->so_offset;
+	});
+
+	struct typedb_header h;
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, TYPEDB_MAGIC, sizeof h.magic);
+	h.version = TYPEDB_VERSION;
+	h.preferred_base = preferred_base;
+	h.nrecords = layout.size();
+	h.records_off = round_up(sizeof h, 8);
+	h.nnames = names.size();
+	h.names_off = h.records_off + h.nrecords * sizeof (struct typedb_record);
+	h.by_so_offset_off = h.names_off + h.nnames * sizeof (struct typedb_name);
+	h.strtab_off = h.by_so_offset_off + h.nrecords * sizeof (unsigned);
+	h.strtab_size = strtab.size();
+	unsigned long off = round_up(h.strtab_off + h.strtab_size, page_size);
+	h.images_off = off;
+	for (unsigned long i = 0; i < layout.size(); ++i)
+	{
+		if (i == layout.size() - npatch)
+		{
+			off = round_up(off, page_size);
+			h.patch_off = off;
+		}
+		layout[i]->image_off = off;
+		off = round_up(off + layout[i]->size, 8);
+	}
+	off = round_up(off, page_size);
+	h.images_size = off - h.images_off;
+	h.patch_size = npatch ? off - h.patch_off : 0;
+	if (!npatch) h.patch_off = off;
+
+	vector<unsigned long> relocs;
+	rewrite_state s = { &by_addr, NULL, preferred_base, &relocs, 0 };
+	for (auto r : layout)
+	{
+		struct uniqtype *t = (struct uniqtype *) r->image.data();
+		memset(&t->cache_word, 0, sizeof t->cache_word);
+		t->make_precise = NULL;
+		unsigned nrelated = (r->size - offsetof(struct uniqtype, related))
+			/ sizeof (struct uniqtype_rel_info);
+		s.r = r;
+		for_each_type_pointer(t, nrelated, rewrite_pointer, &s);
+	}
+	if (s.nunresolved) cerr << "Warning: " << s.nunresolved
+		<< " type pointers point outside " << in_name << "; writing them as null" << endl;
+	/* The relocs come last, since only relocating readers need them. */
+	h.nrelocs = relocs.size();
+	h.relocs_off = off;
+	h.file_size = h.relocs_off + h.nrelocs * sizeof (unsigned long);
+
+	vector<struct typedb_record> out_records;
+	for (auto r : layout)
+	{
+		struct typedb_record rec;
+		rec.image_off = r->image_off;
+		rec.so_offset = r->so_offset;
+		rec.name_off = name_offs[r->names[0]];
+		rec.size = r->size;
+		rec.flags = r->make_precise ? TYPEDB_RECORD_MAKE_PRECISE : 0;
+		out_records.push_back(rec);
+	}
+	vector<struct typedb_name> out_names;
+	for (auto& n : names) {
+		struct typedb_name tn = { name_offs[n.first], n.second };
+		out_names.push_back(tn);
+	}
+
+	vector<char> file(h.file_size, '\0');
+	memcpy(&file[0], &h, sizeof h);
+	if (!out_records.empty()) memcpy(&file[h.records_off], out_records.data(),
+		out_records.size() * sizeof (struct typedb_record));
+	if (!out_names.empty()) memcpy(&file[h.names_off], out_names.data(),
+		out_names.size() * sizeof (struct typedb_name));
+	if (!by_so_offset.empty()) memcpy(&file[h.by_so_offset_off], by_so_offset.data(),
+		by_so_offset.size() * sizeof (unsigned));
+	if (!relocs.empty()) memcpy(&file[h.relocs_off], relocs.data(),
+		relocs.size() * sizeof (unsigned long));
+	memcpy(&file[h.strtab_off], strtab.data(), strtab.size());
+	for (auto r : layout) memcpy(&file[r->image_off], r->image.data(), r->size);
+
+	/* Write it under a temporary name, so that readers never see half a file. */
+	string tmp_name = string(out_name) + ".tmp";
+	std::ofstream out(tmp_name, std::ios::binary);
+	out.write(file.data(), file.size());
+	out.close();
+	if (!out || 0 != rename(tmp_name.c_str(), out_name))
+	{
+		cerr << "Could not write " << out_name << endl;
+		unlink(tmp_name.c_str());
+		return 1;
+	}
+	return 0;
+}
@@ -4,6 +4,7 @@
 #include <sstream>
 #include <map>
 #include <set>
+#include <vector>
 #include <string>
 #include <cctype>
 #include <cstdlib>
@@ -253,6 +254,83 @@ string ensure_contained_length(const string& mangled_name, unsigned contained_le
 	
 	return s.str();
 }
+/* Set the bits in words for every pointer-sized slot of t (placed at base_off)
+ * that holds a pointer. Return false if t can't be described by a pointer map;
+ * the rules here must match add_pointer_slots() in src/uniqtype-ptrmaps.c. */
+static bool add_pointer_slots(iterator_df<type_die> t, Dwarf_Unsigned base_off,
+	std::vector<unsigned long>& words)
+{
+	if (!t) return true; // void
+	t = t->get_concrete_type();
+	if (!t) return true;
+	if (t.is_a<address_holding_type_die>())
+	{
+		auto opt_sz = t->calculate_byte_size();
+		if (!opt_sz || *opt_sz != sizeof (void*)) return false;
+		if (base_off % sizeof (void*) != 0) return false;
+		Dwarf_Unsigned slot = base_off / sizeof (void*);
+		Dwarf_Unsigned word = slot / UNIQTYPE_PTRMAP_SLOTS_PER_WORD;
+		unsigned long bit = 1ul << (slot % UNIQTYPE_PTRMAP_SLOTS_PER_WORD);
+		if (word >= UNIQTYPE_PTRMAP_MAX_WORDS) return false;
+		if (words.size() <= word) words.resize(word + 1, 0ul);
+		if (words[word] & bit) return false; // overlapping pointers, e.g. in a union
+		words[word] |= bit;
+		return true;
+	}
+	if (t.is_a<array_type_die>())
+	{
+		auto element_t = t.as_a<array_type_die>()->get_type();
+		std::vector<unsigned long> element_words;
+		if (!add_pointer_slots(element_t, 0, element_words)) return false;
+		if (element_words.size() == 0) return true; // no pointers, whatever the length
+		auto opt_count = t.as_a<array_type_die>()->element_count();
+		if (!opt_count || !element_t->get_concrete_type()) return false;
+		auto opt_element_sz = element_t->get_concrete_type()->calculate_byte_size();
+		if (!opt_element_sz) return false;
+		for (Dwarf_Unsigned i = 0; i < *opt_count; ++i)
+		{
+			if (!add_pointer_slots(element_t, base_off + i * *opt_element_sz, words)) return false;
+		}
+		return true;
+	}
+	if (t.is_a<with_data_members_die>())
+	{
+		auto members = t.children().subseq_of<member_die>();
+		for (auto i_edge = members.first; i_edge != members.second; ++i_edge)
+		{
+			opt<Dwarf_Unsigned> opt_offset = i_edge->byte_offset_in_enclosing_type(false);
+			if (!opt_offset) continue; // static member
+			if (!add_pointer_slots(i_edge->find_type(), base_off + *opt_offset, words)) return false;
+		}
+		return true;
+	}
+	// base, enumeration, subrange, string and subprogram types hold no pointers
+	return true;
+}
+
+void write_uniqtype_ptrmap(std::ostream& o, const string& mangled_name,
+	iterator_df<type_die> t)
+{
+	std::vector<unsigned long> words;
+	bool known = add_pointer_slots(t, 0, words);
+	/* Maps hold no pointers, so unlike the uniqtype they need no relocation
+	 * and can go in read-only data (in the uniqtype's section group). */
+	o << "const unsigned long " << mangled_name << "_ptrmap[] "
+		<< " __attribute__((weak,section (\".rodata." << mangled_name 
+			<< "_ptrmap, \\\"aG\\\", @progbits, " << mangled_name << ", comdat#\")))"
+		<< " = { ";
+	if (!known) o << "~0ul /* unknown */";
+	else
+	{
+		o << words.size() << "ul";
+		for (auto i_w = words.begin(); i_w != words.end(); ++i_w)
+		{
+			o << ", 0x" << std::hex << *i_w << std::dec << "ul";
+		}
+	}
+	o << " };\n";
+}
+
 void write_master_relation(master_relation_t& r, dwarf::core::root_die& root, 
 	std::ostream& out, std::ostream& err, bool emit_void, bool emit_struct_def, 
 	std::set< std::string >& names_emitted,
@@ -286,6 +364,7 @@ void write_master_relation(master_relation_t& r, dwarf::core::root_die& root,
 		}
 		
 		string mangled_name = mangle_typename(make_pair(string(""), string("void")));
+		write_uniqtype_ptrmap(out, mangled_name, iterator_base::END);
 		write_uniqtype_open_void(out,
 			mangled_name,
 			"void",
@@ -524,6 +603,8 @@ void write_master_relation(master_relation_t& r, dwarf::core::root_die& root,
 				}
 		}
 		
+		write_uniqtype_ptrmap(out, mangled_name, i_vert->second);
+		
 		unsigned contained_length = 1;
 		if (i_vert->second.is_a<array_type_die>())
 		{
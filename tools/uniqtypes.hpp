@@ -41,6 +41,8 @@ void write_master_relation(master_relation_t& r, dwarf::core::root_die& root,
 	bool emit_codeless_aliases,
 	bool emit_subobject_names = true);
 
+void write_uniqtype_ptrmap(std::ostream& o, const string& mangled_name,
+	dwarf::core::iterator_df<dwarf::core::type_die> t);
 void write_uniqtype_open_void(std::ostream& o,
     const string& mangled_typename,
     const string& unmangled_typename,